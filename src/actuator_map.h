@@ -0,0 +1,311 @@
+#ifndef ACTUATOR_MAP_H
+#define ACTUATOR_MAP_H
+
+/********************************************************************
+
+  actuator_map.h
+
+Joint to motor mapping read from the hardware description
+(config/hardware.xml). For each selected ActiveCannulaRobot, the
+TubeCarrier gear ratios and home positions and the ControllerConnection
+axes are put into one flat table. Every joint becomes one row:
+(board, axis, scale, offset).
+
+Joint vector, robot r at r*ACTUATOR_JOINTS_PER_ROBOT:
+    tube 1..3 rotation      alpha [rad]
+    tube 1..3 translation   beta  [m]
+Counts vector, board b at boardOffset(b):
+    one count per axis, boards in order of first use
+
+    counts = scale*(joint - offset)
+
+The offset is the carrier's HomePosition for translations and zero for
+rotations, so the encoders read zero at the home configuration.
+
+The file is parsed once at startup. toCounts() is the per-cycle part: a
+scale-and-offset loop over contiguous arrays, followed by a scatter into
+the board slots.
+
+********************************************************************/
+
+#include "rapidxml.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#define ACTUATOR_TUBES 3
+#define ACTUATOR_JOINTS_PER_ROBOT (2*ACTUATOR_TUBES)
+#define ACTUATOR_MIN_BOARD_AXES 6   // a McbEncoders command always has 6 counts
+
+// one row of the table
+struct ActuatorConnection
+{
+    int robot;
+    int tube;           // 1..3
+    bool rotation;
+    int board;
+    int axis;
+    double scale;       // counts/rad or counts/m
+    double offset;      // rad or m
+};
+
+class ActuatorMap
+{
+public:
+    ActuatorMap() : nCounts(0) {}
+
+    // Reads the named robots from a hardware description. On failure returns
+    // false with a description in error.
+    bool load(const std::string &path, const std::vector<std::string> &robots, std::string &error)
+    {
+        std::ifstream file(path.c_str());
+        if (!file)
+        {
+            error = "Could not open " + path;
+            return false;
+        }
+        std::vector<char> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        buffer.push_back('\0');
+
+        rapidxml::xml_document<> doc;
+        try
+        {
+            doc.parse<0>(&buffer[0]);
+        }
+        catch (rapidxml::parse_error &e)
+        {
+            error = path + ": " + e.what();
+            return false;
+        }
+        rapidxml::xml_node<> *root = doc.first_node("HardwareDescription");
+        if (!root)
+        {
+            error = path + " has no HardwareDescription.";
+            return false;
+        }
+
+        robotNames = robots;
+        boardNames.clear();
+        boardTypes.clear();
+        table.clear();
+        home.assign(robots.size()*ACTUATOR_TUBES, 0.0);
+
+        for (size_t r = 0; r < robots.size(); r++)
+        {
+            rapidxml::xml_node<> *robot = findRobot(root, robots[r]);
+            if (!robot)
+            {
+                error = "No ActiveCannulaRobot " + robots[r] + " in " + path;
+                return false;
+            }
+            rapidxml::xml_attribute<> *nTubes = robot->first_attribute("NumberOfTubes");
+            if (!nTubes || atoi(nTubes->value()) != ACTUATOR_TUBES)
+            {
+                error = robots[r] + " is not a 3-tube robot.";
+                return false;
+            }
+
+            // gear ratios and home positions per tube
+            double rotRatio[ACTUATOR_TUBES], transRatio[ACTUATOR_TUBES];
+            bool haveCarrier[ACTUATOR_TUBES] = {false, false, false};
+            for (rapidxml::xml_node<> *carrier = robot->first_node("TubeCarrier"); carrier; carrier = carrier->next_sibling("TubeCarrier"))
+            {
+                int tube = attributeInt(carrier, "Number");
+                if (tube < 1 || tube > ACTUATOR_TUBES)
+                {
+                    error = robots[r] + ": TubeCarrier without a valid Number.";
+                    return false;
+                }
+                rotRatio[tube-1] = childDouble(carrier, "RotationGearRatio");
+                transRatio[tube-1] = childDouble(carrier, "TranslationGearRatio");
+                home[r*ACTUATOR_TUBES + tube-1] = childDouble(carrier, "HomePosition");
+                haveCarrier[tube-1] = true;
+            }
+
+            for (rapidxml::xml_node<> *conn = robot->first_node("ControllerConnection"); conn; conn = conn->next_sibling("ControllerConnection"))
+            {
+                ActuatorConnection c;
+                c.robot = int(r);
+                c.tube = attributeInt(conn, "TubeNumber");
+                rapidxml::xml_attribute<> *type = conn->first_attribute("Type");
+                rapidxml::xml_node<> *controller = conn->first_node("ControllerName");
+                c.axis = int(childDouble(conn, "AxisNumber", -1));
+                if (c.tube < 1 || c.tube > ACTUATOR_TUBES || !type || !controller || c.axis < 0)
+                {
+                    error = robots[r] + ": incomplete ControllerConnection.";
+                    return false;
+                }
+                if (!haveCarrier[c.tube-1])
+                {
+                    error = robots[r] + ": no TubeCarrier for tube " + std::to_string(c.tube) + ".";
+                    return false;
+                }
+                c.rotation = std::string(type->value()) == "Rotation";
+                c.board = boardIndex(root, controller->value());
+                c.scale = c.rotation ? rotRatio[c.tube-1] : transRatio[c.tube-1];
+                c.offset = c.rotation ? 0.0 : home[r*ACTUATOR_TUBES + c.tube-1];
+                for (size_t k = 0; k < table.size(); k++)
+                {
+                    if (table[k].board == c.board && table[k].axis == c.axis)
+                    {
+                        error = "Axis " + std::to_string(c.axis) + " of " + boardNames[c.board] + " is connected twice.";
+                        return false;
+                    }
+                    if (table[k].robot == c.robot && table[k].tube == c.tube && table[k].rotation == c.rotation)
+                    {
+                        error = robots[r] + ": tube " + std::to_string(c.tube) + " is connected twice.";
+                        return false;
+                    }
+                }
+                table.push_back(c);
+            }
+        }
+
+        // board layout in the counts vector
+        int nBoards = int(boardNames.size());
+        boardOffsets.assign(nBoards + 1, 0);
+        std::vector<int> axes(nBoards, ACTUATOR_MIN_BOARD_AXES);
+        for (size_t k = 0; k < table.size(); k++)
+        {
+            axes[table[k].board] = std::max(axes[table[k].board], table[k].axis + 1);
+        }
+        for (int b = 0; b < nBoards; b++)
+        {
+            boardOffsets[b+1] = boardOffsets[b] + axes[b];
+        }
+        nCounts = boardOffsets[nBoards];
+
+        // per-joint arrays; a joint without a connection has slot -1
+        int nJoints = numJoints();
+        scale.assign(nJoints, 0.0);
+        offset.assign(nJoints, 0.0);
+        slot.assign(nJoints, -1);
+        work.assign(nJoints, 0.0);
+        for (size_t k = 0; k < table.size(); k++)
+        {
+            const ActuatorConnection &c = table[k];
+            int j = jointIndex(c.robot, c.tube, c.rotation);
+            scale[j] = c.scale;
+            offset[j] = c.offset;
+            slot[j] = boardOffsets[c.board] + c.axis;
+        }
+        return true;
+    }
+
+    int numRobots() const { return int(robotNames.size()); }
+    int numJoints() const { return numRobots()*ACTUATOR_JOINTS_PER_ROBOT; }
+    int numBoards() const { return int(boardNames.size()); }
+    int numCounts() const { return nCounts; }
+
+    const std::string &robotName(int r) const { return robotNames[r]; }
+    const std::string &boardName(int b) const { return boardNames[b]; }
+    const std::string &boardType(int b) const { return boardTypes[b]; }  // Controller Type, empty if not declared
+    int boardOffset(int b) const { return boardOffsets[b]; }
+    int boardAxes(int b) const { return boardOffsets[b+1] - boardOffsets[b]; }
+
+    // HomePosition of a tube carrier [m]
+    double homePosition(int robot, int tube) const { return home[robot*ACTUATOR_TUBES + tube-1]; }
+
+    const std::vector<ActuatorConnection> &connections() const { return table; }
+
+    // index of a joint in the joint vector (tube 1..3)
+    static int jointIndex(int robot, int tube, bool rotation)
+    {
+        return robot*ACTUATOR_JOINTS_PER_ROBOT + (rotation ? 0 : ACTUATOR_TUBES) + tube-1;
+    }
+
+    // Per-cycle conversion: joints has numJoints() values, counts numCounts().
+    // Axes without a connection are left untouched. Counts are truncated
+    // towards zero. Not thread-safe (uses a preallocated work array); give
+    // each control loop its own map.
+    void toCounts(const double *joints, int *counts) const
+    {
+        const int n = int(work.size());
+        const double *s = scale.data();
+        const double *o = offset.data();
+        double *w = work.data();
+        for (int j = 0; j < n; j++)
+        {
+            w[j] = s[j]*(joints[j] - o[j]);
+        }
+        const int *dst = slot.data();
+        for (int j = 0; j < n; j++)
+        {
+            if (dst[j] >= 0)
+            {
+                counts[dst[j]] = int(w[j]);
+            }
+        }
+    }
+
+private:
+    static rapidxml::xml_node<> *findRobot(rapidxml::xml_node<> *root, const std::string &name)
+    {
+        for (rapidxml::xml_node<> *robot = root->first_node("ActiveCannulaRobot"); robot; robot = robot->next_sibling("ActiveCannulaRobot"))
+        {
+            rapidxml::xml_node<> *n = robot->first_node("CannulaName");
+            if (n && name == n->value())
+            {
+                return robot;
+            }
+        }
+        return 0;
+    }
+
+    static int attributeInt(rapidxml::xml_node<> *node, const char *name)
+    {
+        rapidxml::xml_attribute<> *a = node->first_attribute(name);
+        return a ? atoi(a->value()) : -1;
+    }
+
+    static double childDouble(rapidxml::xml_node<> *node, const char *name, double fallback = 0.0)
+    {
+        rapidxml::xml_node<> *n = node->first_node(name);
+        return n ? strtod(n->value(), 0) : fallback;
+    }
+
+    int boardIndex(rapidxml::xml_node<> *root, const std::string &name)
+    {
+        for (size_t b = 0; b < boardNames.size(); b++)
+        {
+            if (boardNames[b] == name)
+            {
+                return int(b);
+            }
+        }
+        std::string type;
+        for (rapidxml::xml_node<> *c = root->first_node("Controller"); c; c = c->next_sibling("Controller"))
+        {
+            rapidxml::xml_attribute<> *n = c->first_attribute("Name");
+            rapidxml::xml_attribute<> *t = c->first_attribute("Type");
+            if (n && t && name == n->value())
+            {
+                type = t->value();
+            }
+        }
+        boardNames.push_back(name);
+        boardTypes.push_back(type);
+        return int(boardNames.size()) - 1;
+    }
+
+    std::vector<std::string> robotNames;
+    std::vector<std::string> boardNames;
+    std::vector<std::string> boardTypes;
+    std::vector<int> boardOffsets;
+    std::vector<double> home;
+    std::vector<ActuatorConnection> table;
+    int nCounts;
+
+    // per joint, contiguous for the per-cycle loop
+    std::vector<double> scale;
+    std::vector<double> offset;
+    std::vector<int> slot;
+    mutable std::vector<double> work;
+};
+
+#endif // ACTUATOR_MAP_H
@@ -0,0 +1,199 @@
+#ifndef ALLOC_GUARD_H
+#define ALLOC_GUARD_H
+
+/********************************************************************
+
+  alloc_guard.h
+
+Checks that the control loops do not touch the heap once they run.
+A loop marks its per-cycle work as a hot region:
+
+    {
+        HotRegion hot;
+        rr.step(kinCur,rrOut);
+        ...
+    }
+
+Built with ENDONASAL_ALLOC_GUARD (cmake -DALLOC_GUARD=ON), this header
+replaces malloc, calloc, realloc, the aligned allocators and the global
+operator new, and every allocation made by a thread inside a hot region
+is counted. With setAllocationAbort(true) the first one aborts instead,
+so a debugger or core dump shows the call stack that allocated.
+
+Calls into code we do not own (the CTR solver, roscpp) are wrapped in a
+HotRegionExempt and are not counted.
+
+Without the flag HotRegion and HotRegionExempt compile to nothing and
+hotAllocations() is always zero.
+
+The replacement functions are defined in this header, so it may be
+included by one source file per executable only (every node here is a
+single file).
+
+********************************************************************/
+
+#include <cstddef>
+
+#ifdef ENDONASAL_ALLOC_GUARD
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <new>
+#include <unistd.h>
+
+// glibc's allocator, which the replacements below forward to
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t n, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void *ptr);
+}
+
+static __thread int allocGuardDepth = 0;        // > 0 inside a hot region
+static __thread int allocGuardExempt = 0;       // > 0 inside an exempt call
+static std::atomic<long> allocGuardCount(0);
+static std::atomic<long> allocGuardBytes(0);
+static std::atomic<bool> allocGuardAbort(false);
+
+// called by every allocation function; must not allocate itself
+static inline void allocGuardCheck(size_t size)
+{
+    if (allocGuardDepth > 0 && allocGuardExempt == 0)
+    {
+        allocGuardCount++;
+        allocGuardBytes += long(size);
+        if (allocGuardAbort)
+        {
+            static const char msg[] = "alloc_guard: heap allocation inside a hot region\n";
+            ssize_t ignored = write(2, msg, sizeof(msg)-1);
+            (void)ignored;
+            abort();
+        }
+    }
+}
+
+// same exception specification (__THROW) as glibc's declarations
+extern "C"
+{
+    void *malloc(size_t size) __THROW
+    {
+        allocGuardCheck(size);
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t n, size_t size) __THROW
+    {
+        allocGuardCheck(n*size);
+        return __libc_calloc(n, size);
+    }
+
+    void *realloc(void *ptr, size_t size) __THROW
+    {
+        allocGuardCheck(size);
+        return __libc_realloc(ptr, size);
+    }
+
+    void *memalign(size_t alignment, size_t size) __THROW
+    {
+        allocGuardCheck(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size) __THROW
+    {
+        allocGuardCheck(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void **ptr, size_t alignment, size_t size) __THROW
+    {
+        allocGuardCheck(size);
+        void *p = __libc_memalign(alignment, size);
+        if (!p)
+        {
+            return ENOMEM;
+        }
+        *ptr = p;
+        return 0;
+    }
+}
+
+void *operator new(size_t size)
+{
+    allocGuardCheck(size);
+    void *p = __libc_malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    allocGuardCheck(size);
+    return __libc_malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    allocGuardCheck(size);
+    return __libc_malloc(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { __libc_free(ptr); }
+
+struct HotRegion
+{
+    HotRegion() { allocGuardDepth++; }
+    ~HotRegion() { allocGuardDepth--; }
+};
+
+struct HotRegionExempt
+{
+    HotRegionExempt() { allocGuardExempt++; }
+    ~HotRegionExempt() { allocGuardExempt--; }
+};
+
+inline bool allocationGuardEnabled() { return true; }
+inline long hotAllocations() { return allocGuardCount; }
+inline long hotAllocationBytes() { return allocGuardBytes; }
+inline void resetHotAllocations() { allocGuardCount = 0; allocGuardBytes = 0; }
+inline void setAllocationAbort(bool abortOnAllocation) { allocGuardAbort = abortOnAllocation; }
+
+#else
+
+struct HotRegion
+{
+    HotRegion() {}
+};
+
+struct HotRegionExempt
+{
+    HotRegionExempt() {}
+};
+
+inline bool allocationGuardEnabled() { return false; }
+inline long hotAllocations() { return 0; }
+inline long hotAllocationBytes() { return 0; }
+inline void resetHotAllocations() {}
+inline void setAllocationAbort(bool) {}
+
+#endif // ENDONASAL_ALLOC_GUARD
+
+#endif // ALLOC_GUARD_H
@@ -0,0 +1,299 @@
+#ifndef ANATOMY_FIXTURE_H
+#define ANATOMY_FIXTURE_H
+
+/********************************************************************
+
+  anatomy_fixture.h
+
+Anatomy virtual fixtures, independent of ROS: the backbone points that
+come closer to the anatomy than a margin, as constraints for the
+resolved rates controller and the force feedback.
+
+The kinematics node evaluates them after every update
+(AnatomyFixture). The clearance of backbone point k is the signed
+distance field (anatomy_sdf.h) at the point minus the outer radius of
+its tube, so it costs one lookup per point and no mesh query. Of the
+points in front of the front plate with a clearance below the margin,
+the local minima along the backbone become constraints, the nearest
+ANATOMY_MAX_CONSTRAINTS of them.
+
+Constraint i carries the gradient of its clearance with respect to the
+joints qbeta = [PsiL; Beta]: the field gradient times the Jacobian of
+the backbone point at its arc length. The solver's dense output has no
+per-point Jacobians, so they are taken by finite differences, one joint
+(column) per perturbed kinematics update, stored as a function of arc
+length and reused. While any point is within the lookahead distance,
+the node refreshes one column per update, round robin, so the columns
+are at most six updates old when a point reaches the margin. Columns
+that are older than that (the cannula was clear for a while) are
+refreshed all at once, but only when a constraint needs them.
+
+The controller (resolved_rates_core.h) turns the set into weighting
+terms on the joint step, see ResolvedRatesController::step.
+
+********************************************************************/
+
+#include "anatomy_sdf.h"
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define ANATOMY_MAX_CONSTRAINTS 8
+
+typedef Eigen::Matrix<double,6,1> AnatomyGradient;
+
+// the constraints of one kinematics update (anatomyConstraints message)
+struct AnatomyConstraintSet
+{
+    AnatomyConstraintSet() : n(0), margin(0.0)
+    {
+        for (int i = 0; i < ANATOMY_MAX_CONSTRAINTS; i++)
+        {
+            distance[i] = 0.0;
+            arcLength[i] = 0.0;
+            point[i].fill(0);
+            normal[i].fill(0);
+            gradient[i].fill(0);
+        }
+    }
+
+    int n;
+    double margin;                                      // [m]
+    double distance[ANATOMY_MAX_CONSTRAINTS];           // clearance of the tube surface [m], negative through the surface
+    double arcLength[ANATOMY_MAX_CONSTRAINTS];          // [m]
+    Eigen::Vector3d point[ANATOMY_MAX_CONSTRAINTS];     // backbone point [m, world]
+    Eigen::Vector3d normal[ANATOMY_MAX_CONSTRAINTS];    // unit field gradient, away from the anatomy
+    AnatomyGradient gradient[ANATOMY_MAX_CONSTRAINTS];  // d distance / d qbeta
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+class AnatomyFixture
+{
+public:
+    AnatomyFixture()
+        : sdf(0), marginDist(2e-3), lookaheadDist(3e-3), nCapacity(0), nPoints(0),
+          update(0), nextRoundRobin(0), roundRobinDone(true), watching(false), nCandidates(0)
+    {
+        radii << 0.5825e-3, 1.0287e-3, 1.270e-3;
+        for (int j = 0; j < 6; j++)
+        {
+            colPoints[j] = 0;
+            colUpdate[j] = -1;
+        }
+    }
+
+    // the field (world pose set), owned by the caller
+    void setField(const AnatomySdf *field) { sdf = field; }
+
+    // outer radius of tube 1 (inner) .. 3 (outer) [m]
+    void setTubeRadii(const Eigen::Vector3d &r) { radii = r; }
+
+    // constraints below margin; Jacobian columns kept fresh below lookahead [m]
+    void setMargin(double margin, double lookahead)
+    {
+        marginDist = margin;
+        lookaheadDist = std::max(margin, lookahead);
+    }
+
+    double margin() const { return marginDist; }
+    double lookahead() const { return lookaheadDist; }
+
+    void reserve(int n)
+    {
+        if (n <= nCapacity)
+        {
+            return;
+        }
+        nCapacity = n;
+        clearance.resize(n);
+        fieldNormal.resize(3,n);
+        for (int j = 0; j < 6; j++)
+        {
+            colS[j].resize(n);
+            colDeriv[j].resize(3,n);
+        }
+    }
+
+    // finite difference step of joint j of qbeta [rad or m]
+    static double step(int j) { return j < 3 ? 1e-3 : 1e-4; }
+
+    // posedata, s: backbone of KinematicsResult. Finds the candidate points
+    // and whether the Jacobian columns need to be kept fresh.
+    void evaluate(const Eigen::MatrixXd &posedata, const Eigen::VectorXd &s, int n)
+    {
+        reserve(n);
+        update++;
+        roundRobinDone = false;
+        nPoints = n;
+        nCandidates = 0;
+        double nearest = std::numeric_limits<double>::infinity();
+        for (int k = 0; k < n; k++)
+        {
+            Eigen::Vector3d g = Eigen::Vector3d::Zero();
+            int tube = std::max(1, std::min(3, int(posedata(7,k) + 0.5)));
+            clearance(k) = s(k) >= 0.0 && sdf ? sdf->distance(posedata.block<3,1>(0,k), &g) - radii(tube-1)
+                                              : std::numeric_limits<double>::infinity();
+            fieldNormal.col(k) = g;
+            nearest = std::min(nearest, clearance(k));
+        }
+        watching = nearest < lookaheadDist;
+
+        // local minima below the margin, nearest first
+        for (int k = 0; k < n; k++)
+        {
+            double c = clearance(k);
+            if (c >= marginDist || (k > 0 && clearance(k-1) <= c) || (k+1 < n && clearance(k+1) < c))
+            {
+                continue;
+            }
+            int i = std::min(nCandidates, ANATOMY_MAX_CONSTRAINTS - 1);
+            if (nCandidates == ANATOMY_MAX_CONSTRAINTS && c >= clearance(candidate[i]))
+            {
+                continue;
+            }
+            for (; i > 0 && clearance(candidate[i-1]) > c; i--)
+            {
+                candidate[i] = candidate[i-1];
+            }
+            candidate[i] = k;
+            nCandidates = std::min(nCandidates + 1, ANATOMY_MAX_CONSTRAINTS);
+        }
+    }
+
+    // After evaluate(): the next joint whose column to refresh with a
+    // kinematics update at qbeta + step(j)*e_j, false when done for this update.
+    bool nextColumn(int &j)
+    {
+        if (!watching)
+        {
+            return false;
+        }
+        if (nCandidates > 0)
+        {
+            for (int c = 0; c < 6; c++)
+            {
+                if (stale(c))
+                {
+                    roundRobinDone = true;
+                    j = c;
+                    return true;
+                }
+            }
+        }
+        if (roundRobinDone)
+        {
+            return false;
+        }
+        roundRobinDone = true;
+        j = nextRoundRobin;
+        nextRoundRobin = (nextRoundRobin + 1) % 6;
+        return true;
+    }
+
+    // column j from the backbone of the perturbed update, differenced
+    // against the one given to evaluate() at the same arc lengths
+    void setColumn(int j, const Eigen::MatrixXd &posedata, const Eigen::VectorXd &s,
+                   const Eigen::MatrixXd &posedataPert, const Eigen::VectorXd &sPert, int nPert)
+    {
+        double h = step(j);
+        int m = 0;
+        colPoints[j] = 0;
+        for (int k = 0; k < nPoints; k++)
+        {
+            if (s(k) < 0.0 || s(k) < sPert(0) || s(k) > sPert(nPert-1))
+            {
+                continue;
+            }
+            while (m+2 < nPert && sPert(m+1) < s(k))
+            {
+                m++;
+            }
+            double len = sPert(m+1) - sPert(m);
+            double t = len > 0.0 ? (s(k) - sPert(m))/len : 0.0;
+            Eigen::Vector3d pPert = (1.0 - t)*posedataPert.block<3,1>(0,m) + t*posedataPert.block<3,1>(0,m+1);
+            colS[j](colPoints[j]) = s(k);
+            colDeriv[j].col(colPoints[j]) = (pPert - posedata.block<3,1>(0,k))/h;
+            colPoints[j]++;
+        }
+        colUpdate[j] = update;
+    }
+
+    // the constraints of this update; gradients from the stored columns
+    void constraints(const Eigen::MatrixXd &posedata, const Eigen::VectorXd &s, AnatomyConstraintSet &out) const
+    {
+        out.n = nCandidates;
+        out.margin = marginDist;
+        for (int i = 0; i < nCandidates; i++)
+        {
+            int k = candidate[i];
+            out.distance[i] = clearance(k);
+            out.arcLength[i] = s(k);
+            out.point[i] = posedata.block<3,1>(0,k);
+            out.normal[i] = fieldNormal.col(k);
+            for (int j = 0; j < 6; j++)
+            {
+                out.gradient[i](j) = colUpdate[j] < 0 ? 0.0 : fieldNormal.col(k).dot(columnAt(j, s(k)));
+            }
+        }
+    }
+
+    bool isWatching() const { return watching; }
+
+private:
+    // columns are refreshed every six updates while watching
+    bool stale(int j) const { return colUpdate[j] < 0 || update - colUpdate[j] > 6; }
+
+    // d point / d qbeta_j at arc length sk, interpolated between the stored points
+    Eigen::Vector3d columnAt(int j, double sk) const
+    {
+        int n = colPoints[j];
+        if (n == 0)
+        {
+            return Eigen::Vector3d::Zero();
+        }
+        const double *first = colS[j].data();
+        int b = int(std::upper_bound(first, first + n, sk) - first);
+        if (b == 0)
+        {
+            return colDeriv[j].col(0);
+        }
+        if (b == n)
+        {
+            return colDeriv[j].col(n-1);
+        }
+        double len = colS[j](b) - colS[j](b-1);
+        double t = len > 0.0 ? (sk - colS[j](b-1))/len : 0.0;
+        return (1.0 - t)*colDeriv[j].col(b-1) + t*colDeriv[j].col(b);
+    }
+
+    const AnatomySdf *sdf;
+    Eigen::Vector3d radii;
+    double marginDist;
+    double lookaheadDist;
+
+    // per backbone point of the last evaluate()
+    int nCapacity;
+    int nPoints;
+    Eigen::VectorXd clearance;
+    Eigen::Matrix3Xd fieldNormal;
+
+    // Jacobian columns as a function of arc length
+    Eigen::VectorXd colS[6];
+    Eigen::Matrix3Xd colDeriv[6];
+    int colPoints[6];
+    long colUpdate[6];                  // update it was taken at, -1 never
+
+    long update;
+    int nextRoundRobin;
+    bool roundRobinDone;
+    bool watching;
+    int nCandidates;
+    int candidate[ANATOMY_MAX_CONSTRAINTS];
+};
+
+#endif // ANATOMY_FIXTURE_H
@@ -0,0 +1,704 @@
+#ifndef ANATOMY_MESH_H
+#define ANATOMY_MESH_H
+
+/********************************************************************
+
+  anatomy_mesh.h
+
+Distance queries between the cannula and the patient anatomy
+(src/everythingSmoothedShrink.stl), independent of ROS.
+
+The STL (binary or ASCII) is loaded once, moved into the world frame
+with the pose the display draws it at, and indexed by an axis-aligned
+bounding box tree built with the surface area heuristic (binned, 16
+bins along the longest centroid axis, leaves of at most 4 triangles).
+
+The cannula is a chain of capsules: backbone segment i runs from
+backbone point i to i+1, with the outer radius of the tube at its end.
+A query finds, for every segment, the triangle nearest to the segment
+and the gap between the capsule surface and the mesh (the segment to
+triangle distance minus the radius; negative where the tube surface
+crosses the mesh, which has no inside to tell a tube fully through the
+surface from one just outside it). Traversal visits the nearer child
+first and skips boxes that cannot beat the best distance so far, which
+starts from the triangle the segment was nearest to in the previous
+query: the backbone moves little between cycles, so most boxes are
+skipped right away. Nothing farther than maxDistance is searched for.
+
+Queries do not allocate once the checker is sized for the number of
+backbone points (reserve()).
+
+********************************************************************/
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct MeshTriangle
+{
+    Eigen::Vector3d v[3];
+};
+
+// Reads a binary or ASCII STL file. Binary files are recognised by their
+// size (84 bytes + 50 per triangle); everything else is parsed as ASCII.
+inline bool loadStl(const std::string &path, std::vector<MeshTriangle> &triangles, std::string &error)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        error = "could not open " + path;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    triangles.clear();
+
+    if (data.size() >= 84)
+    {
+        uint32_t n;
+        memcpy(&n, data.data() + 80, 4);
+        if (data.size() == 84 + 50*size_t(n))
+        {
+            triangles.resize(n);
+            for (uint32_t t = 0; t < n; t++)
+            {
+                const char *rec = data.data() + 84 + 50*size_t(t) + 12;    // skip the normal
+                for (int k = 0; k < 3; k++)
+                {
+                    float xyz[3];
+                    memcpy(xyz, rec + 12*k, 12);
+                    triangles[t].v[k] << xyz[0], xyz[1], xyz[2];
+                }
+            }
+            return true;
+        }
+    }
+
+    std::istringstream in(data);
+    std::string word;
+    MeshTriangle tri;
+    int k = 0;
+    while (in >> word)
+    {
+        if (word == "vertex")
+        {
+            if (!(in >> tri.v[k](0) >> tri.v[k](1) >> tri.v[k](2)))
+            {
+                error = "malformed vertex in " + path;
+                return false;
+            }
+            if (++k == 3)
+            {
+                triangles.push_back(tri);
+                k = 0;
+            }
+        }
+    }
+    if (triangles.empty())
+    {
+        error = "no triangles in " + path;
+        return false;
+    }
+    return true;
+}
+
+struct Aabb
+{
+    Aabb() { clear(); }
+
+    void clear()
+    {
+        lo.fill(std::numeric_limits<double>::max());
+        hi.fill(-std::numeric_limits<double>::max());
+    }
+
+    void grow(const Eigen::Vector3d &p)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+
+    void grow(const Aabb &b)
+    {
+        lo = lo.cwiseMin(b.lo);
+        hi = hi.cwiseMax(b.hi);
+    }
+
+    double area() const
+    {
+        Eigen::Vector3d d = (hi - lo).cwiseMax(0.0);
+        return 2.0*(d(0)*d(1) + d(1)*d(2) + d(2)*d(0));
+    }
+
+    double squaredDistance(const Eigen::Vector3d &p) const
+    {
+        return (lo - p).cwiseMax(p - hi).cwiseMax(0.0).squaredNorm();
+    }
+
+    Eigen::Vector3d lo;
+    Eigen::Vector3d hi;
+};
+
+// GEOMETRY ----------------------------------------------------------
+
+// closest point to p on triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+inline Eigen::Vector3d closestPointTriangle(const Eigen::Vector3d &p, const Eigen::Vector3d &a,
+                                            const Eigen::Vector3d &b, const Eigen::Vector3d &c)
+{
+    Eigen::Vector3d ab = b - a, ac = c - a, ap = p - a;
+    double d1 = ab.dot(ap), d2 = ac.dot(ap);
+    if (d1 <= 0.0 && d2 <= 0.0) return a;
+
+    Eigen::Vector3d bp = p - b;
+    double d3 = ab.dot(bp), d4 = ac.dot(bp);
+    if (d3 >= 0.0 && d4 <= d3) return b;
+
+    double vc = d1*d4 - d3*d2;
+    if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) return a + d1/(d1 - d3)*ab;
+
+    Eigen::Vector3d cp = p - c;
+    double d5 = ab.dot(cp), d6 = ac.dot(cp);
+    if (d6 >= 0.0 && d5 <= d6) return c;
+
+    double vb = d5*d2 - d1*d6;
+    if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) return a + d2/(d2 - d6)*ac;
+
+    double va = d3*d6 - d5*d4;
+    if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0) return b + (d4 - d3)/((d4 - d3) + (d5 - d6))*(c - b);
+
+    double denom = 1.0/(va + vb + vc);
+    return a + ab*(vb*denom) + ac*(vc*denom);
+}
+
+// closest points c1 on p1q1 and c2 on p2q2, returns the squared distance (Ericson 5.1.9)
+inline double closestSegmentSegment(const Eigen::Vector3d &p1, const Eigen::Vector3d &q1,
+                                    const Eigen::Vector3d &p2, const Eigen::Vector3d &q2,
+                                    Eigen::Vector3d &c1, Eigen::Vector3d &c2)
+{
+    Eigen::Vector3d d1 = q1 - p1, d2 = q2 - p2, r = p1 - p2;
+    double a = d1.squaredNorm(), e = d2.squaredNorm(), f = d2.dot(r);
+    double s, t;
+    const double eps = 1e-18;
+    if (a <= eps && e <= eps)
+    {
+        c1 = p1;
+        c2 = p2;
+        return (c1 - c2).squaredNorm();
+    }
+    if (a <= eps)
+    {
+        s = 0.0;
+        t = std::max(0.0, std::min(1.0, f/e));
+    }
+    else
+    {
+        double c = d1.dot(r);
+        if (e <= eps)
+        {
+            t = 0.0;
+            s = std::max(0.0, std::min(1.0, -c/a));
+        }
+        else
+        {
+            double b = d1.dot(d2);
+            double denom = a*e - b*b;
+            s = denom != 0.0 ? std::max(0.0, std::min(1.0, (b*f - c*e)/denom)) : 0.0;
+            t = (b*s + f)/e;
+            if (t < 0.0)
+            {
+                t = 0.0;
+                s = std::max(0.0, std::min(1.0, -c/a));
+            }
+            else if (t > 1.0)
+            {
+                t = 1.0;
+                s = std::max(0.0, std::min(1.0, (b - c)/a));
+            }
+        }
+    }
+    c1 = p1 + d1*s;
+    c2 = p2 + d2*t;
+    return (c1 - c2).squaredNorm();
+}
+
+// the line o + t*dir crosses triangle abc at t (Moller-Trumbore)
+inline bool lineTriangle(const Eigen::Vector3d &o, const Eigen::Vector3d &dir, const MeshTriangle &tri, double &t)
+{
+    Eigen::Vector3d e1 = tri.v[1] - tri.v[0], e2 = tri.v[2] - tri.v[0];
+    Eigen::Vector3d h = dir.cross(e2);
+    double det = e1.dot(h);
+    if (fabs(det) <= 1e-30)
+    {
+        return false;
+    }
+    double inv = 1.0/det;
+    Eigen::Vector3d s = o - tri.v[0];
+    double u = inv*s.dot(h);
+    Eigen::Vector3d qv = s.cross(e1);
+    double v = inv*dir.dot(qv);
+    t = inv*e2.dot(qv);
+    return u >= 0.0 && v >= 0.0 && u + v <= 1.0;
+}
+
+// closest points between segment pq and triangle abc, returns the squared distance
+inline double closestSegmentTriangle(const Eigen::Vector3d &p, const Eigen::Vector3d &q, const MeshTriangle &tri,
+                                     Eigen::Vector3d &onSegment, Eigen::Vector3d &onTriangle)
+{
+    const Eigen::Vector3d &a = tri.v[0], &b = tri.v[1], &c = tri.v[2];
+
+    // the segment crosses the triangle
+    double t;
+    if (lineTriangle(p, q - p, tri, t) && t >= 0.0 && t <= 1.0)
+    {
+        onSegment = p + t*(q - p);
+        onTriangle = onSegment;
+        return 0.0;
+    }
+
+    // otherwise the minimum is at an end of the segment or on an edge
+    Eigen::Vector3d cs, ct;
+    onSegment = p;
+    onTriangle = closestPointTriangle(p, a, b, c);
+    double best = (onSegment - onTriangle).squaredNorm();
+
+    ct = closestPointTriangle(q, a, b, c);
+    double d = (q - ct).squaredNorm();
+    if (d < best)
+    {
+        best = d;
+        onSegment = q;
+        onTriangle = ct;
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        d = closestSegmentSegment(p, q, tri.v[k], tri.v[(k+1)%3], cs, ct);
+        if (d < best)
+        {
+            best = d;
+            onSegment = cs;
+            onTriangle = ct;
+        }
+    }
+    return best;
+}
+
+// BOUNDING VOLUME HIERARCHY -------------------------------------------
+
+struct SegmentHit
+{
+    double distance;            // segment to mesh [m]
+    int triangle;               // -1 if nothing within the search distance
+    Eigen::Vector3d onSegment;
+    Eigen::Vector3d onMesh;
+};
+
+class TriangleBvh
+{
+public:
+    enum { LEAF_SIZE = 4, NUM_BINS = 16, MAX_DEPTH = 64 };
+
+    TriangleBvh() {}
+
+    void build(const std::vector<MeshTriangle> &input)
+    {
+        tris = input;
+        nodes.clear();
+        nodes.reserve(2*tris.size());
+        centroids.resize(tris.size());
+        boxes.resize(tris.size());
+        for (size_t i = 0; i < tris.size(); i++)
+        {
+            boxes[i].clear();
+            for (int k = 0; k < 3; k++)
+            {
+                boxes[i].grow(tris[i].v[k]);
+            }
+            centroids[i] = (tris[i].v[0] + tris[i].v[1] + tris[i].v[2])/3.0;
+        }
+        order.resize(tris.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = int(i);
+        }
+
+        nodes.push_back(Node());
+        depth = 0;
+        split(0, 0, int(tris.size()), 1);
+
+        // store the triangles in leaf order
+        std::vector<MeshTriangle> sorted(tris.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            sorted[i] = tris[order[i]];
+        }
+        tris.swap(sorted);
+        spheres.resize(tris.size());
+        for (size_t i = 0; i < tris.size(); i++)
+        {
+            Eigen::Vector3d c = (tris[i].v[0] + tris[i].v[1] + tris[i].v[2])/3.0;
+            double r = std::max((tris[i].v[0] - c).norm(), std::max((tris[i].v[1] - c).norm(), (tris[i].v[2] - c).norm()));
+            spheres[i] << c, r;
+        }
+        std::vector<Eigen::Vector3d>().swap(centroids);
+        std::vector<Aabb>().swap(boxes);
+        std::vector<int>().swap(order);
+    }
+
+    int numTriangles() const { return int(tris.size()); }
+    int numNodes() const { return int(nodes.size()); }
+    int treeDepth() const { return depth; }
+    const MeshTriangle &triangle(int i) const { return tris[i]; }
+    const Aabb &bounds() const { return nodes[0].box; }
+
+    // Nearest triangle to segment pq within maxDistance. hint (a triangle
+    // index, e.g. the previous answer) gives the starting bound.
+    SegmentHit nearest(const Eigen::Vector3d &p, const Eigen::Vector3d &q, double maxDistance, int hint = -1) const
+    {
+        SegmentHit hit;
+        hit.distance = maxDistance;
+        hit.triangle = -1;
+        hit.onSegment = p;
+        hit.onMesh = p;
+        if (nodes.empty())
+        {
+            return hit;
+        }
+        double best2 = maxDistance*maxDistance;
+        Eigen::Vector3d cs, ct;
+        if (hint >= 0 && hint < int(tris.size()))
+        {
+            double d2 = closestSegmentTriangle(p, q, tris[hint], cs, ct);
+            if (d2 < best2)
+            {
+                best2 = d2;
+                hit.triangle = hint;
+                hit.onSegment = cs;
+                hit.onMesh = ct;
+            }
+        }
+
+        // A box is no nearer to the segment than to its midpoint, less half
+        // its length: only boxes within reach of the midpoint can hold a
+        // nearer triangle. Squared distances are compared, no square roots.
+        Eigen::Vector3d mid = 0.5*(p + q);
+        double halfLength = 0.5*(q - p).norm();
+        double reach = sqrt(best2) + halfLength;
+
+        int stack[MAX_DEPTH];
+        double stackDistance2[MAX_DEPTH];   // of the box to mid, when it was pushed
+        int top = 0;
+        stack[top] = 0;
+        stackDistance2[top++] = nodes[0].box.squaredDistance(mid);
+        while (top > 0)
+        {
+            top--;
+            if (stackDistance2[top] >= reach*reach)
+            {
+                continue;
+            }
+            const Node &n = nodes[stack[top]];
+            if (n.count > 0)
+            {
+                for (int i = n.first; i < n.first + n.count; i++)
+                {
+                    // bounding sphere first, most triangles of a leaf are farther than the best
+                    double sphereReach = reach + spheres[i](3);
+                    if ((spheres[i].head<3>() - mid).squaredNorm() >= sphereReach*sphereReach)
+                    {
+                        continue;
+                    }
+                    double d2 = closestSegmentTriangle(p, q, tris[i], cs, ct);
+                    if (d2 < best2)
+                    {
+                        best2 = d2;
+                        reach = sqrt(best2) + halfLength;
+                        hit.triangle = i;
+                        hit.onSegment = cs;
+                        hit.onMesh = ct;
+                    }
+                }
+            }
+            else
+            {
+                // nearer child on top of the stack
+                int l = n.first, r = n.first + 1;
+                double dl = nodes[l].box.squaredDistance(mid), dr = nodes[r].box.squaredDistance(mid);
+                if (dl < dr)
+                {
+                    std::swap(l, r);
+                    std::swap(dl, dr);
+                }
+                stack[top] = l;
+                stackDistance2[top++] = dl;
+                stack[top] = r;
+                stackDistance2[top++] = dr;
+            }
+        }
+        if (hit.triangle >= 0)
+        {
+            hit.distance = sqrt(best2);
+        }
+        return hit;
+    }
+
+    // Appends the t > 0 at which the ray o + t*dir crosses a triangle to
+    // hits. Counting them tells inside from outside on a closed mesh, also
+    // where it intersects itself; dir should not be parallel to an axis.
+    void rayCrossings(const Eigen::Vector3d &o, const Eigen::Vector3d &dir, std::vector<double> &hits) const
+    {
+        if (nodes.empty())
+        {
+            return;
+        }
+        Eigen::Vector3d inv = dir.cwiseInverse();
+        int stack[MAX_DEPTH];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node &n = nodes[stack[--top]];
+            Eigen::Vector3d t0 = (n.box.lo - o).cwiseProduct(inv), t1 = (n.box.hi - o).cwiseProduct(inv);
+            if (t0.cwiseMax(t1).minCoeff() < std::max(0.0, t0.cwiseMin(t1).maxCoeff()))
+            {
+                continue;
+            }
+            if (n.count > 0)
+            {
+                for (int i = n.first; i < n.first + n.count; i++)
+                {
+                    double t;
+                    if (lineTriangle(o, dir, tris[i], t) && t > 0.0)
+                    {
+                        hits.push_back(t);
+                    }
+                }
+            }
+            else
+            {
+                stack[top++] = n.first;
+                stack[top++] = n.first + 1;
+            }
+        }
+    }
+
+private:
+    struct Node
+    {
+        Aabb box;
+        int first;      // leaf: first triangle; inner node: left child (right is first+1)
+        int count;      // triangles in a leaf, 0 for an inner node
+    };
+
+    void split(int nodeIndex, int begin, int end, int level)
+    {
+        depth = std::max(depth, level);
+        Aabb box, centroidBox;
+        for (int i = begin; i < end; i++)
+        {
+            box.grow(boxes[order[i]]);
+            centroidBox.grow(centroids[order[i]]);
+        }
+        nodes[nodeIndex].box = box;
+
+        int n = end - begin;
+        int axis;
+        Eigen::Vector3d extent = centroidBox.hi - centroidBox.lo;
+        extent.maxCoeff(&axis);
+        if (n <= LEAF_SIZE || extent(axis) <= 0.0 || level >= MAX_DEPTH - 1)
+        {
+            makeLeaf(nodeIndex, begin, n);
+            return;
+        }
+
+        // binned surface area heuristic along the longest axis
+        Aabb binBox[NUM_BINS];
+        int binCount[NUM_BINS] = {0};
+        double scale = NUM_BINS/extent(axis);
+        for (int i = begin; i < end; i++)
+        {
+            int b = std::min(NUM_BINS - 1, int((centroids[order[i]](axis) - centroidBox.lo(axis))*scale));
+            binBox[b].grow(boxes[order[i]]);
+            binCount[b]++;
+        }
+        double rightArea[NUM_BINS];
+        int rightCount[NUM_BINS];
+        Aabb acc;
+        int count = 0;
+        for (int b = NUM_BINS - 1; b > 0; b--)
+        {
+            acc.grow(binBox[b]);
+            count += binCount[b];
+            rightArea[b] = count ? acc.area() : 0.0;
+            rightCount[b] = count;
+        }
+        acc.clear();
+        count = 0;
+        double bestCost = std::numeric_limits<double>::max();
+        int bestSplit = -1;
+        for (int b = 1; b < NUM_BINS; b++)
+        {
+            acc.grow(binBox[b-1]);
+            count += binCount[b-1];
+            if (count == 0 || rightCount[b] == 0)
+            {
+                continue;
+            }
+            double cost = count*acc.area() + rightCount[b]*rightArea[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+        // a split must be cheaper than intersecting every triangle of the node
+        if (bestSplit < 0 || (n <= 2*LEAF_SIZE && bestCost >= n*box.area()))
+        {
+            makeLeaf(nodeIndex, begin, n);
+            return;
+        }
+
+        int *mid = std::partition(order.data() + begin, order.data() + end, [&](int t)
+        {
+            return std::min(NUM_BINS - 1, int((centroids[t](axis) - centroidBox.lo(axis))*scale)) < bestSplit;
+        });
+        int m = int(mid - order.data());
+
+        int left = int(nodes.size());
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[nodeIndex].first = left;
+        nodes[nodeIndex].count = 0;
+        split(left, begin, m, level + 1);
+        split(left + 1, m, end, level + 1);
+    }
+
+    void makeLeaf(int nodeIndex, int begin, int n)
+    {
+        nodes[nodeIndex].first = begin;
+        nodes[nodeIndex].count = n;
+    }
+
+    std::vector<MeshTriangle> tris;
+    std::vector<Eigen::Vector4d> spheres;   // bounding sphere of every triangle: centre, radius
+    std::vector<Node> nodes;
+    int depth;
+
+    // build only
+    std::vector<Eigen::Vector3d> centroids;
+    std::vector<Aabb> boxes;
+    std::vector<int> order;
+};
+
+// CANNULA VS ANATOMY --------------------------------------------------
+
+struct AnatomyClearance
+{
+    AnatomyClearance() : nSegments(0), minDistance(0.0), closest(-1) {}
+
+    int nSegments;
+    std::vector<double> distance;       // per segment, capsule surface to mesh [m], reused
+    std::vector<int> triangle;          // nearest triangle per segment, -1 beyond maxDistance
+    double minDistance;
+    int closest;                        // segment with the smallest distance, -1 if none within maxDistance
+    Eigen::Vector3d backbonePoint;      // on the closest segment's axis
+    Eigen::Vector3d anatomyPoint;       // on the mesh
+    double tQuery;                      // [s]
+};
+
+class AnatomyChecker
+{
+public:
+    AnatomyChecker() : maxDist(0.02) { radii << 0.5825e-3, 1.0287e-3, 1.270e-3; }
+
+    // loads the mesh and moves it into the world frame: x_world = R*x_stl*scale + t
+    bool load(const std::string &path, const Eigen::Vector3d &t, const Eigen::Quaterniond &R, double scale, std::string &error)
+    {
+        std::vector<MeshTriangle> triangles;
+        if (!loadStl(path, triangles, error))
+        {
+            return false;
+        }
+        Eigen::Matrix3d rot = R.normalized().toRotationMatrix();
+        for (size_t i = 0; i < triangles.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                triangles[i].v[k] = rot*(scale*triangles[i].v[k]) + t;
+            }
+        }
+        bvh.build(triangles);
+        return true;
+    }
+
+    // outer radius of tube 1 (inner) .. 3 (outer) [m]
+    void setTubeRadii(const Eigen::Vector3d &r) { radii = r; }
+
+    // distances beyond this are not searched for [m]
+    void setMaxDistance(double d) { maxDist = d; }
+
+    void reserve(int nPoints, AnatomyClearance &out) const
+    {
+        if (int(out.distance.size()) < nPoints)
+        {
+            out.distance.resize(nPoints, maxDist);
+            out.triangle.resize(nPoints, -1);
+        }
+    }
+
+    // posedata: 8 x N backbone of KinematicsResult (position, quaternion, tube number)
+    void query(const Eigen::MatrixXd &posedata, int nPoints, AnatomyClearance &out) const
+    {
+        double tic = seconds();
+        reserve(nPoints, out);
+        out.nSegments = std::max(0, nPoints - 1);
+        out.minDistance = maxDist;
+        out.closest = -1;
+        out.backbonePoint.fill(0);
+        out.anatomyPoint.fill(0);
+        for (int i = 0; i < out.nSegments; i++)
+        {
+            Eigen::Vector3d p = posedata.block<3,1>(0,i);
+            Eigen::Vector3d q = posedata.block<3,1>(0,i+1);
+            int tube = std::max(1, std::min(3, int(posedata(7,i+1) + 0.5)));
+            double r = radii(tube-1);
+
+            SegmentHit hit = bvh.nearest(p, q, maxDist + r, out.triangle[i]);
+            out.triangle[i] = hit.triangle;
+            out.distance[i] = hit.triangle >= 0 ? hit.distance - r : maxDist;
+            if (hit.triangle >= 0 && out.distance[i] < out.minDistance)
+            {
+                out.minDistance = out.distance[i];
+                out.closest = i;
+                out.backbonePoint = hit.onSegment;
+                out.anatomyPoint = hit.onMesh;
+            }
+        }
+        out.tQuery = seconds() - tic;
+    }
+
+    const TriangleBvh &tree() const { return bvh; }
+
+private:
+    static double seconds()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + 1e-9*ts.tv_nsec;
+    }
+
+    TriangleBvh bvh;
+    Eigen::Vector3d radii;
+    double maxDist;
+};
+
+#endif // ANATOMY_MESH_H
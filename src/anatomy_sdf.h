@@ -0,0 +1,551 @@
+#ifndef ANATOMY_SDF_H
+#define ANATOMY_SDF_H
+
+/********************************************************************
+
+  anatomy_sdf.h
+
+Signed distance field of the anatomy mesh, for distance lookups at
+control and haptic rates (the exact queries of anatomy_mesh.h cost a
+few microseconds per backbone segment; a lookup here costs 8 samples).
+
+The field is baked once per mesh, resolution and band and cached on
+disk; openAnatomySdf() reuses the cached file when its key matches and
+bakes (and caches) it otherwise, and anatomy_sdf_bake does the same
+from the command line.
+
+Layout: the mesh bounds, grown by the band, are divided into cubic
+cells of the resolution and the cells into bricks of 8^3. Only bricks
+within the band of the surface are stored, each with its own
+(8+1)^3 samples (the shared faces are duplicated, so every cell's 8
+corners are in one brick). A sample holds the signed distance (negative
+inside) and its gradient, the unit vector away from the nearest surface
+point. Bricks beyond the band hold no samples, only whether they are
+outside or inside; lookups there return +band or -band.
+
+The sign is the parity of the mesh crossings along a ray from the
+sample, one ray per row of samples. The smoothed segmentation intersects
+itself in places, where the sign of the nearest face (or its
+pseudo-normal) points the wrong way; the parity does not.
+
+Bricks are baked in parallel, in a fixed order, so the same key always
+gives the same file. The file is a header, the brick index and the
+samples, and is memory-mapped read-only: opening costs nothing and the
+pages are shared between the nodes that use the same field.
+
+The field is in the frame of the STL (times the scale), so a change of
+the pose the anatomy is placed at does not need a new bake; setPose()
+sets it for world frame lookups.
+
+Lookups do not allocate.
+
+********************************************************************/
+
+#include "anatomy_mesh.h"
+#include "flight_recorder.h"
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ANATOMY_SDF_MAGIC "ETANASDF"
+#define ANATOMY_SDF_VERSION 1
+
+// cells per brick edge
+#define ANATOMY_SDF_BRICK 8
+
+// brick index entries of bricks without samples
+#define ANATOMY_SDF_FAR_OUTSIDE -1
+#define ANATOMY_SDF_FAR_INSIDE -2
+
+struct AnatomySdfHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t brickCells;        // ANATOMY_SDF_BRICK
+    uint64_t meshHash;          // of the STL file and the scale
+    double resolution;          // cell size [m]
+    double band;                // [m]
+    double origin[3];           // corner of cell 0 [m, mesh frame]
+    int32_t bricks[3];          // bricks along x, y, z
+    uint32_t numStored;         // bricks with samples
+    uint64_t indexOffset;       // int32 per brick, x fastest: stored brick number or ANATOMY_SDF_FAR_*
+    uint64_t sampleOffset;      // numStored*(brickCells+1)^3 samples, x fastest
+    uint64_t fileSize;
+};
+
+struct AnatomySdfSample
+{
+    float distance;             // [m]
+    float gradient[3];
+};
+
+// key of a cached field: FNV-1a over the STL file and the scale
+inline bool anatomyMeshHash(const std::string &path, double scale, uint64_t &hash, std::string &error)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        error = "could not open " + path;
+        return false;
+    }
+    hash = 1469598103934665603ULL;
+    char buf[65536];
+    while (file)
+    {
+        file.read(buf, sizeof(buf));
+        for (std::streamsize i = 0; i < file.gcount(); i++)
+        {
+            hash = (hash ^ uint8_t(buf[i]))*1099511628211ULL;
+        }
+    }
+    const uint8_t *s = reinterpret_cast<const uint8_t*>(&scale);
+    for (size_t i = 0; i < sizeof(scale); i++)
+    {
+        hash = (hash ^ s[i])*1099511628211ULL;
+    }
+    return true;
+}
+
+// $ROS_HOME/anatomy_sdf, or ~/.ros/anatomy_sdf
+inline std::string anatomySdfCacheDir()
+{
+    const char *rosHome = getenv("ROS_HOME");
+    if (rosHome && *rosHome)
+    {
+        return std::string(rosHome) + "/anatomy_sdf";
+    }
+    const char *home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.ros/anatomy_sdf";
+}
+
+inline std::string anatomySdfCachePath(const std::string &dir, uint64_t hash, double resolution, double band)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "/%016llx_r%.0fum_b%.0fum.sdf", (unsigned long long)hash, resolution*1e6, band*1e6);
+    return dir + name;
+}
+
+// BAKING ------------------------------------------------------------
+
+struct AnatomySdfBakeParams
+{
+    double resolution;          // [m]
+    double band;                // [m]
+    double scale;               // of the STL coordinates
+    int threads;                // 0: one per core
+
+    AnatomySdfBakeParams() : resolution(0.5e-3), band(5e-3), scale(1.0), threads(0) {}
+};
+
+// Bakes the field of the mesh at stlPath and writes it to outPath.
+inline bool bakeAnatomySdf(const std::string &stlPath, const AnatomySdfBakeParams &params,
+                           const std::string &outPath, std::string &report, std::string &error)
+{
+    if (params.resolution <= 0.0 || params.band <= 0.0)
+    {
+        error = "resolution and band must be positive";
+        return false;
+    }
+    double tStart = monotonicSeconds();
+    uint64_t hash;
+    std::vector<MeshTriangle> triangles;
+    if (!anatomyMeshHash(stlPath, params.scale, hash, error) || !loadStl(stlPath, triangles, error))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            triangles[i].v[k] *= params.scale;
+        }
+    }
+    TriangleBvh bvh;
+    bvh.build(triangles);
+
+    const int B = ANATOMY_SDF_BRICK;
+    const int S = B + 1;
+    const double res = params.resolution;
+    Eigen::Vector3d origin = bvh.bounds().lo - Eigen::Vector3d::Constant(params.band + res);
+    Eigen::Vector3d extent = bvh.bounds().hi - bvh.bounds().lo + Eigen::Vector3d::Constant(2*(params.band + res));
+    int bricks[3];
+    for (int a = 0; a < 3; a++)
+    {
+        bricks[a] = std::max(1, int(ceil(extent(a)/(res*B))));
+    }
+    int numBricks = bricks[0]*bricks[1]*bricks[2];
+
+    // every brick: its samples if it is within the band, otherwise just the sign
+    std::vector<int32_t> index(numBricks, ANATOMY_SDF_FAR_OUTSIDE);
+    std::vector<std::vector<AnatomySdfSample> > brickSamples(numBricks);
+    double halfDiagonal = 0.5*sqrt(3.0)*res*B;
+
+    // inside or outside: crossings of a ray along (nearly) +x, off the axis
+    // so it does not graze the edges of an axis-aligned mesh
+    const Eigen::Vector3d rayDir = Eigen::Vector3d(1.0, 1.3e-6, 0.7e-6).normalized();
+
+    std::atomic<int> next(0);
+    auto bake = [&]()
+    {
+        int hint = -1;
+        std::vector<double> crossings;
+        for (int b = next++; b < numBricks; b = next++)
+        {
+            int bx = b % bricks[0], by = (b/bricks[0]) % bricks[1], bz = b/(bricks[0]*bricks[1]);
+            Eigen::Vector3d corner = origin + res*B*Eigen::Vector3d(bx, by, bz);
+            Eigen::Vector3d centre = corner + Eigen::Vector3d::Constant(0.5*res*B);
+
+            SegmentHit hit = bvh.nearest(centre, centre, std::numeric_limits<double>::max(), hint);
+            hint = hit.triangle;
+            if (hit.distance > halfDiagonal + params.band)
+            {
+                crossings.clear();
+                bvh.rayCrossings(centre, rayDir, crossings);
+                index[b] = crossings.size() % 2 ? ANATOMY_SDF_FAR_INSIDE : ANATOMY_SDF_FAR_OUTSIDE;
+                continue;
+            }
+
+            // every sample is within 2*halfDiagonal + band of the surface
+            std::vector<AnatomySdfSample> &samples = brickSamples[b];
+            samples.resize(S*S*S);
+            for (int k = 0; k < S; k++)
+            {
+                for (int j = 0; j < S; j++)
+                {
+                    // one ray per row of samples: sample i is inside if an odd
+                    // number of the crossings lie beyond it
+                    Eigen::Vector3d rowStart = corner + res*Eigen::Vector3d(0, j, k);
+                    crossings.clear();
+                    bvh.rayCrossings(rowStart, rayDir, crossings);
+                    for (int i = 0; i < S; i++)
+                    {
+                        Eigen::Vector3d x = corner + res*Eigen::Vector3d(i, j, k);
+                        double along = (x - rowStart).dot(rayDir);
+                        int beyond = 0;
+                        for (size_t c = 0; c < crossings.size(); c++)
+                        {
+                            beyond += crossings[c] > along ? 1 : 0;
+                        }
+                        double sign = beyond % 2 ? -1.0 : 1.0;
+
+                        SegmentHit h = bvh.nearest(x, x, 2*halfDiagonal + params.band + res, hint);
+                        hint = h.triangle;
+                        const MeshTriangle &tri = bvh.triangle(h.triangle);
+                        Eigen::Vector3d away = x - h.onMesh;
+                        Eigen::Vector3d gradient = h.distance > 1e-12 ? Eigen::Vector3d(sign*away/h.distance)
+                                                                      : (tri.v[1] - tri.v[0]).cross(tri.v[2] - tri.v[0]).normalized();
+                        AnatomySdfSample &s = samples[(k*S + j)*S + i];
+                        s.distance = float(sign*h.distance);
+                        s.gradient[0] = float(gradient(0));
+                        s.gradient[1] = float(gradient(1));
+                        s.gradient[2] = float(gradient(2));
+                    }
+                }
+            }
+        }
+    };
+    int nThreads = params.threads > 0 ? params.threads : std::max(1, int(std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (int i = 1; i < nThreads; i++)
+    {
+        workers.push_back(std::thread(bake));
+    }
+    bake();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    uint32_t numStored = 0;
+    for (int b = 0; b < numBricks; b++)
+    {
+        if (!brickSamples[b].empty())
+        {
+            index[b] = int32_t(numStored++);
+        }
+    }
+
+    AnatomySdfHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANATOMY_SDF_MAGIC, 8);
+    header.version = ANATOMY_SDF_VERSION;
+    header.brickCells = B;
+    header.meshHash = hash;
+    header.resolution = res;
+    header.band = params.band;
+    for (int a = 0; a < 3; a++)
+    {
+        header.origin[a] = origin(a);
+        header.bricks[a] = bricks[a];
+    }
+    header.numStored = numStored;
+    header.indexOffset = sizeof(AnatomySdfHeader);
+    header.sampleOffset = (header.indexOffset + numBricks*sizeof(int32_t) + 63)/64*64;
+    header.fileSize = header.sampleOffset + uint64_t(numStored)*S*S*S*sizeof(AnatomySdfSample);
+
+    // written next to the target and renamed, so a reader never maps half a file
+    std::string tmpPath = outPath + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmpPath.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(index.data()), numBricks*sizeof(int32_t));
+    std::vector<char> pad(header.sampleOffset - header.indexOffset - numBricks*sizeof(int32_t), 0);
+    out.write(pad.data(), pad.size());
+    for (int b = 0; b < numBricks; b++)
+    {
+        if (!brickSamples[b].empty())
+        {
+            out.write(reinterpret_cast<const char*>(brickSamples[b].data()), brickSamples[b].size()*sizeof(AnatomySdfSample));
+        }
+    }
+    out.close();
+    if (!out || rename(tmpPath.c_str(), outPath.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        error = "could not write " + outPath;
+        return false;
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "%d triangles, %d x %d x %d bricks of %d^3 cells at %.2f mm, %u within the %.1f mm band, %.1f MB, %.2f s on %d threads",
+             bvh.numTriangles(), bricks[0], bricks[1], bricks[2], B, 1e3*res, numStored, 1e3*params.band,
+             header.fileSize/1048576.0, monotonicSeconds() - tStart, nThreads);
+    report = line;
+    return true;
+}
+
+// LOOKUP --------------------------------------------------------------
+
+class AnatomySdf
+{
+public:
+    AnatomySdf() : fd(-1), base(0), mapSize(0), header(0), index(0), samples(0)
+    {
+        setPose(Eigen::Vector3d::Zero(), Eigen::Quaterniond::Identity());
+    }
+    ~AnatomySdf() { close(); }
+
+    bool isOpen() const { return base != 0; }
+
+    // maps a baked field; expectHash != 0 rejects a field of another mesh
+    bool open(const std::string &path, std::string &error, uint64_t expectHash = 0)
+    {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(AnatomySdfHeader))
+        {
+            error = "could not open " + path;
+            close();
+            return false;
+        }
+        mapSize = st.st_size;
+        void *p = mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            error = "could not map " + path;
+            close();
+            return false;
+        }
+        base = static_cast<const char*>(p);
+        header = reinterpret_cast<const AnatomySdfHeader*>(base);
+        if (memcmp(header->magic, ANATOMY_SDF_MAGIC, 8) != 0 || header->version != ANATOMY_SDF_VERSION ||
+            header->brickCells != ANATOMY_SDF_BRICK || header->fileSize != mapSize)
+        {
+            error = path + " is not a complete anatomy distance field of this version";
+            close();
+            return false;
+        }
+        if (expectHash != 0 && header->meshHash != expectHash)
+        {
+            error = path + " is the field of another mesh";
+            close();
+            return false;
+        }
+        index = reinterpret_cast<const int32_t*>(base + header->indexOffset);
+        samples = reinterpret_cast<const AnatomySdfSample*>(base + header->sampleOffset);
+        origin = Eigen::Vector3d(header->origin[0], header->origin[1], header->origin[2]);
+        invResolution = 1.0/header->resolution;
+        for (int a = 0; a < 3; a++)
+        {
+            cells[a] = header->bricks[a]*ANATOMY_SDF_BRICK;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (base)
+        {
+            munmap(const_cast<char*>(base), mapSize);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+        base = 0;
+        header = 0;
+        index = 0;
+        samples = 0;
+    }
+
+    double resolution() const { return header ? header->resolution : 0.0; }
+    double band() const { return header ? header->band : 0.0; }
+    uint64_t meshHash() const { return header ? header->meshHash : 0; }
+    size_t bytes() const { return mapSize; }
+
+    // world pose of the mesh frame: x_world = R*x_mesh + t
+    void setPose(const Eigen::Vector3d &t, const Eigen::Quaterniond &R)
+    {
+        translation = t;
+        rotation = R.normalized().toRotationMatrix();
+    }
+
+    // signed distance at x [m, world frame], negative inside; gradient (world frame) if given
+    double distance(const Eigen::Vector3d &x, Eigen::Vector3d *gradient = 0) const
+    {
+        Eigen::Vector3d g;
+        double d = meshDistance(rotation.transpose()*(x - translation), gradient ? &g : 0);
+        if (gradient)
+        {
+            *gradient = rotation*g;
+        }
+        return d;
+    }
+
+    // the same in the mesh frame
+    double meshDistance(const Eigen::Vector3d &x, Eigen::Vector3d *gradient = 0) const
+    {
+        if (!header)
+        {
+            if (gradient)
+            {
+                gradient->setZero();
+            }
+            return std::numeric_limits<double>::max();
+        }
+        const int B = ANATOMY_SDF_BRICK;
+        const int S = B + 1;
+        Eigen::Vector3d u = (x - origin)*invResolution;
+        int cell[3];
+        double f[3];
+        bool inside = true;
+        for (int a = 0; a < 3; a++)
+        {
+            double c = floor(u(a));
+            inside = inside && c >= 0 && c < cells[a];
+            cell[a] = std::max(0, std::min(cells[a] - 1, int(c)));
+            f[a] = u(a) - cell[a];
+        }
+        if (!inside)
+        {
+            // the grid covers the mesh and the band: outside it is outside the band
+            Eigen::Vector3d lo = origin, hi = origin + header->resolution*Eigen::Vector3d(cells[0], cells[1], cells[2]);
+            Eigen::Vector3d away = x - x.cwiseMax(lo).cwiseMin(hi);
+            if (gradient)
+            {
+                *gradient = away.normalized();
+            }
+            return header->band + away.norm();
+        }
+
+        int brick = (cell[2]/B*header->bricks[1] + cell[1]/B)*header->bricks[0] + cell[0]/B;
+        int32_t stored = index[brick];
+        if (stored < 0)
+        {
+            if (gradient)
+            {
+                gradient->setZero();
+            }
+            return stored == ANATOMY_SDF_FAR_INSIDE ? -header->band : header->band;
+        }
+
+        // trilinear over the cell's 8 corners
+        const AnatomySdfSample *s = samples + size_t(stored)*S*S*S + ((cell[2]%B)*S + cell[1]%B)*S + cell[0]%B;
+        double d = 0.0;
+        Eigen::Vector3d g = Eigen::Vector3d::Zero();
+        for (int c = 0; c < 8; c++)
+        {
+            int i = c & 1, j = (c >> 1) & 1, k = (c >> 2) & 1;
+            double w = (i ? f[0] : 1.0 - f[0])*(j ? f[1] : 1.0 - f[1])*(k ? f[2] : 1.0 - f[2]);
+            const AnatomySdfSample &corner = s[(k*S + j)*S + i];
+            d += w*corner.distance;
+            g += w*Eigen::Vector3d(corner.gradient[0], corner.gradient[1], corner.gradient[2]);
+        }
+        if (gradient)
+        {
+            double n = g.norm();
+            *gradient = n > 0.0 ? Eigen::Vector3d(g/n) : g;
+        }
+        return d;
+    }
+
+private:
+    int fd;
+    const char *base;
+    size_t mapSize;
+    const AnatomySdfHeader *header;
+    const int32_t *index;
+    const AnatomySdfSample *samples;
+    Eigen::Vector3d origin;
+    double invResolution;
+    int cells[3];
+    Eigen::Vector3d translation;
+    Eigen::Matrix3d rotation;
+};
+
+// Opens the cached field of the mesh for these parameters, baking it into
+// cacheDir first if there is none. Reports what it did.
+inline bool openAnatomySdf(AnatomySdf &sdf, const std::string &stlPath, const AnatomySdfBakeParams &params,
+                           const std::string &cacheDir, std::string &report, std::string &error)
+{
+    uint64_t hash;
+    if (!anatomyMeshHash(stlPath, params.scale, hash, error))
+    {
+        return false;
+    }
+    std::string path = anatomySdfCachePath(cacheDir, hash, params.resolution, params.band);
+    std::string openError;
+    if (sdf.open(path, openError, hash))
+    {
+        report = "cached " + path;
+        return true;
+    }
+
+    // create the cache directory and its parents
+    for (size_t pos = cacheDir.find('/', 1); ; pos = cacheDir.find('/', pos + 1))
+    {
+        mkdir(cacheDir.substr(0, pos).c_str(), 0755);
+        if (pos == std::string::npos)
+        {
+            break;
+        }
+    }
+    std::string bakeReport;
+    if (!bakeAnatomySdf(stlPath, params, path, bakeReport, error) || !sdf.open(path, error, hash))
+    {
+        return false;
+    }
+    report = "baked " + path + ": " + bakeReport;
+    return true;
+}
+
+#endif // ANATOMY_SDF_H
@@ -0,0 +1,169 @@
+/********************************************************************
+
+  anatomy_sdf_bake.cpp
+
+Bakes the signed distance field of the anatomy mesh (see anatomy_sdf.h)
+into the cache, where the nodes that use it find it at startup. A field
+that is already cached for the same mesh, scale, resolution and band is
+reused unless --force is given.
+
+--check n compares the field with exact distances (anatomy_mesh.h) at n
+random points within the band and prints the error of the distance and
+the angle of the gradient.
+
+The mesh defaults to the package's src/everythingSmoothedShrink.stl and
+the cache to $ROS_HOME/anatomy_sdf (~/.ros/anatomy_sdf).
+
+Usage: anatomy_sdf_bake [mesh.stl] [--resolution m] [--band m] [--scale s]
+                        [--cache-dir dir] [--threads n] [--force] [--check n]
+
+********************************************************************/
+
+#include "anatomy_sdf.h"
+
+#include <ros/package.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+int main(int argc, char *argv[])
+{
+    std::string meshPath = ros::package::getPath("endonasal_teleop") + "/src/everythingSmoothedShrink.stl";
+    std::string cacheDir = anatomySdfCacheDir();
+    AnatomySdfBakeParams params;
+    bool force = false;
+    int checkPoints = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--resolution" && i+1 < argc)
+        {
+            params.resolution = atof(argv[++i]);
+        }
+        else if (arg == "--band" && i+1 < argc)
+        {
+            params.band = atof(argv[++i]);
+        }
+        else if (arg == "--scale" && i+1 < argc)
+        {
+            params.scale = atof(argv[++i]);
+        }
+        else if (arg == "--cache-dir" && i+1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--threads" && i+1 < argc)
+        {
+            params.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--force")
+        {
+            force = true;
+        }
+        else if (arg == "--check" && i+1 < argc)
+        {
+            checkPoints = atoi(argv[++i]);
+        }
+        else if (i == 1 && arg.compare(0, 2, "--") != 0)
+        {
+            meshPath = arg;
+        }
+        else
+        {
+            std::cerr << "Usage: anatomy_sdf_bake [mesh.stl] [--resolution m] [--band m] [--scale s]"
+                         " [--cache-dir dir] [--threads n] [--force] [--check n]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::string error, report;
+    if (force)
+    {
+        uint64_t hash;
+        if (!anatomyMeshHash(meshPath, params.scale, hash, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        unlink(anatomySdfCachePath(cacheDir, hash, params.resolution, params.band).c_str());
+    }
+    AnatomySdf sdf;
+    if (!openAnatomySdf(sdf, meshPath, params, cacheDir, report, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << report << std::endl;
+
+/*******************************************************************************
+                CHECK AGAINST EXACT DISTANCES
+********************************************************************************/
+
+    if (checkPoints > 0)
+    {
+        std::vector<MeshTriangle> triangles;
+        if (!loadStl(meshPath, triangles, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < triangles.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                triangles[i].v[k] *= params.scale;
+            }
+        }
+        TriangleBvh bvh;
+        bvh.build(triangles);
+
+        // points at random distances within the band off random surface points
+        std::mt19937 rng(1);
+        std::uniform_int_distribution<int> pickTriangle(0, bvh.numTriangles() - 1);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        double maxError = 0.0, sumSqError = 0.0, sumSqAngle = 0.0, tLookup = 0.0;
+        int angleChecked = 0, angleOff = 0;
+        for (int n = 0; n < checkPoints; n++)
+        {
+            const MeshTriangle &tri = bvh.triangle(pickTriangle(rng));
+            double a = unit(rng), b = unit(rng);
+            if (a + b > 1.0)
+            {
+                a = 1.0 - a;
+                b = 1.0 - b;
+            }
+            Eigen::Vector3d onSurface = tri.v[0] + a*(tri.v[1] - tri.v[0]) + b*(tri.v[2] - tri.v[0]);
+            Eigen::Vector3d dir(unit(rng) - 0.5, unit(rng) - 0.5, unit(rng) - 0.5);
+            Eigen::Vector3d x = onSurface + (2.0*unit(rng) - 1.0)*params.band*dir.normalized();
+
+            SegmentHit hit = bvh.nearest(x, x, 2.0*params.band);
+            Eigen::Vector3d gradient;
+            double tic = monotonicSeconds();
+            double d = sdf.meshDistance(x, &gradient);
+            tLookup += monotonicSeconds() - tic;
+
+            double e = fabs(fabs(d) - hit.distance);
+            maxError = std::max(maxError, e);
+            sumSqError += e*e;
+            // the gradient is ill-defined next to the surface and where two surfaces are equally near
+            if (hit.distance > 2.0*params.resolution)
+            {
+                Eigen::Vector3d away = (d < 0.0 ? -1.0 : 1.0)*(x - hit.onMesh).normalized();
+                double angle = acos(std::max(-1.0, std::min(1.0, away.dot(gradient))));
+                sumSqAngle += angle*angle;
+                angleChecked++;
+                angleOff += angle > M_PI/6.0 ? 1 : 0;
+            }
+        }
+        printf("%d points: distance error RMS %.4f mm, max %.4f mm; lookup %.0f ns\n",
+               checkPoints, 1e3*sqrt(sumSqError/checkPoints), 1e3*maxError, 1e9*tLookup/checkPoints);
+        printf("gradient more than 2 cells off the surface: angle RMS %.2f deg, %d of %d off by more than 30 deg\n",
+               angleChecked ? sqrt(sumSqAngle/angleChecked)*180.0/M_PI : 0.0, angleOff, angleChecked);
+    }
+
+    return 0;
+}
@@ -0,0 +1,328 @@
+#ifndef ASYNC_LOGGER_H
+#define ASYNC_LOGGER_H
+
+/********************************************************************
+
+  async_logger.h
+
+Asynchronous console logger for the control loops.
+Hot-path calls copy a fixed-size record (a static label plus up to 16
+doubles) into a lock-free bounded queue and return; a background thread
+formats and writes them. Nothing on the calling side allocates, locks or
+touches the terminal.
+
+Counters are for events that can fire every cycle (saturations, limit
+hits): they are incremented with a single atomic add and reported as
+"label: N times in the last T s" once per report period, only if they
+fired.
+
+Labels must be string literals (or otherwise outlive the logger).
+
+********************************************************************/
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+struct LogRecord
+{
+    const char *label;
+    double stamp;       // seconds since the logger started
+    int rows;
+    int cols;
+    bool truncated;     // entries beyond the 16 that fit were left out
+    double vals[16];
+};
+
+class AsyncLogger
+{
+public:
+    enum { QUEUE_SIZE = 1024, MAX_COUNTERS = 32 };
+
+    AsyncLogger(double reportPeriod = 1.0, FILE *out = stdout)
+        : output(out), period(reportPeriod), enqueuePos(0), dequeuePos(0), dropped(0), running(false)
+    {
+        for (size_t i = 0; i < QUEUE_SIZE; i++)
+        {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < MAX_COUNTERS; i++)
+        {
+            counterLabels[i] = 0;
+            counters[i].store(0, std::memory_order_relaxed);
+            reported[i] = 0;
+        }
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~AsyncLogger()
+    {
+        stop();
+    }
+
+    void run()
+    {
+        if (!running.exchange(true))
+        {
+            worker = std::thread(&AsyncLogger::drainLoop, this);
+        }
+    }
+
+    // stops the background thread after writing everything still queued
+    void stop()
+    {
+        if (running.exchange(false))
+        {
+            worker.join();
+        }
+    }
+
+    // counters must be labelled before the loop starts
+    void setCounterLabel(int id, const char *label)
+    {
+        if (id >= 0 && id < MAX_COUNTERS)
+        {
+            counterLabels[id] = label;
+        }
+    }
+
+    void count(int id)
+    {
+        counters[id].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void log(const char *label)
+    {
+        Slot *s = acquire();
+        if (s)
+        {
+            fill(s->rec, label, 0, 0);
+            release(s);
+        }
+    }
+
+    void log(const char *label, double v)
+    {
+        Slot *s = acquire();
+        if (s)
+        {
+            fill(s->rec, label, 1, 1);
+            s->rec.vals[0] = v;
+            release(s);
+        }
+    }
+
+    // vectors are written on one line, matrices row by row; of more than 16
+    // entries only the first 16 of a vector (the first rows of a matrix, at
+    // most 16 columns) are kept, and the line ends in "..."
+    template<typename Derived>
+    void log(const char *label, const Eigen::MatrixBase<Derived> &m)
+    {
+        Slot *s = acquire();
+        if (s)
+        {
+            int rows = int(m.rows());
+            int cols = int(m.cols());
+            if (cols == 1)
+            {
+                cols = rows;
+                rows = 1;
+            }
+            bool truncated = rows*cols > 16;
+            cols = std::min(cols, 16);
+            rows = std::min(rows, 16/cols);
+            fill(s->rec, label, rows, cols);
+            s->rec.truncated = truncated;
+            for (int i = 0; i < rows; i++)
+            {
+                for (int j = 0; j < cols; j++)
+                {
+                    s->rec.vals[i*cols+j] = (m.cols() == 1) ? m(j,0) : m(i,j);
+                }
+            }
+            release(s);
+        }
+    }
+
+    // records dropped because the queue was full
+    uint64_t droppedRecords() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        LogRecord rec;
+    };
+
+    // bounded multi-producer queue (Vyukov); returns 0 and counts a drop if full
+    Slot *acquire()
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot &s = slots[pos & (QUEUE_SIZE-1)];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                {
+                    return &s;
+                }
+            }
+            else if (diff < 0)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // publishes a filled slot to the consumer
+    void release(Slot *s)
+    {
+        size_t seq = s->seq.load(std::memory_order_relaxed);
+        s->seq.store(seq + 1, std::memory_order_release);
+    }
+
+    void fill(LogRecord &r, const char *label, int rows, int cols)
+    {
+        r.label = label;
+        r.stamp = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        r.rows = rows;
+        r.cols = cols;
+        r.truncated = false;
+    }
+
+    bool dequeue(LogRecord &out)
+    {
+        size_t pos = dequeuePos;
+        Slot &s = slots[pos & (QUEUE_SIZE-1)];
+        size_t seq = s.seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(pos+1) < 0)
+        {
+            return false;
+        }
+        out = s.rec;
+        s.seq.store(pos + QUEUE_SIZE, std::memory_order_release);
+        dequeuePos = pos + 1;
+        return true;
+    }
+
+    void write(const LogRecord &r)
+    {
+        fprintf(output, "[%.3f] %s", r.stamp, r.label);
+        if (r.rows == 1)
+        {
+            fprintf(output, " =");
+            for (int j = 0; j < r.cols; j++)
+            {
+                fprintf(output, " %g", r.vals[j]);
+            }
+        }
+        else if (r.rows > 1)
+        {
+            fprintf(output, " =");
+            for (int i = 0; i < r.rows; i++)
+            {
+                fprintf(output, "\n   ");
+                for (int j = 0; j < r.cols; j++)
+                {
+                    fprintf(output, " %g", r.vals[i*r.cols+j]);
+                }
+            }
+        }
+        if (r.truncated)
+        {
+            fprintf(output, " ...");
+        }
+        fprintf(output, "\n");
+    }
+
+    void reportCounters(double elapsed)
+    {
+        for (int i = 0; i < MAX_COUNTERS; i++)
+        {
+            uint64_t c = counters[i].load(std::memory_order_relaxed);
+            if (c != reported[i])
+            {
+                fprintf(output, "%s: %llu times in the last %.1f s\n",
+                        counterLabels[i] ? counterLabels[i] : "counter",
+                        (unsigned long long)(c - reported[i]), elapsed);
+                reported[i] = c;
+            }
+        }
+        uint64_t d = dropped.load(std::memory_order_relaxed);
+        if (d != reportedDropped)
+        {
+            fprintf(output, "logger queue full, %llu records dropped\n", (unsigned long long)(d - reportedDropped));
+            reportedDropped = d;
+        }
+    }
+
+    void drainLoop()
+    {
+        reportedDropped = 0;
+        std::chrono::steady_clock::time_point lastReport = std::chrono::steady_clock::now();
+        LogRecord r;
+        for (;;)
+        {
+            bool more = running.load(std::memory_order_acquire);
+            bool wrote = false;
+            while (dequeue(r))
+            {
+                write(r);
+                wrote = true;
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - lastReport).count();
+            if (elapsed >= period || !more)
+            {
+                reportCounters(elapsed);
+                lastReport = now;
+                wrote = true;
+            }
+            if (wrote)
+            {
+                fflush(output);
+            }
+            if (!more)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    FILE *output;
+    double period;
+    std::chrono::steady_clock::time_point start;
+
+    Slot slots[QUEUE_SIZE];
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos;
+    std::atomic<uint64_t> dropped;
+    uint64_t reportedDropped;
+
+    const char *counterLabels[MAX_COUNTERS];
+    std::atomic<uint64_t> counters[MAX_COUNTERS];
+    uint64_t reported[MAX_COUNTERS];
+
+    std::atomic<bool> running;
+    std::thread worker;
+};
+
+#endif // ASYNC_LOGGER_H
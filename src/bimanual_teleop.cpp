@@ -0,0 +1,452 @@
+/********************************************************************
+
+  bimanual_teleop.cpp
+
+Bimanual teleoperation: two independent teleop pipelines in one
+process, one per arm (hardware.xml: two HapticInterfaces driving two
+ActiveCannulaRobots).
+
+Every arm has its own resolved rates controller, cannula kinematics,
+actuator map and ROS callback queue, and runs all of them on its own
+thread pinned to its own core: Omni callbacks, resolved rates step,
+encoder commands, then kinematics for the next cycle. The two arms share
+no state, so their kinematics solve concurrently and a slow cycle on one
+arm does not delay the other.
+
+An arm starts at the HomePositions of its robot, where the encoders read
+zero. The kinematics model only the tubes of endonasal_cannula and only
+Medlab motor control boards have a driver here, so the node refuses any
+other robot; with the hardware.xml of this package that leaves the
+default grip_cannula and curette_cannula (Galil) out until they have both.
+
+Topics, in the arm's namespace (left and right):
+    in:  Omnipos_stamped (Omnipos while nothing publishes the stamped
+         topic), Buttonstates
+    out: joint_q, kinematics_output
+and <board>/encoder_command for the boards of the arm's robot.
+
+Parameters:
+    ~hardware_file          hardware description (default config/hardware.xml)
+    ~left/robot, ~right/robot
+                            ActiveCannulaRobot of each arm
+                            (default grip_cannula, curette_cannula)
+    ~left/cpu, ~right/cpu   core for each arm's thread, -1 to not pin
+                            (default 2, 3)
+    ~report_period          seconds between rate reports (default 5)
+plus the resolved rates parameters of resolved_rates.
+
+********************************************************************/
+
+#include "resolved_rates_core.h"
+#include "kinematics_core.h"
+#include "actuator_map.h"
+#include "flight_recorder.h"
+#include "realtime.h"
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <ros/package.h>
+#include <geometry_msgs/Pose.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/config3.h>
+#include <endonasal_teleop/kinout.h>
+#include <endonasal_teleop/stampedPose.h>
+
+#include "medlab_motor_control_board/McbEncoders.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one complete teleop pipeline
+class TeleopArm
+{
+public:
+    TeleopArm(const std::string &armName, const ResolvedRatesParams &params)
+        : name(armName), cpu(-1), rr(params), stampedInput(false), running(false),
+          cycles(0), overruns(0), sumCycleTime(0.0), maxCycleTime(0.0)
+    {
+        for (int i = 0; i < NUM_SAT_COUNTERS; i++)
+        {
+            counterLabels[i] = name + ": " + saturationLabels[i];
+            logger.setCounterLabel(i, counterLabels[i].c_str());
+        }
+        rr.setLogger(&logger);
+    }
+
+    ~TeleopArm() { stop(); }
+
+    // reads ~<name>/robot and ~<name>/cpu, loads the actuator map and sets up
+    // the arm's topics on its own callback queue. Refuses a robot whose tubes
+    // CannulaKinematics does not model or that has a board without a driver
+    // here: its commands would not match the robot or never reach it.
+    bool setup(const std::string &hardwarePath, const std::string &defaultRobot, int defaultCpu, std::string &error)
+    {
+        ros::param::param<std::string>("~" + name + "/robot", robot, defaultRobot);
+        ros::param::param<int>("~" + name + "/cpu", cpu, defaultCpu);
+
+        if (robot != CannulaKinematics::robotName())
+        {
+            error = name + ": no kinematics model for " + robot + " (only " + CannulaKinematics::robotName() + ")";
+            return false;
+        }
+        if (!actuators.load(hardwarePath, std::vector<std::string>(1, robot), error))
+        {
+            return false;
+        }
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            if (actuators.boardType(b) != "MedlabMotorControlBoard" || actuators.boardAxes(b) != 6)
+            {
+                error = name + ": no driver for " + actuators.boardName(b) + " (" + actuators.boardType(b) + ") of " + robot;
+                return false;
+            }
+        }
+        counts.assign(actuators.numCounts(), 0);
+        sentCounts.assign(actuators.numCounts(), 0);
+
+        nh = ros::NodeHandle(name);
+        nh.setCallbackQueue(&queue);
+        omniSub = nh.subscribe("Omnipos", 1, &TeleopArm::omniCallback, this);
+        omniStampedSub = nh.subscribe("Omnipos_stamped", 1, &TeleopArm::omniStampedCallback, this);
+        buttonSub = nh.subscribe("Buttonstates", 1, &TeleopArm::buttonCallback, this);
+        jointPub = nh.advertise<endonasal_teleop::config3>("joint_q", 10);
+        kinPub = nh.advertise<endonasal_teleop::kinout>("kinematics_output", 10);
+
+        // boards are global names, outside the arm's namespace
+        ros::NodeHandle root;
+        encoderPub.assign(actuators.numBoards(), ros::Publisher());
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            encoderPub[b] = root.advertise<medlab_motor_control_board::McbEncoders>(actuators.boardName(b) + "/encoder_command", 1);
+        }
+
+        // start where the encoders read zero: at the robot's HomePositions
+        Configuration3 qstart = ResolvedRatesController::homeConfiguration();
+        for (int t = 1; t <= ACTUATOR_TUBES; t++)
+        {
+            qstart.Beta(t-1) = actuators.homePosition(0, t);
+        }
+        cannula.compute(qstart, kin);
+        kinState.ptip = kin.ptip;
+        kinState.qtip = kin.qtip;
+        kinState.alpha.fill(0);
+        kinState.J = kin.J;
+        rr.reset(qstart, cannula.tubeLengths());
+        return true;
+    }
+
+    void start()
+    {
+        if (!running.exchange(true))
+        {
+            logger.run();
+            worker = std::thread(&TeleopArm::run, this);
+            if (cpu >= 0 && !pinThread(worker, cpu))
+            {
+                std::cout << name << ": could not pin the arm thread to core " << cpu << std::endl;
+            }
+        }
+    }
+
+    void stop()
+    {
+        if (running.exchange(false))
+        {
+            worker.join();
+            logger.stop();
+        }
+    }
+
+    const std::string &armName() const { return name; }
+    const std::string &robotName() const { return robot; }
+    const ActuatorMap &actuatorMap() const { return actuators; }
+
+    // cycles, overruns, mean and max cycle time [s] since the last call
+    void takeStats(long &n, long &late, double &mean, double &max)
+    {
+        n = cycles.exchange(0);
+        late = overruns.exchange(0);
+        double sum = sumCycleTime.exchange(0.0);
+        max = maxCycleTime.exchange(0.0);
+        mean = n ? sum/n : 0.0;
+    }
+
+private:
+    // omni_node publishes every sample on both topics; the plain one is only
+    // a fallback for sources without Omnipos_stamped and is dropped once a
+    // stamped sample arrives, so every sample reaches the controller once
+    void omniCallback(const geometry_msgs::Pose &msg)
+    {
+        if (!stampedInput)
+        {
+            omniPose(msg);
+        }
+    }
+
+    void omniStampedCallback(const endonasal_teleop::stampedPose &msg)
+    {
+        if (!stampedInput)
+        {
+            stampedInput = true;
+            omniSub.shutdown();
+        }
+        omniPose(msg.pose);
+    }
+
+    void omniPose(const geometry_msgs::Pose &msg)
+    {
+        Eigen::Vector3d p;
+        p << msg.position.x, msg.position.y, msg.position.z;
+        Eigen::Vector4d q;
+        q << msg.orientation.w, msg.orientation.x, msg.orientation.y, msg.orientation.z;
+        rr.onOmniPose(p, q);
+    }
+
+    void buttonCallback(const std_msgs::Int8 &msg)
+    {
+        rr.onButton(static_cast<int>(msg.data));
+    }
+
+    void run()
+    {
+        std::chrono::steady_clock::duration period =
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0/rr.parameters().rosLoopRate));
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        bool sent = false;
+
+        while (running && ros::ok())
+        {
+            next += period;
+            double tic = monotonicSeconds();
+
+            // this arm's Omni input only
+            queue.callAvailable();
+
+            {
+                HotRegion hot;
+                rr.step(kinState, rrOut);
+                actuators.toCounts(rrOut.actuatorJoints.data(), counts.data());
+            }
+
+            // encoder commands (only when they change)
+            if (!sent || counts != sentCounts)
+            {
+                sendEncoderCommands();
+                sentCounts = counts;
+                sent = true;
+            }
+
+            // joint_q -> kinematics, in this thread, for the next cycle
+            Configuration3 q;
+            q.PsiL = rrOut.q_vec.head<3>();
+            q.Beta = rrOut.q_vec.tail<3>();
+            q.Ftip.fill(0);
+            q.Ttip.fill(0);
+            {
+                HotRegion hot;
+                cannula.compute(q, kin);
+                kinState.ptip = kin.ptip;
+                kinState.qtip = kin.qtip;
+                kinState.alpha = kin.alpha;
+                kinState.J = kin.J;
+            }
+
+            publish();
+
+            double dt = monotonicSeconds() - tic;
+            cycles++;
+            sumCycleTime.store(sumCycleTime.load() + dt);
+            if (dt > maxCycleTime.load())
+            {
+                maxCycleTime.store(dt);
+            }
+
+            // a late cycle starts the next one right away, then the schedule is resumed
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now > next)
+            {
+                overruns++;
+                next = now;
+            }
+            else
+            {
+                std::this_thread::sleep_until(next);
+            }
+        }
+    }
+
+    void sendEncoderCommands()
+    {
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            if (!encoderPub[b])
+            {
+                continue;
+            }
+            const int *boardCounts = counts.data() + actuators.boardOffset(b);
+            for (int i = 0; i < 6; i++)
+            {
+                encMsg.count[i] = boardCounts[i];
+            }
+            encoderPub[b].publish(encMsg);
+        }
+    }
+
+    void publish()
+    {
+        for (int h = 0; h < 6; h++)
+        {
+            jointMsg.joint_q[h] = rrOut.q_vec(h);
+            jointMsg.joint_q[h+6] = 0;
+        }
+        jointPub.publish(jointMsg);
+
+        for (int i = 0; i < 3; i++)
+        {
+            kinMsg.p[i] = kin.ptip(i);
+            kinMsg.alpha[i] = kin.alpha(i);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            kinMsg.q[i] = kin.qtip(i);
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            kinMsg.J1[i] = kin.J(0,i);
+            kinMsg.J2[i] = kin.J(1,i);
+            kinMsg.J3[i] = kin.J(2,i);
+            kinMsg.J4[i] = kin.J(3,i);
+            kinMsg.J5[i] = kin.J(4,i);
+            kinMsg.J6[i] = kin.J(5,i);
+        }
+        kinPub.publish(kinMsg);
+    }
+
+    std::string name;
+    std::string robot;
+    int cpu;
+
+    // pipeline, touched only by the arm's thread once it runs
+    ResolvedRatesController rr;
+    ResolvedRatesOutput rrOut;
+    CannulaKinematics cannula;
+    KinematicsResult kin;
+    KinematicsState kinState;
+    ActuatorMap actuators;
+    std::vector<int> counts;
+    std::vector<int> sentCounts;
+
+    // ROS, on the arm's own callback queue
+    ros::CallbackQueue queue;
+    ros::NodeHandle nh;
+    ros::Subscriber omniSub;
+    ros::Subscriber omniStampedSub;
+    bool stampedInput;          // Omnipos_stamped seen, Omnipos ignored
+    ros::Subscriber buttonSub;
+    ros::Publisher jointPub;
+    ros::Publisher kinPub;
+    std::vector<ros::Publisher> encoderPub;
+    endonasal_teleop::config3 jointMsg;
+    endonasal_teleop::kinout kinMsg;
+    medlab_motor_control_board::McbEncoders encMsg;
+
+    AsyncLogger logger;
+    std::string counterLabels[NUM_SAT_COUNTERS];
+
+    std::atomic<bool> running;
+    std::thread worker;
+
+    // rate statistics, read by the main thread
+    std::atomic<long> cycles;
+    std::atomic<long> overruns;
+    std::atomic<double> sumCycleTime;
+    std::atomic<double> maxCycleTime;
+};
+
+int main(int argc, char *argv[])
+{
+/*******************************************************************************
+                INITIALIZE ROS NODE
+********************************************************************************/
+    ros::init(argc, argv, "bimanual_teleop");
+    ros::NodeHandle node;
+
+/*******************************************************************************
+                PARAMETERS
+********************************************************************************/
+    ResolvedRatesParams rrParams;
+    ros::param::param<bool>("~use_constrained_solver", rrParams.use_constrained_solver, rrParams.use_constrained_solver);
+    ros::param::param<int>("~qp_max_iterations", rrParams.qp_max_iterations, rrParams.qp_max_iterations);
+    ros::param::param<double>("~max_rot_speed", rrParams.max_rot_speed, rrParams.max_rot_speed);
+    ros::param::param<double>("~max_trans_speed", rrParams.max_trans_speed, rrParams.max_trans_speed);
+
+    std::string hardware_file;
+    double report_period = 5.0;
+    ros::param::param<std::string>("~hardware_file", hardware_file, ros::package::getPath("endonasal_teleop") + "/config/hardware.xml");
+    ros::param::param<double>("~report_period", report_period, 5.0);
+
+/*******************************************************************************
+                SET UP BOTH ARMS
+********************************************************************************/
+    TeleopArm left("left", rrParams);
+    TeleopArm right("right", rrParams);
+    std::string error;
+    if (!left.setup(hardware_file, "grip_cannula", 2, error) ||
+        !right.setup(hardware_file, "curette_cannula", 3, error))
+    {
+        std::cout << "Could not set up the arms: " << error << std::endl;
+        return 1;
+    }
+
+    // the arms must not command the same board
+    for (int a = 0; a < left.actuatorMap().numBoards(); a++)
+    {
+        for (int b = 0; b < right.actuatorMap().numBoards(); b++)
+        {
+            if (left.actuatorMap().boardName(a) == right.actuatorMap().boardName(b))
+            {
+                std::cout << "Both arms use " << left.actuatorMap().boardName(a) << "." << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "left: " << left.robotName() << ", right: " << right.robotName() << std::endl << std::endl;
+
+/*******************************************************************************
+                RUN
+********************************************************************************/
+    left.start();
+    right.start();
+
+    TeleopArm *arms[2] = {&left, &right};
+    ros::WallTime lastReport = ros::WallTime::now();
+    while (ros::ok())
+    {
+        ros::WallDuration(0.1).sleep();
+        if ((ros::WallTime::now() - lastReport).toSec() < report_period)
+        {
+            continue;
+        }
+        double elapsed = (ros::WallTime::now() - lastReport).toSec();
+        lastReport = ros::WallTime::now();
+        for (int a = 0; a < 2; a++)
+        {
+            long n, late;
+            double mean, max;
+            arms[a]->takeStats(n, late, mean, max);
+            printf("%-5s %7.1f Hz  cycle mean %7.1f us  max %7.1f us  %ld overruns\n",
+                   arms[a]->armName().c_str(), n/elapsed, 1e6*mean, 1e6*max, late);
+        }
+        fflush(stdout);
+    }
+
+    left.stop();
+    right.stop();
+    return 0;
+}
@@ -0,0 +1,223 @@
+#ifndef BOUNDED_QP_H
+#define BOUNDED_QP_H
+
+/********************************************************************
+
+  bounded_qp.h
+
+Small dense box-constrained QP solver for the resolved rates update:
+
+    minimize   0.5*x'*A*x - b'*x
+    subject to lo <= x <= hi
+
+A must be symmetric positive definite (it is, by construction, for the
+weighted damped least-squares matrix). This is a primal active-set method:
+every iterate is feasible, so when the iteration cap is hit the current
+point is still a valid (if slightly suboptimal) joint step. The working set
+is kept between calls, so consecutive control cycles usually converge in
+one or two iterations.
+
+********************************************************************/
+
+#include <Eigen/Dense>
+#include <cmath>
+
+#include "spd_solve.h"
+
+template<int N>
+class BoundedQP
+{
+public:
+    typedef Eigen::Matrix<double,N,N> MatrixN;
+    typedef Eigen::Matrix<double,N,1> VectorN;
+
+    enum BoundState { AT_LOWER = -1, FREE = 0, AT_UPPER = 1 };
+
+    BoundedQP(int maxIterations = 4*N)
+        : maxIter(maxIterations), iter(0), conv(false)
+    {
+        reset();
+    }
+
+    // forget the warm start (e.g. after a re-clutch or a large jump in q)
+    void reset()
+    {
+        for (int i = 0; i < N; i++)
+        {
+            ws[i] = FREE;
+        }
+    }
+
+    void setMaxIterations(int n) { maxIter = (n > 0) ? n : 1; }
+    int maxIterations() const { return maxIter; }
+
+    // iterations used and convergence status of the last solve
+    int iterations() const { return iter; }
+    bool converged() const { return conv; }
+
+    // working set of the last solve (AT_LOWER, FREE or AT_UPPER per variable)
+    int boundState(int i) const { return ws[i]; }
+
+    // Solves the QP and writes the result into x.
+    // Requires lo <= hi elementwise; where lo > hi the variable is fixed at lo.
+    // Returns true if the KKT conditions were met within the iteration cap.
+    bool solve(const MatrixN &A, const VectorN &b, const VectorN &lo, const VectorN &hi, VectorN &x)
+    {
+        VectorN up = hi;
+
+        // starting point: warm-started working set, zero step for the free variables
+        for (int i = 0; i < N; i++)
+        {
+            if (up(i) < lo(i))
+            {
+                up(i) = lo(i);
+            }
+
+            if (ws[i] == AT_LOWER)
+            {
+                x(i) = lo(i);
+            }
+            else if (ws[i] == AT_UPPER)
+            {
+                x(i) = up(i);
+            }
+            else if (0.0 <= lo(i))
+            {
+                x(i) = lo(i);
+                ws[i] = AT_LOWER;
+            }
+            else if (0.0 >= up(i))
+            {
+                x(i) = up(i);
+                ws[i] = AT_UPPER;
+            }
+            else
+            {
+                x(i) = 0.0;
+            }
+        }
+
+        double gtol = 1e-12*(1.0 + b.cwiseAbs().maxCoeff());
+
+        conv = false;
+        iter = 0;
+        while (iter < maxIter)
+        {
+            iter++;
+
+            // equality-constrained subproblem with the working set held at its bounds
+            MatrixN M = A;
+            VectorN xfixed = VectorN::Zero();
+            for (int i = 0; i < N; i++)
+            {
+                if (ws[i] != FREE)
+                {
+                    xfixed(i) = x(i);
+                }
+            }
+            VectorN r = b - A*xfixed;
+            for (int i = 0; i < N; i++)
+            {
+                if (ws[i] != FREE)
+                {
+                    M.row(i).setZero();
+                    M.col(i).setZero();
+                    M(i,i) = 1.0;
+                    r(i) = x(i);
+                }
+            }
+            SpdSolver<N> chol;
+            if (!chol.compute(M))
+            {
+                // A is not positive definite; keep the last feasible point
+                break;
+            }
+            VectorN xs = chol.solve(r);
+
+            // largest feasible step from x towards xs
+            double alpha = 1.0;
+            int blocking = -1;
+            int blockingState = FREE;
+            for (int i = 0; i < N; i++)
+            {
+                if (ws[i] != FREE)
+                {
+                    continue;
+                }
+                double d = xs(i) - x(i);
+                if (xs(i) < lo(i) && d < 0.0)
+                {
+                    double a = (lo(i) - x(i))/d;
+                    if (a < alpha)
+                    {
+                        alpha = a;
+                        blocking = i;
+                        blockingState = AT_LOWER;
+                    }
+                }
+                else if (xs(i) > up(i) && d > 0.0)
+                {
+                    double a = (up(i) - x(i))/d;
+                    if (a < alpha)
+                    {
+                        alpha = a;
+                        blocking = i;
+                        blockingState = AT_UPPER;
+                    }
+                }
+            }
+
+            if (blocking >= 0)
+            {
+                // step until the first bound is hit and add it to the working set
+                for (int i = 0; i < N; i++)
+                {
+                    if (ws[i] == FREE)
+                    {
+                        x(i) += alpha*(xs(i) - x(i));
+                    }
+                }
+                x(blocking) = (blockingState == AT_LOWER) ? lo(blocking) : up(blocking);
+                ws[blocking] = blockingState;
+                continue;
+            }
+
+            x = xs;
+
+            // check the multipliers of the working set; release the worst one
+            VectorN g = A*x - b;
+            int release = -1;
+            double worst = gtol;
+            for (int i = 0; i < N; i++)
+            {
+                if (ws[i] == FREE || lo(i) == up(i))
+                {
+                    continue;
+                }
+                double violation = (ws[i] == AT_LOWER) ? -g(i) : g(i);
+                if (violation > worst)
+                {
+                    worst = violation;
+                    release = i;
+                }
+            }
+
+            if (release < 0)
+            {
+                conv = true;
+                break;
+            }
+            ws[release] = FREE;
+        }
+
+        return conv;
+    }
+
+private:
+    int maxIter;
+    int iter;
+    bool conv;
+    int ws[N];
+};
+
+#endif // BOUNDED_QP_H
@@ -0,0 +1,366 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+/********************************************************************
+
+  flight_recorder.h
+
+Per-cycle binary flight recorder.
+Each node can write one fixed-width record per control cycle into a
+preallocated, memory-mapped ring file. Writing a record is a memcpy into
+the mapping plus one atomic store of the write counter: no system calls,
+no allocation. The file survives a crash of the node and can be exported
+with flight_recorder_export (CSV or NumPy .npy).
+
+File layout (version 1, little endian):
+    [0, HEADER_SIZE)   FlightRecorderHeader, then '\n'-separated column names
+    [HEADER_SIZE, ...) capacity slots of recordSize bytes:
+                       uint64 sequence, double stamp, double values[numValues]
+
+The stamp is CLOCK_MONOTONIC seconds; the header stores the monotonic and
+wall-clock times at open so the reader can convert.
+
+Opening a path that already holds a recording moves it aside first, so
+a node that restarts after an incident keeps the run before it: the
+previous recordings are <path>.1 (newest) to <path>.3, older ones are
+deleted.
+
+********************************************************************/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define FLIGHT_RECORDER_MAGIC "ETFLTREC"
+#define FLIGHT_RECORDER_VERSION 1
+#define FLIGHT_RECORDER_KEEP 3      // previous recordings kept as <path>.1 .. .3
+
+enum FlightRecordType
+{
+    RECORD_RESOLVED_RATES = 1,
+    RECORD_KINEMATICS = 2
+};
+
+struct FlightRecorderHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordType;
+    uint32_t headerSize;
+    uint32_t recordSize;
+    uint32_t numValues;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t writeCount;    // total records written; slot = writeCount % capacity
+    double monotonicAtOpen;
+    double wallAtOpen;
+};
+
+// a named group of consecutive doubles in a record
+struct FieldSpec
+{
+    const char *name;
+    int count;
+};
+
+// resolved_rates: one record per control cycle
+struct ResolvedRatesRecord
+{
+    double omniPos[3];          // raw Omnipos position
+    double omniQuat[4];         // raw Omnipos orientation (w x y z)
+    double buttonState;
+    double clutched;
+    double robotDesTwist[6];
+    double delta_qx[6];
+    double q_vec[6];
+    double J[36];               // row-major
+    double W_jointlim[6];       // diagonal of the joint limit weighting matrix
+    double enc1[6];             // encoder counts of the first board (MCB1)
+    double enc2[6];             // encoder counts of the second board (MCB4)
+    double solverIterations;
+};
+
+const FieldSpec resolvedRatesFields[] =
+{
+    {"omni_p",3}, {"omni_q",4}, {"button",1}, {"clutched",1},
+    {"des_twist",6}, {"delta_qx",6}, {"q",6}, {"J",36},
+    {"W_jointlim",6}, {"enc1",6}, {"enc2",6}, {"solver_iterations",1}
+};
+
+// kinematics: one record per kinematics update
+struct KinematicsRecord
+{
+    double joint_q[12];         // input configuration
+    double ptip[3];
+    double qtip[4];
+    double alpha[3];
+    double J[36];               // row-major
+    double npts;                // dense output points
+    double tSolve;              // Kinematics_with_dense_output [s]
+    double tInterp;             // backbone interpolation [s]
+    double tTotal;              // whole update, including message packing [s]
+};
+
+const FieldSpec kinematicsFields[] =
+{
+    {"joint_q",12}, {"p",3}, {"qtip",4}, {"alpha",3}, {"J",36},
+    {"npts",1}, {"t_solve",1}, {"t_interp",1}, {"t_total",1}
+};
+
+inline double monotonicSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+class FlightRecorder
+{
+public:
+    enum { HEADER_SIZE = 8192 };
+
+    FlightRecorder() : fd(-1), base(0), mapSize(0), header(0), slots(0), capacity(0), recordSize(0), numValues(0) {}
+    ~FlightRecorder() { close(); }
+
+    bool isOpen() const { return base != 0; }
+
+    // Creates the ring file (moving an existing one aside, see above), sizes
+    // it and faults every page in, so the per-cycle writes never block on
+    // the file system.
+    bool open(const std::string &path, FlightRecordType type, const FieldSpec *fields, int nFields, uint64_t nRecords)
+    {
+        close();
+        rotate(path);
+
+        numValues = 0;
+        std::string names = "seq\nstamp\n";
+        for (int i = 0; i < nFields; i++)
+        {
+            for (int k = 0; k < fields[i].count; k++)
+            {
+                names += fields[i].name;
+                if (fields[i].count > 1)
+                {
+                    names += "_" + std::to_string(k);
+                }
+                names += "\n";
+            }
+            numValues += fields[i].count;
+        }
+        if (sizeof(FlightRecorderHeader) + names.size() + 1 > HEADER_SIZE || nRecords == 0)
+        {
+            return false;
+        }
+
+        capacity = nRecords;
+        recordSize = sizeof(uint64_t) + sizeof(double)*(1 + numValues);
+        mapSize = HEADER_SIZE + capacity*recordSize;
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        if (posix_fallocate(fd, 0, mapSize) != 0 && ftruncate(fd, mapSize) != 0)
+        {
+            close();
+            return false;
+        }
+        void *p = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        base = static_cast<char*>(p);
+        memset(base, 0, mapSize);
+
+        header = reinterpret_cast<FlightRecorderHeader*>(base);
+        memcpy(header->magic, FLIGHT_RECORDER_MAGIC, 8);
+        header->version = FLIGHT_RECORDER_VERSION;
+        header->recordType = type;
+        header->headerSize = HEADER_SIZE;
+        header->recordSize = recordSize;
+        header->numValues = numValues;
+        header->capacity = capacity;
+        header->writeCount = 0;
+        header->monotonicAtOpen = monotonicSeconds();
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        header->wallAtOpen = ts.tv_sec + 1e-9*ts.tv_nsec;
+        memcpy(base + sizeof(FlightRecorderHeader), names.c_str(), names.size() + 1);
+
+        slots = base + HEADER_SIZE;
+        return true;
+    }
+
+    // <path>.n -> <path>.n+1 for the kept generations, then <path> -> <path>.1
+    static void rotate(const std::string &path)
+    {
+        if (access(path.c_str(), F_OK) != 0)
+        {
+            return;
+        }
+        std::remove((path + "." + std::to_string(FLIGHT_RECORDER_KEEP)).c_str());
+        for (int i = FLIGHT_RECORDER_KEEP - 1; i >= 1; i--)
+        {
+            std::rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i+1)).c_str());
+        }
+        std::rename(path.c_str(), (path + ".1").c_str());
+    }
+
+    // hot path: copies one record into the next ring slot
+    template<typename Record>
+    void write(const Record &r)
+    {
+        static_assert(sizeof(Record) % sizeof(double) == 0, "flight records must be plain arrays of doubles");
+        if (!base || sizeof(Record) != numValues*sizeof(double))
+        {
+            return;
+        }
+        uint64_t n = header->writeCount;
+        char *slot = slots + (n % capacity)*recordSize;
+        double stamp = monotonicSeconds();
+        memcpy(slot, &n, sizeof(uint64_t));
+        memcpy(slot + sizeof(uint64_t), &stamp, sizeof(double));
+        memcpy(slot + sizeof(uint64_t) + sizeof(double), &r, sizeof(Record));
+        __atomic_store_n(&header->writeCount, n + 1, __ATOMIC_RELEASE);
+    }
+
+    uint64_t recordsWritten() const { return header ? header->writeCount : 0; }
+
+    void close()
+    {
+        if (base)
+        {
+            msync(base, mapSize, MS_ASYNC);
+            munmap(base, mapSize);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+        base = 0;
+        header = 0;
+        slots = 0;
+    }
+
+private:
+    int fd;
+    char *base;
+    size_t mapSize;
+    FlightRecorderHeader *header;
+    char *slots;
+    uint64_t capacity;
+    uint32_t recordSize;
+    uint32_t numValues;
+};
+
+// a whole recording read back into memory, oldest record first
+struct FlightRecording
+{
+    FlightRecorderHeader header;
+    std::vector<std::string> columns;   // "seq", "stamp", then one per value
+    std::vector<double> table;          // row-major, records x columns
+    uint64_t count;                     // records in the table
+    size_t ncols;
+
+    // index of a named column, or -1
+    int column(const std::string &name) const
+    {
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+            if (columns[c] == name)
+            {
+                return int(c);
+            }
+        }
+        return -1;
+    }
+
+    double value(uint64_t r, int c) const { return table[r*ncols + c]; }
+};
+
+// Reads a ring file written by FlightRecorder. On failure returns false
+// with a description in error.
+inline bool loadFlightRecording(const std::string &path, FlightRecording &rec, std::string &error)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in)
+    {
+        error = "Could not open " + path;
+        return false;
+    }
+
+    FlightRecorderHeader &header = rec.header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || memcmp(header.magic, FLIGHT_RECORDER_MAGIC, 8) != 0)
+    {
+        error = path + " is not a flight recorder file.";
+        return false;
+    }
+    if (header.version != FLIGHT_RECORDER_VERSION)
+    {
+        error = "Unsupported flight recorder version " + std::to_string(header.version)
+                + " (this tool reads version " + std::to_string(FLIGHT_RECORDER_VERSION) + ").";
+        return false;
+    }
+
+    // column names follow the header, '\n'-separated
+    std::vector<char> nameBuf(header.headerSize - sizeof(header));
+    in.read(&nameBuf[0], nameBuf.size());
+    rec.columns.clear();
+    std::string nameTable(&nameBuf[0]);
+    std::istringstream names(nameTable);
+    std::string name;
+    while (std::getline(names, name))
+    {
+        rec.columns.push_back(name);
+    }
+    rec.ncols = header.numValues + 2;
+    if (rec.columns.size() != rec.ncols)
+    {
+        error = "Corrupt column table (" + std::to_string(rec.columns.size()) + " names for "
+                + std::to_string(rec.ncols) + " columns).";
+        return false;
+    }
+
+    rec.count = header.writeCount < header.capacity ? header.writeCount : header.capacity;
+    uint64_t first = header.writeCount - rec.count;
+
+    // read the ring oldest first
+    rec.table.clear();
+    rec.table.reserve(rec.count*rec.ncols);
+    std::vector<char> slot(header.recordSize);
+    for (uint64_t n = first; n < header.writeCount; n++)
+    {
+        in.seekg(header.headerSize + (n % header.capacity)*header.recordSize);
+        in.read(&slot[0], slot.size());
+        if (!in)
+        {
+            error = "Recording is truncated at record " + std::to_string(n) + ".";
+            return false;
+        }
+        uint64_t seq;
+        memcpy(&seq, &slot[0], sizeof(seq));
+        rec.table.push_back(double(seq));
+        for (size_t c = 1; c < rec.ncols; c++)
+        {
+            double v;
+            memcpy(&v, &slot[sizeof(uint64_t) + (c-1)*sizeof(double)], sizeof(double));
+            rec.table.push_back(v);
+        }
+    }
+    return true;
+}
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,102 @@
+/********************************************************************
+
+  flight_recorder_export.cpp
+
+Exports a flight recorder ring file (see flight_recorder.h) to CSV or to
+a NumPy .npy array, oldest record first. For .npy the column names are
+written next to it as <output>.columns.txt.
+
+Usage: flight_recorder_export <recording> <output.csv|output.npy>
+
+********************************************************************/
+
+#include "flight_recorder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+bool endsWith(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: flight_recorder_export <recording> <output.csv|output.npy>" << std::endl;
+        return 1;
+    }
+    std::string inPath = argv[1];
+    std::string outPath = argv[2];
+
+    FlightRecording rec;
+    std::string error;
+    if (!loadFlightRecording(inPath, rec, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    const std::vector<std::string> &columns = rec.columns;
+    const std::vector<double> &table = rec.table;
+    uint64_t count = rec.count;
+    size_t ncols = rec.ncols;
+
+    if (endsWith(outPath, ".npy"))
+    {
+        std::ofstream out(outPath.c_str(), std::ios::binary);
+        std::ostringstream dict;
+        dict << "{'descr': '<f8', 'fortran_order': False, 'shape': (" << count << ", " << ncols << "), }";
+        std::string hdr = dict.str();
+        // pad so the data starts on a 64-byte boundary, header ends with '\n'
+        size_t total = 10 + hdr.size() + 1;
+        hdr.append((64 - total % 64) % 64, ' ');
+        hdr += '\n';
+        uint16_t hlen = uint16_t(hdr.size());
+        out.write("\x93NUMPY\x01\x00", 8);
+        out.write(reinterpret_cast<const char*>(&hlen), 2);
+        out.write(hdr.c_str(), hdr.size());
+        if (!table.empty())
+        {
+            out.write(reinterpret_cast<const char*>(&table[0]), table.size()*sizeof(double));
+        }
+
+        std::ofstream colsOut((outPath + ".columns.txt").c_str());
+        for (size_t c = 0; c < ncols; c++)
+        {
+            colsOut << columns[c] << "\n";
+        }
+    }
+    else
+    {
+        FILE *out = fopen(outPath.c_str(), "w");
+        if (!out)
+        {
+            std::cerr << "Could not open " << outPath << std::endl;
+            return 1;
+        }
+        for (size_t c = 0; c < ncols; c++)
+        {
+            fprintf(out, c ? ",%s" : "%s", columns[c].c_str());
+        }
+        fprintf(out, "\n");
+        for (uint64_t r = 0; r < count; r++)
+        {
+            for (size_t c = 0; c < ncols; c++)
+            {
+                fprintf(out, c ? ",%.17g" : "%.17g", table[r*ncols + c]);
+            }
+            fprintf(out, "\n");
+        }
+        fclose(out);
+    }
+
+    std::cout << "Exported " << count << " records (" << ncols << " columns, "
+              << (rec.header.writeCount - count) << " overwritten) to " << outPath << std::endl;
+    return 0;
+}
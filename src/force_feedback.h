@@ -0,0 +1,325 @@
+#ifndef FORCE_FEEDBACK_H
+#define FORCE_FEEDBACK_H
+
+/********************************************************************
+
+  force_feedback.h
+
+Haptic rendering on the Omni of what the controller cannot do.
+The control loop (100 Hz) hands a HapticSnapshot to the rendering
+thread after every step, through a lock-free triple buffer. The thread
+runs at 1 kHz, reads the newest snapshot and the newest Omni position
+and sends a force (Omni base frame, N):
+
+  - lost motion: while a step was saturated (a speed or translation
+    bound of the constrained solver, or the translation limits), a
+    spring pulls the stylus back towards the anchor, the Omni position
+    that corresponds to where the tip actually is. Offsets below the
+    deadband (normal tracking lag) are not rendered, and the spring
+    fades in and out over the ramp time instead of switching at 100 Hz.
+  - joint limits: inside the limit zone of a translation joint, a force
+    of gain*dh (dh from dhFunction, the gradient the joint limit
+    weighting uses) against the Omni direction that drives that joint
+    further towards its limit.
+  - anatomy: while a backbone point is closer to the anatomy than the
+    fixture margin (anatomy_fixture.h), a force of anatomyGain per mm
+    inside the margin against the Omni direction that closes the gap
+    of the nearest one fastest.
+
+The sum is limited in magnitude and in rate of change. Without a
+clutched snapshot, or if the newest one is older than the timeout, the
+force goes to zero.
+
+The Omni position comes in through the poll function, which the thread
+calls every tick (e.g. a ROS callback queue of its own), so it is
+sampled at the rendering rate rather than the control rate.
+
+********************************************************************/
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+// Single-writer, single-reader exchange of the newest value without locks:
+// the writer fills its own buffer and swaps it into the middle, the reader
+// swaps the middle out if it is newer than what it holds.
+template<typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : middle(1), back(0), front(2), written(false) {}
+
+    void write(const T &value)
+    {
+        buffers[back] = value;
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+        written.store(true, std::memory_order_release);
+    }
+
+    // newest value into out; false until the first write
+    bool read(T &out)
+    {
+        if (!written.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        if (middle.load(std::memory_order_relaxed) & FRESH)
+        {
+            front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        }
+        out = buffers[front];
+        return true;
+    }
+
+private:
+    enum { INDEX = 3, FRESH = 4 };
+
+    T buffers[3];
+    std::atomic<int> middle;    // index, FRESH if not read yet
+    int back;                   // writer only
+    int front;                  // reader only
+    std::atomic<bool> written;
+};
+
+// controller state for one control cycle, in Omni coordinates
+struct HapticSnapshot
+{
+    HapticSnapshot() : stamp(0.0), active(false), saturated(false), anatomyDistance(1.0), anatomyMargin(0.0)
+    {
+        anchor.fill(0);
+        anatomyDirection.fill(0);
+        for (int i = 0; i < 3; i++)
+        {
+            limitDirection[i].fill(0);
+            limitGradient[i] = 0.0;
+            boundaryDistance[i] = 1.0;
+        }
+    }
+
+    double stamp;                       // set by ForceFeedbackThread::update [s]
+    bool active;                        // clutched
+    bool saturated;                     // the step was limited
+    Eigen::Vector3d anchor;             // Omni position of the commanded tip [mm]
+    Eigen::Vector3d limitDirection[3];  // unit Omni motion moving translation joint i towards its nearer limit
+    double limitGradient[3];            // dh of translation joint i (dhFunction)
+    double boundaryDistance[3];         // distance of translation joint i to its nearer limit [m]
+    Eigen::Vector3d anatomyDirection;   // unit Omni motion closing the gap of the nearest anatomy constraint
+    double anatomyDistance;             // gap of that constraint [m]
+    double anatomyMargin;               // fixture margin [m]
+};
+
+struct HapticParams
+{
+    double rate;            // Hz
+    double stiffness;       // lost motion spring [N/mm]
+    double deadband;        // [mm]
+    double rampTime;        // saturation fade in/out [s]
+    double limitGain;       // joint limit force per dh [N*m]
+    double limitZone;       // [m]
+    double anatomyGain;     // anatomy force per mm inside the fixture margin [N/mm]
+    double maxForce;        // [N]
+    double maxForceRate;    // [N/s]
+    double timeout;         // snapshot age after which the force is released [s]
+
+    HapticParams()
+        : rate(1000.0), stiffness(0.05), deadband(2.0), rampTime(0.05),
+          limitGain(1.0e-4), limitZone(5.0e-3), anatomyGain(0.3), maxForce(1.5), maxForceRate(50.0),
+          timeout(0.1)
+    {}
+};
+
+// the force law, one tick at a time
+class ForceRenderer
+{
+public:
+    ForceRenderer(const HapticParams &p = HapticParams()) : params(p) { reset(); }
+
+    void reset()
+    {
+        gate = 0.0;
+        force.fill(0);
+    }
+
+    const Eigen::Vector3d &compute(const HapticSnapshot &s, const Eigen::Vector3d &omniPos, double dt)
+    {
+        Eigen::Vector3d target = Eigen::Vector3d::Zero();
+        if (s.active)
+        {
+            // lost motion spring, faded by the saturation state
+            double step = params.rampTime > 0.0 ? dt/params.rampTime : 1.0;
+            gate = s.saturated ? std::min(1.0, gate + step) : std::max(0.0, gate - step);
+            Eigen::Vector3d offset = omniPos - s.anchor;
+            double dist = offset.norm();
+            if (dist > params.deadband)
+            {
+                target -= gate*params.stiffness*(dist - params.deadband)/dist*offset;
+            }
+
+            // joint limit field
+            for (int i = 0; i < 3; i++)
+            {
+                if (s.boundaryDistance[i] < params.limitZone)
+                {
+                    target -= std::min(params.maxForce, params.limitGain*s.limitGradient[i])*s.limitDirection[i];
+                }
+            }
+
+            // anatomy fixture
+            if (s.anatomyDistance < s.anatomyMargin)
+            {
+                target -= std::min(params.maxForce, params.anatomyGain*1000.0*(s.anatomyMargin - s.anatomyDistance))*s.anatomyDirection;
+            }
+
+            double mag = target.norm();
+            if (mag > params.maxForce)
+            {
+                target *= params.maxForce/mag;
+            }
+        }
+        else
+        {
+            gate = 0.0;
+        }
+
+        // slew limit, also when the force goes back to zero
+        Eigen::Vector3d change = target - force;
+        double maxChange = params.maxForceRate*dt;
+        double c = change.norm();
+        if (c > maxChange)
+        {
+            change *= maxChange/c;
+        }
+        force += change;
+        return force;
+    }
+
+private:
+    HapticParams params;
+    double gate;
+    Eigen::Vector3d force;
+};
+
+class ForceFeedbackThread
+{
+public:
+    typedef std::function<void()> PollFunction;
+    typedef std::function<void(const Eigen::Vector3d &force)> SendFunction;
+
+    ForceFeedbackThread(const HapticParams &p = HapticParams())
+        : params(p), renderer(p), running(false), havePose(false), nTicks(0), nOverruns(0)
+    {
+        omniPos.fill(0);
+    }
+
+    ~ForceFeedbackThread() { stop(); }
+
+    // before start()
+    void setParams(const HapticParams &p)
+    {
+        params = p;
+        renderer = ForceRenderer(p);
+    }
+
+    // from the control loop, once per cycle
+    void update(const HapticSnapshot &s)
+    {
+        HapticSnapshot stamped = s;
+        stamped.stamp = seconds();
+        snapshots.write(stamped);
+    }
+
+    // from the poll function (on the rendering thread), Omni position in mm
+    void setOmniPosition(const Eigen::Vector3d &p)
+    {
+        omniPos = p;
+        havePose = true;
+    }
+
+    void start(PollFunction pollFn, SendFunction sendFn)
+    {
+        if (running)
+        {
+            return;
+        }
+        poll = pollFn;
+        send = sendFn;
+        running = true;
+        worker = std::thread(&ForceFeedbackThread::run, this);
+    }
+
+    void stop()
+    {
+        if (!running)
+        {
+            return;
+        }
+        running = false;
+        worker.join();
+    }
+
+    long ticks() const { return nTicks; }
+    long overruns() const { return nOverruns; }
+
+private:
+    static double seconds()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void run()
+    {
+        std::chrono::steady_clock::duration period =
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0/params.rate));
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        double dt = 1.0/params.rate;
+        HapticSnapshot snapshot;
+
+        while (running)
+        {
+            next += period;
+
+            poll();
+            // no force without a pose, or when the control loop has stopped updating
+            if (!snapshots.read(snapshot) || !havePose || seconds() - snapshot.stamp > params.timeout)
+            {
+                snapshot.active = false;
+            }
+            send(renderer.compute(snapshot, omniPos, dt));
+            nTicks++;
+
+            // a late tick starts the next one right away, then the schedule is resumed
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now > next)
+            {
+                nOverruns++;
+                next = now;
+            }
+            else
+            {
+                std::this_thread::sleep_until(next);
+            }
+        }
+        send(Eigen::Vector3d::Zero());
+    }
+
+    HapticParams params;
+    ForceRenderer renderer;
+    TripleBuffer<HapticSnapshot> snapshots;
+    std::atomic<bool> running;
+    std::thread worker;
+    PollFunction poll;
+    SendFunction send;
+
+    // rendering thread only
+    Eigen::Vector3d omniPos;
+    bool havePose;
+    std::atomic<long> nTicks;
+    std::atomic<long> nOverruns;
+};
+
+#endif // FORCE_FEEDBACK_H
@@ -0,0 +1,624 @@
+#ifndef HAPTIC_BRIDGE_H
+#define HAPTIC_BRIDGE_H
+
+/********************************************************************
+
+  haptic_bridge.h
+
+Device-independent part of the haptic device bridge, portable between
+the Windows machine of omni_node and Linux (no ROS, no Eigen):
+
+  HapticDevice              one device frame: apply a force, read the
+                            pose and buttons (OpenHaptics in omni_node,
+                            a scripted device in haptic_bridge_fake)
+  hapticPoseFromTransform   device transform to the Omnipos orientation
+  HapticPosePacket,         the two datagrams, below
+  HapticForcePacket
+  HapticUdpSocket           non-blocking UDP (BSD sockets or Winsock)
+  HapticBridge              the device loop: runs device frames, sends
+                            the pose at most at the bridge rate, with a
+                            sequence number and the device time, applies
+                            the newest force command and measures the
+                            round trip
+
+On the ROS side, haptic_udp_receiver turns the pose packets into
+Omnipos, Omnipos_stamped and Buttonstates, and sends Omniforce back.
+
+Datagrams, little endian, no padding:
+  pose (device -> ROS), 48 bytes
+    u32 magic "HBP1"    u32 sequence (from 1)    u64 device time [us]
+    f32 position [mm] x y z    f32 orientation x y z w
+    u8 buttons    u8[3] reserved
+  force (ROS -> device), 32 bytes
+    u32 magic "HBF1"    u32 sequence (from 1)    u32 echoed pose sequence
+    u64 echoed pose device time [us]    f32 force [N] x y z
+The echo is the newest pose the receiver had when it sent the force;
+its device time gives the bridge the round trip on its own clock. A
+force is applied if it is newer than the last one, clamped to the
+maximum force, and drops back to zero when no command came for the
+force timeout.
+
+********************************************************************/
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#define HAPTIC_POSE_MAGIC 0x31504248u       // "HBP1"
+#define HAPTIC_FORCE_MAGIC 0x31464248u      // "HBF1"
+#define HAPTIC_POSE_PACKET_SIZE 48
+#define HAPTIC_FORCE_PACKET_SIZE 32
+#define HAPTIC_DEFAULT_PORT 9870
+#define HAPTIC_RESTART_GAP 1000             // a sequence this far back: the sender restarted
+
+/*******************************************************************************
+                PACKETS
+********************************************************************************/
+
+inline void hapticPutU32(uint8_t *b, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        b[i] = uint8_t(v >> (8*i));
+    }
+}
+
+inline void hapticPutU64(uint8_t *b, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        b[i] = uint8_t(v >> (8*i));
+    }
+}
+
+inline void hapticPutF32(uint8_t *b, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    hapticPutU32(b, v);
+}
+
+inline uint32_t hapticGetU32(const uint8_t *b)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        v |= uint32_t(b[i]) << (8*i);
+    }
+    return v;
+}
+
+inline uint64_t hapticGetU64(const uint8_t *b)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        v |= uint64_t(b[i]) << (8*i);
+    }
+    return v;
+}
+
+inline float hapticGetF32(const uint8_t *b)
+{
+    uint32_t v = hapticGetU32(b);
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+struct HapticPosePacket
+{
+    HapticPosePacket() : seq(0), deviceTimeUs(0), buttons(0)
+    {
+        position[0] = position[1] = position[2] = 0.0f;
+        orientation[0] = orientation[1] = orientation[2] = 0.0f;
+        orientation[3] = 1.0f;
+    }
+
+    uint32_t seq;
+    uint64_t deviceTimeUs;
+    float position[3];          // [mm]
+    float orientation[4];       // x y z w
+    uint8_t buttons;
+
+    void encode(uint8_t *b) const
+    {
+        hapticPutU32(b, HAPTIC_POSE_MAGIC);
+        hapticPutU32(b + 4, seq);
+        hapticPutU64(b + 8, deviceTimeUs);
+        for (int i = 0; i < 3; i++)
+        {
+            hapticPutF32(b + 16 + 4*i, position[i]);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            hapticPutF32(b + 28 + 4*i, orientation[i]);
+        }
+        b[44] = buttons;
+        b[45] = b[46] = b[47] = 0;
+    }
+
+    bool decode(const uint8_t *b, size_t n)
+    {
+        if (n != HAPTIC_POSE_PACKET_SIZE || hapticGetU32(b) != HAPTIC_POSE_MAGIC)
+        {
+            return false;
+        }
+        seq = hapticGetU32(b + 4);
+        deviceTimeUs = hapticGetU64(b + 8);
+        for (int i = 0; i < 3; i++)
+        {
+            position[i] = hapticGetF32(b + 16 + 4*i);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            orientation[i] = hapticGetF32(b + 28 + 4*i);
+        }
+        buttons = b[44];
+        return true;
+    }
+};
+
+struct HapticForcePacket
+{
+    HapticForcePacket() : seq(0), echoSeq(0), echoDeviceTimeUs(0)
+    {
+        force[0] = force[1] = force[2] = 0.0f;
+    }
+
+    uint32_t seq;
+    uint32_t echoSeq;           // 0: no pose received yet
+    uint64_t echoDeviceTimeUs;
+    float force[3];             // [N]
+
+    void encode(uint8_t *b) const
+    {
+        hapticPutU32(b, HAPTIC_FORCE_MAGIC);
+        hapticPutU32(b + 4, seq);
+        hapticPutU32(b + 8, echoSeq);
+        hapticPutU64(b + 12, echoDeviceTimeUs);
+        for (int i = 0; i < 3; i++)
+        {
+            hapticPutF32(b + 20 + 4*i, force[i]);
+        }
+    }
+
+    bool decode(const uint8_t *b, size_t n)
+    {
+        if (n != HAPTIC_FORCE_PACKET_SIZE || hapticGetU32(b) != HAPTIC_FORCE_MAGIC)
+        {
+            return false;
+        }
+        seq = hapticGetU32(b + 4);
+        echoSeq = hapticGetU32(b + 8);
+        echoDeviceTimeUs = hapticGetU64(b + 12);
+        for (int i = 0; i < 3; i++)
+        {
+            force[i] = hapticGetF32(b + 20 + 4*i);
+        }
+        return true;
+    }
+};
+
+// Orientation (x y z w) of a 4x4 device transform, as omni_node has
+// always computed it: the transform read row-major. OpenHaptics stores
+// it column-major, so this is the inverse rotation of the stylus; the
+// rest of the stack expects that convention.
+inline void hapticPoseFromTransform(const double transform[16], double q[4])
+{
+    double R00 = transform[0]; double R01 = transform[1]; double R02 = transform[2];
+    double R10 = transform[4]; double R11 = transform[5]; double R12 = transform[6];
+    double R20 = transform[8]; double R21 = transform[9]; double R22 = transform[10];
+
+    q[3] = 0.5*sqrt(1 + R00 + R11 + R22);
+    q[0] = (R21 - R12) / (4 * q[3]);
+    q[1] = (R02 - R20) / (4 * q[3]);
+    q[2] = (R10 - R01) / (4 * q[3]);
+}
+
+/*******************************************************************************
+                UDP SOCKET
+********************************************************************************/
+
+#ifdef _WIN32
+typedef SOCKET HapticSocketHandle;
+#define HAPTIC_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int HapticSocketHandle;
+#define HAPTIC_INVALID_SOCKET (-1)
+#endif
+
+class HapticUdpSocket
+{
+public:
+    HapticUdpSocket() : fd(HAPTIC_INVALID_SOCKET), havePeer(false)
+    {
+        memset(&peer, 0, sizeof(peer));
+    }
+
+    ~HapticUdpSocket() { close(); }
+
+    // bound to port (0: any free one), non-blocking
+    bool open(uint16_t port, std::string &error)
+    {
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2,2), &wsa) != 0)
+        {
+            error = "WSAStartup failed";
+            return false;
+        }
+#endif
+        fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd == HAPTIC_INVALID_SOCKET)
+        {
+            error = "Could not create a UDP socket";
+            return false;
+        }
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            error = "Could not bind UDP port " + std::to_string(port);
+            close();
+            return false;
+        }
+#ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(fd, FIONBIO, &nonBlocking);
+#else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        return true;
+    }
+
+    // where send() goes (host name or address)
+    bool setPeer(const std::string &host, uint16_t port, std::string &error)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *result = 0;
+        if (getaddrinfo(host.c_str(), 0, &hints, &result) != 0 || !result)
+        {
+            error = "Could not resolve " + host;
+            return false;
+        }
+        memcpy(&peer, result->ai_addr, sizeof(peer));
+        peer.sin_port = htons(port);
+        freeaddrinfo(result);
+        havePeer = true;
+        return true;
+    }
+
+    bool hasPeer() const { return havePeer; }
+
+    bool send(const uint8_t *data, size_t n)
+    {
+        if (!havePeer)
+        {
+            return false;
+        }
+        return sendto(fd, reinterpret_cast<const char*>(data), int(n), 0,
+                      reinterpret_cast<const sockaddr*>(&peer), sizeof(peer)) == int(n);
+    }
+
+    // one pending datagram, without blocking: its size, or -1 if none;
+    // with learnPeer, replies go to its sender from now on
+    int receive(uint8_t *data, size_t n, bool learnPeer = false)
+    {
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        int got = int(recvfrom(fd, reinterpret_cast<char*>(data), int(n), 0, reinterpret_cast<sockaddr*>(&from), &fromLen));
+        if (got >= 0 && learnPeer)
+        {
+            peer = from;
+            havePeer = true;
+        }
+        return got;
+    }
+
+    // waits up to timeout [s] for a datagram
+    bool waitReadable(double timeout)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+        timeval tv;
+        tv.tv_sec = long(timeout);
+        tv.tv_usec = long((timeout - tv.tv_sec)*1e6);
+        return select(int(fd) + 1, &readable, 0, 0, &tv) > 0;
+    }
+
+    void close()
+    {
+        if (fd == HAPTIC_INVALID_SOCKET)
+        {
+            return;
+        }
+#ifdef _WIN32
+        closesocket(fd);
+        WSACleanup();
+#else
+        ::close(fd);
+#endif
+        fd = HAPTIC_INVALID_SOCKET;
+    }
+
+private:
+    HapticSocketHandle fd;
+    sockaddr_in peer;
+    bool havePeer;
+};
+
+/*******************************************************************************
+                DEVICE LOOP
+********************************************************************************/
+
+struct HapticDeviceState
+{
+    double position[3];         // [mm]
+    double transform[16];       // as the device reports it
+    int buttons;
+};
+
+class HapticDevice
+{
+public:
+    virtual ~HapticDevice() {}
+
+    virtual bool open(std::string &error) = 0;
+
+    // one device frame: applies force [N] and reads the state; false on a device error
+    virtual bool frame(const double force[3], HapticDeviceState &state) = 0;
+
+    // true if frame() waits for the device's own servo clock (the
+    // OpenHaptics scheduler); otherwise the bridge paces the loop
+    virtual bool paced() const { return false; }
+
+    virtual void close() {}
+};
+
+struct HapticBridgeParams
+{
+    HapticBridgeParams() : rate(1000.0), maxForce(3.3), forceTimeout(0.1) {}
+
+    double rate;                // pose packets per second, at most
+    double maxForce;            // [N]
+    double forceTimeout;        // [s]
+};
+
+// counters of the bridge, since startup or over one report interval
+struct HapticBridgeCounts
+{
+    HapticBridgeCounts() { clear(); }
+
+    void clear()
+    {
+        frames = 0;
+        deviceErrors = 0;
+        posesSent = 0;
+        sendErrors = 0;
+        forces = 0;
+        forcesLost = 0;
+        forcesStale = 0;
+        timeouts = 0;
+        roundTrip.clear();
+    }
+
+    long frames;
+    long deviceErrors;
+    long posesSent;
+    long sendErrors;
+    long forces;
+    long forcesLost;            // sequence gaps
+    long forcesStale;           // older than the last one (reordered or duplicated)
+    long timeouts;              // force dropped to zero
+    LatencyHistogram roundTrip;
+};
+
+class HapticBridge
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    HapticBridge(HapticDevice &dev, HapticUdpSocket &sock, const HapticBridgeParams &p = HapticBridgeParams())
+        : device(dev), socket(sock), params(p), start(Clock::now()), nextSend(0.0), seq(0),
+          lastForceSeq(0), lastForceTime(-1.0)
+    {
+        force[0] = force[1] = force[2] = 0.0;
+        memset(&state, 0, sizeof(state));
+    }
+
+    // seconds since the bridge started (the device time of the packets)
+    double seconds() const
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // One cycle: takes the force commands that arrived, runs a device
+    // frame, and sends the pose if one is due; without a paced device, then
+    // waits for the next send. Returns false on a device error (the caller
+    // may reopen the device).
+    bool step()
+    {
+        receiveForces();
+        double t = seconds();
+        if (lastForceTime >= 0.0 && t - lastForceTime > params.forceTimeout)
+        {
+            force[0] = force[1] = force[2] = 0.0;
+            lastForceTime = -1.0;
+            interval.timeouts++;
+            total.timeouts++;
+        }
+
+        bool ok = device.frame(force, state);
+        interval.frames++;
+        total.frames++;
+        if (!ok)
+        {
+            interval.deviceErrors++;
+            total.deviceErrors++;
+        }
+
+        t = seconds();
+        if (t >= nextSend)
+        {
+            sendPose(t);
+            // a missed slot restarts the schedule instead of sending a burst
+            double period = 1.0/params.rate;
+            nextSend = t - nextSend > period ? t + period : nextSend + period;
+        }
+        // until the next send, wait on the socket rather than sleep, so
+        // forces are taken (and their round trip timed) as they arrive
+        while (!device.paced() && seconds() < nextSend)
+        {
+            if (!socket.waitReadable(nextSend - seconds()))
+            {
+                // timed out, or select failed: do not spin on the error
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(nextSend)));
+                break;
+            }
+            receiveForces();
+        }
+        return ok;
+    }
+
+    const HapticDeviceState &deviceState() const { return state; }
+    const double *currentForce() const { return force; }
+    const HapticBridgeCounts &totals() const { return total; }
+
+    // one line per report: rates over elapsed seconds and the round trip
+    void report(FILE *out, const char *name, double elapsed, bool sinceStart = false)
+    {
+        HapticBridgeCounts &c = sinceStart ? total : interval;
+        const LatencyHistogram &rt = c.roundTrip;
+        fprintf(out, "%s: %.1f frames/s, %.1f poses/s, %.1f forces/s, %ld lost, %ld stale, %ld timeouts, "
+                     "%ld device errors; round trip mean %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                name, c.frames/elapsed, c.posesSent/elapsed, c.forces/elapsed, c.forcesLost, c.forcesStale,
+                c.timeouts, c.deviceErrors, 1e3*rt.mean(), 1e3*rt.percentile(0.5), 1e3*rt.percentile(0.99),
+                1e3*rt.maximum());
+        fflush(out);
+        if (!sinceStart)
+        {
+            interval.clear();
+        }
+    }
+
+private:
+    void sendPose(double t)
+    {
+        HapticPosePacket packet;
+        double q[4];
+        hapticPoseFromTransform(state.transform, q);
+        packet.seq = ++seq;
+        packet.deviceTimeUs = uint64_t(t*1e6);
+        for (int i = 0; i < 3; i++)
+        {
+            packet.position[i] = float(state.position[i]);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            packet.orientation[i] = float(q[i]);
+        }
+        packet.buttons = uint8_t(state.buttons);
+
+        uint8_t buffer[HAPTIC_POSE_PACKET_SIZE];
+        packet.encode(buffer);
+        if (socket.send(buffer, sizeof(buffer)))
+        {
+            interval.posesSent++;
+            total.posesSent++;
+        }
+        else
+        {
+            interval.sendErrors++;
+            total.sendErrors++;
+        }
+    }
+
+    void receiveForces()
+    {
+        uint8_t buffer[64];
+        int n;
+        while ((n = socket.receive(buffer, sizeof(buffer))) >= 0)
+        {
+            HapticForcePacket packet;
+            if (!packet.decode(buffer, size_t(n)))
+            {
+                continue;
+            }
+            if (packet.seq <= lastForceSeq && lastForceSeq - packet.seq < HAPTIC_RESTART_GAP)
+            {
+                interval.forcesStale++;
+                total.forcesStale++;
+                continue;
+            }
+            long lost = packet.seq > lastForceSeq ? long(packet.seq - lastForceSeq) - 1 : 0;
+            interval.forcesLost += lost;
+            total.forcesLost += lost;
+            lastForceSeq = packet.seq;
+            interval.forces++;
+            total.forces++;
+
+            double t = seconds();
+            if (packet.echoSeq != 0)
+            {
+                double rt = t - 1e-6*packet.echoDeviceTimeUs;
+                interval.roundTrip.add(rt);
+                total.roundTrip.add(rt);
+            }
+
+            double norm = sqrt(double(packet.force[0])*packet.force[0] + double(packet.force[1])*packet.force[1] +
+                               double(packet.force[2])*packet.force[2]);
+            double scale = norm > params.maxForce ? params.maxForce/norm : 1.0;
+            for (int i = 0; i < 3; i++)
+            {
+                force[i] = scale*packet.force[i];
+            }
+            lastForceTime = t;
+        }
+    }
+
+    HapticDevice &device;
+    HapticUdpSocket &socket;
+    HapticBridgeParams params;
+    Clock::time_point start;
+    double nextSend;
+    uint32_t seq;
+    uint32_t lastForceSeq;
+    double lastForceTime;
+    double force[3];
+    HapticDeviceState state;
+    HapticBridgeCounts interval;
+    HapticBridgeCounts total;
+};
+
+#endif // HAPTIC_BRIDGE_H
@@ -0,0 +1,127 @@
+/********************************************************************
+
+  haptic_bridge_fake.cpp
+
+The haptic bridge (haptic_bridge.h) with a scripted device instead of
+the Omni, for testing the UDP link and haptic_udp_receiver on Linux
+without the device or the Windows machine. Needs no ROS.
+
+The stylus moves on a circle of 20 mm radius at 0.5 Hz, turning about
+z, with the button pressed. Every second the bridge prints its rates,
+the forces received and the round trip (pose sent to the force that
+echoes it coming back); at the end the same since startup. For the
+link alone, run haptic_udp_receiver with ~loopback.
+
+Usage: haptic_bridge_fake [host] [--port n] [--rate Hz] [--duration s]
+
+host defaults to localhost, port to 9870, rate to 1000 Hz; duration 0
+runs until killed.
+
+********************************************************************/
+
+#include "haptic_bridge.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+class FakeHapticDevice : public HapticDevice
+{
+public:
+    FakeHapticDevice() : start(std::chrono::steady_clock::now()) {}
+
+    bool open(std::string &) { return true; }
+
+    bool frame(const double *, HapticDeviceState &state)
+    {
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double phase = 2.0*M_PI*0.5*t;
+        state.position[0] = 20.0*cos(phase);
+        state.position[1] = 20.0*sin(phase);
+        state.position[2] = 0.0;
+
+        // rotation about z by phase/4, read back row-major by hapticPoseFromTransform
+        double c = cos(0.25*phase), s = sin(0.25*phase);
+        for (int i = 0; i < 16; i++)
+        {
+            state.transform[i] = 0.0;
+        }
+        state.transform[0] = c;
+        state.transform[1] = -s;
+        state.transform[4] = s;
+        state.transform[5] = c;
+        state.transform[10] = 1.0;
+        state.transform[15] = 1.0;
+        state.buttons = 1;
+        return true;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+int main(int argc, char *argv[])
+{
+    std::string host = "localhost";
+    int port = HAPTIC_DEFAULT_PORT;
+    double duration = 0.0;
+    HapticBridgeParams params;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--port" && i+1 < argc)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (arg == "--rate" && i+1 < argc)
+        {
+            params.rate = atof(argv[++i]);
+        }
+        else if (arg == "--duration" && i+1 < argc)
+        {
+            duration = atof(argv[++i]);
+        }
+        else if (i == 1 && arg.compare(0, 2, "--") != 0)
+        {
+            host = arg;
+        }
+        else
+        {
+            std::cerr << "Usage: haptic_bridge_fake [host] [--port n] [--rate Hz] [--duration s]" << std::endl;
+            return 1;
+        }
+    }
+    if (params.rate <= 0.0)
+    {
+        std::cerr << "The rate must be positive." << std::endl;
+        return 1;
+    }
+
+    std::string error;
+    HapticUdpSocket socket;
+    FakeHapticDevice device;
+    if (!socket.open(0, error) || !socket.setPeer(host, uint16_t(port), error) || !device.open(error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << "Fake haptic device sending to " << host << ":" << port << " at " << params.rate << " Hz" << std::endl;
+
+    HapticBridge bridge(device, socket, params);
+    double lastReport = 0.0;
+    while (duration <= 0.0 || bridge.seconds() < duration)
+    {
+        bridge.step();
+        double t = bridge.seconds();
+        if (t - lastReport >= 1.0)
+        {
+            bridge.report(stdout, "haptic_bridge_fake", t - lastReport);
+            lastReport = t;
+        }
+    }
+    bridge.report(stdout, "haptic_bridge_fake since start", bridge.seconds(), true);
+
+    return 0;
+}
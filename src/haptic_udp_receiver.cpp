@@ -0,0 +1,197 @@
+/********************************************************************
+
+  haptic_udp_receiver.cpp
+
+ROS end of the haptic bridge (haptic_bridge.h). Receives the pose
+datagrams of omni_node (or haptic_bridge_fake) on UDP ~port (9870) and
+publishes each one as Omnipos, Omnipos_stamped and Buttonstates, as
+omni_node did over rosserial. Every Omniforce goes back to the sender
+of the latest pose as a force datagram that echoes that pose, for the
+round trip the bridge measures. With ~loopback, every pose is answered
+right away with the latest force instead (zero without Omniforce), to
+measure the link alone.
+
+The trace id of Omnipos_stamped is the sequence number of the packet.
+Its stamp is the device time moved onto the ROS clock by the smallest
+offset seen so far (allowed to drift by 10 ppm), so the stamps carry
+the link delay beyond that of the fastest packet; the minimum delay
+itself needs synchronized clocks to be seen.
+
+Packets that arrive out of order or twice are dropped. Every
+~report_period [s] the node prints the packet rate, the lost (sequence
+gaps) and dropped packets, the forces sent and the delay beyond the
+minimum.
+
+********************************************************************/
+
+#include "haptic_bridge.h"
+#include "latency_histogram.h"
+
+#include <ros/ros.h>
+#include <geometry_msgs/Pose.h>
+#include <geometry_msgs/Vector3.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/stampedPose.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+HapticUdpSocket udp;
+
+// the newest pose received, echoed with every force
+bool havePose = false;
+uint32_t lastSeq = 0;
+uint64_t lastDeviceTimeUs = 0;
+
+uint32_t forceSeq = 0;
+geometry_msgs::Vector3 lastForce;
+long forcesSent = 0;
+
+void sendForce()
+{
+    if (!havePose)
+    {
+        return;
+    }
+    HapticForcePacket packet;
+    packet.seq = ++forceSeq;
+    packet.echoSeq = lastSeq;
+    packet.echoDeviceTimeUs = lastDeviceTimeUs;
+    packet.force[0] = float(lastForce.x);
+    packet.force[1] = float(lastForce.y);
+    packet.force[2] = float(lastForce.z);
+    uint8_t buffer[HAPTIC_FORCE_PACKET_SIZE];
+    packet.encode(buffer);
+    if (udp.send(buffer, sizeof(buffer)))
+    {
+        forcesSent++;
+    }
+}
+
+void forceCallback(const geometry_msgs::Vector3 &msg)
+{
+    lastForce = msg;
+    sendForce();
+}
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "haptic_udp_receiver");
+    ros::NodeHandle node;
+
+    int port;
+    double reportPeriod;
+    bool loopback;
+    ros::param::param<int>("~port", port, HAPTIC_DEFAULT_PORT);
+    ros::param::param<double>("~report_period", reportPeriod, 5.0);
+    ros::param::param<bool>("~loopback", loopback, false);
+
+    std::string error;
+    if (!udp.open(uint16_t(port), error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << "Receiving haptic device poses on UDP port " << port << (loopback ? " (loopback)" : "") << std::endl;
+
+    ros::Publisher buttonPub = node.advertise<std_msgs::Int8>("Buttonstates", 100);
+    ros::Publisher omniPub = node.advertise<geometry_msgs::Pose>("Omnipos", 100);
+    ros::Publisher omniStampedPub = node.advertise<endonasal_teleop::stampedPose>("Omnipos_stamped", 100);
+    ros::Subscriber forceSub = node.subscribe("Omniforce", 1, forceCallback);
+
+    geometry_msgs::Pose poseMsg;
+    endonasal_teleop::stampedPose stampedMsg;
+    std_msgs::Int8 buttonMsg;
+    bool haveOffset = false;
+    double clockOffset = 0.0, offsetDeviceTime = 0.0;
+    long received = 0, lost = 0, dropped = 0, invalid = 0;
+    LatencyHistogram delay;
+    ros::WallTime lastReport = ros::WallTime::now();
+
+    while (ros::ok())
+    {
+        udp.waitReadable(0.001);
+
+        uint8_t buffer[64];
+        int n;
+        while ((n = udp.receive(buffer, sizeof(buffer), true)) >= 0)
+        {
+            HapticPosePacket packet;
+            if (!packet.decode(buffer, size_t(n)))
+            {
+                invalid++;
+                continue;
+            }
+            bool restarted = havePose && packet.seq <= lastSeq && lastSeq - packet.seq >= HAPTIC_RESTART_GAP;
+            if (havePose && packet.seq <= lastSeq && !restarted)
+            {
+                dropped++;
+                continue;
+            }
+            if (havePose && !restarted)
+            {
+                lost += long(packet.seq - lastSeq) - 1;
+            }
+            if (restarted)
+            {
+                haveOffset = false;
+            }
+            havePose = true;
+            lastSeq = packet.seq;
+            lastDeviceTimeUs = packet.deviceTimeUs;
+            received++;
+
+            // device time onto the ROS clock, by the smallest offset seen
+            double now = ros::Time::now().toSec();
+            double deviceTime = 1e-6*packet.deviceTimeUs;
+            double offset = now - deviceTime;
+            if (!haveOffset)
+            {
+                clockOffset = offset;
+                haveOffset = true;
+            }
+            clockOffset = std::min(clockOffset + 1e-5*std::max(0.0, deviceTime - offsetDeviceTime), offset);
+            offsetDeviceTime = deviceTime;
+            delay.add(offset - clockOffset);
+
+            poseMsg.position.x = packet.position[0];
+            poseMsg.position.y = packet.position[1];
+            poseMsg.position.z = packet.position[2];
+            poseMsg.orientation.x = packet.orientation[0];
+            poseMsg.orientation.y = packet.orientation[1];
+            poseMsg.orientation.z = packet.orientation[2];
+            poseMsg.orientation.w = packet.orientation[3];
+            buttonMsg.data = packet.buttons;
+            stampedMsg.header.stamp = ros::Time(deviceTime + clockOffset);
+            stampedMsg.trace_id = packet.seq;
+            stampedMsg.pose = poseMsg;
+            buttonPub.publish(buttonMsg);
+            omniPub.publish(poseMsg);
+            omniStampedPub.publish(stampedMsg);
+
+            if (loopback)
+            {
+                sendForce();
+            }
+        }
+
+        ros::spinOnce();
+
+        double elapsed = (ros::WallTime::now() - lastReport).toSec();
+        if (reportPeriod > 0.0 && elapsed >= reportPeriod)
+        {
+            printf("haptic_udp_receiver: %.1f poses/s, %ld lost, %ld dropped, %ld invalid, %.1f forces/s; "
+                   "delay beyond the minimum mean %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                   received/elapsed, lost, dropped, invalid, forcesSent/elapsed,
+                   1e3*delay.mean(), 1e3*delay.percentile(0.99), 1e3*delay.maximum());
+            fflush(stdout);
+            received = lost = dropped = invalid = forcesSent = 0;
+            delay.clear();
+            lastReport = ros::WallTime::now();
+        }
+    }
+
+    return 0;
+}
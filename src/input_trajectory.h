@@ -0,0 +1,427 @@
+#ifndef INPUT_TRAJECTORY_H
+#define INPUT_TRAJECTORY_H
+
+/********************************************************************
+
+  input_trajectory.h
+
+Scripted operator input for the test tools (load_generator, omni_sim):
+Omni poses and buttons, or joint_q configurations, one InputSample at
+a time (InputTrajectory, set up from the node's private parameters).
+
+    sinusoid        every coordinate a sine of the frequency, the three
+                    of the position (or rotation) 120 deg apart
+    random_walk     every coordinate a random walk pulled back to the
+                    center with the walk time constant, so it stays
+                    within about the amplitude
+    recorded        the samples of a rosbag (Omnipos and Buttonstates,
+                    or joint_q) or a flight recording (resolved_rates
+                    for the Omni, kinematics for joint_q, see
+                    flight_recorder.h), played at the pace they
+                    were recorded (bag times or the stamp column)
+
+Omni coordinates are the position around the center [mm] with the
+amplitude [mm] and a rotation of up to the rotation amplitude [rad];
+joint coordinates are PsiL and Beta around a home configuration, with
+the rotation [rad] and translation [m] amplitudes.
+
+********************************************************************/
+
+#include "teleop_common.h"
+#include "flight_recorder.h"
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <geometry_msgs/Pose.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/config3.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// one input sample
+struct InputSample
+{
+    double p[3];            // Omni position [mm]
+    double q[4];            // Omni orientation, w x y z
+    int button;
+    double joint_q[12];     // PsiL, Beta, Ftip, Ttip
+};
+
+struct TrajectoryParams
+{
+    bool omni;                      // Omni samples, else joint_q
+    Eigen::Vector3d center;         // [mm]
+    double amplitude;               // [mm]
+    double rotationAmplitude;       // [rad]
+    double translationAmplitude;    // [m]
+    double frequency;               // [Hz]
+    double walkTime;                // [s]
+    int button;
+    Configuration3 home;
+};
+
+// six coordinates in [-1, 1] (roughly) to a sample: Omni position and
+// rotation vector, or PsiL and Beta
+inline void sampleFromUnit(const TrajectoryParams &tp, const double u[6], InputSample &s)
+{
+    for (int i = 0; i < 12; i++)
+    {
+        s.joint_q[i] = 0.0;
+    }
+    s.button = tp.button;
+    if (tp.omni)
+    {
+        Eigen::Vector3d r(u[3], u[4], u[5]);
+        r *= tp.rotationAmplitude;
+        double angle = r.norm();
+        Eigen::Vector3d axis = angle > 0.0 ? Eigen::Vector3d(r/angle) : Eigen::Vector3d::UnitZ();
+        for (int i = 0; i < 3; i++)
+        {
+            s.p[i] = tp.center(i) + tp.amplitude*u[i];
+        }
+        s.q[0] = cos(0.5*angle);
+        s.q[1] = sin(0.5*angle)*axis(0);
+        s.q[2] = sin(0.5*angle)*axis(1);
+        s.q[3] = sin(0.5*angle)*axis(2);
+    }
+    else
+    {
+        s.p[0] = s.p[1] = s.p[2] = 0.0;
+        s.q[0] = 1.0;
+        s.q[1] = s.q[2] = s.q[3] = 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            s.joint_q[i] = tp.home.PsiL(i) + tp.rotationAmplitude*u[i];
+            s.joint_q[i+3] = tp.home.Beta(i) + tp.translationAmplitude*u[i+3];
+        }
+    }
+}
+
+inline void sinusoidSample(const TrajectoryParams &tp, double t, InputSample &s)
+{
+    double u[6];
+    for (int i = 0; i < 6; i++)
+    {
+        u[i] = sin(2.0*M_PI*tp.frequency*t + (i % 3)*2.0*M_PI/3.0 + (i / 3)*M_PI/2.0);
+    }
+    sampleFromUnit(tp, u, s);
+}
+
+// Ornstein-Uhlenbeck walk with a standard deviation of 0.5 per coordinate
+class RandomWalk
+{
+public:
+    RandomWalk(unsigned seed) : rng(seed), normal(0.0, 1.0)
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            u[i] = 0.0;
+        }
+    }
+
+    void next(const TrajectoryParams &tp, double dt, InputSample &s)
+    {
+        double a = exp(-dt/tp.walkTime);
+        double sigma = 0.5*sqrt(1.0 - a*a);
+        for (int i = 0; i < 6; i++)
+        {
+            u[i] = a*u[i] + sigma*normal(rng);
+        }
+        sampleFromUnit(tp, u, s);
+    }
+
+private:
+    std::mt19937 rng;
+    std::normal_distribution<double> normal;
+    double u[6];
+};
+
+inline bool endsWith(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+inline bool loadRecordedBag(const std::string &path, const TrajectoryParams &tp,
+                            std::vector<InputSample> &samples, std::vector<double> &times)
+{
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(path, rosbag::bagmode::Read);
+    }
+    catch (rosbag::BagException &e)
+    {
+        std::cerr << "Could not open " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> topics;
+    if (tp.omni)
+    {
+        topics.push_back("Omnipos");
+        topics.push_back("/Omnipos");
+        topics.push_back("Buttonstates");
+        topics.push_back("/Buttonstates");
+    }
+    else
+    {
+        topics.push_back("joint_q");
+        topics.push_back("/joint_q");
+    }
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+    const double zero[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    InputSample s;
+    sampleFromUnit(tp, zero, s);
+    for (rosbag::View::iterator it = view.begin(); it != view.end(); ++it)
+    {
+        geometry_msgs::Pose::ConstPtr pose = it->instantiate<geometry_msgs::Pose>();
+        std_msgs::Int8::ConstPtr button = it->instantiate<std_msgs::Int8>();
+        endonasal_teleop::config3::ConstPtr config = it->instantiate<endonasal_teleop::config3>();
+        if (pose)
+        {
+            s.p[0] = pose->position.x;
+            s.p[1] = pose->position.y;
+            s.p[2] = pose->position.z;
+            s.q[0] = pose->orientation.w;
+            s.q[1] = pose->orientation.x;
+            s.q[2] = pose->orientation.y;
+            s.q[3] = pose->orientation.z;
+            samples.push_back(s);
+            times.push_back(it->getTime().toSec());
+        }
+        else if (button)
+        {
+            s.button = button->data;
+        }
+        else if (config)
+        {
+            for (int i = 0; i < 12; i++)
+            {
+                s.joint_q[i] = config->joint_q[i];
+            }
+            samples.push_back(s);
+            times.push_back(it->getTime().toSec());
+        }
+    }
+    bag.close();
+    return true;
+}
+
+inline bool loadRecordedFlight(const std::string &path, const TrajectoryParams &tp,
+                               std::vector<InputSample> &samples, std::vector<double> &times)
+{
+    FlightRecording rec;
+    std::string error;
+    if (!loadFlightRecording(path, rec, error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    const double zero[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    InputSample s;
+    sampleFromUnit(tp, zero, s);
+    int cStamp = rec.column("stamp");
+    if (tp.omni)
+    {
+        int cP = rec.column("omni_p_0");
+        int cQ = rec.column("omni_q_0");
+        int cButton = rec.column("button");
+        if (rec.header.recordType != RECORD_RESOLVED_RATES || cP < 0 || cQ < 0 || cButton < 0)
+        {
+            std::cerr << path << " is not a resolved_rates recording with the Omni input." << std::endl;
+            return false;
+        }
+        for (uint64_t r = 0; r < rec.count; r++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                s.p[i] = rec.value(r, cP+i);
+            }
+            for (int i = 0; i < 4; i++)
+            {
+                s.q[i] = rec.value(r, cQ+i);
+            }
+            s.button = int(rec.value(r, cButton));
+            samples.push_back(s);
+            times.push_back(rec.value(r, cStamp));
+        }
+    }
+    else
+    {
+        int cJoint = rec.column("joint_q_0");
+        if (rec.header.recordType != RECORD_KINEMATICS || cJoint < 0)
+        {
+            std::cerr << path << " is not a kinematics recording." << std::endl;
+            return false;
+        }
+        for (uint64_t r = 0; r < rec.count; r++)
+        {
+            for (int i = 0; i < 12; i++)
+            {
+                s.joint_q[i] = rec.value(r, cJoint+i);
+            }
+            samples.push_back(s);
+            times.push_back(rec.value(r, cStamp));
+        }
+    }
+    return true;
+}
+
+// The trajectory given by the private parameters ~trajectory (sinusoid,
+// random_walk or recorded), ~recording, ~center, ~amplitude,
+// ~rotation_amplitude, ~translation_amplitude, ~frequency, ~walk_time,
+// ~button and ~seed. Recorded samples are interpolated at the time of
+// the call, from the first one at t = 0; after the last one (held for a
+// mean sample interval) the recording loops.
+class InputTrajectory
+{
+public:
+    enum Type { SINUSOID, RANDOM_WALK, RECORDED };
+
+    InputTrajectory() : type(SINUSOID), walk(1), period(0.0) {}
+
+    // omni: Omni samples, else joint_q around home; prints why and
+    // returns false if the parameters are unusable
+    bool init(bool omni, const Configuration3 &home)
+    {
+        std::string trajectory, recording;
+        std::vector<double> center;
+        int seed;
+        ros::param::param<std::string>("~trajectory", trajectory, "sinusoid");
+        ros::param::param<std::string>("~recording", recording, "");
+        ros::param::param<std::vector<double> >("~center", center, {0.0, 0.0, 0.0});
+        ros::param::param<double>("~amplitude", tp.amplitude, 20.0);
+        ros::param::param<double>("~rotation_amplitude", tp.rotationAmplitude, 0.3);
+        ros::param::param<double>("~translation_amplitude", tp.translationAmplitude, 5.0e-3);
+        ros::param::param<double>("~frequency", tp.frequency, 0.5);
+        ros::param::param<double>("~walk_time", tp.walkTime, 1.0);
+        ros::param::param<int>("~button", tp.button, 1);
+        ros::param::param<int>("~seed", seed, 1);
+        tp.omni = omni;
+        tp.center = center.size() == 3 ? Eigen::Vector3d(center[0], center[1], center[2]) : Eigen::Vector3d::Zero();
+        tp.walkTime = std::max(tp.walkTime, 1e-3);
+        tp.home = home;
+        walk = RandomWalk(seed);
+        typeName = trajectory;
+
+        if (trajectory == "sinusoid")
+        {
+            type = SINUSOID;
+        }
+        else if (trajectory == "random_walk")
+        {
+            type = RANDOM_WALK;
+        }
+        else if (trajectory == "recorded")
+        {
+            type = RECORDED;
+            bool ok = endsWith(recording, ".bag") ? loadRecordedBag(recording, tp, recorded, recordedTimes)
+                                                  : loadRecordedFlight(recording, tp, recorded, recordedTimes);
+            if (!ok || recorded.empty())
+            {
+                std::cerr << "No " << (omni ? "Omni" : "joint_q") << " samples in " << recording << std::endl;
+                return false;
+            }
+
+            // times from the first sample, never going back
+            double t0 = recordedTimes[0];
+            for (size_t i = 0; i < recordedTimes.size(); i++)
+            {
+                recordedTimes[i] = std::max(recordedTimes[i] - t0, i > 0 ? recordedTimes[i-1] : 0.0);
+            }
+            double span = recordedTimes.back();
+            if (recorded.size() > 1 && span <= 0.0)
+            {
+                std::cerr << "The samples in " << recording << " have no times to play them at." << std::endl;
+                return false;
+            }
+            period = recorded.size() > 1 ? span*recorded.size()/(recorded.size() - 1) : 0.0;
+        }
+        else
+        {
+            std::cerr << "Unknown ~trajectory " << trajectory << " (sinusoid, random_walk or recorded)." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    const std::string &name() const { return typeName; }
+    const TrajectoryParams &params() const { return tp; }
+
+    // the sample at time t [s], dt after the previous one
+    void sample(double t, double dt, InputSample &s)
+    {
+        if (type == SINUSOID)
+        {
+            sinusoidSample(tp, t, s);
+        }
+        else if (type == RANDOM_WALK)
+        {
+            walk.next(tp, dt, s);
+        }
+        else
+        {
+            recordedSample(t, s);
+        }
+    }
+
+private:
+    // the recording at t, looped: position and joints interpolated
+    // linearly, the orientation normalized, the button of the sample before
+    void recordedSample(double t, InputSample &s) const
+    {
+        double tl = period > 0.0 ? t - period*floor(t/period) : 0.0;
+        size_t i = std::upper_bound(recordedTimes.begin(), recordedTimes.end(), tl) - recordedTimes.begin();
+        i = i > 0 ? i-1 : 0;
+        s = recorded[i];
+        if (i+1 >= recorded.size() || recordedTimes[i+1] <= recordedTimes[i])
+        {
+            return;
+        }
+
+        const InputSample &b = recorded[i+1];
+        double w = (tl - recordedTimes[i])/(recordedTimes[i+1] - recordedTimes[i]);
+        for (int k = 0; k < 3; k++)
+        {
+            s.p[k] += w*(b.p[k] - s.p[k]);
+        }
+        for (int k = 0; k < 12; k++)
+        {
+            s.joint_q[k] += w*(b.joint_q[k] - s.joint_q[k]);
+        }
+        double dot = s.q[0]*b.q[0] + s.q[1]*b.q[1] + s.q[2]*b.q[2] + s.q[3]*b.q[3];
+        double sign = dot < 0.0 ? -1.0 : 1.0;
+        double norm = 0.0;
+        for (int k = 0; k < 4; k++)
+        {
+            s.q[k] += w*(sign*b.q[k] - s.q[k]);
+            norm += s.q[k]*s.q[k];
+        }
+        norm = sqrt(norm);
+        for (int k = 0; k < 4 && norm > 0.0; k++)
+        {
+            s.q[k] /= norm;
+        }
+    }
+
+    Type type;
+    std::string typeName;
+    TrajectoryParams tp;
+    RandomWalk walk;
+    std::vector<InputSample> recorded;
+    std::vector<double> recordedTimes;  // [s] from the first sample
+    double period;                      // [s] of one loop
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif // INPUT_TRAJECTORY_H
@@ -0,0 +1,624 @@
+#ifndef KINEMATICS_CORE_H
+#define KINEMATICS_CORE_H
+
+/********************************************************************
+
+  kinematics_core.h
+
+3-tube concentric tube robot kinematics, independent of ROS.
+Holds the cannula definition and turns a joint configuration into the
+tip pose, tube base rotations, Jacobian and the interpolated backbone
+used by the kinematics node, teleop_replay and the display.
+
+********************************************************************/
+
+// Cannula kinematics headers
+#include "Kinematics.h"
+#include "BasicFunctions.h"
+#include "Tube.h"
+
+#include "teleop_common.h"
+#include "flight_recorder.h"
+#include "alloc_guard.h"
+
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+//TYPEDEFS
+typedef CTR::Functions::constant_fun<Eigen::Vector2d> CurvFun;
+typedef std::tuple< CTR::Tube<CurvFun>, CTR::Tube<CurvFun>, CTR::Tube<CurvFun> > CannulaT;
+typedef CTR::DeclareOptions< CTR::Option::ComputeJacobian, CTR::Option::ComputeGeometry, CTR::Option::ComputeStability, CTR::Option::ComputeCompliance>::options OType;
+
+inline Eigen::Matrix3d hat3(Eigen::Vector3d v)
+{
+    Eigen::Matrix3d H = Eigen::Matrix<double,3,3>::Zero();
+    H(0,1) = -1*v(2);
+    H(0,2) = v(1);
+    H(1,0) = v(2);
+    H(1,2) = -1*v(0);
+    H(2,0) = -1*v(1);
+    H(2,1) = v(0);
+
+    return H;
+}
+
+
+inline Eigen::Matrix<double,6,6> Adjoint_p_q(Eigen::Vector3d p, Eigen::Vector4d q)
+{
+    Eigen::Matrix3d R = quat2rotm(q);
+    Eigen::Matrix3d phat = hat3(p);
+    Eigen::Matrix<double,6,6> Ad = Eigen::Matrix<double,6,6>::Zero();
+    Ad.topLeftCorner<3,3>() = R;
+    Ad.bottomRightCorner<3,3>() = R;
+    Ad.topRightCorner<3,3>() = phat*R;
+
+    return Ad;
+}
+
+inline double sgn(double x)
+{
+    double s = (x > 0) - (x < 0);
+    return s;
+}
+
+inline Eigen::Vector4d rotm2quat(Eigen::Matrix3d R)
+{
+    R = orthonormalize(R);
+    Eigen::Vector4d Q;
+    Q.fill(0);
+
+    double trace = R(0,0) + R(1,1) + R(2,2);
+    if (trace > 0)
+    {
+        double s = 0.5*sqrt(trace+1.0);
+        Q(0) = s; //w eqn
+        Q(1) = (R(2,1)-R(1,2))/(4*s); //x eqn
+        Q(2) = (R(0,2)-R(2,0))/(4*s); //y eqn
+        Q(3) = (R(1,0)-R(0,1))/(4*s); //z eqn
+    }
+    else
+    {
+       if(R(0,0)>R(1,1) && R(0,0)>R(2,2))
+       {
+            double s = 0.5*sqrt(1.0 + R(0,0) - R(1,1) - R(2,2));
+            Q(0) = (R(2,1) - R(1,2))*s; //w eqn
+            Q(1) = s; //x eqn
+            Q(2) = (R(0,1)+R(1,0))*s; //y eqn
+            Q(3) = (R(0,2)+R(2,0))*s; //z eqn
+        }
+       else if (R(1,1)>R(2,2))
+       {
+            double s = 0.5*sqrt(1.0 + R(1,1) - R(0,0) - R(2,2));
+            Q(0) = (R(0,2)-R(2,0))*s; //w eqn
+            Q(1) = (R(0,1)+R(1,0))*s; //x eqn
+            Q(2) = s; //y eqn
+            Q(3) = (R(1,2)+R(2,1))*s; //z eqn
+        }
+       else
+       {
+            double s = 0.5*sqrt(1.0 + R(2,2) - R(0,0) - R(1,1));
+            Q(0) = (R(1,0)-R(0,1))*s; //w eqn
+            Q(1) = (R(0,2)+R(2,0))*s; //x eqn
+            Q(2) = (R(1,2)+R(2,1))*s; //y eqn
+            Q(3) = s; //z eqn
+        }
+    }
+
+    return Q;
+}
+
+inline Eigen::Matrix<double,7,1> collapseTransform(Eigen::Matrix4d T)
+{
+    Eigen::Matrix<double,7,1> x;
+    x.fill(0);
+    x.head(3) = T.topRightCorner(3,1);
+    x.tail(4) = rotm2quat(T.topLeftCorner(3,3));
+    return x;
+}
+
+inline Eigen::Vector4d slerp(Eigen::Vector4d qa, Eigen::Vector4d qb, double t)
+{
+    Eigen::Vector4d qm;
+    qm.fill(0);
+
+    double cosHalfTheta = qa.transpose()*qb;
+    if(fabs(cosHalfTheta) >= 1.0)
+    {
+        qm = qa;
+        return qm;
+    }
+
+    double halfTheta = acos(cosHalfTheta);
+    double sinHalfTheta = sqrt(1.0-cosHalfTheta*cosHalfTheta);
+
+    if(fabs(sinHalfTheta)<0.001)
+    {
+        qm(0) = 0.5*qa(0) + 0.5*qb(0);
+        qm(1) = 0.5*qa(1) + 0.5*qb(1);
+        qm(2) = 0.5*qa(2) + 0.5*qb(2);
+        qm(3) = 0.5*qa(3) + 0.5*qb(3);
+        return qm;
+    }
+
+    double ratioA = sin((1-t)*halfTheta)/sinHalfTheta;
+    double ratioB = sin(t*halfTheta) / sinHalfTheta;
+
+    qm(0) = ratioA*qa(0) + ratioB*qb(0);
+    qm(1) = ratioA*qa(1) + ratioB*qb(1);
+    qm(2) = ratioA*qa(2) + ratioB*qb(2);
+    qm(3) = ratioA*qa(3) + ratioB*qb(3);
+    return qm;
+}
+
+// Natural cubic spline (zero curvature at both ends) through n points with
+// ascending x. Computes the same coefficients and values as tk::spline with
+// its default boundary conditions, but solves the tridiagonal system in
+// place, in buffers that are only reallocated when more points arrive than
+// ever before. x and y are not copied and must outlive the evaluations.
+class CubicSpline
+{
+public:
+    CubicSpline() : px(0), py(0), n(0) {}
+
+    void reserve(int nPoints)
+    {
+        if (int(m_a.size()) < nPoints)
+        {
+            m_a.resize(nPoints);
+            m_b.resize(nPoints);
+            m_c.resize(nPoints);
+            lower.resize(nPoints);
+            diag.resize(nPoints);
+            upper.resize(nPoints);
+            savedDiag.resize(nPoints);
+            rhs.resize(nPoints);
+        }
+    }
+
+    void setPoints(const double *x, const double *y, int nPoints)
+    {
+        reserve(nPoints);
+        px = x;
+        py = y;
+        n = nPoints;
+
+        // equation system for the parameters b[]
+        for (int i = 1; i < n-1; i++)
+        {
+            lower[i] = 1.0/3.0*(x[i]-x[i-1]);
+            diag[i] = 2.0/3.0*(x[i+1]-x[i-1]);
+            upper[i] = 1.0/3.0*(x[i+1]-x[i]);
+            rhs[i] = (y[i+1]-y[i])/(x[i+1]-x[i]) - (y[i]-y[i-1])/(x[i]-x[i-1]);
+        }
+        // boundary conditions: 2*b[0] = 0, 2*b[n-1] = 0
+        diag[0] = 2.0;
+        upper[0] = 0.0;
+        rhs[0] = 0.0;
+        diag[n-1] = 2.0;
+        lower[n-1] = 0.0;
+        rhs[n-1] = 0.0;
+
+        // scale each row to a unit diagonal, then LU decomposition
+        for (int i = 0; i < n; i++)
+        {
+            savedDiag[i] = 1.0/diag[i];
+            if (i > 0)
+            {
+                lower[i] *= savedDiag[i];
+            }
+            if (i < n-1)
+            {
+                upper[i] *= savedDiag[i];
+            }
+            diag[i] = 1.0;
+        }
+        for (int k = 0; k < n-1; k++)
+        {
+            double f = -lower[k+1]/diag[k];
+            lower[k+1] = -f;
+            diag[k+1] = diag[k+1] + f*upper[k];
+        }
+
+        // forward substitution (into rhs), then back substitution (into m_b)
+        for (int i = 0; i < n; i++)
+        {
+            double sum = 0;
+            if (i > 0)
+            {
+                sum += lower[i]*rhs[i-1];
+            }
+            rhs[i] = (rhs[i]*savedDiag[i]) - sum;
+        }
+        for (int i = n-1; i >= 0; i--)
+        {
+            double sum = 0;
+            if (i < n-1)
+            {
+                sum += upper[i]*m_b[i+1];
+            }
+            m_b[i] = (rhs[i] - sum) / diag[i];
+        }
+
+        // parameters a[] and c[] from b[]
+        for (int i = 0; i < n-1; i++)
+        {
+            m_a[i] = 1.0/3.0*(m_b[i+1]-m_b[i])/(x[i+1]-x[i]);
+            m_c[i] = (y[i+1]-y[i])/(x[i+1]-x[i])
+                     - 1.0/3.0*(2.0*m_b[i]+m_b[i+1])*(x[i+1]-x[i]);
+        }
+
+        // extrapolation: quadratic to the left, and to the right with the
+        // slope at the last point
+        m_b0 = m_b[0];
+        m_c0 = m_c[0];
+        double h = x[n-1]-x[n-2];
+        m_a[n-1] = 0.0;
+        m_c[n-1] = 3.0*m_a[n-2]*h*h+2.0*m_b[n-2]*h+m_c[n-2];
+    }
+
+    double operator()(double x) const
+    {
+        // closest point px[idx] < x, idx = 0 if x < px[0]
+        int idx = std::max(int(std::lower_bound(px, px+n, x) - px)-1, 0);
+
+        double h = x-px[idx];
+        if (x < px[0])
+        {
+            return (m_b0*h + m_c0)*h + py[0];
+        }
+        if (x > px[n-1])
+        {
+            return (m_b[n-1]*h + m_c[n-1])*h + py[n-1];
+        }
+        return ((m_a[idx]*h + m_b[idx])*h + m_c[idx])*h + py[idx];
+    }
+
+private:
+    const double *px;
+    const double *py;
+    int n;
+    // f(x) = a*(x-x_i)^3 + b*(x-x_i)^2 + c*(x-x_i) + y_i
+    std::vector<double> m_a, m_b, m_c;
+    double m_b0, m_c0;
+    // tridiagonal system
+    std::vector<double> lower, diag, upper, savedDiag, rhs;
+};
+
+// Interpolates the solver's dense output along the backbone: the reference
+// points plus nInterp evenly spaced ones, positions by cubic spline in arc
+// length and orientations by slerp between neighbouring reference frames.
+// The buffers are sized by reserve() and reused on every call.
+class BackboneInterpolator
+{
+public:
+    BackboneInterpolator(int nInterpPoints) : nInterp(nInterpPoints), nRefCapacity(0)
+    {
+        linspace.setLinSpaced(nInterp,0.0,1.0);
+    }
+
+    void reserve(int nRef)
+    {
+        if (nRef <= nRefCapacity)
+        {
+            return;
+        }
+        nRefCapacity = nRef;
+        zeroToOne.resize(nRef);
+        xs.resize(nRef+nInterp);
+        yRef.resize(nRef);
+        spline.reserve(nRef);
+    }
+
+    int numPoints(int nRef) const { return nRef+nInterp; }
+
+    // sRef: nRef ascending arc lengths; poseRef: p (rows 0-2) and q (rows 3-6)
+    // in its first nRef columns. Writes numPoints(nRef) arc lengths to s and
+    // poses to rows 0-6 of pose, which must have at least that many columns.
+    void interpolate(const double *sRef, const Eigen::MatrixXd &poseRef, int nRef, Eigen::VectorXd &s, Eigen::MatrixXd &pose)
+    {
+        reserve(nRef);
+        int nTotal = numPoints(nRef);
+
+        // reference arc lengths scaled to 0..1, merged with the evenly spaced ones
+        double totalArcLength = sRef[nRef-1] - sRef[0];
+        double scale = 1/totalArcLength;
+        for (int i = 0; i < nRef; i++)
+        {
+            zeroToOne(i) = scale*(sRef[i] - sRef[0]);
+        }
+        for (int i = 0; i < nInterp; i++)
+        {
+            xs(i) = linspace(i);
+        }
+        for (int i = 0; i < nRef; i++)
+        {
+            xs(nInterp+i) = zeroToOne(i);
+        }
+        std::sort(xs.data(),xs.data()+nTotal);
+        for (int k = 0; k < nTotal; k++)
+        {
+            s(k) = totalArcLength*xs(k)+sRef[0];
+        }
+
+        // orientations, walking from the tip (1) down to the base (0); every
+        // reference point is among the xs, so the interval advances at most
+        // one reference point per step
+        int a = nRef-1;
+        for (int k = nTotal-1; k >= 0; k--)
+        {
+            if (xs(k) < zeroToOne(a-1))
+            {
+                a--;
+            }
+            double len = zeroToOne(a) - zeroToOne(a-1);
+            double t = (zeroToOne(a)-xs(k))/len;
+            pose.block<4,1>(3,k) = slerp(poseRef.block<4,1>(3,a), poseRef.block<4,1>(3,a-1), t);
+        }
+
+        // positions
+        for (int r = 0; r < 3; r++)
+        {
+            for (int i = 0; i < nRef; i++)
+            {
+                yRef[i] = poseRef(r,i);
+            }
+            spline.setPoints(sRef,yRef.data(),nRef);
+            for (int k = 0; k < nTotal; k++)
+            {
+                pose(r,k) = spline(s(k));
+            }
+        }
+    }
+
+private:
+    int nInterp;
+    int nRefCapacity;
+    Eigen::VectorXd linspace;
+    Eigen::VectorXd zeroToOne;
+    Eigen::VectorXd xs;             // all points scaled to 0..1, ascending
+    std::vector<double> yRef;
+    CubicSpline spline;
+};
+
+// Dense output points the kinematics buffers are sized for at startup. A
+// solution with more points grows them (once).
+#define KINEMATICS_RESERVE_POINTS 300
+
+// everything one kinematics update produces
+struct KinematicsResult
+{
+    KinematicsResult() : nBackbone(0) {}
+
+    Eigen::Vector3d ptip;
+    Eigen::Vector4d qtip;
+    Eigen::Vector3d alpha;          // base rotations of the tubes
+    Matrix6d J;
+    Eigen::MatrixXd posedata;       // 8 x N interpolated backbone: p, q (wxyz), tube number (1 inner .. 3 outer)
+    Eigen::VectorXd s;              // arc length of each backbone point
+    int nBackbone;                  // backbone points N; posedata and s are reused and may be larger
+    int npts;                       // dense output points from the solver
+    double tSolve;                  // Kinematics_with_dense_output [s]
+    double tInterp;                 // backbone interpolation [s]
+};
+
+class CannulaKinematics
+{
+public:
+    CannulaKinematics(int nInterpPoints = 200)
+        : L(defaultTubeLengths()), cannula(makeCannula(L)), interpolator(nInterpPoints), nCapacity(0)
+    {
+        reserve(KINEMATICS_RESERVE_POINTS);
+    }
+
+    // tube lengths, inner to outer
+    Eigen::Vector3d tubeLengths() const { return L; }
+
+    // the ActiveCannulaRobot of hardware.xml whose tubes this class models
+    static const char *robotName() { return "endonasal_cannula"; }
+
+    // tube outer diameters, inner to outer
+    static Eigen::Vector3d tubeOuterDiameters()
+    {
+        Eigen::Vector3d od;
+        od << 1.165e-3, 2.0574e-3, 2.540e-3;
+        return od;
+    }
+
+    // Cannula starting configuration (home position)
+    static Configuration3 homeConfiguration()
+    {
+        Configuration3 qstart;
+        qstart.PsiL = Eigen::Vector3d::Zero();
+        qstart.Beta << -160e-3, -127.2e-3, -86.4e-3;
+        qstart.Ftip = Eigen::Vector3d::Zero();
+        qstart.Ttip = Eigen::Vector3d::Zero();
+        return qstart;
+    }
+
+    // Everything after the solver call works in preallocated buffers, so a
+    // compute() into the same result allocates nothing unless the solver
+    // returns more points than any call before.
+    void compute(const Configuration3 &q, KinematicsResult &out)
+    {
+        double tStart = monotonicSeconds();
+
+        // Run kinematics (the solver allocates its own dense output)
+        auto ret1 = [&]()
+        {
+            HotRegionExempt exempt;
+            return Kinematics_with_dense_output( cannula, q, OType() );
+        }();
+        out.tSolve = monotonicSeconds() - tStart;
+
+        // Pick out the body Jacobian relating actuation to tip position
+        out.J = CTR::GetTipJacobianForTube1(ret1.y_final);
+
+        // Pick out arc length points
+        int Npts = ret1.arc_length_points.size();
+        out.npts = Npts;
+        reserve(Npts);
+        double* ptr = &ret1.arc_length_points[0];
+        Eigen::Map<Eigen::VectorXd> s(ptr, Npts);
+        for (int i = 0; i<Npts; i++)
+        {
+            s_abs(i) = fabs(s(i));
+            s_ref(i) = s(Npts-i-1);
+        }
+
+        // Pick out pos & quat for each point expressed in the tip frame
+        for(int j = 0; j<Npts; j++){
+            double* p_ptr = &ret1.dense_state_output[j].p[0];
+            double* q_ptr = &ret1.dense_state_output[j].q[0];
+            double* psi_ptr = &ret1.dense_state_output[j].Psi[0];
+            Eigen::Map<Eigen::Vector3d> pj(p_ptr, 3);
+            Eigen::Map<Eigen::Vector4d> qj(q_ptr, 4);
+            Eigen::Map<Eigen::Vector3d> psij(psi_ptr,3);
+
+            pos.col(j) = pj;
+            quat.col(j) = qj;
+            psiangles.col(j) = psij;
+        };
+
+        int baseplateindex;
+        s_abs.head(Npts).minCoeff(&baseplateindex);
+
+        out.alpha << psiangles(0,baseplateindex), psiangles(1,baseplateindex), psiangles(2,baseplateindex);
+
+        // Now assemble a transformation matrix for the frame at s = 0 relative to the tip frame
+        Eigen::Matrix3d Rbt = quat2rotm(quat.col(Npts-1));  // orientation of the frame at s = 0 is same as at s = beta1;
+        Eigen::Matrix4d Tbt = assembleTransformation(Rbt,pos.col(Npts-1));
+
+        // Now transform each of our frames along the backbone to be expressed in the last frame,
+        // then shift them up by Beta[0] in z so that they are relative to the front plate
+        Eigen::Matrix<double,8,1> x;
+        for(int j = 0; j<Npts; j++){
+            Eigen::Matrix3d Rjt = quat2rotm(quat.col(Npts-j-1));
+            Eigen::Matrix4d Tjt = assembleTransformation(Rjt,pos.col(Npts-j-1));
+            Eigen::Matrix4d Tjb = inverseTransform(Tbt)*Tjt;
+            Eigen::Matrix<double,7,1> tjb = collapseTransform(Tjb);
+            // Append it with a flag corresponding to which tube it is a member of. For now, all get a 1.
+            x.fill(0);
+            x.head<7>() = tjb;
+            x(7) = 1.0;
+            posedata.col(j) = x;
+        };
+
+        // Interpolate points along the backbone
+        double tInterpStart = monotonicSeconds();
+        int nBackbone = interpolator.numPoints(Npts);
+        if (out.posedata.cols() < nBackbone)
+        {
+            out.posedata.resize(8,nBackbone);
+            out.s.resize(nBackbone);
+        }
+        interpolator.interpolate(s_ref.data(),posedata,Npts,out.s,out.posedata);
+        out.tInterp = monotonicSeconds() - tInterpStart;
+        out.nBackbone = nBackbone;
+        int lastPos = nBackbone-1;
+
+        // tip pose
+        out.ptip << out.posedata(0,lastPos), out.posedata(1,lastPos), out.posedata(2,lastPos);
+        out.qtip << out.posedata(3,lastPos), out.posedata(4,lastPos), out.posedata(5,lastPos), out.posedata(6,lastPos);
+
+        // choose color coding for each tube:
+        for(int j=0; j<=lastPos; j++)
+        {
+            if (q.Beta[1]>out.s[j] || L(1)+q.Beta[1]<out.s[j])
+            {
+                out.posedata(7,j) = 1; // inner tube - green
+            }
+            else if ((q.Beta[1]<=out.s[j] && q.Beta[2]>out.s[j]) || (L(2)+q.Beta[2]<out.s[j] && L(1)+q.Beta[1]>=out.s[j]))
+            {
+                out.posedata(7,j) = 2; // middle tube - red
+            }
+            else
+            {
+                out.posedata(7,j) = 3; // outer tube - blue
+            }
+        }
+    }
+
+private:
+    static Eigen::Vector3d defaultTubeLengths()
+    {
+        Eigen::Vector3d lengths;
+        lengths << 222.5e-3, 163e-3, 104.4e-3;
+        return lengths;
+    }
+
+    static CannulaT makeCannula(const Eigen::Vector3d &lengths)
+    {
+        using namespace CTR;
+        using namespace CTR::Functions;
+
+        // Curvature of each tube
+        CurvFun k_fun1( (1.0/63.5e-3)*Eigen::Vector2d::UnitX() );
+        CurvFun k_fun2( (1.0/51.2e-3)*Eigen::Vector2d::UnitX() );
+        CurvFun k_fun3( (1.0/71.4e-3)*Eigen::Vector2d::UnitX() );
+
+        // Material properties
+        double E = 60e9;
+        double G = 60e9 / 2.0 / 1.33;
+        // Tube 1 geometry
+        double L1 = lengths(0);
+        double Lt1 = L1 - 42.2e-3;
+        double OD1 = tubeOuterDiameters()(0);
+        double ID1 = 1.067e-3;
+        // Tube 2 geometry
+        double L2 = lengths(1);
+        double Lt2 = L2 - 38e-3;
+        double OD2 = tubeOuterDiameters()(1);
+        double ID2 = 1.6002e-3;
+        //Tube 3 geometry
+        double L3 = lengths(2);
+        double Lt3 = L3 - 21.4e-3;
+        double OD3 = tubeOuterDiameters()(2);
+        double ID3 = 2.2479e-3;
+
+        // Define tubes
+        // Inputs: make_annular_tube( L, Lt, OD, ID, k_fun, E, G );
+        Tube<CurvFun> T1 = make_annular_tube( L1, Lt1, OD1, ID1, k_fun1, E, G );
+        Tube<CurvFun> T2 = make_annular_tube( L2, Lt2, OD2, ID2, k_fun2, E, G );
+        Tube<CurvFun> T3 = make_annular_tube( L3, Lt3, OD3, ID3, k_fun3, E, G );
+
+        // Assemble cannula
+        return std::make_tuple( T1, T2, T3 );
+    }
+
+    // sizes the per-point buffers for nPoints solver points
+    void reserve(int nPoints)
+    {
+        if (nPoints <= nCapacity)
+        {
+            return;
+        }
+        nCapacity = nPoints;
+        s_abs.resize(nPoints);
+        s_ref.resize(nPoints);
+        pos.resize(3,nPoints);
+        quat.resize(4,nPoints);
+        psiangles.resize(3,nPoints);
+        posedata.resize(8,nPoints);
+        interpolator.reserve(nPoints);
+    }
+
+    Eigen::Vector3d L;
+    CannulaT cannula;
+    BackboneInterpolator interpolator;
+
+    // per solver point, reused every compute()
+    int nCapacity;
+    Eigen::VectorXd s_abs;
+    Eigen::VectorXd s_ref;          // arc lengths, base to tip
+    Eigen::MatrixXd pos;
+    Eigen::MatrixXd quat;
+    Eigen::MatrixXd psiangles;
+    Eigen::MatrixXd posedata;
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif // KINEMATICS_CORE_H
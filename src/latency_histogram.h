@@ -0,0 +1,71 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+/********************************************************************
+
+  latency_histogram.h
+
+Fixed-size latency histogram for the measurement tools
+(trace_collector, load_generator, the haptic bridge): adding a sample is a few
+instructions and never allocates, percentiles are read off the bins.
+
+********************************************************************/
+
+const double LATENCY_BIN_WIDTH = 1.0e-4;    // s
+
+// latencies [s] in 0.1 ms bins up to 100 ms, plus one overflow bin
+class LatencyHistogram
+{
+public:
+    enum { NUM_BINS = 1000 };
+
+    LatencyHistogram() { clear(); }
+
+    void clear()
+    {
+        for (int i = 0; i <= NUM_BINS; i++)
+        {
+            bins[i] = 0;
+        }
+        n = 0;
+        sum = 0.0;
+        max = 0.0;
+    }
+
+    void add(double dt)
+    {
+        int b = dt < 0.0 ? 0 : int(dt/LATENCY_BIN_WIDTH);
+        bins[b < NUM_BINS ? b : NUM_BINS]++;
+        n++;
+        sum += dt;
+        max = dt > max ? dt : max;
+    }
+
+    // upper edge of the bin holding the p-th fraction of samples (at most the maximum)
+    double percentile(double p) const
+    {
+        long target = long(p*n + 0.5);
+        long seen = 0;
+        for (int i = 0; i < NUM_BINS; i++)
+        {
+            seen += bins[i];
+            if (seen >= target)
+            {
+                return (i+1)*LATENCY_BIN_WIDTH < max ? (i+1)*LATENCY_BIN_WIDTH : max;
+            }
+        }
+        return max;
+    }
+
+    long count() const { return n; }
+    double mean() const { return n ? sum/n : 0.0; }
+    double maximum() const { return max; }
+
+private:
+    long bins[NUM_BINS+1];
+    long n;
+    double sum;
+    double max;
+};
+
+#endif // LATENCY_HISTOGRAM_H
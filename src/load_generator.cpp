@@ -0,0 +1,466 @@
+/********************************************************************
+
+  load_generator.cpp
+
+Synthetic load for the teleoperation nodes: publishes a stream of
+inputs at a fixed rate and measures how far each sample gets through
+the pipeline and how long it takes.
+
+~stream omni (default) stands in for omni_node: every sample goes out
+on Omnipos, Omnipos_stamped (trace id and send time) and Buttonstates,
+for resolved_rates (and from there kinematics). ~stream joint_q stands
+in for resolved_rates instead: every sample is a config3 on joint_q
+followed by rr_status (true), which lets kinematics solve again, for
+kinematics alone; do not run resolved_rates alongside.
+
+~trajectory is sinusoid (~frequency), random_walk (~walk_time,
+~seed) or recorded (~recording, looped), see input_trajectory.h.
+Omni samples move around ~center [mm] by ~amplitude [mm] and
+~rotation_amplitude [rad]; joint samples move PsiL and Beta around the
+home configuration of ResolvedRatesController by ~rotation_amplitude
+[rad] and ~translation_amplitude [m]. The Omni button is held at
+~button.
+
+Samples are sent at ~rate [Hz] for ~duration [s] (0: until shut down),
+on absolute CLOCK_MONOTONIC deadlines. Injected disturbances:
+    ~jitter         each send is delayed by a uniform random time in
+                    [0, jitter] [s]
+    ~burst_size     every ~burst_period [s], the next burst_size
+                    samples are held back and sent back to back when
+                    the last of them is due, as after a stalled link
+Neither changes the average rate. A send that starts more than one
+period after its deadline counts as late (the generator itself could
+not keep up).
+
+Measurement: every sample carries a trace id from ~trace_id_base up, so
+the trace events of the nodes (trace_events.h) tell where it went. A
+sample is settled ~settle_time [s] after it was sent; for each point
+along its path, it either reached the point (latency from the send,
+same clock) or it missed it:
+    rr_omni_receive     missed: dropped before resolved_rates' Omni
+                        callback (queue full)
+    rr_joint_publish    missed: superseded by a newer sample before a
+                        control cycle took it (expected above the
+                        control rate)
+    kin_joint_receive   missed: dropped in kinematics' joint_q queue
+                        (length 1) or superseded
+    kin_output_publish, rr_kin_receive, rr_encoder_publish: the sample
+                        was superseded further down
+    kinout_receive      kinematics_output back at the generator
+Every ~report_period [s] and at the end, the counts and the latency
+percentiles of each point are printed. The nodes need ~trace_events
+(on by default).
+
+********************************************************************/
+
+#include "resolved_rates_core.h"
+#include "flight_recorder.h"
+#include "trace_events.h"
+#include "latency_histogram.h"
+#include "input_trajectory.h"
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <geometry_msgs/Pose.h>
+#include <std_msgs/Bool.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/config3.h>
+#include <endonasal_teleop/kinout.h>
+#include <endonasal_teleop/stampedPose.h>
+#include <endonasal_teleop/traceEvent.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <time.h>
+
+/*******************************************************************************
+                MEASUREMENT
+********************************************************************************/
+
+// points along the path of a sample: the trace hops after omni_publish,
+// then kinematics_output received back here
+#define LOAD_KINOUT_RECEIVE NUM_TRACE_HOPS
+#define NUM_LOAD_POINTS (NUM_TRACE_HOPS+1)
+
+const char *loadPointName(int k)
+{
+    return k == LOAD_KINOUT_RECEIVE ? "kinout_receive" : traceHopNames[k];
+}
+
+struct SentSample
+{
+    uint64_t id;
+    double tSend;
+    double t[NUM_LOAD_POINTS];
+    unsigned seen;          // bit per point
+    bool open;
+};
+
+// Samples in flight, in a ring indexed by trace id. The callbacks (their
+// own spinner thread) fill in the points; the send loop settles the
+// samples in send order once they are old enough.
+class LoadTracker
+{
+public:
+    LoadTracker() : base(1), mask(0), nextSettle(1), settleTime(0.5), usedPoints(0) {}
+
+    void init(uint64_t idBase, size_t capacity, double settle, unsigned points)
+    {
+        size_t n = 1;
+        while (n < capacity)
+        {
+            n <<= 1;
+        }
+        ring.assign(n, SentSample());
+        for (size_t i = 0; i < n; i++)
+        {
+            ring[i].open = false;
+        }
+        mask = n - 1;
+        base = idBase;
+        nextSettle = idBase;
+        settleTime = settle;
+        usedPoints = points;
+        clear(true);
+    }
+
+    bool uses(int k) const { return (usedPoints >> k) & 1; }
+
+    // a sample leaves; settles the oldest one first if its slot is needed
+    void sent(uint64_t id, double t)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (id - nextSettle > mask)
+        {
+            settleOne();
+        }
+        SentSample &s = ring[(id - base) & mask];
+        s.id = id;
+        s.tSend = t;
+        s.seen = 0;
+        s.open = true;
+    }
+
+    // a sample reached point k at time t; the first time counts
+    void reached(uint64_t id, int k, double t)
+    {
+        if (id < base || k < 0 || k >= NUM_LOAD_POINTS)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        SentSample &s = ring[(id - base) & mask];
+        if (s.open && s.id == id && !((s.seen >> k) & 1))
+        {
+            s.seen |= 1u << k;
+            s.t[k] = t;
+        }
+    }
+
+    // settles the samples sent before now - settle time (all, with flush)
+    void settle(double now, uint64_t nextId, bool flush = false)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (nextSettle < nextId && (flush || ring[(nextSettle - base) & mask].tSend + settleTime <= now))
+        {
+            settleOne();
+        }
+    }
+
+    // interval (and with all, since startup) counts and histograms
+    void clear(bool all = false)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int k = 0; k < NUM_LOAD_POINTS; k++)
+        {
+            hist[k].clear();
+            missed[k] = 0;
+            if (all)
+            {
+                totalHist[k].clear();
+                totalMissed[k] = 0;
+            }
+        }
+        settled = 0;
+        if (all)
+        {
+            totalSettled = 0;
+        }
+    }
+
+    void print(const char *title, bool total)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const LatencyHistogram *h = total ? totalHist : hist;
+        const long *m = total ? totalMissed : missed;
+        printf("%s %ld samples settled\n", title, total ? totalSettled : settled);
+        printf("  %-20s %8s %8s %8s %8s %8s %8s %8s %8s\n", "since send [ms]", "reached", "missed",
+               "mean", "p50", "p90", "p99", "p99.9", "max");
+        for (int k = 1; k < NUM_LOAD_POINTS; k++)
+        {
+            if (!uses(k))
+            {
+                continue;
+            }
+            printf("  %-20s %8ld %8ld %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", loadPointName(k), h[k].count(), m[k],
+                   1e3*h[k].mean(), 1e3*h[k].percentile(0.5), 1e3*h[k].percentile(0.9), 1e3*h[k].percentile(0.99),
+                   1e3*h[k].percentile(0.999), 1e3*h[k].maximum());
+        }
+        fflush(stdout);
+    }
+
+private:
+    // with the mutex held
+    void settleOne()
+    {
+        SentSample &s = ring[(nextSettle - base) & mask];
+        if (s.open && s.id == nextSettle)
+        {
+            for (int k = 1; k < NUM_LOAD_POINTS; k++)
+            {
+                if (!uses(k))
+                {
+                    continue;
+                }
+                if ((s.seen >> k) & 1)
+                {
+                    hist[k].add(s.t[k] - s.tSend);
+                    totalHist[k].add(s.t[k] - s.tSend);
+                }
+                else
+                {
+                    missed[k]++;
+                    totalMissed[k]++;
+                }
+            }
+            s.open = false;
+            settled++;
+            totalSettled++;
+        }
+        nextSettle++;
+    }
+
+    std::mutex mutex;
+    std::vector<SentSample> ring;
+    uint64_t base;
+    uint64_t mask;
+    uint64_t nextSettle;
+    double settleTime;
+    unsigned usedPoints;
+
+    LatencyHistogram hist[NUM_LOAD_POINTS];
+    LatencyHistogram totalHist[NUM_LOAD_POINTS];
+    long missed[NUM_LOAD_POINTS];
+    long totalMissed[NUM_LOAD_POINTS];
+    long settled;
+    long totalSettled;
+};
+
+LoadTracker tracker;
+
+void traceCallback(const endonasal_teleop::traceEvent &msg)
+{
+    tracker.reached(msg.trace_id, msg.hop, msg.stamp.toSec());
+}
+
+void kinCallback(const endonasal_teleop::kinout &msg)
+{
+    tracker.reached(msg.trace_id, LOAD_KINOUT_RECEIVE, ros::Time::now().toSec());
+}
+
+void sleepUntil(double t)
+{
+    timespec deadline;
+    deadline.tv_sec = time_t(t);
+    deadline.tv_nsec = long((t - deadline.tv_sec)*1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) == EINTR)
+    {
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "load_generator");
+    ros::NodeHandle node;
+
+    std::string stream;
+    double rate, duration, jitter, burstPeriod, settleTime, reportPeriod;
+    int burstSize, idBase, seed;
+    ros::param::param<std::string>("~stream", stream, "omni");
+    ros::param::param<double>("~rate", rate, 1000.0);
+    ros::param::param<double>("~duration", duration, 30.0);
+    ros::param::param<double>("~jitter", jitter, 0.0);
+    ros::param::param<int>("~burst_size", burstSize, 0);
+    ros::param::param<double>("~burst_period", burstPeriod, 1.0);
+    ros::param::param<int>("~trace_id_base", idBase, 1 << 30);
+    ros::param::param<int>("~seed", seed, 1);
+    ros::param::param<double>("~settle_time", settleTime, 0.5);
+    ros::param::param<double>("~report_period", reportPeriod, 5.0);
+
+    bool omni = (stream != "joint_q");
+    InputTrajectory trajectory;
+    if (!trajectory.init(omni, ResolvedRatesController::homeConfiguration()))
+    {
+        return 1;
+    }
+    if (rate <= 0.0)
+    {
+        std::cerr << "~rate must be positive." << std::endl;
+        return 1;
+    }
+
+    // burst: the first burstSize samples of every burstEvery are released together
+    long burstEvery = std::max(1L, long(burstPeriod*rate + 0.5));
+    burstSize = std::max(0, int(std::min<long>(burstSize, burstEvery)));
+
+    // publishers
+    ros::Publisher omniPub, omniStampedPub, buttonPub, jointPub, statusPub;
+    if (omni)
+    {
+        omniPub = node.advertise<geometry_msgs::Pose>("Omnipos", 1000);
+        omniStampedPub = node.advertise<endonasal_teleop::stampedPose>("Omnipos_stamped", 1000);
+        buttonPub = node.advertise<std_msgs::Int8>("Buttonstates", 1000);
+    }
+    else
+    {
+        jointPub = node.advertise<endonasal_teleop::config3>("joint_q", 1000);
+        statusPub = node.advertise<std_msgs::Bool>("rr_status", 1000);
+    }
+
+    // measurement on a queue and thread of its own, so it does not delay the sends
+    unsigned points = (1u << endonasal_teleop::traceEvent::KIN_JOINT_RECEIVE) |
+                      (1u << endonasal_teleop::traceEvent::KIN_OUTPUT_PUBLISH) | (1u << LOAD_KINOUT_RECEIVE);
+    if (omni)
+    {
+        points |= (1u << endonasal_teleop::traceEvent::RR_OMNI_RECEIVE) |
+                  (1u << endonasal_teleop::traceEvent::RR_JOINT_PUBLISH) |
+                  (1u << endonasal_teleop::traceEvent::RR_KIN_RECEIVE) |
+                  (1u << endonasal_teleop::traceEvent::RR_ENCODER_PUBLISH);
+    }
+    tracker.init(uint64_t(idBase), size_t(2.0*rate*settleTime) + 2*burstSize + 1024, settleTime, points);
+
+    ros::NodeHandle measureNode;
+    ros::CallbackQueue measureQueue;
+    measureNode.setCallbackQueue(&measureQueue);
+    ros::Subscriber traceSub = measureNode.subscribe("trace_events", 10000, traceCallback);
+    ros::Subscriber kinSub = measureNode.subscribe("kinematics_output", 1000, kinCallback);
+    ros::AsyncSpinner measureSpinner(1, &measureQueue);
+    measureSpinner.start();
+
+    std::cout << "Sending " << (omni ? "Omnipos, Omnipos_stamped and Buttonstates" : "joint_q")
+              << " (" << trajectory.name() << ") at " << rate << " Hz";
+    if (jitter > 0.0)
+    {
+        std::cout << ", jitter up to " << 1e3*jitter << " ms";
+    }
+    if (burstSize > 1)
+    {
+        std::cout << ", bursts of " << burstSize << " every " << burstEvery/rate << " s";
+    }
+    std::cout << std::endl;
+
+    // give the subscribers time to connect
+    ros::WallDuration(1.0).sleep();
+
+/*******************************************************************************
+                SEND LOOP
+********************************************************************************/
+
+    std::mt19937 jitterRng(seed + 1);
+    std::uniform_real_distribution<double> jitterDist(0.0, std::max(jitter, 0.0));
+    InputSample s;
+    geometry_msgs::Pose poseMsg;
+    endonasal_teleop::stampedPose stampedMsg;
+    std_msgs::Int8 buttonMsg;
+    endonasal_teleop::config3 jointMsg;
+    std_msgs::Bool statusMsg;
+    statusMsg.data = true;
+
+    uint64_t nextId = uint64_t(idBase);
+    long nTotal = duration > 0.0 ? long(duration*rate + 0.5) : -1;
+    long nSent = 0, nLate = 0, intervalSent = 0, intervalLate = 0;
+    double t0 = monotonicSeconds() + 0.01;
+    double lastReport = t0;
+    for (long k = 0; ros::ok() && (nTotal < 0 || k < nTotal); k++)
+    {
+        double tNominal = k/rate;
+        long inBurst = k % burstEvery;
+        double tRelease = burstSize > 1 && inBurst < burstSize ? (k - inBurst + burstSize - 1)/rate : tNominal;
+        double deadline = t0 + tRelease + (jitter > 0.0 ? jitterDist(jitterRng) : 0.0);
+        sleepUntil(deadline);
+        double now = monotonicSeconds();
+        if (now - deadline > 1.0/rate)
+        {
+            nLate++;
+            intervalLate++;
+        }
+
+        trajectory.sample(tNominal, 1.0/rate, s);
+
+        uint64_t id = nextId++;
+        ros::Time stamp = ros::Time::now();
+        tracker.sent(id, stamp.toSec());
+        if (omni)
+        {
+            poseMsg.position.x = s.p[0];
+            poseMsg.position.y = s.p[1];
+            poseMsg.position.z = s.p[2];
+            poseMsg.orientation.w = s.q[0];
+            poseMsg.orientation.x = s.q[1];
+            poseMsg.orientation.y = s.q[2];
+            poseMsg.orientation.z = s.q[3];
+            buttonMsg.data = s.button;
+            stampedMsg.header.stamp = stamp;
+            stampedMsg.trace_id = id;
+            stampedMsg.pose = poseMsg;
+            buttonPub.publish(buttonMsg);
+            omniPub.publish(poseMsg);
+            omniStampedPub.publish(stampedMsg);
+        }
+        else
+        {
+            for (int i = 0; i < 12; i++)
+            {
+                jointMsg.joint_q[i] = s.joint_q[i];
+            }
+            jointMsg.trace_id = id;
+            jointPub.publish(jointMsg);
+            statusPub.publish(statusMsg);   // as resolved_rates after every joint_q
+        }
+        nSent++;
+        intervalSent++;
+
+        tracker.settle(ros::Time::now().toSec(), nextId);
+        if (reportPeriod > 0.0 && now - lastReport >= reportPeriod)
+        {
+            char title[96];
+            snprintf(title, sizeof(title), "Last %.1f s: %.1f samples/s sent, %ld late;",
+                     now - lastReport, intervalSent/(now - lastReport), intervalLate);
+            tracker.print(title, false);
+            tracker.clear();
+            intervalSent = 0;
+            intervalLate = 0;
+            lastReport = now;
+        }
+    }
+    double elapsed = monotonicSeconds() - t0;
+
+    // let the last samples arrive, then settle everything
+    ros::WallDuration(settleTime).sleep();
+    tracker.settle(ros::Time::now().toSec(), nextId, true);
+    measureSpinner.stop();
+
+    char title[96];
+    snprintf(title, sizeof(title), "Total: %ld samples in %.1f s (%.1f/s), %ld late;",
+             nSent, elapsed, nSent/std::max(elapsed, 1e-9), nLate);
+    tracker.print(title, true);
+
+    return 0;
+}
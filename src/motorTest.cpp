@@ -8,12 +8,19 @@
 #include "medlab_motor_control_board/McbEncoders.h"
 // %EndTag(MSG_HEADER)%
 
+#include "async_logger.h"
+
 int main(int argc, char **argv)
 {
   ros::init(argc, argv, "nodeCommandSender");
 
   ros::NodeHandle n;
 
+  // counts sent commands instead of printing every one from the 220 Hz loop
+  AsyncLogger logger;
+  logger.setCounterLabel(0, "encoder commands sent");
+  logger.run();
+
   ros::Publisher pubEncoderCommand = n.advertise<medlab_motor_control_board::McbEncoders>("encoder_command", 1);
 
   double amplitude = 10000.0;
@@ -33,7 +40,7 @@ int main(int argc, char **argv)
     enc.count[4] = (int)(amplitude*sin((2.0*M_PI*signal_hertz/loop_hertz)*count + 1.0)+amplitude+1000);
     enc.count[5] = (int)(amplitude*sin((2.0*M_PI*signal_hertz/loop_hertz)*count + 1.25)+amplitude+1000);
 
-    ROS_INFO("message sent");
+    logger.count(0);
 
     pubEncoderCommand.publish(enc);
 
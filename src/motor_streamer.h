@@ -0,0 +1,287 @@
+#ifndef MOTOR_STREAMER_H
+#define MOTOR_STREAMER_H
+
+/********************************************************************
+
+  motor_streamer.h
+
+Streams encoder commands to the motor control boards at the board rate
+(220 Hz) from setpoints that arrive at the control rate (100 Hz).
+
+Every axis follows its newest setpoint with limited velocity and
+acceleration. The velocity between the last two setpoints is fed
+forward, so a steadily moving joint is tracked without lag instead of
+as a staircase. A moving average over the jerk time turns the
+trapezoidal velocity profile into an S-curve, which limits the jerk to
+2*maxAcc/jerkTime.
+
+The streaming thread samples the trajectory at its own clock, rounds
+to counts and hands the commands for all boards (the counts vector of
+ActuatorMap) to the send function in one call, only when a count
+changed (or every keepAlive seconds, so a lost message is eventually
+repeated).
+
+********************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#define MOTOR_MAX_AXES 64
+
+#define MOTOR_MAX_SMOOTHING 32
+
+// one axis: acceleration-limited tracking followed by a moving average
+class InterpolatedAxis
+{
+public:
+    InterpolatedAxis() : maxVel(1e9), maxAcc(1e12), nAvg(1)
+    {
+        reset(0.0);
+    }
+
+    void setLimits(double vel, double acc)
+    {
+        maxVel = vel;
+        maxAcc = acc;
+    }
+
+    void setSmoothing(int n)
+    {
+        nAvg = std::max(1, std::min(n, MOTOR_MAX_SMOOTHING));
+        reset(p);
+    }
+
+    void reset(double p0)
+    {
+        p = p0;
+        v = 0.0;
+        for (int i = 0; i < MOTOR_MAX_SMOOTHING; i++)
+        {
+            hist[i] = p0;
+        }
+        sum = p0*nAvg;
+        head = 0;
+    }
+
+    // advance by dt towards target, which moves at targetVel
+    void step(double target, double targetVel, double dt)
+    {
+        double e = target - p;
+
+        // fastest approach speed from which we can still stop at the target
+        // in whole steps of dt at maxAcc
+        double vBrake = maxAcc*dt*(sqrt(0.25 + 2.0*fabs(e)/(maxAcc*dt*dt)) - 0.5);
+        double vDes = targetVel + (e > 0.0 ? vBrake : -vBrake);
+        vDes = std::max(-maxVel, std::min(maxVel, vDes));
+
+        v = std::max(v - maxAcc*dt, std::min(v + maxAcc*dt, vDes));
+        p += v*dt;
+
+        sum += p - hist[head];
+        hist[head] = p;
+        head = (head + 1) % nAvg;
+    }
+
+    double position() const { return sum/nAvg; }
+
+private:
+    double maxVel;
+    double maxAcc;
+    int nAvg;
+    double p;
+    double v;
+    double hist[MOTOR_MAX_SMOOTHING];
+    double sum;
+    int head;
+};
+
+class MotorStreamer
+{
+public:
+    // receives the counts of all axes together, and the tag of the newest setpoint
+    typedef std::function<void(const int *counts, uint64_t tag)> SendFunction;
+
+    MotorStreamer(int numAxes, double rate = 220.0, double jerkTime = 0.01, double keepAlive = 1.0)
+        : nAxes(std::max(0, std::min(numAxes, MOTOR_MAX_AXES))), rate(rate), keepAlive(keepAlive), running(false),
+          haveTarget(false), targetTag(0), targetStamp(0.0), prevStamp(0.0),
+          nSent(0), nTicks(0)
+    {
+        int n = int(jerkTime*rate + 0.5);
+        for (int i = 0; i < MOTOR_MAX_AXES; i++)
+        {
+            axes[i].setSmoothing(n);
+            target[i] = 0.0;
+            targetVel[i] = 0.0;
+            velLimit[i] = 1e9;
+            sent[i] = 0;
+        }
+    }
+
+    ~MotorStreamer() { stop(); }
+
+    // limits in counts/s and counts/s^2
+    void setLimits(int axis, double maxVel, double maxAcc)
+    {
+        axes[axis].setLimits(maxVel, maxAcc);
+        velLimit[axis] = maxVel;
+    }
+
+    // new setpoint from the control loop
+    void setTarget(const int *counts, uint64_t tag)
+    {
+        double now = seconds();
+        std::lock_guard<std::mutex> lock(targetMutex);
+        double dt = now - targetStamp;
+        for (int i = 0; i < nAxes; i++)
+        {
+            double t = counts[i];
+            double vel = 0.0;
+            // feed forward the setpoint velocity if setpoints are arriving steadily
+            if (haveTarget && dt > 0.0 && dt < 0.1)
+            {
+                vel = (t - target[i])/dt;
+                vel = std::max(-velLimit[i], std::min(velLimit[i], vel));
+            }
+            target[i] = t;
+            targetVel[i] = vel;
+        }
+        prevStamp = haveTarget ? targetStamp : now;
+        targetStamp = now;
+        targetTag = tag;
+        haveTarget = true;
+    }
+
+    void start(SendFunction fn)
+    {
+        if (running)
+        {
+            return;
+        }
+        send = fn;
+        running = true;
+        worker = std::thread(&MotorStreamer::run, this);
+    }
+
+    void stop()
+    {
+        if (!running)
+        {
+            return;
+        }
+        running = false;
+        worker.join();
+    }
+
+    int numAxes() const { return nAxes; }
+    long commandsSent() const { return nSent; }
+    long ticks() const { return nTicks; }
+
+private:
+    static double seconds()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void run()
+    {
+        std::chrono::steady_clock::duration period =
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0/rate));
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        bool started = false;
+        double lastSend = 0.0;
+        double dt = 1.0/rate;
+
+        while (running)
+        {
+            next += period;
+            double now = seconds();
+
+            double tgt[MOTOR_MAX_AXES];
+            double vel[MOTOR_MAX_AXES];
+            double stamp;
+            double horizon;
+            uint64_t tag;
+            bool have;
+            {
+                std::lock_guard<std::mutex> lock(targetMutex);
+                have = haveTarget;
+                for (int i = 0; i < nAxes; i++)
+                {
+                    tgt[i] = target[i];
+                    vel[i] = targetVel[i];
+                }
+                stamp = targetStamp;
+                horizon = targetStamp - prevStamp;
+                tag = targetTag;
+            }
+
+            if (have)
+            {
+                // extrapolate no further than one setpoint period
+                double ahead = std::max(0.0, std::min(now - stamp, horizon));
+
+                int enc[MOTOR_MAX_AXES];
+                bool changed = !started;
+                for (int i = 0; i < nAxes; i++)
+                {
+                    if (!started)
+                    {
+                        axes[i].reset(tgt[i]);
+                    }
+                    else
+                    {
+                        axes[i].step(tgt[i] + vel[i]*ahead, vel[i], dt);
+                    }
+                    enc[i] = int(lround(axes[i].position()));
+                    changed = changed || enc[i] != sent[i];
+                }
+                started = true;
+
+                if (changed || (keepAlive > 0.0 && now - lastSend >= keepAlive))
+                {
+                    send(enc, tag);
+                    for (int i = 0; i < nAxes; i++)
+                    {
+                        sent[i] = enc[i];
+                    }
+                    lastSend = now;
+                    nSent++;
+                }
+            }
+            nTicks++;
+
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    int nAxes;
+    double rate;
+    double keepAlive;
+    std::atomic<bool> running;
+    std::thread worker;
+    SendFunction send;
+
+    // setpoint, shared with the control loop
+    std::mutex targetMutex;
+    bool haveTarget;
+    double target[MOTOR_MAX_AXES];
+    double targetVel[MOTOR_MAX_AXES];
+    uint64_t targetTag;
+    double targetStamp;
+    double prevStamp;
+
+    // streaming thread only
+    InterpolatedAxis axes[MOTOR_MAX_AXES];
+    double velLimit[MOTOR_MAX_AXES];
+    int sent[MOTOR_MAX_AXES];
+    std::atomic<long> nSent;
+    std::atomic<long> nTicks;
+};
+
+#endif // MOTOR_STREAMER_H
@@ -0,0 +1,298 @@
+#ifndef OMNI_FILTER_H
+#define OMNI_FILTER_H
+
+/********************************************************************
+
+  omni_filter.h
+
+Input conditioning for the Omni pose: a One-Euro filter (Casiez et al.,
+CHI 2012) on the position and one on the orientation, each with the
+velocity estimate it adapts to.
+
+A One-Euro filter is a first-order low-pass whose cutoff rises with the
+filtered speed, cutoff = minCutoff + beta*|velocity|: at rest the low
+cutoff removes the encoder and quantization noise that would otherwise
+turn into joint motion, and when the stylus moves the cutoff goes up so
+the lag stays small. The velocity is itself low-passed at dCutoff.
+
+Filtering happens per sample, with the time between samples, so it runs
+at the input rate. The latency a filter adds is the delay with which it
+follows a steady motion, 1/(2*pi*cutoff) at its current cutoff. Its
+mean and maximum over the samples taken while the stylus moves (at rest
+there is nothing to lag behind) are kept with every sample.
+
+Units: position mm, velocity mm/s, angular velocity rad/s (Omni base
+frame), cutoffs Hz, position beta 1/mm, orientation beta 1/rad.
+
+********************************************************************/
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// speeds above which the latency statistics count a sample as moving
+const double OMNI_MOVING_SPEED = 5.0;           // mm/s
+const double OMNI_MOVING_ANGULAR_SPEED = 0.05;  // rad/s
+
+// smoothing factor of a first-order low-pass at cutoff [Hz] for a step of dt [s]
+inline double lowPassAlpha(double cutoff, double dt)
+{
+    double r = 2.0*M_PI*cutoff*dt;
+    return r/(r + 1.0);
+}
+
+struct OneEuroParams
+{
+    double minCutoff;   // Hz
+    double beta;        // cutoff increase per unit of speed
+    double dCutoff;     // velocity low-pass, Hz
+
+    OneEuroParams(double minCutoff = 1.0, double beta = 0.0, double dCutoff = 1.0)
+        : minCutoff(minCutoff), beta(beta), dCutoff(dCutoff)
+    {}
+};
+
+class OneEuroFilter3
+{
+public:
+    OneEuroFilter3(const OneEuroParams &p = OneEuroParams()) : params(p) { reset(); }
+
+    void setParams(const OneEuroParams &p) { params = p; }
+
+    void reset()
+    {
+        initialized = false;
+        x.fill(0);
+        xRaw.fill(0);
+        dx.fill(0);
+        cutoff = params.minCutoff;
+    }
+
+    const Eigen::Vector3d &update(const Eigen::Vector3d &raw, double dt)
+    {
+        if (!initialized)
+        {
+            x = raw;
+            xRaw = raw;
+            dx.fill(0);
+            cutoff = params.minCutoff;
+            initialized = true;
+        }
+        else if (dt > 0.0)
+        {
+            dx += lowPassAlpha(params.dCutoff, dt)*((raw - xRaw)/dt - dx);
+            cutoff = params.minCutoff + params.beta*dx.norm();
+            x += lowPassAlpha(cutoff, dt)*(raw - x);
+            xRaw = raw;
+        }
+        return x;
+    }
+
+    const Eigen::Vector3d &value() const { return x; }
+    const Eigen::Vector3d &velocity() const { return dx; }
+    double cutoffFrequency() const { return cutoff; }
+    double lag() const { return 1.0/(2.0*M_PI*cutoff); }
+
+private:
+    OneEuroParams params;
+    bool initialized;
+    Eigen::Vector3d x;
+    Eigen::Vector3d xRaw;   // previous sample
+    Eigen::Vector3d dx;
+    double cutoff;
+};
+
+// the same on the unit quaternion: the raw angular velocity is that of the
+// rotation from the previous sample to this one, and the low-pass step is
+// a slerp by alpha
+class OneEuroQuaternionFilter
+{
+public:
+    OneEuroQuaternionFilter(const OneEuroParams &p = OneEuroParams()) : params(p) { reset(); }
+
+    void setParams(const OneEuroParams &p) { params = p; }
+
+    void reset()
+    {
+        initialized = false;
+        q.setIdentity();
+        qRaw.setIdentity();
+        w.fill(0);
+        cutoff = params.minCutoff;
+    }
+
+    const Eigen::Quaterniond &update(const Eigen::Quaterniond &raw, double dt)
+    {
+        if (!initialized)
+        {
+            q = raw.normalized();
+            qRaw = q;
+            w.fill(0);
+            cutoff = params.minCutoff;
+            initialized = true;
+        }
+        else if (dt > 0.0)
+        {
+            // q and -q are the same orientation; take the one nearer the previous sample
+            Eigen::Quaterniond target = raw.normalized();
+            if (target.dot(qRaw) < 0.0)
+            {
+                target.coeffs() = -target.coeffs();
+            }
+            Eigen::AngleAxisd delta(target*qRaw.conjugate());
+            w += lowPassAlpha(params.dCutoff, dt)*(delta.angle()/dt*delta.axis() - w);
+            cutoff = params.minCutoff + params.beta*w.norm();
+            q = q.slerp(lowPassAlpha(cutoff, dt), target).normalized();
+            qRaw = target;
+        }
+        return q;
+    }
+
+    const Eigen::Quaterniond &value() const { return q; }
+    const Eigen::Vector3d &angularVelocity() const { return w; }
+    double cutoffFrequency() const { return cutoff; }
+    double lag() const { return 1.0/(2.0*M_PI*cutoff); }
+
+private:
+    OneEuroParams params;
+    bool initialized;
+    Eigen::Quaterniond q;
+    Eigen::Quaterniond qRaw;    // previous sample
+    Eigen::Vector3d w;
+    double cutoff;
+};
+
+struct OmniFilterParams
+{
+    bool enabled;               // false passes the raw pose on (velocities are still estimated)
+    OneEuroParams position;
+    OneEuroParams orientation;
+
+    OmniFilterParams()
+        : enabled(true), position(1.0, 0.1, 1.0), orientation(1.0, 5.0, 1.0)
+    {}
+};
+
+// one conditioned Omni sample, with the filter statistics up to it
+struct OmniInputSample
+{
+    OmniInputSample()
+        : stamp(0.0), traceId(0), linkDelay(0.0), linkJitter(0.0), samples(0), positionMoving(0), orientationMoving(0),
+          positionLag(0.0), orientationLag(0.0), positionLagSum(0.0), orientationLagSum(0.0),
+          positionLagMax(0.0), orientationLagMax(0.0)
+    {
+        rawPosition.fill(0);
+        position.fill(0);
+        velocity.fill(0);
+        rawOrientation << 1, 0, 0, 0;
+        orientation << 1, 0, 0, 0;
+        angularVelocity.fill(0);
+    }
+
+    double stamp;                       // receive time [s]
+    uint64_t traceId;                   // of the newest stamped sample
+    double linkDelay;                   // estimated transit time of the samples [s] (omni_predictor.h)
+    double linkJitter;                  // [s]
+    Eigen::Vector3d rawPosition;        // [mm]
+    Eigen::Vector4d rawOrientation;     // w x y z
+    Eigen::Vector3d position;           // filtered [mm]
+    Eigen::Vector4d orientation;        // filtered, w x y z
+    Eigen::Vector3d velocity;           // [mm/s]
+    Eigen::Vector3d angularVelocity;    // [rad/s]
+
+    long samples;                       // filtered so far
+    long positionMoving;                // of which moving
+    long orientationMoving;
+    double positionLag;                 // added by the filters at this sample [s]
+    double orientationLag;
+    double positionLagSum;              // over the moving samples so far [s]
+    double orientationLagSum;
+    double positionLagMax;
+    double orientationLagMax;
+};
+
+class OmniInputFilter
+{
+public:
+    OmniInputFilter(const OmniFilterParams &p = OmniFilterParams()) { setParams(p); }
+
+    void setParams(const OmniFilterParams &p)
+    {
+        params = p;
+        positionFilter.setParams(p.position);
+        orientationFilter.setParams(p.orientation);
+        reset();
+    }
+
+    void reset()
+    {
+        positionFilter.reset();
+        orientationFilter.reset();
+        out = OmniInputSample();
+    }
+
+    // Filters a pose received at time t [s]. Every Omni sample must come in
+    // once: a second copy counts as a sample without motion.
+    void update(double t, const Eigen::Vector3d &p, const Eigen::Vector4d &qwxyz)
+    {
+        double dt = out.samples > 0 ? t - out.stamp : 0.0;
+
+        const Eigen::Vector3d &pf = positionFilter.update(p, dt);
+        const Eigen::Quaterniond &qf = orientationFilter.update(Eigen::Quaterniond(qwxyz(0), qwxyz(1), qwxyz(2), qwxyz(3)), dt);
+
+        out.stamp = t;
+        out.rawPosition = p;
+        out.rawOrientation = qwxyz;
+        if (params.enabled)
+        {
+            out.position = pf;
+            out.orientation << qf.w(), qf.x(), qf.y(), qf.z();
+            out.positionLag = positionFilter.lag();
+            out.orientationLag = orientationFilter.lag();
+        }
+        else
+        {
+            out.position = p;
+            out.orientation = qwxyz;
+            out.positionLag = 0.0;
+            out.orientationLag = 0.0;
+        }
+        out.velocity = positionFilter.velocity();
+        out.angularVelocity = orientationFilter.angularVelocity();
+
+        out.samples++;
+        if (out.velocity.norm() > OMNI_MOVING_SPEED)
+        {
+            out.positionMoving++;
+            out.positionLagSum += out.positionLag;
+            out.positionLagMax = std::max(out.positionLagMax, out.positionLag);
+        }
+        if (out.angularVelocity.norm() > OMNI_MOVING_ANGULAR_SPEED)
+        {
+            out.orientationMoving++;
+            out.orientationLagSum += out.orientationLag;
+            out.orientationLagMax = std::max(out.orientationLagMax, out.orientationLag);
+        }
+    }
+
+    // the trace id and link estimates travel with the sample
+    void setTraceId(uint64_t id) { out.traceId = id; }
+    void setLinkDelay(double delay, double jitter)
+    {
+        out.linkDelay = delay;
+        out.linkJitter = jitter;
+    }
+
+    const OmniInputSample &sample() const { return out; }
+
+private:
+    OmniFilterParams params;
+    OneEuroFilter3 positionFilter;
+    OneEuroQuaternionFilter orientationFilter;
+    OmniInputSample out;
+};
+
+#endif // OMNI_FILTER_H
@@ -6,9 +6,10 @@
 #include <HDU\hduVector.h>
 #include <HDU\hduMatrix.h>
 #include "stdafx.h"
-#include "ros.h"
+#include "haptic_bridge.h"  // before windows.h, for winsock2
 #include <string>
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <map>
 #include <vector>
@@ -22,22 +23,17 @@
 #include "Windows.h"
 #include <mutex>
 
-// ROS messages
-#include <geometry_msgs/Twist.h>
-#include <geometry_msgs/Pose.h>
-#include <geometry_msgs/Vector3.h>
-#include "std_msgs/Int64.h"
-#include "std_msgs/Int32.h"
-#include "std_msgs/Int8.h"
-#include "std_msgs/String.h"
-
 using namespace std;
-using namespace ros;
 using std::string;
 
+// ROS side: haptic_udp_receiver on the ROS master. HAPTIC_BRIDGE_HOST and
+// HAPTIC_BRIDGE_PORT in the environment override the address and port
+// (e.g. the right arm's receiver in bimanual.launch listens on 9871).
+const char *default_ros_host = "192.168.0.1";
+
 double position[3] = { 2, 2, 2 };
 double transform[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-double quaternion[4] = { 0, 0, 0, 0 };
+bool device_error = false;
 int force_flag = 1;
 int button1_int;
 int switch1_int;
@@ -62,28 +58,37 @@ HDfloat currentForce[3] = { 0, 0, 0 };
 
 LARGE_INTEGER starttime, Frequency, endtime, elapsedtime;
 
-HHD hHD;
-HHD hHD1;
+HHD hHD = HD_INVALID_HANDLE;
+HHD hHD1 = HD_INVALID_HANDLE;
+
+// Stops the scheduler and releases the device, if one is open.
+void close_haptic_device()
+{
+	if (hHD == HD_INVALID_HANDLE) { return; }
+
+	hdStopScheduler();
+	hdDisableDevice(hHD);
+	hHD = HD_INVALID_HANDLE;
+	hHD1 = HD_INVALID_HANDLE;
+}
 
-void init_haptic_device()
+// (Re)starts the device and the scheduler. On an OpenHaptics error,
+// returns false with its description in error_text.
+bool init_haptic_device(std::string &error_text)
 {
+	close_haptic_device();
+
 	hHD = hdInitDevice(HD_DEFAULT_DEVICE);
 	HDErrorInfo error;
 	error = hdGetError();
 
 	if (HD_DEVICE_ERROR(error))  // checking the device status
 	{
-		string sss = hdGetErrorString(error.errorCode);
-		printline();
-		std::cout << "Error in device initialization. \n\n";
-		std::cout << sss << "\n\n";
-	}
-	else
-	{
+		error_text = std::string("Error in device initialization: ") + hdGetErrorString(error.errorCode);
 		printline();
-		if (launches < 1) { std::cout << "Device Successfully Connected and Initialized. \nPhantom Omni should now be reading and writing ROS messages.\n\n"; }
-		else { std::cout << "Device will now restart...\n\n" << "Restart Number " << launches << " completed sucessfully. \nPhantom Omni should now be reading and writing ROS messages.\n\n"; }
-		launches++;
+		std::cout << error_text << "\n\n";
+		hHD = HD_INVALID_HANDLE;
+		return false;
 	}
 
 	hdEnable(HD_FORCE_OUTPUT); // enable force output
@@ -94,121 +99,151 @@ void init_haptic_device()
 	else { printline();  std::cout << "An error has been encountered when enabling forces. \n" << std::endl;}
 
 	hdStartScheduler();
+	error = hdGetError();
 
-	HHD hHD1 = hdGetCurrentDevice();
-}
-
-HDCallbackCode HDCALLBACK DeviceStateCallback(void *pUserdata)
-{
-	try
+	if (HD_DEVICE_ERROR(error))  // checking the scheduler
 	{
-		int nButtons = 0;
+		error_text = std::string("Error in starting the scheduler: ") + hdGetErrorString(error.errorCode);
+		printline();
+		std::cout << error_text << "\n\n";
+		hdDisableDevice(hHD);
+		hHD = HD_INVALID_HANDLE;
+		return false;
+	}
 
-		hdBeginFrame(hHD1);
+	hHD1 = hdGetCurrentDevice();
 
-		hdSetFloatv(HD_CURRENT_FORCE, currentForce);
-		
-		hdGetBooleanv(HD_CURRENT_SAFETY_SWITCH, &omniDeviceData.switch1);
+	printline();
+	if (launches < 1) { std::cout << "Device Successfully Connected and Initialized. \nPhantom Omni should now be sending poses to the ROS side.\n\n"; }
+	else { std::cout << "Device will now restart...\n\n" << "Restart Number " << launches << " completed sucessfully. \nPhantom Omni should now be sending poses to the ROS side.\n\n"; }
+	launches++;
+	return true;
+}
 
-		hdGetIntegerv(HD_CURRENT_BUTTONS, &nButtons);
+HDCallbackCode HDCALLBACK DeviceStateCallback(void *pUserdata)
+{
+	int nButtons = 0;
 
-		omniDeviceData.button1 =
-			(nButtons & HD_DEVICE_BUTTON_4) ? HD_TRUE : HD_FALSE;
+	hdBeginFrame(hHD1);
 
-		hdGetDoublev(HD_CURRENT_POSITION, position);
-		hdGetDoublev(HD_CURRENT_TRANSFORM, transform);
+	hdSetFloatv(HD_CURRENT_FORCE, currentForce);
+	
+	hdGetBooleanv(HD_CURRENT_SAFETY_SWITCH, &omniDeviceData.switch1);
 
-		hdEndFrame(hHD1);
+	hdGetIntegerv(HD_CURRENT_BUTTONS, &nButtons);
 
-		// Convert from matrix to quaternion
+	omniDeviceData.button1 =
+		(nButtons & HD_DEVICE_BUTTON_4) ? HD_TRUE : HD_FALSE;
 
-		double R00 = transform[0]; double R01 = transform[1]; double R02 = transform[2];
-		double R10 = transform[4]; double R11 = transform[5]; double R12 = transform[6];
-		double R20 = transform[8]; double R21 = transform[9]; double R22 = transform[10];
+	hdGetDoublev(HD_CURRENT_POSITION, position);
+	hdGetDoublev(HD_CURRENT_TRANSFORM, transform);
 
-		quaternion[3] = 0.5*sqrt(1 + R00 + R11 + R22);
-		quaternion[0] = (R21 - R12) / (4 * quaternion[3]);
-		quaternion[1] = (R02 - R20) / (4 * quaternion[3]);
-		quaternion[2] = (R10 - R01) / (4 * quaternion[3]);
+	hdEndFrame(hHD1);
 
-		HDErrorInfo error;
-		error = hdGetError();
+	HDErrorInfo error;
+	error = hdGetError();
 
-		if (HD_DEVICE_ERROR(error))  // checking the device status
-		{
-			printline();
-			std::cout << "An exception has occurred in communication with the Omni Controller. \nAn error from the controller API follows...\n\n";
-			std::string sss = hdGetErrorString(error.errorCode);
-			std::cout << sss << "\n\n";
-			throw 1;
-		}
-	}
-	catch (int param)
+	if (HD_DEVICE_ERROR(error))  // checking the device status
 	{
-		init_haptic_device();
+		printline();
+		std::cout << "An exception has occurred in communication with the Omni Controller. \nAn error from the controller API follows...\n\n";
+		std::string sss = hdGetErrorString(error.errorCode);
+		std::cout << sss << "\n\n";
+		device_error = true;
 	}
 
 	return HD_CALLBACK_DONE;
 
 }
 
-void force_callback(const geometry_msgs::Vector3 & force_information)
+// The Omni behind the haptic bridge: the bridge (haptic_bridge.h) does
+// the pose conversion, rate limiting and the UDP link to the ROS side.
+class OmniDevice : public HapticDevice
 {
-	// Set file global to the current subscribed force.
-	currentForce[0] = force_information.x;
-	currentForce[1] = force_information.y;
-	currentForce[2] = force_information.z;
+public:
+	bool open(std::string &error)
+	{
+		return init_haptic_device(error);
+	}
 
-	return;
+	bool frame(const double force[3], HapticDeviceState &state)
+	{
+		// Set file global to the current commanded force.
+		currentForce[0] = HDfloat(force[0]);
+		currentForce[1] = HDfloat(force[1]);
+		currentForce[2] = HDfloat(force[2]);
+
+		device_error = false;
+		hdScheduleSynchronous(DeviceStateCallback, (void*)0, HD_DEFAULT_SCHEDULER_PRIORITY);
+
+		for (int i = 0; i < 3; i++) { state.position[i] = position[i]; }
+		for (int i = 0; i < 16; i++) { state.transform[i] = transform[i]; }
+
+		// There's some nonsense going on here, but it works...
+		switch1_int = omniDeviceData.switch1 + '0' - 48;
+		state.buttons = switch1_int;
+
+		return !device_error;
+	}
+
+	// hdScheduleSynchronous waits for the servo loop
+	bool paced() const { return true; }
 
+	void close() { close_haptic_device(); }
+};
+
+// Opens the Omni, retrying every second until it starts.
+void open_omni(OmniDevice &omni)
+{
+	std::string error;
+	while (!omni.open(error))
+	{
+		std::cout << "Retrying in 1 s.\n\n";
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
 }
 
 int _tmain(int argc, _TCHAR * argv[])
 {
-	// ROS node initialization
-	NodeHandle nh;
-	char *ros_master = "192.168.0.1";
-	printline();
-	printf("Connecting to server at %s\n\n", ros_master);
-	nh.initNode(ros_master);
-
-	// Setting up publishers
-	std_msgs::Int8 button_msg;
-	Publisher button_state_pub("Buttonstates", &button_msg);
-	nh.advertise(button_state_pub);
+	const char *ros_host = getenv("HAPTIC_BRIDGE_HOST");
+	if (!ros_host || !*ros_host) { ros_host = default_ros_host; }
+	const char *ros_port_env = getenv("HAPTIC_BRIDGE_PORT");
+	int ros_port = (ros_port_env && *ros_port_env) ? atoi(ros_port_env) : HAPTIC_DEFAULT_PORT;
 
-	geometry_msgs::Pose ROS_pos;
-	Publisher omni_position_pub ("Omnipos", &ROS_pos); // this publishes the ROS_pos messages to the Omnipos topic
-	nh.advertise(omni_position_pub);
+	std::string error;
+	HapticUdpSocket socket;
+	printline();
+	printf("Sending to the ROS side at %s:%d\n\n", ros_host, ros_port);
+	if (ros_port <= 0 || ros_port > 65535)
+	{
+		std::cout << "HAPTIC_BRIDGE_PORT is not a port: " << ros_port_env << "\n\n";
+		return 1;
+	}
+	if (!socket.open(0, error) || !socket.setPeer(ros_host, uint16_t(ros_port), error))
+	{
+		std::cout << error << "\n\n";
+		return 1;
+	}
 
-	// Setting up subscriber 
-	ros::Subscriber<geometry_msgs::Vector3> omni_force_sub("Omniforce", &force_callback);
-	nh.subscribe(omni_force_sub);
-	nh.subscribe(omni_force_sub);
+	OmniDevice omni;
+	open_omni(omni);
 
-	init_haptic_device();
+	HapticBridge bridge(omni, socket);
+	double last_report = 0.0;
 
 	while (1){
 		
-		hdScheduleSynchronous(DeviceStateCallback, (void*)0, HD_DEFAULT_SCHEDULER_PRIORITY);
-
-		// Prepare twist to be sent to omnipos topic through rosserial
-		ROS_pos.position.x = position[0];
-		ROS_pos.position.y = position[1];
-		ROS_pos.position.z = position[2];
-		ROS_pos.orientation.x = quaternion[0];
-		ROS_pos.orientation.y = quaternion[1];
-		ROS_pos.orientation.z = quaternion[2];
-		ROS_pos.orientation.w = quaternion[3];
-
-		// There's some nonsense going on here, but it works...
-		switch1_int = omniDeviceData.switch1 + '0' - 48;
-		button_msg.data = switch1_int;
+		if (!bridge.step())
+		{
+			open_omni(omni);
+		}
 
-		// Publish to the ROS network
-		button_state_pub.publish(&button_msg);
-		omni_position_pub.publish(&ROS_pos);
-		nh.spinOnce();
+		double t = bridge.seconds();
+		if (t - last_report >= 10.0)
+		{
+			bridge.report(stdout, "omni_node", t - last_report);
+			last_report = t;
+		}
 	}
 
 	return 0;
@@ -0,0 +1,228 @@
+#ifndef OMNI_PREDICTOR_H
+#define OMNI_PREDICTOR_H
+
+/********************************************************************
+
+  omni_predictor.h
+
+Receive-side prediction of the Omni pose across the rosserial link.
+omni_node stamps every Omnipos_stamped sample with its (synchronized)
+ROS time when it is sent; the receiver measures the transit time of
+each sample:
+
+  - LinkDelayEstimator keeps a running estimate of the one-way delay and
+    of its jitter (the RFC 3550 interarrival jitter, the mean variation
+    of the transit time from one sample to the next, which does not
+    depend on the clock offset between the two machines).
+  - OmniPredictor, called by the control loop, takes the newest filtered
+    sample (omni_filter.h) and extrapolates it with its velocity
+    estimates to the current time: the horizon is the estimated delay
+    plus the time since the sample was received, times the horizon
+    scale, and never more than the maximum horizon.
+
+Accuracy is measured as the samples that were predicted come in: each
+prediction is compared with the raw pose actually taken at its target
+time (interpolated between the two samples around it), as is the pose
+the controller would have used without prediction. The RMS of both is
+kept, so a horizon that does more harm than good shows up directly.
+
+Times are in seconds on the receiver's monotonic clock, positions in mm.
+
+********************************************************************/
+
+#include "omni_filter.h"
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+
+// gain of the running delay and jitter estimates (1/16, as RFC 3550)
+const double LINK_ESTIMATE_GAIN = 1.0/16.0;
+
+class LinkDelayEstimator
+{
+public:
+    LinkDelayEstimator() { reset(); }
+
+    void reset()
+    {
+        n = 0;
+        transitPrev = 0.0;
+        delayEst = 0.0;
+        jitterEst = 0.0;
+    }
+
+    // transit = receive time - send stamp of one sample [s]
+    void update(double transit)
+    {
+        if (n == 0)
+        {
+            delayEst = transit;
+        }
+        else
+        {
+            delayEst += LINK_ESTIMATE_GAIN*(transit - delayEst);
+            jitterEst += LINK_ESTIMATE_GAIN*(fabs(transit - transitPrev) - jitterEst);
+        }
+        transitPrev = transit;
+        n++;
+    }
+
+    // a clock offset between the machines can make the transit negative
+    double delay() const { return std::max(0.0, delayEst); }
+    double jitter() const { return jitterEst; }
+    long samples() const { return n; }
+
+private:
+    long n;
+    double transitPrev;
+    double delayEst;
+    double jitterEst;
+};
+
+struct OmniPredictorParams
+{
+    bool enabled;           // false uses the newest sample as it is (accuracy is still measured)
+    double maxHorizon;      // [s]
+    double horizonScale;    // fraction of the sample age that is predicted
+
+    OmniPredictorParams() : enabled(true), maxHorizon(0.05), horizonScale(1.0) {}
+};
+
+struct OmniPredictionStats
+{
+    OmniPredictionStats()
+        : predictions(0), horizonSum(0.0), evaluated(0),
+          positionSqError(0.0), positionSqErrorHold(0.0), angleSqError(0.0), angleSqErrorHold(0.0)
+    {}
+
+    long predictions;
+    double horizonSum;              // [s]
+    long evaluated;                 // predictions compared with the actual pose
+    double positionSqError;         // sums of squares over the evaluated predictions [mm^2]
+    double positionSqErrorHold;     // the same without prediction
+    double angleSqError;            // [rad^2]
+    double angleSqErrorHold;
+};
+
+class OmniPredictor
+{
+public:
+    enum { MAX_PENDING = 64 };
+
+    OmniPredictor(const OmniPredictorParams &p = OmniPredictorParams()) : params(p) { reset(); }
+
+    void setParams(const OmniPredictorParams &p) { params = p; }
+
+    void reset()
+    {
+        head = 0;
+        count = 0;
+        lastSamples = 0;
+        havePrev = false;
+        stats = OmniPredictionStats();
+    }
+
+    // Pose of the operator at time now from the newest sample s (position
+    // in mm, quaternion w x y z). Returns the horizon used.
+    double predict(const OmniInputSample &s, double now, Eigen::Vector3d &p, Eigen::Vector4d &q)
+    {
+        // when the operator's hand was where the sample says
+        double tSample = s.stamp - s.linkDelay;
+        if (s.samples != lastSamples)
+        {
+            evaluate(s, tSample);
+            lastSamples = s.samples;
+        }
+
+        double h = 0.0;
+        if (params.enabled)
+        {
+            h = std::max(0.0, std::min(params.horizonScale*(now - tSample), params.maxHorizon));
+        }
+        p = s.position + h*s.velocity;
+
+        Eigen::Quaterniond qs(s.orientation(0), s.orientation(1), s.orientation(2), s.orientation(3));
+        Eigen::Quaterniond qp = qs;
+        double angle = h*s.angularVelocity.norm();
+        if (angle > 0.0)
+        {
+            // angular velocity is in the base frame
+            qp = (Eigen::Quaterniond(Eigen::AngleAxisd(angle, s.angularVelocity.normalized()))*qs).normalized();
+        }
+        q << qp.w(), qp.x(), qp.y(), qp.z();
+
+        Pending &pd = pending[(head + count) % MAX_PENDING];
+        if (count == MAX_PENDING)
+        {
+            head = (head + 1) % MAX_PENDING;
+        }
+        else
+        {
+            count++;
+        }
+        pd.target = now;
+        pd.position = p;
+        pd.orientation = qp;
+        pd.positionHold = s.position;
+        pd.orientationHold = qs;
+
+        stats.predictions++;
+        stats.horizonSum += h;
+        return h;
+    }
+
+    const OmniPredictionStats &statistics() const { return stats; }
+
+private:
+    struct Pending
+    {
+        double target;
+        Eigen::Vector3d position;
+        Eigen::Quaterniond orientation;
+        Eigen::Vector3d positionHold;
+        Eigen::Quaterniond orientationHold;
+    };
+
+    // scores the predictions whose target time lies between the previous sample and this one
+    void evaluate(const OmniInputSample &s, double tSample)
+    {
+        Eigen::Quaterniond qRaw(s.rawOrientation(0), s.rawOrientation(1), s.rawOrientation(2), s.rawOrientation(3));
+        while (count > 0 && havePrev && pending[head].target <= tSample)
+        {
+            const Pending &pd = pending[head];
+            if (pd.target >= tPrev && tSample > tPrev)
+            {
+                double f = (pd.target - tPrev)/(tSample - tPrev);
+                Eigen::Vector3d pActual = pPrev + f*(s.rawPosition - pPrev);
+                Eigen::Quaterniond qActual = qPrev.slerp(f, qRaw);
+                stats.positionSqError += (pd.position - pActual).squaredNorm();
+                stats.positionSqErrorHold += (pd.positionHold - pActual).squaredNorm();
+                stats.angleSqError += pow(pd.orientation.angularDistance(qActual), 2);
+                stats.angleSqErrorHold += pow(pd.orientationHold.angularDistance(qActual), 2);
+                stats.evaluated++;
+            }
+            head = (head + 1) % MAX_PENDING;
+            count--;
+        }
+        tPrev = tSample;
+        pPrev = s.rawPosition;
+        qPrev = qRaw;
+        havePrev = true;
+    }
+
+    OmniPredictorParams params;
+    Pending pending[MAX_PENDING];
+    int head;
+    int count;
+    long lastSamples;
+    bool havePrev;
+    double tPrev;
+    Eigen::Vector3d pPrev;
+    Eigen::Quaterniond qPrev;
+    OmniPredictionStats stats;
+};
+
+#endif // OMNI_PREDICTOR_H
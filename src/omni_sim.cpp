@@ -0,0 +1,360 @@
+/********************************************************************
+
+  omni_sim.cpp
+
+Simulated Omni for running the whole pipeline on one Linux machine,
+without the device, OpenHaptics or the Windows machine of omni_node.
+Publishes what omni_node does, Omnipos, Omnipos_stamped (trace id and
+sample time) and Buttonstates, at ~rate (1000 Hz), and takes the force
+commands on Omniforce.
+
+The operator's hand follows ~trajectory: sinusoid, random_walk or
+recorded, with the parameters of input_trajectory.h (as for
+load_generator), or mouse. With mouse, the hand moves with the mouse
+(~mouse_device, default /dev/input/mice, needs read access) by
+~mouse_scale [mm/count], in x and y, or in x and z while the right
+button is held, within ~mouse_range [mm] of ~center; the left button
+is the Omni button.
+
+Device model:
+  - the stylus is held with a stiffness of ~hand_stiffness [N/mm], so
+    the commanded force, clamped to ~max_force [N], pushes it off the
+    hand by force/stiffness, ~force_latency [s] after the command came
+  - the position gets Gaussian noise of ~position_noise [mm] and is
+    quantized to ~position_resolution [mm] (encoder steps); the
+    orientation is turned by a random rotation of ~orientation_noise
+    [rad] per axis
+  - every sample is stamped when it is taken and published in the
+    first cycle ~latency [s] plus up to ~latency_jitter [s] (uniform)
+    later, in order, like samples crossing the rosserial link; resolved_rates measures that
+    delay from the stamps (omni_predictor.h)
+
+The loop runs on absolute deadlines (realtime.h; ~realtime and the
+other profile parameters apply). Every ~report_period [s] and at
+shutdown it prints the achieved rate, the jitter of the loop and the
+force commands received.
+
+********************************************************************/
+
+#include "input_trajectory.h"
+#include "realtime.h"
+#include "flight_recorder.h"
+
+#include <ros/ros.h>
+#include <geometry_msgs/Pose.h>
+#include <geometry_msgs/Vector3.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/stampedPose.h>
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// relative motion and buttons of a mouse, from the 3-byte PS/2 packets
+// of /dev/input/mice
+class MouseInput
+{
+public:
+    MouseInput() : fd(-1), buttons(0)
+    {
+        offset.setZero();
+    }
+
+    ~MouseInput()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    bool open(const std::string &device)
+    {
+        fd = ::open(device.c_str(), O_RDONLY | O_NONBLOCK);
+        return fd >= 0;
+    }
+
+    // reads the pending packets without blocking
+    void poll(double scale, double range)
+    {
+        unsigned char packet[3];
+        while (fd >= 0 && read(fd, packet, sizeof(packet)) == sizeof(packet))
+        {
+            buttons = packet[0] & 0x07;
+            int dx = int(packet[1]) - ((packet[0] & 0x10) ? 256 : 0);
+            int dy = int(packet[2]) - ((packet[0] & 0x20) ? 256 : 0);
+            offset(0) += scale*dx;
+            offset((buttons & 0x02) ? 2 : 1) += scale*dy;
+            for (int i = 0; i < 3; i++)
+            {
+                offset(i) = std::max(-range, std::min(range, offset(i)));
+            }
+        }
+    }
+
+    // hand position around center, identity orientation, left button
+    void sample(const Eigen::Vector3d &center, InputSample &s) const
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            s.p[i] = center(i) + offset(i);
+        }
+        s.q[0] = 1.0;
+        s.q[1] = s.q[2] = s.q[3] = 0.0;
+        s.button = buttons & 0x01;
+    }
+
+private:
+    int fd;
+    int buttons;
+    Eigen::Vector3d offset;     // [mm]
+};
+
+// force commands, applied after the force latency
+struct ForceCommand
+{
+    double t;
+    Eigen::Vector3d f;
+};
+
+#define FORCE_QUEUE_SIZE 256
+
+ForceCommand forceQueue[FORCE_QUEUE_SIZE];
+long forceWritten = 0;
+long forceRead = 0;
+long forceIntervalCount = 0;
+double forceIntervalSum = 0.0;
+double forceIntervalMax = 0.0;
+
+void forceCallback(const geometry_msgs::Vector3 &msg)
+{
+    ForceCommand &c = forceQueue[forceWritten % FORCE_QUEUE_SIZE];
+    c.t = monotonicSeconds();
+    c.f << msg.x, msg.y, msg.z;
+    forceWritten++;
+    if (forceWritten - forceRead > FORCE_QUEUE_SIZE)
+    {
+        forceRead = forceWritten - FORCE_QUEUE_SIZE;
+    }
+
+    double norm = c.f.norm();
+    forceIntervalCount++;
+    forceIntervalSum += norm;
+    forceIntervalMax = std::max(forceIntervalMax, norm);
+}
+
+// a sample on its way over the simulated link
+struct LinkSample
+{
+    double release;
+    ros::Time stamp;
+    geometry_msgs::Pose pose;
+    int button;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "omni_sim");
+    ros::NodeHandle node;
+
+    std::string trajectoryName, mouseDevice;
+    double rate, reportPeriod, mouseScale, mouseRange;
+    double handStiffness, maxForce, forceLatency, positionNoise, positionResolution, orientationNoise;
+    double latency, latencyJitter;
+    int seed;
+    std::vector<double> center;
+    ros::param::param<double>("~rate", rate, 1000.0);
+    ros::param::param<double>("~report_period", reportPeriod, 5.0);
+    ros::param::param<std::string>("~trajectory", trajectoryName, "sinusoid");
+    ros::param::param<std::string>("~mouse_device", mouseDevice, "/dev/input/mice");
+    ros::param::param<double>("~mouse_scale", mouseScale, 0.1);
+    ros::param::param<double>("~mouse_range", mouseRange, 100.0);
+    ros::param::param<std::vector<double> >("~center", center, {0.0, 0.0, 0.0});
+    ros::param::param<double>("~hand_stiffness", handStiffness, 0.5);
+    ros::param::param<double>("~max_force", maxForce, 3.3);
+    ros::param::param<double>("~force_latency", forceLatency, 1.0e-3);
+    ros::param::param<double>("~position_noise", positionNoise, 0.01);
+    ros::param::param<double>("~position_resolution", positionResolution, 0.055);
+    ros::param::param<double>("~orientation_noise", orientationNoise, 1.0e-3);
+    ros::param::param<double>("~latency", latency, 1.0e-3);
+    ros::param::param<double>("~latency_jitter", latencyJitter, 0.5e-3);
+    ros::param::param<int>("~seed", seed, 1);
+    if (rate <= 0.0 || handStiffness <= 0.0)
+    {
+        std::cerr << "~rate and ~hand_stiffness must be positive." << std::endl;
+        return 1;
+    }
+    Eigen::Vector3d handCenter = center.size() == 3 ? Eigen::Vector3d(center[0], center[1], center[2]) : Eigen::Vector3d::Zero();
+
+    bool useMouse = (trajectoryName == "mouse");
+    MouseInput mouse;
+    InputTrajectory trajectory;
+    if (useMouse)
+    {
+        if (!mouse.open(mouseDevice))
+        {
+            std::cerr << "Could not open " << mouseDevice << " (read access to the input devices is needed)." << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        Configuration3 noJoints;    // Omni samples only
+        noJoints.PsiL = noJoints.Beta = noJoints.Ftip = noJoints.Ttip = Eigen::Vector3d::Zero();
+        if (!trajectory.init(true, noJoints))
+        {
+            return 1;
+        }
+    }
+
+    ros::Publisher buttonPub = node.advertise<std_msgs::Int8>("Buttonstates", 100);
+    ros::Publisher omniPub = node.advertise<geometry_msgs::Pose>("Omnipos", 100);
+    ros::Publisher omniStampedPub = node.advertise<endonasal_teleop::stampedPose>("Omnipos_stamped", 100);
+    ros::Subscriber forceSub = node.subscribe("Omniforce", 100, forceCallback);
+
+    // the link holds the samples of latency + jitter, plus some slack
+    std::vector<LinkSample> linkQueue(size_t(rate*(latency + latencyJitter)) + 64);
+    long linkWritten = 0, linkRead = 0;
+    double lastRelease = 0.0;
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::uniform_real_distribution<double> linkJitter(0.0, std::max(latencyJitter, 0.0));
+
+    std::cout << "Simulated Omni at " << rate << " Hz (" << (useMouse ? "mouse" : trajectory.name())
+              << "), latency " << 1e3*latency << " ms + up to " << 1e3*latencyJitter << " ms" << std::endl;
+
+    RealtimeProfile rtProfile = readRealtimeProfile();
+    if (rtProfile.enabled)
+    {
+        std::string rtReport;
+        bool rtOk = applyRealtimeProfile(rtProfile,rtReport);
+        std::cout << (rtOk ? "Real-time profile:" : "Real-time profile (incomplete):") << std::endl << rtReport << std::endl;
+    }
+    PeriodicTimer timer(rate);
+    JitterMonitor loopJitter(rate);
+    JitterMonitor intervalJitter(rate);
+
+    InputSample hand;
+    Eigen::Vector3d force = Eigen::Vector3d::Zero();
+    endonasal_teleop::stampedPose stampedMsg;
+    std_msgs::Int8 buttonMsg;
+    uint64_t traceId = 0;
+    long intervalPublished = 0;
+    auto publishSample = [&](const LinkSample &in)
+    {
+        buttonMsg.data = in.button;
+        stampedMsg.header.stamp = in.stamp;
+        stampedMsg.trace_id = ++traceId;
+        stampedMsg.pose = in.pose;
+        buttonPub.publish(buttonMsg);
+        omniPub.publish(in.pose);
+        omniStampedPub.publish(stampedMsg);
+        intervalPublished++;
+    };
+    double t0 = monotonicSeconds();
+    double lastReport = t0;
+
+    while (ros::ok())
+    {
+        loopJitter.tick();
+        intervalJitter.tick();
+        ros::spinOnce();
+        double now = monotonicSeconds();
+
+        // the newest force command that has reached the device
+        while (forceRead < forceWritten && forceQueue[forceRead % FORCE_QUEUE_SIZE].t + forceLatency <= now)
+        {
+            force = forceQueue[forceRead % FORCE_QUEUE_SIZE].f;
+            forceRead++;
+        }
+        double forceNorm = force.norm();
+        Eigen::Vector3d applied = forceNorm > maxForce ? Eigen::Vector3d(force*(maxForce/forceNorm)) : force;
+
+        // hand, pushed off by the force, with sensor noise
+        if (useMouse)
+        {
+            mouse.poll(mouseScale, mouseRange);
+            mouse.sample(handCenter, hand);
+        }
+        else
+        {
+            trajectory.sample(now - t0, 1.0/rate, hand);
+        }
+        Eigen::Vector3d p;
+        for (int i = 0; i < 3; i++)
+        {
+            p(i) = hand.p[i] + applied(i)/handStiffness + positionNoise*normal(rng);
+            if (positionResolution > 0.0)
+            {
+                p(i) = positionResolution*std::floor(p(i)/positionResolution + 0.5);
+            }
+        }
+        Eigen::Vector3d noiseRotation(normal(rng), normal(rng), normal(rng));
+        noiseRotation *= orientationNoise;
+        Eigen::Quaterniond q(hand.q[0], hand.q[1], hand.q[2], hand.q[3]);
+        if (noiseRotation.norm() > 0.0)
+        {
+            q = q*Eigen::Quaterniond(Eigen::AngleAxisd(noiseRotation.norm(), noiseRotation.normalized()));
+        }
+        q.normalize();
+
+        // onto the link; if it is full, the oldest sample goes out now
+        if (linkWritten - linkRead >= long(linkQueue.size()))
+        {
+            publishSample(linkQueue[linkRead % linkQueue.size()]);
+            linkRead++;
+        }
+        LinkSample &out = linkQueue[linkWritten % linkQueue.size()];
+        out.stamp = ros::Time::now();
+        out.release = std::max(lastRelease, now + latency + (latencyJitter > 0.0 ? linkJitter(rng) : 0.0));
+        out.pose.position.x = p(0);
+        out.pose.position.y = p(1);
+        out.pose.position.z = p(2);
+        out.pose.orientation.x = q.x();
+        out.pose.orientation.y = q.y();
+        out.pose.orientation.z = q.z();
+        out.pose.orientation.w = q.w();
+        out.button = hand.button;
+        lastRelease = out.release;
+        linkWritten++;
+
+        // the samples that have crossed it
+        while (linkRead < linkWritten && linkQueue[linkRead % linkQueue.size()].release <= now)
+        {
+            publishSample(linkQueue[linkRead % linkQueue.size()]);
+            linkRead++;
+        }
+
+        if (reportPeriod > 0.0 && now - lastReport >= reportPeriod)
+        {
+            double elapsed = now - lastReport;
+            printf("omni_sim: %.1f samples/s, %.1f force commands/s, force mean %.2f N, max %.2f N\n",
+                   intervalPublished/elapsed, forceIntervalCount/elapsed,
+                   forceIntervalCount ? forceIntervalSum/forceIntervalCount : 0.0, forceIntervalMax);
+            intervalJitter.print("omni_sim loop");
+            intervalJitter.clear();
+            intervalPublished = 0;
+            forceIntervalCount = 0;
+            forceIntervalSum = 0.0;
+            forceIntervalMax = 0.0;
+            lastReport = now;
+        }
+
+        timer.wait();
+    }
+
+    printf("omni_sim: %llu samples in %.1f s\n", (unsigned long long)traceId, monotonicSeconds() - t0);
+    loopJitter.print("omni_sim loop");
+
+    return 0;
+}
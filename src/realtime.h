@@ -0,0 +1,316 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+/********************************************************************
+
+  realtime.h
+
+Opt-in real-time execution profile for the control loops.
+With ~realtime set, a node, just before its loop starts:
+  - locks all current and future pages in RAM (mlockall) and stops
+    malloc from returning memory to the system,
+  - faults in a heap reserve and a stack reserve, so the loop does not
+    take page faults on memory it touches for the first time,
+  - pins the loop thread to ~rt_cpu and switches it to SCHED_FIFO at
+    ~rt_priority,
+and then paces the loop with absolute clock_nanosleep deadlines instead
+of ros::Rate. Threads created after that (e.g. the motor streamer)
+inherit the policy and the core.
+
+Without it the loop keeps default scheduling and ros::Rate. In both
+cases a JitterMonitor measures the period actually achieved, so the two
+profiles can be compared on the same machine.
+
+Works on a stock kernel (SCHED_FIFO needs root, CAP_SYS_NICE or an
+rtprio limit in /etc/security/limits.conf) and on PREEMPT_RT, which
+bounds the wake-up latency. Steps that fail (e.g. no permission) are
+reported and skipped; the loop runs either way.
+
+Parameters (private):
+    ~realtime               enable the profile (false)
+    ~rt_priority            SCHED_FIFO priority, 1-99 (80)
+    ~rt_cpu                 core for the loop thread, -1 for any (-1)
+    ~rt_lock_memory         mlockall and keep freed heap (true)
+    ~rt_prefault_stack_kb   stack reserve (512)
+    ~rt_prefault_heap_kb    heap reserve (16384)
+
+********************************************************************/
+
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct RealtimeProfile
+{
+    bool enabled;
+    int priority;
+    int cpu;
+    bool lockMemory;
+    int stackKb;
+    int heapKb;
+};
+
+inline RealtimeProfile readRealtimeProfile()
+{
+    RealtimeProfile p;
+    ros::param::param<bool>("~realtime", p.enabled, false);
+    ros::param::param<int>("~rt_priority", p.priority, 80);
+    ros::param::param<int>("~rt_cpu", p.cpu, -1);
+    ros::param::param<bool>("~rt_lock_memory", p.lockMemory, true);
+    ros::param::param<int>("~rt_prefault_stack_kb", p.stackKb, 512);
+    ros::param::param<int>("~rt_prefault_heap_kb", p.heapKb, 16384);
+    return p;
+}
+
+// pins a thread to one core
+inline bool pinThread(pthread_t t, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(t, sizeof(set), &set) == 0;
+}
+
+inline bool pinThread(std::thread &t, int cpu)
+{
+    return pinThread(t.native_handle(), cpu);
+}
+
+// touches every page of a stack buffer of the given size
+__attribute__((noinline)) inline void prefaultStack(size_t bytes)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *buf = static_cast<char*>(alloca(bytes));
+    for (size_t i = 0; i < bytes; i += page)
+    {
+        *static_cast<volatile char*>(buf + i) = 0;
+    }
+}
+
+// Faults in a heap reserve and gives it back to malloc, which keeps it
+// (with trimming and mmap disabled) for the allocations the loop makes.
+inline bool prefaultHeap(size_t bytes)
+{
+    char *reserve = static_cast<char*>(malloc(bytes));
+    if (!reserve)
+    {
+        return false;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < bytes; i += page)
+    {
+        *static_cast<volatile char*>(reserve + i) = 0;
+    }
+    free(reserve);
+    return true;
+}
+
+// Applies the profile to the calling thread (the control loop). Returns
+// false if any step failed; report says what was applied.
+inline bool applyRealtimeProfile(const RealtimeProfile &p, std::string &report)
+{
+    bool ok = true;
+    report.clear();
+    char line[128];
+
+    if (p.lockMemory)
+    {
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        {
+            report += "  memory locked\n";
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "  mlockall failed: %s\n", strerror(errno));
+            report += line;
+            ok = false;
+        }
+    }
+
+    if (p.heapKb > 0)
+    {
+        bool faulted = prefaultHeap(size_t(p.heapKb)*1024);
+        snprintf(line, sizeof(line), "  heap reserve %d KiB %s\n", p.heapKb, faulted ? "faulted in" : "could not be allocated");
+        report += line;
+        ok = ok && faulted;
+    }
+    if (p.stackKb > 0)
+    {
+        prefaultStack(size_t(p.stackKb)*1024);
+        snprintf(line, sizeof(line), "  stack reserve %d KiB faulted in\n", p.stackKb);
+        report += line;
+    }
+
+    if (p.cpu >= 0)
+    {
+        if (pinThread(pthread_self(), p.cpu))
+        {
+            snprintf(line, sizeof(line), "  pinned to core %d\n", p.cpu);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "  could not pin to core %d\n", p.cpu);
+            ok = false;
+        }
+        report += line;
+    }
+
+    sched_param sp;
+    sp.sched_priority = std::max(sched_get_priority_min(SCHED_FIFO), std::min(p.priority, sched_get_priority_max(SCHED_FIFO)));
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (err == 0)
+    {
+        snprintf(line, sizeof(line), "  SCHED_FIFO priority %d\n", sp.sched_priority);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "  SCHED_FIFO failed: %s\n", strerror(err));
+        ok = false;
+    }
+    report += line;
+    return ok;
+}
+
+// fixed-rate loop pacing on absolute CLOCK_MONOTONIC deadlines
+class PeriodicTimer
+{
+public:
+    PeriodicTimer(double rate) : periodNs(long(1e9/rate + 0.5))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+    }
+
+    // sleeps until the next deadline; a missed deadline restarts the
+    // schedule from now instead of running a burst of catch-up cycles
+    void wait()
+    {
+        deadline.tv_nsec += periodNs;
+        while (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_nsec -= 1000000000L;
+            deadline.tv_sec++;
+        }
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec))
+        {
+            deadline = now;
+            return;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) == EINTR)
+        {
+        }
+    }
+
+private:
+    long periodNs;
+    timespec deadline;
+};
+
+const double JITTER_BIN_WIDTH = 1.0e-5;     // s
+
+// Measures the period a loop actually runs at: tick() once per cycle,
+// at the same point of the loop. Jitter is |interval - period|, in 10 us
+// bins up to 50 ms. An overrun is an interval of more than 1.5 periods,
+// i.e. a cycle that came late by half a period or more.
+class JitterMonitor
+{
+public:
+    enum { NUM_BINS = 5000 };
+
+    JitterMonitor(double rate) : period(1.0/rate) { clear(); }
+
+    void clear()
+    {
+        for (int i = 0; i <= NUM_BINS; i++)
+        {
+            bins[i] = 0;
+        }
+        last = 0.0;
+        n = 0;
+        sum = 0.0;
+        max = 0.0;
+        overruns = 0;
+    }
+
+    // returns true if this interval was an overrun
+    bool tick()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        double now = ts.tv_sec + 1e-9*ts.tv_nsec;
+        if (last > 0.0)
+        {
+            double dt = now - last;
+            double j = fabs(dt - period);
+            int b = int(j/JITTER_BIN_WIDTH);
+            bins[b < NUM_BINS ? b : NUM_BINS]++;
+            n++;
+            sum += j;
+            max = j > max ? j : max;
+            if (dt > 1.5*period)
+            {
+                overruns++;
+                last = now;
+                return true;
+            }
+        }
+        last = now;
+        return false;
+    }
+
+    // upper edge of the bin holding the p-th fraction of intervals (at most the maximum)
+    double percentile(double p) const
+    {
+        long target = long(p*n + 0.5);
+        long seen = 0;
+        for (int i = 0; i < NUM_BINS; i++)
+        {
+            seen += bins[i];
+            if (seen >= target)
+            {
+                return (i+1)*JITTER_BIN_WIDTH < max ? (i+1)*JITTER_BIN_WIDTH : max;
+            }
+        }
+        return max;
+    }
+
+    long intervals() const { return n; }
+    long overrunCount() const { return overruns; }
+    double mean() const { return n ? sum/n : 0.0; }
+    double maximum() const { return max; }
+
+    // one-line summary in microseconds
+    void print(const char *name, FILE *out = stdout) const
+    {
+        fprintf(out, "%s: %ld periods of %.1f ms, jitter mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us, %ld overruns\n",
+                name, n, 1e3*period, 1e6*mean(), 1e6*percentile(0.5), 1e6*percentile(0.99), 1e6*max, overruns);
+        fflush(out);
+    }
+
+private:
+    double period;
+    long bins[NUM_BINS+1];
+    double last;
+    long n;
+    double sum;
+    double max;
+    long overruns;
+};
+
+#endif // REALTIME_H
@@ -27,6 +27,8 @@ revised:  6/14/2018
 // ROS headers
 #include <ros/ros.h>
 #include <ros/console.h>
+#include <ros/package.h>
+#include <ros/callback_queue.h>
 
 //XML parsing headers
 #include "rapidxml.hpp"
@@ -46,8 +48,10 @@ revised:  6/14/2018
 #include <endonasal_teleop/config3.h>
 #include <endonasal_teleop/vector7.h>
 #include <endonasal_teleop/kinout.h>
+#include <endonasal_teleop/anatomyConstraints.h>
 #include <endonasal_teleop/getStartingConfig.h>
 #include <endonasal_teleop/getStartingKin.h>
+#include <endonasal_teleop/stampedPose.h>
 #include <geometry_msgs/Vector3.h>
 
 #include "medlab_motor_control_board/McbEncoders.h"
@@ -59,6 +63,16 @@ revised:  6/14/2018
 #include <cstdlib>
 #include <vector>
 #include "spline.h"
+#include "resolved_rates_core.h"
+#include "flight_recorder.h"
+#include "trace_events.h"
+#include "motor_streamer.h"
+#include "actuator_map.h"
+#include "realtime.h"
+#include "alloc_guard.h"
+#include "force_feedback.h"
+#include "omni_filter.h"
+#include "omni_predictor.h"
 #include <iostream>
 #include <fstream>
 #include <random>
@@ -74,10 +88,6 @@ using std::tuple;
 using namespace std;
 
 // TYPEDEFS
-typedef Eigen::Matrix<double,4,4> Matrix4d;
-typedef Eigen::Matrix<double,6,6> Matrix6d;
-typedef Eigen::Matrix<double,7,1> Vector7d;
-typedef Eigen::Matrix<double,6,1> Vector6d;
 typedef tuple < Tube< constant_fun< Vector2d > >,
 Tube< constant_fun< Vector2d > >,
 Tube< constant_fun< Vector2d > > > Cannula3;
@@ -85,453 +95,51 @@ typedef constant_fun<Eigen::Vector2d> CurvFun;
 typedef std::tuple< Tube<CurvFun>, Tube<CurvFun>, Tube<CurvFun> > CannulaT;
 typedef DeclareOptions< Option::ComputeJacobian, Option::ComputeGeometry, Option::ComputeStability, Option::ComputeCompliance>::options OType;
 
-struct Configuration3
-{
-    Eigen::Vector3d	PsiL;
-    Eigen::Vector3d	Beta;
-    Eigen::Vector3d     Ftip;
-    Eigen::Vector3d	Ttip;
-};
-
 // GLOBAL VARIABLES NEEDED FOR RESOLVED RATES
-Matrix4d omniPose;
-Matrix4d prevOmni;
-Matrix4d curOmni;
-Matrix4d robotTipFrameAtClutch; //clutch-in position of cannula
+// (the resolved rates math itself lives in ResolvedRatesController, resolved_rates_core.h)
+ResolvedRatesParams rrParams;
+ResolvedRatesController *controller = 0;
 
 geometry_msgs::Vector3 omniForce;
 
-Eigen::Vector3d ptipcur; // use for continually updated message value
-Eigen::Vector4d qtipcur;
-Eigen::Vector3d alphacur;
-Matrix6d Jcur;
+KinematicsState kinCur; // use for continually updated message value
 bool new_kin_msg = 0;
-double rosLoopRate = 100.0;
-
-// BASIC MATH FUNCTION DEFINITIONS -----------------------------------
-
-double deg2rad (double degrees) {
-    return degrees * 4.0 * atan (1.0) / 180.0;
-}
-
-double vectornorm(Eigen::Vector3d v)
-{
-    double n = sqrt(v.transpose()*v);
-    return n;
-}
-
-Eigen::Matrix3d orthonormalize(Eigen::Matrix3d R)
-{
-    Eigen::Matrix3d R_ortho;
-    R_ortho.fill(0);
-    // Normalize the first column:
-    R_ortho.col(0) = R.col(0) / vectornorm(R.col(0));
-
-    // Orthogonalize & normalize second column:
-    R_ortho.col(1) = R.col(1);
-    double c = (R_ortho.col(1).transpose()*R_ortho.col(0));
-    c = c/(R_ortho.col(0).transpose()*R_ortho.col(0));
-    R_ortho.col(1) = R_ortho.col(1) - c*R_ortho.col(0);
-    R_ortho.col(1) = R_ortho.col(1)/vectornorm(R_ortho.col(1));
-
-    // Orthogonalize & normalize third column:
-    R_ortho.col(2) = R.col(2);
-    double d = (R_ortho.col(2).transpose()*R_ortho.col(0));
-    d = d/(R_ortho.col(0).transpose()*R_ortho.col(0));
-    R_ortho.col(2) = R_ortho.col(2) - d*R_ortho.col(0);
-    double e = (R_ortho.col(2).transpose()*R_ortho.col(1));
-    e = e/(R_ortho.col(1).transpose()*R_ortho.col(1));
-    R_ortho.col(2) = R_ortho.col(2) - e*R_ortho.col(1);
-    R_ortho.col(2) = R_ortho.col(2)/vectornorm(R_ortho.col(2));
-    return R_ortho;
-}
-
-Eigen::Matrix4d assembleTransformation(Eigen::Matrix3d Rot, Eigen::Vector3d Trans)
-{
-    Rot = orthonormalize(Rot);
-    Eigen::Matrix4d T;
-    T.fill(0);
-    T.topLeftCorner(3,3) = Rot;
-    T.topRightCorner(3,1) = Trans;
-    T(3,3) = 1;
-    return T;
-}
-
-Eigen::Matrix3d quat2rotm(Eigen::Vector4d Quat)
-{
-    // Agrees with Matlab
-    // Quaternion order is wxyz
-    Eigen::Matrix3d R;
-    R.fill(0);
-
-    R(0,0) = pow(Quat(0),2) + pow(Quat(1),2) - pow(Quat(2),2) - pow(Quat(3),2);
-    R(0,1) = 2*Quat(1)*Quat(2) - 2*Quat(0)*Quat(3);
-    R(0,2) = 2*Quat(1)*Quat(3) + 2*Quat(0)*Quat(2);
-
-    R(1,0) = 2*Quat(1)*Quat(2) + 2*Quat(0)*Quat(3);
-    R(1,1) = pow(Quat(0),2) - pow(Quat(1),2) + pow(Quat(2),2) - pow(Quat(3),2);
-    R(1,2) = 2*Quat(2)*Quat(3) - 2*Quat(0)*Quat(1);
-
-    R(2,0) = 2*Quat(1)*Quat(3) - 2*Quat(0)*Quat(2);
-    R(2,1) = 2*Quat(2)*Quat(3) + 2*Quat(0)*Quat(1);
-    R(2,2) = pow(Quat(0),2) - pow(Quat(1),2) - pow(Quat(2),2) + pow(Quat(3),2);
-    return R;
-}
-
-
-// Function to get cofactor of A[p][q] in temp[][]
-void getCofactor(double A[6][6], double temp[6][6], int p, int q, int n)
-{
-    int i = 0, j = 0;
-
-    // Looping for each element of the matrix
-    for (int row = 0; row < n; row++)
-    {
-        for (int col = 0; col < n; col++)
-        {
-            //  Copying into temporary matrix only those element
-            //  which are not in given row and column
-            if (row != p && col != q)
-            {
-                temp[i][j++] = A[row][col];
-
-                // Row is filled, so increase row index and
-                // reset col index
-                if (j == n - 1)
-                {
-                    j = 0;
-                    i++;
-                }
-            }
-        }
-    }
-}
-
-// Recursive function for finding determinant of matrix.
-double determinant(double A[6][6], int n)
-{
-    double D = 0; // Initialize result
-
-    //  Base case : if matrix contains single element
-    if (n == 1)
-        return A[0][0];
 
-    double temp[6][6]; // To store cofactors
+// console output from the control loop goes through the asynchronous logger;
+// saturations are counted and reported once per second
+AsyncLogger logger;
 
-    int sign = 1;  // To store sign multiplier
+// latency tracing: trace id of the newest kinematics output (the Omni
+// sample's travels with it, see omniStampedCallback)
+TraceEventPublisher tracer;
+uint64_t kinTraceId = 0;
 
-    // Iterate for each element of first row
-    for (int f = 0; f < n; f++)
-    {
-        // Getting Cofactor of A[0][f]
-        getCofactor(A, temp, 0, f, n);
-        D += sign * A[0][f] * determinant(temp, n - 1);
-
-        // terms are to be added with alternate sign
-        sign = -sign;
-    }
-
-    return D;
-}
+// joint to motor board mapping from hardware.xml (see actuator_map.h)
+ActuatorMap actuators;
 
-// Function to get adjoint of A[N][N] in adj[N][N].
-void adjoint(double A[6][6],double adj[6][6])
+// encoder commands for all boards always go out together, from the
+// motor streaming thread or (without streaming) from the control loop
+std::vector<ros::Publisher> pubEncoderCommand;
+uint64_t lastEncoderTrace = 0;
+void sendEncoderCommands(const int *counts, uint64_t traceId)
 {
-    // temp is used to store cofactors of A[][]
-    int sign = 1;
-    double temp[6][6];
-
-    for (int i=0; i<6; i++)
+    medlab_motor_control_board::McbEncoders enc;
+    for (int b=0; b<actuators.numBoards(); b++)
     {
-        for (int j=0; j<6; j++)
+        const int *boardCounts = counts + actuators.boardOffset(b);
+        for (int i=0; i<6; i++)
         {
-            // Get cofactor of A[i][j]
-            getCofactor(A, temp, i, j, 6);
-
-            // sign of adj[j][i] positive if sum of row
-            // and column indexes is even.
-            sign = ((i+j)%2==0)? 1: -1;
-
-            // Interchanging rows and columns to get the
-            // transpose of the cofactor matrix
-            adj[j][i] = (sign)*(determinant(temp, 6-1));
+            enc.count[i] = boardCounts[i];
         }
+        pubEncoderCommand[b].publish(enc);
     }
-}
-
-// Function to calculate and store inverse, returns false if
-// matrix is singular
-void inverse(double A[6][6], double inverse[6][6])
-{
-    // Find determinant of A[][]
-    double det = determinant(A, 6);
-    if (det != 0) //matrix is not singular
+    if (traceId != lastEncoderTrace)
     {
-        // Find adjoint
-        double adj[6][6];
-        adjoint(A, adj);
-
-        // Find Inverse using formula "inverse(A) = adj(A)/det(A)"
-        for (int i=0; i<6; i++)
-            for (int j=0; j<6; j++)
-                inverse[i][j] = adj[i][j]/double(det);
+        tracer.emit(traceId,endonasal_teleop::traceEvent::RR_ENCODER_PUBLISH);
+        lastEncoderTrace = traceId;
     }
 }
 
-// 
-Vector6d saturateJointVelocities(Vector6d delta_qx, int node_freq)
-{
-
-double max_rot_speed = 0.8; // rad/sec
-double max_trans_speed = 5.0; // mm/sec
-
-Vector6d commanded_speed = delta_qx*node_freq;
-Vector6d saturated_speed = commanded_speed;
-Vector6d delta_qx_sat;
-
-// saturate tip rotations
-for (int i=0; i<3; i++)
-{
-    if(fabs(commanded_speed(i)) > max_rot_speed)
-    {
-        saturated_speed(i) = (commanded_speed(i)/fabs(commanded_speed(i)))*max_rot_speed;
-		std::cout << "Tube rotation speed saturated for tube" << i << std::endl << std::endl;
-    }
-    delta_qx_sat(i) = saturated_speed(i)/node_freq;
-}
-
-// saturate translations
-for (int i=3; i<6; i++)
-{
-    if(fabs(commanded_speed(i)) > max_trans_speed)
-    {
-        saturated_speed(i) = (commanded_speed(i)/fabs(commanded_speed(i)))*max_trans_speed;
-		std::cout << "Tube translation speed saturated for tube" << i << std::endl << std::endl;
-    }
-    delta_qx_sat(i) = saturated_speed(i)/node_freq;
-}
-
-return delta_qx_sat;
-
-}
-
-Vector6d transformBetaToX(Vector6d qbeta, Eigen::Vector3d L)
-{
-    Vector6d qx;
-    qx << qbeta(0), qbeta(1), qbeta(2), 0, 0, 0;
-    qx(3) = L(0) - L(1) + qbeta(3) - qbeta(4);
-    qx(4) = L(1) - L(2) + qbeta(4) - qbeta(5);
-    qx(5) = L(2) + qbeta(5);
-    return qx;
-}
-
-Vector6d transformXToBeta(Vector6d qx, Eigen::Vector3d L)
-{
-    Vector6d qbeta;
-    qbeta << qx(0), qx(1), qx(2), 0, 0, 0;
-    qbeta(3) = qx(3) + qx(4) + qx(5) - L(0);
-    qbeta(4) = qx(4) + qx(5) - L(1);
-    qbeta(5) = qx(5) - L(2);
-    return qbeta;
-}
-
-double dhFunction(double xmin, double xmax, double x)
-{
-    double dh = fabs((xmax-xmin)*(xmax-xmin)*(2*x-xmax-xmin)/(4*(xmax-x)*(xmax-x)*(x-xmin)*(x-xmin)));
-
-    return dh;
-}
-
-struct weightingRet
-{
-    Eigen::Matrix<double,6,6>   W;
-    Eigen::Vector3d             dh;
-};
-
-weightingRet getWeightingMatrix(Eigen::Vector3d x, Eigen::Vector3d dhPrev, Eigen::Vector3d L, double lambda)
-{
-    Eigen::Matrix<double,6,6> W = MatrixXd::Identity(6,6);
-
-    // No penalties on the rotational degrees of freedom (they don't have any joint limits)
-    // Therefore leave the first three entries in W as 1.
-
-    double eps = 2e-3;
-
-    // x1:
-    double x1min = eps;
-    double x1max = L(0)-L(1)-eps;
-    double x1 = x(0);
-    double dh1 = dhFunction(x1min,x1max,x1);
-    W(3,3) = (dh1 >= dhPrev(0))*(1+dh1) + (dh1 < dhPrev(0))*1;
-    //W(3,3) = 1+dh1;
-    W(3,3) *= lambda;
-
-    // x2:
-    double x2min = eps;
-    double x2max = L(1)-L(2)-eps;
-    double x2 = x(1);
-    double dh2 = dhFunction(x2min,x2max,x2);
-    W(4,4) = (dh2 >= dhPrev(1))*(1+dh2) + (dh2 < dhPrev(1))*1;
-    //W(4,4) = 1+dh2;
-    W(4,4) *= lambda;
-
-    // x3:
-    double x3min = eps;
-    double x3max = L(2)-eps;
-    double x3 = x(2);
-    double dh3 = dhFunction(x3min,x3max,x3);
-    W(5,5) = (dh3 >= dhPrev(2))*(1+dh3) + (dh3 < dhPrev(2))*1;
-    //W(5,5) = 1+dh3;
-    W(5,5) *= lambda;
-
-    Eigen::Vector3d dh;
-    dh << dh1,dh2,dh3;
-
-    weightingRet output;
-    output.W = W;
-    output.dh = dh;
-    return output;
-}
-
-
-Eigen::Vector3d limitBetaValsSimple(Eigen::Vector3d x_in, Eigen::Vector3d L)
-{
-    Eigen::Vector3d x = x_in;
-    double epsilon = 0.5e-3;  // keep a 0.5 mm minimum margin
-
-    // check tube 3 first:
-    if (x(2) < epsilon)
-    {
-        x(2) = epsilon;
-        std::cout << "Tube 3 translation saturated (front)" << std::endl;
-    }
-    else if (x(2) > L(2)-epsilon)
-    {
-        x(2) = L(2)-epsilon;
-        std::cout << "Tube 3 translation saturated (rear)" << std::endl;
-    }
-
-    // now check tube 2:
-    if (x(1) < epsilon)
-    {
-        x(1) = epsilon;
-        std::cout << "Tube 2 translation saturated (front)" << std::endl;
-    }
-    else if (x(1) > L(1)-L(2)-epsilon)
-    {
-        x(1) = L(1)-L(2)-epsilon;
-        std::cout << "Tube 2 translation saturated (rear)" << std::endl;
-    }
-
-    // and last check tube 1:
-    if (x(0) < epsilon)
-    {
-        x(0) = epsilon;
-        std::cout << "Tube 1 translation saturated (front)" << std::endl;
-    }
-    else if (x(0) > L(0)-L(1)-epsilon)
-    {
-        x(0)=L(0)-L(1)-epsilon;
-        std::cout << "Tube 1 translation saturated (rear)" << std::endl;
-    }
-
-    return x;
-}
-
-Eigen::Vector3d limitBetaValsBimanualAlgorithm(Eigen::Vector3d Beta_in, Eigen::Vector3d L_in)
-{
-    int nTubes = 3;
-
-    // plate thicknesses (constant)
-    // eventually we'll want to load them from elsewhere
-    // these also need to be updated to correct values for the new robot
-    // and this whole algorithm will need to be adapted
-    Eigen::Matrix<double,4,1> tplus;
-    tplus << 0.0, 10e-3, 10e-3, 10e-3;
-
-    Eigen::Matrix<double,4,1> tminus;
-    tminus << 0.0, 10e-3, 10e-3, 10e-3;
-
-    Eigen::Matrix<double,4,1> extMargin;
-    extMargin << 1e-3, 1e-3, 10e-3, 1e-3;
-    // tube 2 is different because we have to make sure it doesn't knock off the end effector
-
-    double tp = 25e-3;
-
-    Eigen::Matrix<double,4,1> L;
-    L << 3*L_in(0), L_in(0), L_in(1), L_in(2);
-
-    Eigen::Matrix<double,4,1> beta;
-    beta << -2*L_in(0), Beta_in(0), Beta_in(1), Beta_in(2);
-
-    // starting with tube 1, correct any translational joint limit violations
-    for (int i = 1; i <=nTubes; i++)
-    {
-        // if it's going to hit the carriage behind it, move it up:
-        if (beta(i) - tminus(i) < beta(i-1) + tplus(i-1))
-        {
-            beta(i) = beta(i-1) + tplus(i-1) + tminus(i);
-        }
-
-        // if it's going to not leave space for the other carriages in front of it, move it back:
-        double partial_sum = 0.0;
-        for (int k = i+1; k <= nTubes; k++)
-        {
-            partial_sum += tplus(k) + tminus(k);
-        }
-        if (beta(i) + tplus(i) > -tp - partial_sum)
-        {
-            beta(i) = -tp - partial_sum - tplus(i);
-        }
-
-        // if the tube is getting too close to the end of the next tube out, move it up:
-        if (beta(i) + L(i) > beta(i-1) + L(i-1) - extMargin(i))
-        {
-            beta(i) = beta(i-1) + L(i-1) - L(i) - extMargin(i);
-        }
-
-        // if the tube is going to retract all the way behind the front plate, move it up:
-        if (beta(i) + L(i) - 0.001*(nTubes-i+1) < 0.0)
-        {
-            beta(i) = -L(i) + 0.001*(nTubes-i+1);
-        }
-    }
-
-    Eigen::Vector3d Beta;
-    Beta << beta(1), beta(2), beta(3);
-    return Beta;
-}
-
-Vector6d scaleOmniVelocity(Vector6d desTwistDelta)
-{
-	Vector6d scaledDesTwistDelta = desTwistDelta;
-
-	//double pStepMax = 2.0e-3; // 2 mm
-	double vMax = 0.1; // [m/s]
-	double pStepMax = vMax / rosLoopRate; // [mm]
-
-	double pErr = desTwistDelta.topRows<3>().norm();
-	double gain = 1.0;
-	if (pErr > pStepMax)
-	{
-		gain = 	pStepMax / pErr;
-	}
-	scaledDesTwistDelta.topRows<3>() *= gain;
-
-	//double angleStepMax = 0.05; //0.05 radians
-	double wMax = 2.5; // [rad/s]
-	double angleStepMax = wMax / rosLoopRate;
-	double angleErr = desTwistDelta.bottomRows<3>().norm();
-	gain = 1.0;
-	if (angleErr > angleStepMax)
-	{
-		gain = angleStepMax / angleErr;
-	}
-	scaledDesTwistDelta.bottomRows<3>() *= gain;
-
-	return scaledDesTwistDelta;
-}
-
 
 // SERVICE CALL FUNCTION DEFINITION ------------------------------
 
@@ -539,11 +147,7 @@ bool startingConfig(endonasal_teleop::getStartingConfig::Request &req, endonasal
 {
     std::cout << "Retrieving the starting configuration..." << std::endl << std::endl;
 
-    Configuration3 qstart;
-    qstart.PsiL = Eigen::Vector3d::Zero();
-    qstart.Beta << -160.9e-3, -127.2e-3, -86.4e-3;
-    qstart.Ftip = Eigen::Vector3d::Zero();
-    qstart.Ttip = Eigen::Vector3d::Zero();
+    Configuration3 qstart = ResolvedRatesController::homeConfiguration();
 
     for(int i = 0; i<3; i++)
     {
@@ -563,32 +167,56 @@ endonasal_teleop::kinout tmpkin;
 void kinCallback(const endonasal_teleop::kinout kinmsg)
 {
     tmpkin = kinmsg;
+    kinTraceId = tmpkin.trace_id;
+    tracer.emit(kinTraceId,endonasal_teleop::traceEvent::RR_KIN_RECEIVE);
 
     // pull out position
-    ptipcur[0] = tmpkin.p[0];
-    ptipcur[1] = tmpkin.p[1];
-    ptipcur[2] = tmpkin.p[2];
+    kinCur.ptip[0] = tmpkin.p[0];
+    kinCur.ptip[1] = tmpkin.p[1];
+    kinCur.ptip[2] = tmpkin.p[2];
 
     // pull out orientation (quaternion)
-    qtipcur[0] = tmpkin.q[0];
-    qtipcur[1] = tmpkin.q[1];
-    qtipcur[2] = tmpkin.q[2];
-    qtipcur[3] = tmpkin.q[3];
+    kinCur.qtip[0] = tmpkin.q[0];
+    kinCur.qtip[1] = tmpkin.q[1];
+    kinCur.qtip[2] = tmpkin.q[2];
+    kinCur.qtip[3] = tmpkin.q[3];
 
     // pull out the base angles of the tubes (alpha in rad)	
-    alphacur[0] = tmpkin.alpha[0];
-    alphacur[1] = tmpkin.alpha[1];
-    alphacur[2] = tmpkin.alpha[2];
+    kinCur.alpha[0] = tmpkin.alpha[0];
+    kinCur.alpha[1] = tmpkin.alpha[1];
+    kinCur.alpha[2] = tmpkin.alpha[2];
 
     // pull out Jacobian
     for(int i = 0; i<6; i++)
     {
-        Jcur(0,i)=tmpkin.J1[i];
-        Jcur(1,i)=tmpkin.J2[i];
-        Jcur(2,i)=tmpkin.J3[i];
-        Jcur(3,i)=tmpkin.J4[i];
-        Jcur(4,i)=tmpkin.J5[i];
-        Jcur(5,i)=tmpkin.J6[i];
+        kinCur.J(0,i)=tmpkin.J1[i];
+        kinCur.J(1,i)=tmpkin.J2[i];
+        kinCur.J(2,i)=tmpkin.J3[i];
+        kinCur.J(3,i)=tmpkin.J4[i];
+        kinCur.J(4,i)=tmpkin.J5[i];
+        kinCur.J(5,i)=tmpkin.J6[i];
+    }
+}
+
+// anatomy virtual fixtures of the newest kinematics update (anatomy_fixture.h)
+void anatomyConstraintsCallback(const endonasal_teleop::anatomyConstraints &msg)
+{
+    AnatomyConstraintSet &c = kinCur.anatomy;
+    c.n = std::min(int(msg.n),ANATOMY_MAX_CONSTRAINTS);
+    c.margin = msg.margin;
+    for (int i = 0; i<c.n; i++)
+    {
+        c.distance[i] = msg.distance[i];
+        c.arcLength[i] = msg.arc_length[i];
+        for (int k = 0; k<3; k++)
+        {
+            c.point[i](k) = msg.point[3*i+k];
+            c.normal[i](k) = msg.normal[3*i+k];
+        }
+        for (int k = 0; k<6; k++)
+        {
+            c.gradient[i](k) = msg.gradient[6*i+k];
+        }
     }
 }
 
@@ -602,38 +230,68 @@ void kinStatusCallback(const std_msgs::Bool &fkmMsg)
     }
 }
 
-geometry_msgs::Pose tempMsg;
-void omniCallback(const geometry_msgs::Pose &msg)
+// Omni input conditioning (see omni_filter.h). The Omni topics have a
+// callback queue and spinner thread of their own, so every sample is
+// filtered when it arrives; the control loop takes the newest result.
+// omni_node publishes every sample on Omnipos and Omnipos_stamped; the
+// plain topic is only a fallback for sources without the stamped one and
+// is dropped once a stamped sample arrives, so the filter sees every
+// sample once.
+OmniInputFilter omniFilter;
+TripleBuffer<OmniInputSample> omniInput;
+ros::Subscriber *omniPoseSub = 0;
+bool omniStampedInput = false;
+void omniPose(const geometry_msgs::Pose &msg)
 {
-    tempMsg = msg;
-    //    prevOmni = curOmni;
-
     Eigen::Vector4d qOmni;
-    qOmni << tempMsg.orientation.w, tempMsg.orientation.x, tempMsg.orientation.y, tempMsg.orientation.z;
-    Eigen::Matrix3d ROmni = quat2rotm(qOmni);
+    qOmni << msg.orientation.w, msg.orientation.x, msg.orientation.y, msg.orientation.z;
 
     Eigen::Vector3d pOmni;
-    pOmni << tempMsg.position.x, tempMsg.position.y, tempMsg.position.z;
+    pOmni << msg.position.x, msg.position.y, msg.position.z;
 
-    omniPose.fill(0);
-    omniPose.topLeftCorner(3,3) = ROmni;
-    omniPose.topRightCorner(3,1) = pOmni;
-    omniPose(3,3) = 1.0;
+    omniFilter.update(monotonicSeconds(),pOmni,qOmni);
+    omniInput.write(omniFilter.sample());
+}
 
-    //    curOmni = omniPose;
+void omniCallback(const geometry_msgs::Pose &msg)
+{
+    if (!omniStampedInput)
+    {
+        omniPose(msg);
+    }
 }
 
-int buttonState = 0;
-int buttonStatePrev = 0;
-bool justClutched = false;
-void omniButtonCallback(const std_msgs::Int8 &buttonMsg)
+// same as Omnipos, with the trace id and send time of the sample; the
+// send time gives the delay of the rosserial link (see omni_predictor.h)
+LinkDelayEstimator omniLink;
+void omniStampedCallback(const endonasal_teleop::stampedPose &msg)
 {
-    buttonStatePrev = buttonState;
-    buttonState = static_cast<int>(buttonMsg.data);
-    if(buttonState==1 && buttonStatePrev==0)
+    if (!omniStampedInput)
     {
-        justClutched = true;
+        omniStampedInput = true;
+        omniPoseSub->shutdown();
     }
+    tracer.emit(msg.trace_id,endonasal_teleop::traceEvent::RR_OMNI_RECEIVE);
+    if (!msg.header.stamp.isZero())
+    {
+        omniLink.update((ros::Time::now() - msg.header.stamp).toSec());
+        omniFilter.setLinkDelay(omniLink.delay(),omniLink.jitter());
+    }
+    omniFilter.setTraceId(msg.trace_id);
+    omniPose(msg.pose);
+}
+
+void omniButtonCallback(const std_msgs::Int8 &buttonMsg)
+{
+    controller->onButton(static_cast<int>(buttonMsg.data));
+}
+
+// force feedback on the Omni at 1 kHz (see force_feedback.h); its thread
+// takes Omni positions from a callback queue of its own
+ForceFeedbackThread forceFeedback;
+void forceOmniCallback(const geometry_msgs::Pose &msg)
+{
+    forceFeedback.setOmniPosition(Eigen::Vector3d(msg.position.x, msg.position.y, msg.position.z));
 }
 
 void zero_force()
@@ -651,92 +309,171 @@ int main(int argc, char *argv[])
 ********************************************************************************/
     ros::init(argc, argv, "resolved_rates");
     ros::NodeHandle node;
+
+    for (int i = 0; i < NUM_SAT_COUNTERS; i++)
+    {
+        logger.setCounterLabel(i,saturationLabels[i]);
+    }
+    logger.setCounterLabel(NUM_SAT_COUNTERS,"control loop period overrun");
+    logger.run();
 /*******************************************************************************
                 DECLARATIONS & CONSTANT DEFINITIONS
 ********************************************************************************/
-    // TELEOP PARAMETERS
-    double scale_factor = 0.10;
-    double lambda_tracking = 10.0; 	// originally 1.0			// TODO: tune these gains
-    double lambda_damping = 50.0;    // originally 5.0
-    double lambda_jointlim = 100.0;  // originally 10.0
-
-    // motion tracking weighting matrix (task space):
-    Matrix6d W_tracking = Eigen::Matrix<double,6,6>::Zero();
-    W_tracking(0,0) = lambda_tracking*1.0e6;
-    W_tracking(1,1) = lambda_tracking*1.0e6;
-    W_tracking(2,2) = lambda_tracking*1.0e6;
-    W_tracking(3,3) = 0.1*lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
-    W_tracking(4,4) = 0.1*lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
-    W_tracking(5,5) = lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
-
-    std::cout << "W_tracking = " << std::endl << W_tracking << std::endl << std::endl;
-
-    // damping weighting matrix (actuator space):
-    Matrix6d W_damping = Eigen::Matrix<double,6,6>::Zero();
-    double thetadeg = 2.0; // degrees to damp as much as 1 mm  
-    W_damping(0,0) = lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
-    W_damping(1,1) = lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
-    W_damping(2,2) = lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
-    W_damping(3,3) = lambda_damping*1.0e6;
-    W_damping(4,4) = lambda_damping*1.0e6;
-    W_damping(5,5) = lambda_damping*1.0e6;
-
-    std::cout << "W_damping = " << std::endl << W_damping << std::endl << std::endl;
-
-    // conversion from beta to x:
-    Eigen::Matrix3d dbeta_dx;
-    dbeta_dx << 1, 1, 1,
-                0, 1, 1,
-                0, 0, 1;
-
-    Eigen::Matrix<double,6,6> dqbeta_dqx;
-    dqbeta_dqx.fill(0);
-    dqbeta_dqx.block(0,0,3,3) = MatrixXd::Identity(3,3);
-    dqbeta_dqx.block(3,3,3,3) = dbeta_dx;
-
-    // ROBOT POSE VARIABLES
-    Eigen::Vector3d ptip;
-    Eigen::Vector4d qtip;
-    Eigen::Matrix3d Rtip;
-    Eigen::Vector3d alpha;
-    Vector6d q_vec;
-    Vector6d delta_qx;
-    Matrix4d omniFrameAtClutch;
-    Matrix4d robotTipFrameAtClutch; //clutch-in position of cannula
-    Matrix4d robotTipFrame; //from tip pose
-    Matrix6d J;
-    Matrix4d robotDesFrameDelta;
-    Vector6d robotDesTwist;
-    Eigen::Vector3d L;
-
-    // OMNI POSE VARIABLES
-    Matrix4d Tregs;
-    Matrix4d omniDelta_omniCoords;
-    Matrix4d prevOmniInv;
-    Matrix4d omniDelta_cannulaCoords; //change in Omni position between timesteps in inertial frame
-
-    // OMNI REGISTRATION (constant)
-    Matrix4d OmniReg = Matrix4d::Identity();
-    Eigen::MatrixXd rotationY = Eigen::AngleAxisd(M_PI,Eigen::Vector3d::UnitY()).toRotationMatrix();
-    Mtransform::SetRotation(OmniReg,rotationY);
-
-    Matrix4d OmniRegInv = Mtransform::Inverse(OmniReg);
+    // TELEOP PARAMETERS (defaults in ResolvedRatesParams)
+    // constrained resolved rates solver (warm-started between cycles)
+    ros::param::param<bool>("~use_constrained_solver", rrParams.use_constrained_solver, rrParams.use_constrained_solver);
+    ros::param::param<int>("~qp_max_iterations", rrParams.qp_max_iterations, rrParams.qp_max_iterations);
+    ros::param::param<double>("~max_rot_speed", rrParams.max_rot_speed, rrParams.max_rot_speed);
+    ros::param::param<double>("~max_trans_speed", rrParams.max_trans_speed, rrParams.max_trans_speed);
+    // anatomy fixtures, when the kinematics node publishes them (~anatomy_fixture)
+    ros::param::param<double>("~lambda_anatomy", rrParams.lambda_anatomy, rrParams.lambda_anatomy);
+
+    ResolvedRatesController rr(rrParams);
+    rr.setLogger(&logger);
+    controller = &rr;
+
+    std::cout << "W_tracking = " << std::endl << rr.trackingWeights() << std::endl << std::endl;
+    std::cout << "W_damping = " << std::endl << rr.dampingWeights() << std::endl << std::endl;
+
+    // ACTUATOR MAP
+    // joint -> (board, axis, scale, offset) for the robot in the hardware description
+    std::string hardware_file;
+    std::string robot_name;
+    ros::param::param<std::string>("~hardware_file", hardware_file, ros::package::getPath("endonasal_teleop") + "/config/hardware.xml");
+    ros::param::param<std::string>("~robot", robot_name, "endonasal_cannula");
+    std::string actuatorError;
+    if (!actuators.load(hardware_file, std::vector<std::string>(1,robot_name), actuatorError))
+    {
+        std::cout << "Could not load the actuator map: " << actuatorError << std::endl;
+        return 1;
+    }
+    for (int b=0; b<actuators.numBoards(); b++)
+    {
+        if (actuators.boardType(b) != "MedlabMotorControlBoard" || actuators.boardAxes(b) != 6)
+        {
+            std::cout << robot_name << " uses " << actuators.boardName(b) << ", which is not a Medlab motor control board." << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Driving " << robot_name << " on " << actuators.numBoards() << " boards (" << hardware_file << ")" << std::endl;
+    for (size_t k=0; k<actuators.connections().size(); k++)
+    {
+        const ActuatorConnection &c = actuators.connections()[k];
+        std::cout << "  tube " << c.tube << (c.rotation ? " rotation    -> " : " translation -> ")
+                  << actuators.boardName(c.board) << " axis " << c.axis << ", " << c.scale << " counts/" << (c.rotation ? "rad" : "m") << std::endl;
+    }
+    std::cout << std::endl;
 
     // MESSAGES TO BE SENT
     endonasal_teleop::config3 q_msg;
     std_msgs::Bool rrUpdateStatusMsg;
+    ResolvedRatesOutput rrOut;
+    uint64_t lastJointTrace = 0;
+    std::vector<int> encCounts(actuators.numCounts(),0);
+    std::vector<int> sentCounts(actuators.numCounts(),0);
+    bool encSent = false;
+    OmniInputSample omniSample;
+    OmniInputSample omniReported;
+    OmniPredictionStats predictionReported;
+    double omniReportTime = monotonicSeconds();
+    Eigen::Vector3d pOmniPredicted;
+    Eigen::Vector4d qOmniPredicted;
+
+    // motor command streaming at the board rate (see motor_streamer.h)
+    bool motor_stream = true;
+    double motor_stream_rate = 220.0;
+    double motor_jerk_time = 0.01;
+    double motor_keepalive = 1.0;
+    ros::param::param<bool>("~motor_stream", motor_stream, true);
+    ros::param::param<double>("~motor_stream_rate", motor_stream_rate, 220.0);
+    ros::param::param<double>("~motor_jerk_time", motor_jerk_time, 0.01);
+    ros::param::param<double>("~motor_keepalive", motor_keepalive, 1.0);
+    MotorStreamer streamer(actuators.numCounts(), motor_stream_rate, motor_jerk_time, motor_keepalive);
+
+    // force feedback (see force_feedback.h); without it Omniforce stays zero,
+    // published once per control cycle. Off unless a launch file turns it
+    // on, until its gains are tuned on the device.
+    bool force_feedback = false;
+    HapticParams hapticParams;
+    ros::param::param<bool>("~force_feedback", force_feedback, false);
+    ros::param::param<double>("~force_rate", hapticParams.rate, hapticParams.rate);
+    ros::param::param<double>("~force_stiffness", hapticParams.stiffness, hapticParams.stiffness);
+    ros::param::param<double>("~force_deadband", hapticParams.deadband, hapticParams.deadband);
+    ros::param::param<double>("~force_ramp_time", hapticParams.rampTime, hapticParams.rampTime);
+    ros::param::param<double>("~force_limit_gain", hapticParams.limitGain, hapticParams.limitGain);
+    ros::param::param<double>("~force_limit_zone", hapticParams.limitZone, hapticParams.limitZone);
+    ros::param::param<double>("~force_anatomy_gain", hapticParams.anatomyGain, hapticParams.anatomyGain);
+    ros::param::param<double>("~force_max", hapticParams.maxForce, hapticParams.maxForce);
+    ros::param::param<double>("~force_max_rate", hapticParams.maxForceRate, hapticParams.maxForceRate);
+    ros::param::param<double>("~force_timeout", hapticParams.timeout, hapticParams.timeout);
+    forceFeedback.setParams(hapticParams);
+
+    // Omni input filters (see omni_filter.h); the added latency is reported
+    // every omni_filter_report_period seconds while the Omni moves
+    OmniFilterParams omniFilterParams;
+    double omni_filter_report_period = 5.0;
+    ros::param::param<bool>("~omni_filter", omniFilterParams.enabled, omniFilterParams.enabled);
+    ros::param::param<double>("~omni_pos_min_cutoff", omniFilterParams.position.minCutoff, omniFilterParams.position.minCutoff);
+    ros::param::param<double>("~omni_pos_beta", omniFilterParams.position.beta, omniFilterParams.position.beta);
+    ros::param::param<double>("~omni_pos_d_cutoff", omniFilterParams.position.dCutoff, omniFilterParams.position.dCutoff);
+    ros::param::param<double>("~omni_rot_min_cutoff", omniFilterParams.orientation.minCutoff, omniFilterParams.orientation.minCutoff);
+    ros::param::param<double>("~omni_rot_beta", omniFilterParams.orientation.beta, omniFilterParams.orientation.beta);
+    ros::param::param<double>("~omni_rot_d_cutoff", omniFilterParams.orientation.dCutoff, omniFilterParams.orientation.dCutoff);
+    ros::param::param<double>("~omni_filter_report_period", omni_filter_report_period, 5.0);
+    omniFilter.setParams(omniFilterParams);
+
+    // prediction of the Omni pose across the link delay (see omni_predictor.h)
+    OmniPredictorParams omniPredictorParams;
+    ros::param::param<bool>("~omni_predict", omniPredictorParams.enabled, omniPredictorParams.enabled);
+    ros::param::param<double>("~omni_predict_max_horizon", omniPredictorParams.maxHorizon, omniPredictorParams.maxHorizon);
+    ros::param::param<double>("~omni_predict_horizon_scale", omniPredictorParams.horizonScale, omniPredictorParams.horizonScale);
+    OmniPredictor omniPredictor(omniPredictorParams);
+    if (omniFilterParams.enabled)
+    {
+        std::cout << "Omni filter: position cutoff " << omniFilterParams.position.minCutoff << " Hz + "
+                  << omniFilterParams.position.beta << "/mm, orientation cutoff " << omniFilterParams.orientation.minCutoff
+                  << " Hz + " << omniFilterParams.orientation.beta << "/rad (at most "
+                  << 1e3/(2.0*M_PI*omniFilterParams.position.minCutoff) << " ms and "
+                  << 1e3/(2.0*M_PI*omniFilterParams.orientation.minCutoff) << " ms of lag)" << std::endl << std::endl;
+    }
 
-    // MISC.
-    Eigen::Vector3d zerovec;
-    zerovec.fill(0);
-    double theta;
-    double acosArg;
-    double trace;
-    Eigen::Matrix3d logR;
-    double logRmag;
-    Vector6d delta_q;
-    Eigen::Matrix<double,6,6> A;
-    Eigen::Matrix<double,6,6> Jstar;
+    // the streamer may go up to twice the controller's joint speed limits
+    // (so it only smooths, never lags a legal step) and reaches that in 50 ms
+    for (size_t k=0; k<actuators.connections().size(); k++)
+    {
+        const ActuatorConnection &c = actuators.connections()[k];
+        double maxVel = 2.0*(c.rotation ? rrParams.max_rot_speed : rrParams.max_trans_speed)*fabs(c.scale);
+        streamer.setLimits(actuators.boardOffset(c.board) + c.axis, maxVel, maxVel/0.05);
+    }
+
+    // optional per-cycle flight recorder (disabled unless a path is given)
+    std::string flight_recorder_path;
+    int flight_recorder_capacity = 60000;
+    ros::param::param<std::string>("~flight_recorder_path", flight_recorder_path, "");
+    ros::param::param<int>("~flight_recorder_capacity", flight_recorder_capacity, 60000);
+    FlightRecorder recorder;
+    if (!flight_recorder_path.empty())
+    {
+        if (recorder.open(flight_recorder_path, RECORD_RESOLVED_RATES, resolvedRatesFields,
+                          sizeof(resolvedRatesFields)/sizeof(FieldSpec), flight_recorder_capacity))
+        {
+            std::cout << "Recording every cycle to " << flight_recorder_path << std::endl << std::endl;
+        }
+        else
+        {
+            std::cout << "Could not open flight recorder file " << flight_recorder_path << std::endl << std::endl;
+        }
+    }
+    ResolvedRatesRecord cycleRecord;
+
+    // opt-in real-time profile (see realtime.h); the loop period is measured either way
+    RealtimeProfile rtProfile = readRealtimeProfile();
+    JitterMonitor loopJitter(rrParams.rosLoopRate);
+
+    // allocation guard (alloc_guard.h, builds with -DALLOC_GUARD=ON only)
+    bool abort_on_allocation;
+    ros::param::param<bool>("~abort_on_allocation", abort_on_allocation, false);
+    setAllocationAbort(abort_on_allocation);
 
 /*******************************************************************************
                 SET UP PUBLISHERS, SUBSCRIBERS, SERVICES & CLIENTS
@@ -744,22 +481,38 @@ int main(int argc, char *argv[])
 
     // subscribers
     ros::Subscriber omniButtonSub 	  = node.subscribe("Buttonstates",1,omniButtonCallback);
-    ros::Subscriber omniPoseSub   	  = node.subscribe("Omnipos",1,omniCallback);
     ros::Subscriber kinSub 	  	  = node.subscribe("kinematics_output",1,kinCallback);
     ros::Subscriber kinematics_status_pub = node.subscribe("kinematics_status",1,kinStatusCallback);
+    ros::Subscriber anatomySub        = node.subscribe("anatomy_constraints",1,anatomyConstraintsCallback);
+    ros::NodeHandle forceNode;
+    ros::CallbackQueue forceQueue;
+    forceNode.setCallbackQueue(&forceQueue);
+    ros::Subscriber forceOmniSub      = forceNode.subscribe("Omnipos",1,forceOmniCallback);
+    ros::NodeHandle omniNode;
+    ros::CallbackQueue omniQueue;
+    omniNode.setCallbackQueue(&omniQueue);
+    ros::Subscriber omniPoseSubLocal  = omniNode.subscribe("Omnipos",10,omniCallback);
+    omniPoseSub = &omniPoseSubLocal;
+    ros::Subscriber omniStampedSub    = omniNode.subscribe("Omnipos_stamped",10,omniStampedCallback);
+    ros::AsyncSpinner omniSpinner(1,&omniQueue);
 
     // publishers
     ros::Publisher rr_status_pub      = node.advertise<std_msgs::Bool>("rr_status",1000);
     ros::Publisher jointValPub 	      = node.advertise<endonasal_teleop::config3>("joint_q",1000);
     ros::Publisher omniForcePub       = node.advertise<geometry_msgs::Vector3>("Omniforce",1000);
-    ros::Publisher pubEncoderCommand1 = node.advertise<medlab_motor_control_board::McbEncoders>("MCB1/encoder_command", 1); // EC13
-    ros::Publisher pubEncoderCommand2 = node.advertise<medlab_motor_control_board::McbEncoders>("MCB4/encoder_command", 1); // EC16
+    for (int b=0; b<actuators.numBoards(); b++)
+    {
+        pubEncoderCommand.push_back(node.advertise<medlab_motor_control_board::McbEncoders>(actuators.boardName(b) + "/encoder_command", 1));
+    }
+
+    // latency trace events (see trace_events.h)
+    tracer.advertise(node);
 
     //clients
     ros::ServiceClient startingKinClient = node.serviceClient<endonasal_teleop::getStartingKin>("get_starting_kin");
 
     // rate
-    ros::Rate r(rosLoopRate);
+    ros::Rate r(rrParams.rosLoopRate);
 
 /*******************************************************************************
                 LOAD PARAMETERS FROM XML FILES
@@ -807,42 +560,40 @@ std::cout << "EEtype is now: " << EEtype << std::endl;
                 COMPUTE KINEMATICS FOR STARTING CONFIGURATION
 ********************************************************************************/
 
-    Configuration3 qstart;
-    qstart.PsiL = Eigen::Vector3d::Zero();
-    qstart.Beta << -160.9e-3, -127.2e-3, -86.4e-3;		// TODO: need to set these and get corresponding counts for initialization
-    qstart.Ftip = Eigen::Vector3d::Zero();	
-    qstart.Ttip = Eigen::Vector3d::Zero();
-
-    q_vec << qstart.PsiL(0), qstart.PsiL(1), qstart.PsiL(2), qstart.Beta(0), qstart.Beta(1), qstart.Beta(2);
+    Configuration3 qstart = ResolvedRatesController::homeConfiguration();
 
+    Eigen::Vector3d L;
     L << 222.5e-3, 163e-3, 104.4e-3;
 
+    rr.reset(qstart,L);
+
     // Call getStartingKin service:
     endonasal_teleop::getStartingKin get_starting_kin;
     get_starting_kin.request.kinrequest = true;
     ros::service::waitForService("get_starting_kin",-1);
     zero_force();
 
+    kinCur.alpha.fill(0);
     if (startingKinClient.call(get_starting_kin))
     {
         for(int i=0; i<3; i++)
         {
-            ptipcur(i) = get_starting_kin.response.p[i];
+            kinCur.ptip(i) = get_starting_kin.response.p[i];
         }
 
         for(int i=0; i<4; i++)
         {
-            qtipcur(i) = get_starting_kin.response.q[i];
+            kinCur.qtip(i) = get_starting_kin.response.q[i];
         }
 
         for (int i=0; i<6; i++)
         {
-            Jcur(0,i)=get_starting_kin.response.J1[i];
-            Jcur(1,i)=get_starting_kin.response.J2[i];
-            Jcur(2,i)=get_starting_kin.response.J3[i];
-            Jcur(3,i)=get_starting_kin.response.J4[i];
-            Jcur(4,i)=get_starting_kin.response.J5[i];
-            Jcur(5,i)=get_starting_kin.response.J6[i];
+            kinCur.J(0,i)=get_starting_kin.response.J1[i];
+            kinCur.J(1,i)=get_starting_kin.response.J2[i];
+            kinCur.J(2,i)=get_starting_kin.response.J3[i];
+            kinCur.J(3,i)=get_starting_kin.response.J4[i];
+            kinCur.J(4,i)=get_starting_kin.response.J5[i];
+            kinCur.J(5,i)=get_starting_kin.response.J6[i];
         }
 
         new_kin_msg = 1;
@@ -856,245 +607,211 @@ std::cout << "EEtype is now: " << EEtype << std::endl;
     }
 
     // Check that the kinematics got called once
-    std::cout << "ptip at start = " << std::endl << ptipcur << std::endl << std::endl;
-    std::cout << "qtip at start = " << std::endl << qtipcur << std::endl << std::endl;
-    std::cout << "J at start = " << std::endl << Jcur << std::endl << std::endl;
+    std::cout << "ptip at start = " << std::endl << kinCur.ptip << std::endl << std::endl;
+    std::cout << "qtip at start = " << std::endl << kinCur.qtip << std::endl << std::endl;
+    std::cout << "J at start = " << std::endl << kinCur.J << std::endl << std::endl;
+
+/*******************************************************************************
+                PREALLOCATION & REAL-TIME PROFILE
+********************************************************************************/
 
-    Eigen::Vector3d dhPrev;
-    dhPrev.fill(0);
+    // the streaming thread is started afterwards, so it inherits the profile
+    if (rtProfile.enabled)
+    {
+        std::string rtReport;
+        bool rtOk = applyRealtimeProfile(rtProfile,rtReport);
+        std::cout << (rtOk ? "Real-time profile:" : "Real-time profile (incomplete):") << std::endl << rtReport << std::endl;
+    }
+    PeriodicTimer rtTimer(rrParams.rosLoopRate);
 
-    prevOmni = omniPose;
+    omniSpinner.start();
+    if (motor_stream)
+    {
+        streamer.start(sendEncoderCommands);
+    }
+    if (force_feedback)
+    {
+        forceFeedback.start([&forceQueue]() { forceQueue.callAvailable(); },
+                            [&omniForcePub](const Eigen::Vector3d &f)
+                            {
+                                geometry_msgs::Vector3 forceMsg;
+                                forceMsg.x = f(0);
+                                forceMsg.y = f(1);
+                                forceMsg.z = f(2);
+                                omniForcePub.publish(forceMsg);
+                            });
+    }
 
     while (ros::ok())
     {
+        if (loopJitter.tick())
+        {
+            logger.count(NUM_SAT_COUNTERS);
+        }
+
+        // Omni input rate, the latency the filters added and the link and
+        // prediction accuracy since the last report
+        if (omni_filter_report_period > 0.0 && monotonicSeconds() - omniReportTime >= omni_filter_report_period)
+        {
+            long n = omniSample.samples - omniReported.samples;
+            long nPos = omniSample.positionMoving - omniReported.positionMoving;
+            long nRot = omniSample.orientationMoving - omniReported.orientationMoving;
+            if (omniFilterParams.enabled && (nPos > 0 || nRot > 0))
+            {
+                Eigen::Vector3d report;
+                report << n/(monotonicSeconds() - omniReportTime),
+                          nPos > 0 ? 1e3*(omniSample.positionLagSum - omniReported.positionLagSum)/nPos : 0.0,
+                          nRot > 0 ? 1e3*(omniSample.orientationLagSum - omniReported.orientationLagSum)/nRot : 0.0;
+                logger.log("Omni input [Hz], mean filter lag position, orientation [ms]",report.transpose());
+            }
+            const OmniPredictionStats &ps = omniPredictor.statistics();
+            long nEval = ps.evaluated - predictionReported.evaluated;
+            if (nEval > 0)
+            {
+                Vector7d report;
+                report << 1e3*omniSample.linkDelay, 1e3*omniSample.linkJitter,
+                          1e3*(ps.horizonSum - predictionReported.horizonSum)/(ps.predictions - predictionReported.predictions),
+                          sqrt((ps.positionSqError - predictionReported.positionSqError)/nEval),
+                          sqrt((ps.positionSqErrorHold - predictionReported.positionSqErrorHold)/nEval),
+                          sqrt((ps.angleSqError - predictionReported.angleSqError)/nEval),
+                          sqrt((ps.angleSqErrorHold - predictionReported.angleSqErrorHold)/nEval);
+                logger.log("Omni link delay, jitter, mean horizon [ms], RMS error predicted, unpredicted [mm], [rad]",report.transpose());
+            }
+            predictionReported = ps;
+            omniReported = omniSample;
+            omniReportTime = monotonicSeconds();
+        }
+
         if(new_kin_msg==1)
         {
-			//new_kin_msg = 0;
-            // take a "snapshot" of the current values from the kinematics and Omni for this loop iteration
-            curOmni = omniPose;
-            ptip = ptipcur;
-            qtip = qtipcur;
-	    	alpha = alphacur;
-            J = Jcur;
-            Rtip = quat2rotm(qtip);
-            robotTipFrame = assembleTransformation(Rtip,ptip);
-
-		// send commands to motorboards
-		double offset_trans_inner = 0; // -46800.0;
-		double offset_trans_middle = 0; // -36080.0;
-		double offset_trans_outer = 0; // -290.0;
-		double scale_rot = 16498.78; 		// counts/rad
-		double scale_trans = 6802.16*1e3;		// counts/m
-		double scale_trans_outer = 2351.17*1e3;	// counts/m
-
-		medlab_motor_control_board::McbEncoders enc1;
-		medlab_motor_control_board::McbEncoders enc2;
-
-//		enc1.count[0] = (int)(q_msg.joint_q[3] * scale_trans - offset_trans_inner); // inner translation
-		enc1.count[0] = (int)((q_vec[3] - qstart.Beta[0]) * scale_trans); // inner translation
-		enc1.count[1] = (int)(alpha[0] * scale_rot); // inner rotation
-		enc1.count[2] = (int)(alpha[2] * scale_rot); // outer rotation
-//		enc1.count[3] = (int)(q_msg.joint_q[4] * scale_trans - offset_trans_middle); // middle translation
-		enc1.count[3] = (int)((q_vec[4] - qstart.Beta[1]) * scale_trans);  // middle translation
-		enc1.count[4] = (int)(alpha[1] * scale_rot); // middle rotation
-		enc1.count[5] = 0; // accessory
-
-//		enc2.count[0] = (int)(q_msg.joint_q[5] * scale_trans_outer - offset_trans_outer); // external translation
-		enc2.count[0] = 0; // (int)((q_vec[5] - qstart.Beta[2]) * scale_trans_outer); 	// outer translation
-		enc2.count[1] = 0;
- 		enc2.count[2] = (int)((q_vec[5] - qstart.Beta[2]) * scale_trans_outer); 	// outer translation;
-		enc2.count[3] = 0;
- 		enc2.count[4] = 0;
-  		enc2.count[5] = 0;
-
-		pubEncoderCommand1.publish(enc1); 
-		pubEncoderCommand2.publish(enc2);
-
-            if(buttonState==1) //must clutch in button for any motions to happen
+            // one resolved rates step on a "snapshot" of the current kinematics and Omni values
+            if (omniInput.read(omniSample))
+            {
+                omniPredictor.predict(omniSample,monotonicSeconds(),pOmniPredicted,qOmniPredicted);
+                rr.onOmniPose(pOmniPredicted,qOmniPredicted);
+            }
+            uint64_t cycleOmniTrace = omniSample.traceId;
+            uint64_t cycleKinTrace = kinTraceId;
             {
-                //std::cout << "J(beta) = " << std::endl << J << std::endl << std::endl;
-                std::cout << "ptip = " << std::endl << ptip.transpose() << std::endl << std::endl;
-                //std::cout << "qtip = " << std::endl << qtip.transpose() << std::endl << std::endl;
-
-				Matrix4d ROmniFrameAtClutch; // Rotation of the Omni frame tip at clutch in
-
-                //furthermore, if this is the first time step of clutch in, we need to save the robot pose & the omni pose
-                if(justClutched==true)
-                {
-                    robotTipFrameAtClutch = robotTipFrame;
-                    omniFrameAtClutch = omniPose;
-					ROmniFrameAtClutch = assembleTransformation(omniFrameAtClutch.block(0,0,3,3),zerovec);
-                    Tregs = assembleTransformation(Rtip.transpose(),zerovec);
-                    std::cout << "robotTipFrameAtClutch = " << std::endl << robotTipFrameAtClutch << std::endl << std::endl;
-                    std::cout << "omniFrameAtClutch = " << std::endl << omniFrameAtClutch << std::endl << std::endl;
-                    justClutched = false; // next time, skip this step
-                }
-
-                // find change in omni position and orientation from the clutch pose
-                omniDelta_omniCoords = Mtransform::Inverse(ROmniFrameAtClutch.transpose())*Mtransform::Inverse(omniFrameAtClutch)*curOmni*ROmniFrameAtClutch.transpose();
-		//omniDelta_omniCoords = Mtransform::Inverse(omniFrameAtClutch)*curOmni;
-				// std::cout << "omniDelta_omniCoords = " << std::endl << omniDelta_omniCoords << std::endl << std::endl;
-
-                // expressed in cannula base frame coordinates
-                omniDelta_cannulaCoords = OmniRegInv*omniDelta_omniCoords*OmniReg;
-
-                // convert position units mm -> m
-                omniDelta_cannulaCoords.block(0,3,3,1) = omniDelta_cannulaCoords.block(0,3,3,1)/1000.0;
-
-                // scale position through scaling ratio
-                omniDelta_cannulaCoords.block(0,3,3,1) = scale_factor*omniDelta_cannulaCoords.block(0,3,3,1);
-
-                // scale orientation through scaling ratio (if it is large enough)
-                trace = omniDelta_cannulaCoords(0,0)+omniDelta_cannulaCoords(1,1)+omniDelta_cannulaCoords(2,2);
-                acosArg = 0.5*(trace-1);
-                if(acosArg>1.0) {acosArg = 1.0;}
-                if(acosArg<-1.0) {acosArg = -1.0;}
-                theta = acos(acosArg);
-                if(fabs(theta)>1.0e-3)
-                {
-                    Eigen::Matrix3d Rdelta;
-                    Rdelta = omniDelta_cannulaCoords.block(0,0,3,3);
-                    logR = theta/(2*sin(theta))*(Rdelta-Rdelta.transpose());
-                    logRmag = logR(2,1)*logR(2,1) + logR(1,0)*logR(1,0) + logR(0,2)*logR(0,2);
-                    logRmag *= 0.8;
-                    logR *= 0.8;
-                    if(logRmag > 1.0e-3)
-                    {
-                        Rdelta = Eigen::MatrixXd::Identity(3,3) + sin(logRmag)/logRmag*logR + (1-cos(logRmag))/(logRmag*logRmag)*logR*logR;
-                        Mtransform::SetRotation(omniDelta_cannulaCoords,Rdelta);
-                    }
-                }
-
-               // std::cout << "omniDelta_cannulaCoords = " << std::endl << omniDelta_cannulaCoords << std::endl << std::endl;
-                //std::cout << "robotTipFrame = " << std::endl << robotTipFrame << std::endl << std::endl;
-
-                // compute the desired robot motion from the omni motion
-                robotDesFrameDelta = Mtransform::Inverse(robotTipFrame) * robotTipFrameAtClutch * Tregs * omniDelta_cannulaCoords * Mtransform::Inverse(Tregs);
-
-                // convert to twist coordinates ("wedge" operator)
-	 	///*                
-		robotDesTwist[0]=robotDesFrameDelta(0,3); //v_x
-                robotDesTwist[1]=robotDesFrameDelta(1,3); //v_y
-                robotDesTwist[2]=robotDesFrameDelta(2,3); //v_z
-                robotDesTwist[3]=robotDesFrameDelta(2,1); //w_x
-                robotDesTwist[4]=robotDesFrameDelta(0,2); //w_y
-                robotDesTwist[5]=robotDesFrameDelta(1,0); //w_z
-		//*/
-
-		/*
-		robotDesTwist[0]=0.0; //v_x
-                robotDesTwist[1]=0.0; //v_y
-                robotDesTwist[2]=0.0; //v_z
-                robotDesTwist[3]=0.0; //w_x
-                robotDesTwist[4]=0.0; //w_y
-                robotDesTwist[5]=0.1; //w_z
-		*/
-
-                std::cout << "robotDesTwist = " << std::endl << robotDesTwist.transpose() << std::endl << std::endl;
-				robotDesTwist = scaleOmniVelocity(robotDesTwist);
-				std::cout << "scaled robotDesTwist = " << std::endl << robotDesTwist.transpose() << std::endl << std::endl;
-
-                // position control only:
-//                Eigen::Vector3d delta_x = robotDesTwist.head(3);
-//                Eigen::Matrix<double,3,6> Jpos = J.topRows(3);
-//                A = (Jpos.transpose()*Jpos + 1e-4*Eigen::MatrixXd::Identity(6,6));
-//                Jstar = A.inverse()*Jpos.transpose();
-
-//                // position and orientation control:
-//                A = J.transpose()*J + 1e-6*Eigen::MatrixXd::Identity(6,6);
-//                Jstar = A.inverse()*J.transpose();
-
-//                //main resolved rates update
-
-//                delta_q = J.colPivHouseholderQr().solve(robotDesTwist);
-//                delta_q = Jstar*delta_x;
-//                delta_q = Jstar*robotDesTwist;
-//                q_vec = q_vec + delta_q;
-
-                // same as what's on the bimanual
-                /*Eigen::Matrix<double,6,6> K = J.transpose()*W_tracking*J + W_damping;
-                Vector6d V = J.transpose()*W_tracking*robotDesTwist;
-                delta_q = K.partialPivLu().solve(V);
-				delta_q = saturateJointVelocities(delta_q,rosLoopRate);
-                q_vec = q_vec + delta_q;
-				*/
-				//std::cout << "delta_q = "  << std::endl << delta_q.transpose() << std::endl << std::endl;
-				
-				// Check if valid betas
-				//Vector6d qx_vec = transformBetaToX(q_vec,L);
-				//qx_vec.tail(3) = limitBetaValsSimple(qx_vec.tail(3),L);
-				//q_vec = transformXToBeta(qx_vec,L);
-
-//                // Transformation from qbeta to qx:
-                Eigen::Matrix<double,6,6> Jx = J*dqbeta_dqx;
-                //std::cout << "Jx = " << std::endl << Jx << std::endl << std::endl;
-                Vector6d qx_vec = transformBetaToX(q_vec,L);
-
-                // Joint limit avoidance weighting matrix
-                weightingRet Wout = getWeightingMatrix(qx_vec.tail(3),dhPrev,L,lambda_jointlim);
-                Eigen::Matrix<double,6,6> W_jointlim = Wout.W;
-                dhPrev = Wout.dh; // and save this dh value for next time
-
-                // Resolved rates update
-                Eigen::Matrix<double,6,6> A = Jx.transpose()*W_tracking*Jx + W_damping + W_jointlim;
-                Vector6d b = Jx.transpose()*W_tracking*robotDesTwist;
-				//Eigen::Matrix<double,6,6> A = Jx.transpose()*W_tracking*Jx;
-				//Vector6d b = Jx.transpose()*W_tracking*robotDesTwist;
-                delta_qx = A.partialPivLu().solve(b);
-				//std::cout <<"delta_qx: "<< delta_qx.transpose() << std::endl << std::endl;
-
-		//delta_qx = saturateJointVelocities(delta_qx, rosLoopRate);
-                qx_vec = qx_vec + delta_qx;
-
-                // Correct joint limit violations
-                qx_vec.tail(3) = limitBetaValsSimple(qx_vec.tail(3),L);
-
-//                //            Eigen::Matrix<double,6,6> K1 = Jx.transpose()*W_tracking*Jx + W_damping;
-//                //            Vector6d V = Jx.transpose()*W_tracking*robotDesTwist;
-//                //            Vector6d delta_qx = K1.partialPivLu().solve(V);
-//                qx_vec = qx_vec + delta_qx;
-
-//                std::cout << "delta_qx = " << delta_qx << std::endl << std::endl;
-//                std::cout << "qx_vec = " << qx_vec << std::endl << std::endl;
-
-                // Transform qbeta back from qx
-                q_vec = transformXToBeta(qx_vec,L);
-                //std::cout << "q_vec = " << std::endl << q_vec.transpose() << std::endl;
-				std::cout << "----------------------------------------------------" << std::endl << std::endl;
-
-                prevOmni = curOmni;
-
-                for(int h = 0; h<6; h++)
-                {
-                    q_msg.joint_q[h] = q_vec(h);
-                    q_msg.joint_q[h+6] = 0;
-                }
-                rrUpdateStatusMsg.data = true;
+                HotRegion hot;
+                rr.step(kinCur,rrOut);
+                actuators.toCounts(rrOut.actuatorJoints.data(),encCounts.data());
+            }
+            if (force_feedback)
+            {
+                forceFeedback.update(rrOut.haptic);
             }
 
-            else    // if the button isn't clutched, just send out the current joint values to kinematics
+            // send commands to motorboards (only when they change)
+            if (motor_stream)
+            {
+                streamer.setTarget(encCounts.data(),cycleKinTrace);
+            }
+            else if (!encSent || encCounts != sentCounts)
             {
-                for(int h = 0; h<6; h++)
-                {
-                    q_msg.joint_q[h] = q_vec(h);
-                    q_msg.joint_q[h+6] = 0;
-                }
-                rrUpdateStatusMsg.data = true;
+                sendEncoderCommands(encCounts.data(),cycleKinTrace);
+                sentCounts = encCounts;
+                encSent = true;
             }
 
+            // send out the current joint values to kinematics
+            for(int h = 0; h<6; h++)
+            {
+                q_msg.joint_q[h] = rrOut.q_vec(h);
+                q_msg.joint_q[h+6] = 0;
+            }
+            rrUpdateStatusMsg.data = true;
+
+            cycleRecord = ResolvedRatesRecord();
+            Eigen::Map<Eigen::Vector3d>(cycleRecord.omniPos) = omniSample.rawPosition;
+            Eigen::Map<Eigen::Vector4d>(cycleRecord.omniQuat) = omniSample.rawOrientation;
+            cycleRecord.buttonState = rr.button();
+            cycleRecord.clutched = rrOut.clutched;
+            Eigen::Map<Eigen::Matrix<double,6,6,Eigen::RowMajor> >(cycleRecord.J) = kinCur.J;
+            Eigen::Map<Vector6d>(cycleRecord.robotDesTwist) = rrOut.robotDesTwist;
+            Eigen::Map<Vector6d>(cycleRecord.delta_qx) = rrOut.delta_qx;
+            Eigen::Map<Vector6d>(cycleRecord.q_vec) = rrOut.q_vec;
+            Eigen::Map<Vector6d>(cycleRecord.W_jointlim) = rrOut.W_jointlim;
+            for (int i=0; i<6; i++)
+            {
+                cycleRecord.enc1[i] = encCounts[i];
+                cycleRecord.enc2[i] = actuators.numBoards() > 1 ? encCounts[actuators.boardOffset(1) + i] : 0;
+            }
+            cycleRecord.solverIterations = rrOut.solverIterations;
+            recorder.write(cycleRecord);
+
             // publish
+            q_msg.trace_id = cycleOmniTrace;
             jointValPub.publish(q_msg);
+            if (cycleOmniTrace != lastJointTrace)
+            {
+                tracer.emit(cycleOmniTrace,endonasal_teleop::traceEvent::RR_JOINT_PUBLISH);
+                lastJointTrace = cycleOmniTrace;
+            }
             rr_status_pub.publish(rrUpdateStatusMsg);
-            omniForcePub.publish(omniForce);
-
-
+            if (!force_feedback)
+            {
+                omniForcePub.publish(omniForce);
+            }
         }
 
         // sleep
         ros::spinOnce();
-        r.sleep();
+        if (rtProfile.enabled)
+        {
+            rtTimer.wait();
+        }
+        else
+        {
+            r.sleep();
+        }
+    }
+
+    loopJitter.print("resolved_rates loop");
+    if (allocationGuardEnabled())
+    {
+        std::cout << "Heap allocations in the control loop: " << hotAllocations() << std::endl;
+    }
+
+    omniSpinner.stop();
+    if (omniSample.samples > 0)
+    {
+        std::cout << "Omni input: " << omniSample.samples << " samples";
+        if (omniFilterParams.enabled && omniSample.positionMoving > 0)
+        {
+            std::cout << ", position filter lag " << 1e3*omniSample.positionLagSum/omniSample.positionMoving
+                      << " ms mean, " << 1e3*omniSample.positionLagMax << " ms max";
+        }
+        if (omniFilterParams.enabled && omniSample.orientationMoving > 0)
+        {
+            std::cout << ", orientation filter lag " << 1e3*omniSample.orientationLagSum/omniSample.orientationMoving
+                      << " ms mean, " << 1e3*omniSample.orientationLagMax << " ms max";
+        }
+        std::cout << std::endl;
+    }
+    const OmniPredictionStats &ps = omniPredictor.statistics();
+    if (ps.evaluated > 0)
+    {
+        std::cout << "Omni link delay " << 1e3*omniSample.linkDelay << " ms, jitter " << 1e3*omniSample.linkJitter
+                  << " ms; prediction over " << 1e3*ps.horizonSum/ps.predictions << " ms on average, RMS error "
+                  << sqrt(ps.positionSqError/ps.evaluated) << " mm (" << sqrt(ps.positionSqErrorHold/ps.evaluated)
+                  << " mm without), " << sqrt(ps.angleSqError/ps.evaluated) << " rad ("
+                  << sqrt(ps.angleSqErrorHold/ps.evaluated) << " rad without)" << std::endl;
+    }
+
+    if (force_feedback)
+    {
+        forceFeedback.stop();
+        std::cout << "Force feedback rendered " << forceFeedback.ticks() << " ticks, "
+                  << forceFeedback.overruns() << " late" << std::endl;
+    }
+
+    if (motor_stream)
+    {
+        streamer.stop();
+        std::cout << "Motor streaming sent " << streamer.commandsSent() << " commands in "
+                  << streamer.ticks() << " ticks" << std::endl;
     }
 
     return 0;
 }
-
@@ -0,0 +1,818 @@
+#ifndef RESOLVED_RATES_CORE_H
+#define RESOLVED_RATES_CORE_H
+
+/********************************************************************
+
+  resolved_rates_core.h
+
+Resolved rates controller for the endonasal teleoperation system,
+independent of ROS. The resolved_rates node feeds it Omni poses, button
+states and kinematics snapshots from its subscribers and publishes what
+it returns; teleop_replay drives it in-process from a recording.
+
+********************************************************************/
+
+#include "teleop_common.h"
+#include "bounded_qp.h"
+#include "spd_solve.h"
+#include "async_logger.h"
+#include "force_feedback.h"
+#include "anatomy_fixture.h"
+
+#include <Mtransform.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// saturation counters, reported through the logger once per second
+enum SaturationCounter
+{
+    ROT_SPEED_SAT_1, ROT_SPEED_SAT_2, ROT_SPEED_SAT_3,
+    TRANS_SPEED_SAT_1, TRANS_SPEED_SAT_2, TRANS_SPEED_SAT_3,
+    TUBE1_SAT_FRONT, TUBE1_SAT_REAR,
+    TUBE2_SAT_FRONT, TUBE2_SAT_REAR,
+    TUBE3_SAT_FRONT, TUBE3_SAT_REAR,
+    QP_ITERATION_CAP,
+    ANATOMY_FIXTURE_ACTIVE,
+    NUM_SAT_COUNTERS
+};
+
+static const char * const saturationLabels[NUM_SAT_COUNTERS] =
+{
+    "Tube rotation speed saturated for tube 1",
+    "Tube rotation speed saturated for tube 2",
+    "Tube rotation speed saturated for tube 3",
+    "Tube translation speed saturated for tube 1",
+    "Tube translation speed saturated for tube 2",
+    "Tube translation speed saturated for tube 3",
+    "Tube 1 translation saturated (front)",
+    "Tube 1 translation saturated (rear)",
+    "Tube 2 translation saturated (front)",
+    "Tube 2 translation saturated (rear)",
+    "Tube 3 translation saturated (front)",
+    "Tube 3 translation saturated (rear)",
+    "Constrained solver hit its iteration cap",
+    "Anatomy fixture resisted the step"
+};
+
+inline Vector6d transformBetaToX(Vector6d qbeta, Eigen::Vector3d L)
+{
+    Vector6d qx;
+    qx << qbeta(0), qbeta(1), qbeta(2), 0, 0, 0;
+    qx(3) = L(0) - L(1) + qbeta(3) - qbeta(4);
+    qx(4) = L(1) - L(2) + qbeta(4) - qbeta(5);
+    qx(5) = L(2) + qbeta(5);
+    return qx;
+}
+
+inline Vector6d transformXToBeta(Vector6d qx, Eigen::Vector3d L)
+{
+    Vector6d qbeta;
+    qbeta << qx(0), qx(1), qx(2), 0, 0, 0;
+    qbeta(3) = qx(3) + qx(4) + qx(5) - L(0);
+    qbeta(4) = qx(4) + qx(5) - L(1);
+    qbeta(5) = qx(5) - L(2);
+    return qbeta;
+}
+
+inline double dhFunction(double xmin, double xmax, double x)
+{
+    double dh = fabs((xmax-xmin)*(xmax-xmin)*(2*x-xmax-xmin)/(4*(xmax-x)*(xmax-x)*(x-xmin)*(x-xmin)));
+
+    return dh;
+}
+
+struct weightingRet
+{
+    Eigen::Matrix<double,6,6>   W;
+    Eigen::Vector3d             dh;
+};
+
+inline weightingRet getWeightingMatrix(Eigen::Vector3d x, Eigen::Vector3d dhPrev, Eigen::Vector3d L, double lambda)
+{
+    Eigen::Matrix<double,6,6> W = Eigen::Matrix<double,6,6>::Identity();
+
+    // No penalties on the rotational degrees of freedom (they don't have any joint limits)
+    // Therefore leave the first three entries in W as 1.
+
+    double eps = 2e-3;
+
+    // x1:
+    double x1min = eps;
+    double x1max = L(0)-L(1)-eps;
+    double x1 = x(0);
+    double dh1 = dhFunction(x1min,x1max,x1);
+    W(3,3) = (dh1 >= dhPrev(0))*(1+dh1) + (dh1 < dhPrev(0))*1;
+    //W(3,3) = 1+dh1;
+    W(3,3) *= lambda;
+
+    // x2:
+    double x2min = eps;
+    double x2max = L(1)-L(2)-eps;
+    double x2 = x(1);
+    double dh2 = dhFunction(x2min,x2max,x2);
+    W(4,4) = (dh2 >= dhPrev(1))*(1+dh2) + (dh2 < dhPrev(1))*1;
+    //W(4,4) = 1+dh2;
+    W(4,4) *= lambda;
+
+    // x3:
+    double x3min = eps;
+    double x3max = L(2)-eps;
+    double x3 = x(2);
+    double dh3 = dhFunction(x3min,x3max,x3);
+    W(5,5) = (dh3 >= dhPrev(2))*(1+dh3) + (dh3 < dhPrev(2))*1;
+    //W(5,5) = 1+dh3;
+    W(5,5) *= lambda;
+
+    Eigen::Vector3d dh;
+    dh << dh1,dh2,dh3;
+
+    weightingRet output;
+    output.W = W;
+    output.dh = dh;
+    return output;
+}
+
+inline Eigen::Vector3d limitBetaValsBimanualAlgorithm(Eigen::Vector3d Beta_in, Eigen::Vector3d L_in)
+{
+    int nTubes = 3;
+
+    // plate thicknesses (constant)
+    // eventually we'll want to load them from elsewhere
+    // these also need to be updated to correct values for the new robot
+    // and this whole algorithm will need to be adapted
+    Eigen::Matrix<double,4,1> tplus;
+    tplus << 0.0, 10e-3, 10e-3, 10e-3;
+
+    Eigen::Matrix<double,4,1> tminus;
+    tminus << 0.0, 10e-3, 10e-3, 10e-3;
+
+    Eigen::Matrix<double,4,1> extMargin;
+    extMargin << 1e-3, 1e-3, 10e-3, 1e-3;
+    // tube 2 is different because we have to make sure it doesn't knock off the end effector
+
+    double tp = 25e-3;
+
+    Eigen::Matrix<double,4,1> L;
+    L << 3*L_in(0), L_in(0), L_in(1), L_in(2);
+
+    Eigen::Matrix<double,4,1> beta;
+    beta << -2*L_in(0), Beta_in(0), Beta_in(1), Beta_in(2);
+
+    // starting with tube 1, correct any translational joint limit violations
+    for (int i = 1; i <=nTubes; i++)
+    {
+        // if it's going to hit the carriage behind it, move it up:
+        if (beta(i) - tminus(i) < beta(i-1) + tplus(i-1))
+        {
+            beta(i) = beta(i-1) + tplus(i-1) + tminus(i);
+        }
+
+        // if it's going to not leave space for the other carriages in front of it, move it back:
+        double partial_sum = 0.0;
+        for (int k = i+1; k <= nTubes; k++)
+        {
+            partial_sum += tplus(k) + tminus(k);
+        }
+        if (beta(i) + tplus(i) > -tp - partial_sum)
+        {
+            beta(i) = -tp - partial_sum - tplus(i);
+        }
+
+        // if the tube is getting too close to the end of the next tube out, move it up:
+        if (beta(i) + L(i) > beta(i-1) + L(i-1) - extMargin(i))
+        {
+            beta(i) = beta(i-1) + L(i-1) - L(i) - extMargin(i);
+        }
+
+        // if the tube is going to retract all the way behind the front plate, move it up:
+        if (beta(i) + L(i) - 0.001*(nTubes-i+1) < 0.0)
+        {
+            beta(i) = -L(i) + 0.001*(nTubes-i+1);
+        }
+    }
+
+    Eigen::Vector3d Beta;
+    Beta << beta(1), beta(2), beta(3);
+    return Beta;
+}
+
+// TELEOP PARAMETERS
+struct ResolvedRatesParams
+{
+    double rosLoopRate;
+    double scale_factor;
+    double lambda_tracking;     // originally 1.0			// TODO: tune these gains
+    double lambda_damping;      // originally 5.0
+    double lambda_jointlim;     // originally 10.0
+    double lambda_anatomy;      // anatomy fixture weight (anatomy_fixture.h)
+    double max_rot_speed;       // rad/sec
+    double max_trans_speed;     // m/sec
+    double translation_margin;  // minimum margin kept from each translation limit [m]
+    bool use_constrained_solver;
+    int qp_max_iterations;
+
+    ResolvedRatesParams()
+        : rosLoopRate(100.0), scale_factor(0.10),
+          lambda_tracking(10.0), lambda_damping(50.0), lambda_jointlim(100.0), lambda_anatomy(100.0),
+          max_rot_speed(0.8), max_trans_speed(5.0e-3), translation_margin(0.5e-3),
+          use_constrained_solver(true), qp_max_iterations(12)
+    {}
+};
+
+// snapshot of the kinematics output (kinout message / getStartingKin response)
+struct KinematicsState
+{
+    KinematicsState() : seq(0) {}
+
+    uint64_t seq;                   // joint command it was computed for (teleop_executor), else 0
+    Eigen::Vector3d ptip;
+    Eigen::Vector4d qtip;
+    Eigen::Vector3d alpha;
+    Matrix6d J;
+    AnatomyConstraintSet anatomy;   // anatomy_constraints message, empty without fixtures
+};
+
+// everything one control cycle produces
+struct ResolvedRatesOutput
+{
+    Vector6d q_vec;             // joint values for kinematics (joint_q[0..5])
+    Vector6d actuatorJoints;    // tube rotations alpha [rad], then translations [m] (see actuator_map.h)
+    bool clutched;
+    Vector6d robotDesTwist;     // zero unless clutched
+    Vector6d delta_qx;          // zero unless clutched
+    Vector6d W_jointlim;        // diagonal, zero unless clutched
+    int solverIterations;
+    HapticSnapshot haptic;      // for the force feedback thread, inactive unless clutched
+};
+
+class ResolvedRatesController
+{
+public:
+    ResolvedRatesController(const ResolvedRatesParams &p = ResolvedRatesParams())
+        : params(p), jointStepQP(p.qp_max_iterations), logger(0),
+          buttonState(0), buttonStatePrev(0), justClutched(false)
+    {
+        // motion tracking weighting matrix (task space):
+        W_tracking = Eigen::Matrix<double,6,6>::Zero();
+        W_tracking(0,0) = params.lambda_tracking*1.0e6;
+        W_tracking(1,1) = params.lambda_tracking*1.0e6;
+        W_tracking(2,2) = params.lambda_tracking*1.0e6;
+        W_tracking(3,3) = 0.1*params.lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
+        W_tracking(4,4) = 0.1*params.lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
+        W_tracking(5,5) = params.lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
+
+        // damping weighting matrix (actuator space):
+        W_damping = Eigen::Matrix<double,6,6>::Zero();
+        double thetadeg = 2.0; // degrees to damp as much as 1 mm
+        W_damping(0,0) = params.lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
+        W_damping(1,1) = params.lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
+        W_damping(2,2) = params.lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
+        W_damping(3,3) = params.lambda_damping*1.0e6;
+        W_damping(4,4) = params.lambda_damping*1.0e6;
+        W_damping(5,5) = params.lambda_damping*1.0e6;
+
+        // conversion from beta to x:
+        Eigen::Matrix3d dbeta_dx;
+        dbeta_dx << 1, 1, 1,
+                    0, 1, 1,
+                    0, 0, 1;
+
+        dqbeta_dqx.fill(0);
+        dqbeta_dqx.block(0,0,3,3) = Eigen::Matrix3d::Identity();
+        dqbeta_dqx.block(3,3,3,3) = dbeta_dx;
+
+        // OMNI REGISTRATION (constant)
+        OmniReg = Matrix4d::Identity();
+        Eigen::Matrix3d rotationY = Eigen::AngleAxisd(M_PI,Eigen::Vector3d::UnitY()).toRotationMatrix();
+        Mtransform::SetRotation(OmniReg,rotationY);
+        OmniRegInv = Mtransform::Inverse(OmniReg);
+
+        zerovec.fill(0);
+        omniPose = Matrix4d::Identity();
+        omniFrameAtClutch = Matrix4d::Identity();
+        ROmniFrameAtClutch = Matrix4d::Identity();
+        robotTipFrameAtClutch = Matrix4d::Identity();
+        Tregs = Matrix4d::Identity();
+        dhPrev.fill(0);
+        q_vec.fill(0);
+        L.fill(0);
+    }
+
+    // optional; counts saturations if set
+    void setLogger(AsyncLogger *lg)
+    {
+        logger = lg;
+    }
+
+    const ResolvedRatesParams &parameters() const { return params; }
+    const Matrix6d &trackingWeights() const { return W_tracking; }
+    const Matrix6d &dampingWeights() const { return W_damping; }
+
+    // starting configuration handed out by get_starting_config; Beta is the
+    // encoder zero, so it must match the HomePosition entries in hardware.xml
+    static Configuration3 homeConfiguration()
+    {
+        Configuration3 qstart;
+        qstart.PsiL = Eigen::Vector3d::Zero();
+        qstart.Beta << -160.9e-3, -127.2e-3, -86.4e-3;		// TODO: need to set these and get corresponding counts for initialization
+        qstart.Ftip = Eigen::Vector3d::Zero();
+        qstart.Ttip = Eigen::Vector3d::Zero();
+        return qstart;
+    }
+
+    // starting configuration and tube lengths
+    void reset(const Configuration3 &qstart, Eigen::Vector3d tubeLengths)
+    {
+        q_vec << qstart.PsiL(0), qstart.PsiL(1), qstart.PsiL(2), qstart.Beta(0), qstart.Beta(1), qstart.Beta(2);
+        L = tubeLengths;
+        dhPrev.fill(0);
+        jointStepQP.reset();
+        justClutched = false;
+    }
+
+    const Vector6d &joints() const { return q_vec; }
+    int button() const { return buttonState; }
+
+    void onOmniPose(const Eigen::Vector3d &pOmni, const Eigen::Vector4d &qOmni)
+    {
+        Eigen::Matrix3d ROmni = quat2rotm(qOmni);
+
+        omniPose.fill(0);
+        omniPose.topLeftCorner(3,3) = ROmni;
+        omniPose.topRightCorner(3,1) = pOmni;
+        omniPose(3,3) = 1.0;
+    }
+
+    void onButton(int state)
+    {
+        buttonStatePrev = buttonState;
+        buttonState = state;
+        if(buttonState==1 && buttonStatePrev==0)
+        {
+            justClutched = true;
+        }
+    }
+
+    // one control cycle
+    void step(const KinematicsState &kin, ResolvedRatesOutput &out)
+    {
+        // take a "snapshot" of the current values from the kinematics and Omni for this loop iteration
+        Matrix4d curOmni = omniPose;
+        Eigen::Vector3d ptip = kin.ptip;
+        Eigen::Vector4d qtip = kin.qtip;
+        Matrix6d J = kin.J;
+        Eigen::Matrix3d Rtip = quat2rotm(qtip);
+        Matrix4d robotTipFrame = assembleTransformation(Rtip,ptip);
+
+        // joint values for the motorboards (converted to counts by ActuatorMap)
+        out.actuatorJoints << kin.alpha, q_vec.tail<3>();
+
+        out.clutched = (buttonState==1);
+        out.robotDesTwist.fill(0);
+        out.delta_qx.fill(0);
+        out.W_jointlim.fill(0);
+        out.solverIterations = 0;
+        out.haptic.active = false;
+
+        if(buttonState==1) //must clutch in button for any motions to happen
+        {
+            if (logger)
+            {
+                logger->log("ptip",ptip);
+            }
+
+            //furthermore, if this is the first time step of clutch in, we need to save the robot pose & the omni pose
+            if(justClutched==true)
+            {
+                robotTipFrameAtClutch = robotTipFrame;
+                omniFrameAtClutch = omniPose;
+                ROmniFrameAtClutch = assembleTransformation(omniFrameAtClutch.block(0,0,3,3),zerovec);
+                Tregs = assembleTransformation(Rtip.transpose(),zerovec);
+                if (logger)
+                {
+                    logger->log("robotTipFrameAtClutch",robotTipFrameAtClutch);
+                    logger->log("omniFrameAtClutch",omniFrameAtClutch);
+                }
+                justClutched = false; // next time, skip this step
+            }
+
+            // find change in omni position and orientation from the clutch pose
+            Matrix4d omniDelta_omniCoords = Mtransform::Inverse(ROmniFrameAtClutch.transpose())*Mtransform::Inverse(omniFrameAtClutch)*curOmni*ROmniFrameAtClutch.transpose();
+
+            // expressed in cannula base frame coordinates
+            Matrix4d omniDelta_cannulaCoords = OmniRegInv*omniDelta_omniCoords*OmniReg;
+
+            // convert position units mm -> m
+            omniDelta_cannulaCoords.block(0,3,3,1) = omniDelta_cannulaCoords.block(0,3,3,1)/1000.0;
+
+            // scale position through scaling ratio
+            omniDelta_cannulaCoords.block(0,3,3,1) = params.scale_factor*omniDelta_cannulaCoords.block(0,3,3,1);
+
+            // scale orientation through scaling ratio (if it is large enough)
+            double trace = omniDelta_cannulaCoords(0,0)+omniDelta_cannulaCoords(1,1)+omniDelta_cannulaCoords(2,2);
+            double acosArg = 0.5*(trace-1);
+            if(acosArg>1.0) {acosArg = 1.0;}
+            if(acosArg<-1.0) {acosArg = -1.0;}
+            double theta = acos(acosArg);
+            if(fabs(theta)>1.0e-3)
+            {
+                Eigen::Matrix3d Rdelta;
+                Rdelta = omniDelta_cannulaCoords.block(0,0,3,3);
+                Eigen::Matrix3d logR = theta/(2*sin(theta))*(Rdelta-Rdelta.transpose());
+                double logRmag = logR(2,1)*logR(2,1) + logR(1,0)*logR(1,0) + logR(0,2)*logR(0,2);
+                logRmag *= 0.8;
+                logR *= 0.8;
+                if(logRmag > 1.0e-3)
+                {
+                    Rdelta = Eigen::Matrix3d::Identity() + sin(logRmag)/logRmag*logR + (1-cos(logRmag))/(logRmag*logRmag)*logR*logR;
+                    Mtransform::SetRotation(omniDelta_cannulaCoords,Rdelta);
+                }
+            }
+
+            // compute the desired robot motion from the omni motion
+            Matrix4d robotDesFrameDelta = Mtransform::Inverse(robotTipFrame) * robotTipFrameAtClutch * Tregs * omniDelta_cannulaCoords * Mtransform::Inverse(Tregs);
+
+            // convert to twist coordinates ("wedge" operator)
+            Vector6d robotDesTwist;
+            robotDesTwist[0]=robotDesFrameDelta(0,3); //v_x
+            robotDesTwist[1]=robotDesFrameDelta(1,3); //v_y
+            robotDesTwist[2]=robotDesFrameDelta(2,3); //v_z
+            robotDesTwist[3]=robotDesFrameDelta(2,1); //w_x
+            robotDesTwist[4]=robotDesFrameDelta(0,2); //w_y
+            robotDesTwist[5]=robotDesFrameDelta(1,0); //w_z
+
+            if (logger)
+            {
+                logger->log("robotDesTwist",robotDesTwist);
+            }
+            robotDesTwist = scaleOmniVelocity(robotDesTwist);
+            if (logger)
+            {
+                logger->log("scaled robotDesTwist",robotDesTwist);
+            }
+
+            // Transformation from qbeta to qx:
+            Eigen::Matrix<double,6,6> Jx = J*dqbeta_dqx;
+            Vector6d qx_vec = transformBetaToX(q_vec,L);
+
+            // Joint limit avoidance weighting matrix
+            weightingRet Wout = getWeightingMatrix(qx_vec.tail(3),dhPrev,L,params.lambda_jointlim);
+            Eigen::Matrix<double,6,6> W_jointlim = Wout.W;
+            dhPrev = Wout.dh; // and save this dh value for next time
+
+            // Resolved rates update
+            Eigen::Matrix<double,6,6> A = Jx.transpose()*W_tracking*Jx + W_damping + W_jointlim;
+            Vector6d b = Jx.transpose()*W_tracking*robotDesTwist;
+            Vector6d delta_qx;
+            bool stepSaturated = solveJointStep(A,b,qx_vec,delta_qx,out.solverIterations);
+
+            // Anatomy virtual fixtures: every constraint point the step would
+            // move towards the anatomy adds a weighting term against motion
+            // along its clearance gradient, and the step is solved again
+            int nearestFixture = -1;
+            Vector6d g_nearest = Vector6d::Zero();
+            if (kin.anatomy.n > 0)
+            {
+                Matrix6d W_anatomy = getAnatomyWeighting(kin.anatomy,delta_qx,nearestFixture,g_nearest);
+                if (!W_anatomy.isZero(0.0))
+                {
+                    count(ANATOMY_FIXTURE_ACTIVE);
+                    A += W_anatomy;
+                    int iterations = 0;
+                    stepSaturated = solveJointStep(A,b,qx_vec,delta_qx,iterations);
+                    out.solverIterations += iterations;
+                }
+            }
+
+            Vector6d qx_prev = qx_vec;
+            qx_vec = qx_vec + delta_qx;
+
+            // Correct joint limit violations (a no-op for the constrained solver
+            // unless the tubes started outside their limits)
+            Eigen::Vector3d x_unlimited = qx_vec.tail(3);
+            qx_vec.tail(3) = limitBetaValsSimple(qx_vec.tail(3));
+            stepSaturated = stepSaturated || qx_vec.tail<3>() != x_unlimited;
+            getHapticState(Rtip,ptip,Jx,qx_prev,qx_vec,stepSaturated,out.haptic);
+            getAnatomyHapticState(Rtip,Jx,kin.anatomy,nearestFixture,g_nearest,out.haptic);
+
+            // Transform qbeta back from qx
+            q_vec = transformXToBeta(qx_vec,L);
+            if (logger)
+            {
+                logger->log("----------------------------------------------------");
+            }
+
+            out.robotDesTwist = robotDesTwist;
+            out.delta_qx = delta_qx;
+            out.W_jointlim = W_jointlim.diagonal();
+        }
+
+        out.q_vec = q_vec;
+    }
+
+    Vector6d saturateJointVelocities(Vector6d delta_qx, int node_freq)
+    {
+        Vector6d commanded_speed = delta_qx*node_freq;
+        Vector6d saturated_speed = commanded_speed;
+        Vector6d delta_qx_sat;
+
+        // saturate tip rotations
+        for (int i=0; i<3; i++)
+        {
+            if(fabs(commanded_speed(i)) > params.max_rot_speed)
+            {
+                saturated_speed(i) = (commanded_speed(i)/fabs(commanded_speed(i)))*params.max_rot_speed;
+                count(ROT_SPEED_SAT_1+i);
+            }
+            delta_qx_sat(i) = saturated_speed(i)/node_freq;
+        }
+
+        // saturate translations
+        for (int i=3; i<6; i++)
+        {
+            if(fabs(commanded_speed(i)) > params.max_trans_speed)
+            {
+                saturated_speed(i) = (commanded_speed(i)/fabs(commanded_speed(i)))*params.max_trans_speed;
+                count(TRANS_SPEED_SAT_1+i-3);
+            }
+            delta_qx_sat(i) = saturated_speed(i)/node_freq;
+        }
+
+        return delta_qx_sat;
+    }
+
+    Eigen::Vector3d limitBetaValsSimple(Eigen::Vector3d x_in)
+    {
+        Eigen::Vector3d x = x_in;
+        double epsilon = params.translation_margin;  // keep a 0.5 mm minimum margin
+
+        // check tube 3 first:
+        if (x(2) < epsilon)
+        {
+            x(2) = epsilon;
+            count(TUBE3_SAT_FRONT);
+        }
+        else if (x(2) > L(2)-epsilon)
+        {
+            x(2) = L(2)-epsilon;
+            count(TUBE3_SAT_REAR);
+        }
+
+        // now check tube 2:
+        if (x(1) < epsilon)
+        {
+            x(1) = epsilon;
+            count(TUBE2_SAT_FRONT);
+        }
+        else if (x(1) > L(1)-L(2)-epsilon)
+        {
+            x(1) = L(1)-L(2)-epsilon;
+            count(TUBE2_SAT_REAR);
+        }
+
+        // and last check tube 1:
+        if (x(0) < epsilon)
+        {
+            x(0) = epsilon;
+            count(TUBE1_SAT_FRONT);
+        }
+        else if (x(0) > L(0)-L(1)-epsilon)
+        {
+            x(0)=L(0)-L(1)-epsilon;
+            count(TUBE1_SAT_REAR);
+        }
+
+        return x;
+    }
+
+    // Bounds on one resolved rates step delta_qx, for the constrained solver.
+    // Rotations are limited by speed only; translations by speed and by the
+    // same limits limitBetaValsSimple enforces, expressed relative to qx.
+    void getJointStepBounds(Vector6d qx, Vector6d &lo, Vector6d &hi) const
+    {
+        double rotStep = params.max_rot_speed/params.rosLoopRate;
+        double transStep = params.max_trans_speed/params.rosLoopRate;
+        double margin = params.translation_margin;
+
+        Eigen::Vector3d xmin;
+        xmin.fill(margin);
+        Eigen::Vector3d xmax;
+        xmax << L(0)-L(1)-margin, L(1)-L(2)-margin, L(2)-margin;
+
+        for (int i=0; i<3; i++)
+        {
+            lo(i) = -rotStep;
+            hi(i) = rotStep;
+        }
+
+        for (int i=0; i<3; i++)
+        {
+            double posLo = xmin(i) - qx(i+3);
+            double posHi = xmax(i) - qx(i+3);
+            lo(i+3) = std::max(posLo,-transStep);
+            hi(i+3) = std::min(posHi,transStep);
+
+            // if the tube is already outside its limits, move back at full speed
+            if (lo(i+3) > hi(i+3))
+            {
+                lo(i+3) = (posHi < -transStep) ? -transStep : transStep;
+                hi(i+3) = lo(i+3);
+            }
+        }
+    }
+
+    Vector6d scaleOmniVelocity(Vector6d desTwistDelta) const
+    {
+        Vector6d scaledDesTwistDelta = desTwistDelta;
+
+        //double pStepMax = 2.0e-3; // 2 mm
+        double vMax = 0.1; // [m/s]
+        double pStepMax = vMax / params.rosLoopRate; // [mm]
+
+        double pErr = desTwistDelta.topRows<3>().norm();
+        double gain = 1.0;
+        if (pErr > pStepMax)
+        {
+            gain = 	pStepMax / pErr;
+        }
+        scaledDesTwistDelta.topRows<3>() *= gain;
+
+        //double angleStepMax = 0.05; //0.05 radians
+        double wMax = 2.5; // [rad/s]
+        double angleStepMax = wMax / params.rosLoopRate;
+        double angleErr = desTwistDelta.bottomRows<3>().norm();
+        gain = 1.0;
+        if (angleErr > angleStepMax)
+        {
+            gain = angleStepMax / angleErr;
+        }
+        scaledDesTwistDelta.bottomRows<3>() *= gain;
+
+        return scaledDesTwistDelta;
+    }
+
+private:
+    // One resolved rates step minimizing 1/2 dq'*A*dq - b'*dq, bounded (the
+    // constrained solver) or not; true if a bound was reached
+    bool solveJointStep(const Matrix6d &A, const Vector6d &b, const Vector6d &qx, Vector6d &delta_qx, int &iterations)
+    {
+        bool saturated = false;
+        if (params.use_constrained_solver)
+        {
+            // translation and speed limits as hard constraints on the step
+            Vector6d delta_lo;
+            Vector6d delta_hi;
+            getJointStepBounds(qx,delta_lo,delta_hi);
+            if (!jointStepQP.solve(A,b,delta_lo,delta_hi,delta_qx) && logger)
+            {
+                logger->count(QP_ITERATION_CAP); // using best feasible step
+            }
+            iterations = jointStepQP.iterations();
+            for (int i=0; i<6; i++)
+            {
+                saturated = saturated || delta_qx(i) <= delta_lo(i) || delta_qx(i) >= delta_hi(i);
+            }
+        }
+        else
+        {
+            // A is symmetric positive definite by construction
+            SpdSolver<6> chol(A);
+            delta_qx = chol.ok() ? chol.solve(b) : Vector6d(A.partialPivLu().solve(b));
+        }
+        return saturated;
+    }
+
+    // Weighting of the anatomy constraints a step delta_qx moves towards the
+    // anatomy: w*g*g' per constraint, g its clearance gradient in qx, and
+    // w = lambda_anatomy*1e6*(margin-d)/d, zero at the margin and growing
+    // like 1/d towards the surface (d held at a twentieth of the margin).
+    // Also returns the nearest constraint within the margin and its
+    // gradient, for the haptics.
+    Matrix6d getAnatomyWeighting(const AnatomyConstraintSet &c, const Vector6d &delta_qx, int &nearest, Vector6d &g_nearest) const
+    {
+        Matrix6d W = Matrix6d::Zero();
+        nearest = -1;
+        double dMin = c.margin;
+        double dFloor = 0.05*c.margin;
+        for (int i=0; i<c.n; i++)
+        {
+            if (c.distance[i] >= c.margin)
+            {
+                continue;
+            }
+            Vector6d g = dqbeta_dqx.transpose()*c.gradient[i];
+            if (c.distance[i] < dMin)
+            {
+                dMin = c.distance[i];
+                nearest = i;
+                g_nearest = g;
+            }
+            if (g.dot(delta_qx) < 0.0)
+            {
+                double w = params.lambda_anatomy*1.0e6*(c.margin - c.distance[i])/std::max(c.distance[i],dFloor);
+                W += w*g*g.transpose();
+            }
+        }
+        return W;
+    }
+
+    // Controller state for the force feedback (force_feedback.h), in Omni
+    // coordinates: the tip position after this step mapped back through the
+    // clutch-in frames, registration and scaling to the Omni position that
+    // would command it, and per translation joint the dhFunction gradient,
+    // the distance to the nearer limit and the Omni direction towards it.
+    void getHapticState(const Eigen::Matrix3d &Rtip, const Eigen::Vector3d &ptip, const Matrix6d &Jx,
+                        const Vector6d &qxPrev, const Vector6d &qx, bool saturated, HapticSnapshot &h) const
+    {
+        Eigen::Matrix3d Rreg = OmniReg.topLeftCorner<3,3>();
+        h.active = true;
+        h.saturated = saturated;
+
+        Eigen::Vector3d tipNext = ptip + Rtip*(Jx*(qx-qxPrev)).head<3>();
+        Eigen::Vector3d tipDelta = tipNext - robotTipFrameAtClutch.topRightCorner<3,1>();
+        h.anchor = omniFrameAtClutch.topRightCorner<3,1>() + (1000.0/params.scale_factor)*(Rreg*tipDelta);
+
+        // same limits as getWeightingMatrix
+        double eps = 2e-3;
+        Eigen::Vector3d xmin;
+        xmin.fill(eps);
+        Eigen::Vector3d xmax;
+        xmax << L(0)-L(1)-eps, L(1)-L(2)-eps, L(2)-eps;
+        for (int i=0; i<3; i++)
+        {
+            double x = qx(i+3);
+            double towardsLimit = (2*x-xmax(i)-xmin(i) >= 0) ? 1.0 : -1.0;
+            Eigen::Vector3d u = Rreg*(Rtip*Jx.block<3,1>(0,i+3));
+            double n = u.norm();
+            h.limitDirection[i] = (n > 0.0) ? Eigen::Vector3d((towardsLimit/n)*u) : Eigen::Vector3d::Zero();
+            h.limitGradient[i] = dhFunction(xmin(i),xmax(i),x);
+            h.boundaryDistance[i] = std::min(x-xmin(i), xmax(i)-x);
+        }
+    }
+
+    // Anatomy fixture state for the force feedback: the clearance of the
+    // nearest constraint within the margin and the Omni direction of the
+    // tip motion that closes it fastest (the steepest descent of its
+    // clearance in qx, mapped to the tip like the joint limit directions)
+    void getAnatomyHapticState(const Eigen::Matrix3d &Rtip, const Matrix6d &Jx, const AnatomyConstraintSet &c,
+                               int nearest, const Vector6d &g, HapticSnapshot &h) const
+    {
+        h.anatomyMargin = c.margin;
+        h.anatomyDistance = 1.0;
+        h.anatomyDirection.fill(0);
+        if (nearest < 0)
+        {
+            return;
+        }
+        Eigen::Vector3d u = OmniReg.topLeftCorner<3,3>()*(Rtip*(Jx.topRows<3>()*(-g)));
+        double n = u.norm();
+        if (n > 0.0)
+        {
+            h.anatomyDistance = c.distance[nearest];
+            h.anatomyDirection = u/n;
+        }
+    }
+
+    void count(int id)
+    {
+        if (logger)
+        {
+            logger->count(id);
+        }
+    }
+
+    ResolvedRatesParams params;
+    Matrix6d W_tracking;
+    Matrix6d W_damping;
+    Eigen::Matrix<double,6,6> dqbeta_dqx;
+    Matrix4d OmniReg;
+    Matrix4d OmniRegInv;
+    Eigen::Vector3d zerovec;
+
+    BoundedQP<6> jointStepQP;
+    AsyncLogger *logger;
+
+    // robot state
+    Vector6d q_vec;
+    Eigen::Vector3d L;
+    Eigen::Vector3d dhPrev;
+
+    // omni state
+    Matrix4d omniPose;
+    int buttonState;
+    int buttonStatePrev;
+    bool justClutched;
+
+    // clutch-in frames
+    Matrix4d omniFrameAtClutch;
+    Matrix4d ROmniFrameAtClutch; // Rotation of the Omni frame tip at clutch in
+    Matrix4d robotTipFrameAtClutch; //clutch-in position of cannula
+    Matrix4d Tregs;
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif // RESOLVED_RATES_CORE_H
@@ -0,0 +1,226 @@
+/********************************************************************
+
+  solver_benchmark.cpp
+
+Offline benchmark of the resolved rates joint step solve.
+Builds the same weighted damped least-squares system as resolved_rates
+for a slowly varying operator motion near the translation limits, and
+times the unconstrained partialPivLu + clipping path against the
+constrained active-set solver (cold and warm started), and the
+fixed-size SPD kernel against Eigen's general and SPD decompositions
+for the plain unconstrained solve.
+
+Usage: solver_benchmark [cycles]
+
+********************************************************************/
+
+#include <Eigen/Dense>
+
+#include "bounded_qp.h"
+#include "spd_solve.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+typedef Eigen::Matrix<double,6,6> Matrix6d;
+typedef Eigen::Matrix<double,6,1> Vector6d;
+
+struct timingStats
+{
+    double mean;
+    double p50;
+    double p99;
+    double max;
+};
+
+timingStats summarize(std::vector<double> t)
+{
+    timingStats s;
+    std::sort(t.begin(),t.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < t.size(); i++)
+    {
+        sum += t[i];
+    }
+    s.mean = sum/t.size();
+    s.p50 = t[t.size()/2];
+    s.p99 = t[(t.size()*99)/100];
+    s.max = t.back();
+    return s;
+}
+
+void printStats(const char *name, timingStats s, double budget_us)
+{
+    printf("%-28s mean %7.3f us   p50 %7.3f us   p99 %7.3f us   max %7.3f us   (%.3f%% of budget)\n",
+           name, s.mean, s.p50, s.p99, s.max, 100.0*s.max/budget_us);
+}
+
+int main(int argc, char *argv[])
+{
+    int cycles = (argc > 1) ? atoi(argv[1]) : 100000;
+    double rate = 100.0;
+    double budget_us = 1.0e6/rate;
+
+    // same weights as resolved_rates
+    double lambda_tracking = 10.0;
+    double lambda_damping = 50.0;
+    double thetadeg = 2.0;
+    Matrix6d W_tracking = Matrix6d::Zero();
+    W_tracking(0,0) = W_tracking(1,1) = W_tracking(2,2) = lambda_tracking*1.0e6;
+    W_tracking(3,3) = W_tracking(4,4) = 0.1*lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
+    W_tracking(5,5) = lambda_tracking*(180.0/M_PI/2.0)*(180.0/M_PI/2.0);
+    Matrix6d W_damping = Matrix6d::Zero();
+    W_damping(0,0) = W_damping(1,1) = W_damping(2,2) = lambda_damping*(180.0/thetadeg/M_PI)*(180.0/thetadeg/M_PI);
+    W_damping(3,3) = W_damping(4,4) = W_damping(5,5) = lambda_damping*1.0e6;
+
+    Eigen::Vector3d L;
+    L << 222.5e-3, 163e-3, 104.4e-3;
+    double margin = 0.5e-3;
+    double rotStep = 0.8/rate;
+    double transStep = 5.0e-3/rate;
+
+    // representative Jacobian scales: translation columns ~1 m/m, rotation ~10 mm/rad
+    std::mt19937 gen(1);
+    std::normal_distribution<double> nd(0.0,1.0);
+    Matrix6d Jx;
+    for (int i = 0; i < 6; i++)
+    {
+        for (int j = 0; j < 6; j++)
+        {
+            double scale = (i < 3) ? ((j < 3) ? 1.0e-2 : 1.0) : ((j < 3) ? 1.0 : 10.0);
+            Jx(i,j) = scale*nd(gen);
+        }
+    }
+
+    std::vector<double> tLu, tCold, tWarm;
+    std::vector<double> tPlu, tLlt, tLdlt, tSpd;
+    tLu.reserve(cycles);
+    tCold.reserve(cycles);
+    tWarm.reserve(cycles);
+    tPlu.reserve(cycles);
+    tLlt.reserve(cycles);
+    tLdlt.reserve(cycles);
+    tSpd.reserve(cycles);
+    double worstSpdErr = 0.0;
+
+    BoundedQP<6> warm(12);
+    BoundedQP<6> cold(12);
+    int warmIterations = 0, coldIterations = 0, warmCapped = 0, clipped = 0;
+    double trackingErrLu = 0.0, trackingErrQp = 0.0;
+
+    // start the inner tube 1 mm from its front limit so the operator motion drives it into the limit
+    Vector6d qx;
+    qx << 0.0, 0.0, 0.0, margin + 1.0e-3, 20e-3, 40e-3;
+
+    for (int k = 0; k < cycles; k++)
+    {
+        double t = k/rate;
+        Vector6d twist;
+        twist << 1.0e-3*sin(0.5*t), 1.0e-3*cos(0.3*t), -1.0e-3*fabs(sin(0.2*t)),
+                 1.0e-2*sin(0.7*t), 1.0e-2*cos(0.4*t), 2.0e-2*sin(0.1*t);
+
+        Matrix6d W_jointlim = Matrix6d::Identity()*100.0;
+        Matrix6d A = Jx.transpose()*W_tracking*Jx + W_damping + W_jointlim;
+        Vector6d b = Jx.transpose()*W_tracking*twist;
+
+        Vector6d lo, hi;
+        for (int i = 0; i < 3; i++)
+        {
+            lo(i) = -rotStep;
+            hi(i) = rotStep;
+        }
+        Eigen::Vector3d xmax;
+        xmax << L(0)-L(1)-margin, L(1)-L(2)-margin, L(2)-margin;
+        for (int i = 0; i < 3; i++)
+        {
+            lo(i+3) = std::max(margin - qx(i+3),-transStep);
+            hi(i+3) = std::min(xmax(i) - qx(i+3),transStep);
+        }
+
+        // current path: unconstrained solve, then clip the result
+        auto t0 = std::chrono::steady_clock::now();
+        Vector6d dLu = A.partialPivLu().solve(b);
+        Vector6d dClip = dLu.cwiseMax(lo).cwiseMin(hi);
+        auto t1 = std::chrono::steady_clock::now();
+        if (dClip != dLu)
+        {
+            clipped++;
+        }
+
+        // constrained solver, cold start every cycle
+        Vector6d dCold;
+        cold.reset();
+        auto t2 = std::chrono::steady_clock::now();
+        cold.solve(A,b,lo,hi,dCold);
+        auto t3 = std::chrono::steady_clock::now();
+        coldIterations += cold.iterations();
+
+        // constrained solver, warm started from the previous cycle
+        Vector6d dWarm;
+        auto t4 = std::chrono::steady_clock::now();
+        bool ok = warm.solve(A,b,lo,hi,dWarm);
+        auto t5 = std::chrono::steady_clock::now();
+        warmIterations += warm.iterations();
+        warmCapped += ok ? 0 : 1;
+
+        // plain solve: general LU vs Eigen SPD decompositions vs the fixed-size kernel
+        auto s0 = std::chrono::steady_clock::now();
+        Vector6d xPlu = A.partialPivLu().solve(b);
+        auto s1 = std::chrono::steady_clock::now();
+        Vector6d xLlt = A.llt().solve(b);
+        auto s2 = std::chrono::steady_clock::now();
+        Vector6d xLdlt = A.ldlt().solve(b);
+        auto s3 = std::chrono::steady_clock::now();
+        SpdSolver<6> chol(A);
+        Vector6d xSpd = chol.solve(b);
+        auto s4 = std::chrono::steady_clock::now();
+        tPlu.push_back(std::chrono::duration<double,std::micro>(s1-s0).count());
+        tLlt.push_back(std::chrono::duration<double,std::micro>(s2-s1).count());
+        tLdlt.push_back(std::chrono::duration<double,std::micro>(s3-s2).count());
+        tSpd.push_back(std::chrono::duration<double,std::micro>(s4-s3).count());
+        worstSpdErr = std::max(worstSpdErr,(xSpd-xPlu).norm()/xPlu.norm());
+        if (xLlt.hasNaN() || xLdlt.hasNaN())
+        {
+            printf("Eigen SPD decomposition failed at cycle %d\n", k);
+        }
+
+        tLu.push_back(std::chrono::duration<double,std::micro>(t1-t0).count());
+        tCold.push_back(std::chrono::duration<double,std::micro>(t3-t2).count());
+        tWarm.push_back(std::chrono::duration<double,std::micro>(t5-t4).count());
+
+        // weighted tracking error of each step
+        Vector6d eLu = Jx*dClip - twist;
+        Vector6d eQp = Jx*dWarm - twist;
+        trackingErrLu += eLu.dot(W_tracking*eLu);
+        trackingErrQp += eQp.dot(W_tracking*eQp);
+
+        qx += dWarm;
+        // slowly rotate the Jacobian so the active set keeps changing
+        Jx.col(k%6) *= (1.0 + 1.0e-3*sin(t));
+    }
+
+    printf("%d cycles at %.0f Hz (budget %.0f us per cycle)\n\n", cycles, rate, budget_us);
+    printf("unconstrained solve:\n");
+    printStats("partialPivLu", summarize(tPlu), budget_us);
+    printStats("Eigen LLT", summarize(tLlt), budget_us);
+    printStats("Eigen LDLT", summarize(tLdlt), budget_us);
+    printStats("SpdSolver<6>", summarize(tSpd), budget_us);
+    printf("worst relative difference SpdSolver vs partialPivLu: %.3g\n\n", worstSpdErr);
+
+    printf("constrained step:\n");
+    printStats("partialPivLu + clip", summarize(tLu), budget_us);
+    printStats("active-set QP (cold)", summarize(tCold), budget_us);
+    printStats("active-set QP (warm)", summarize(tWarm), budget_us);
+    printf("\nmean iterations: cold %.2f, warm %.2f; warm solves hitting the cap: %d\n",
+           double(coldIterations)/cycles, double(warmIterations)/cycles, warmCapped);
+    printf("cycles where clipping changed the step: %d\n", clipped);
+    printf("mean weighted tracking error: clip %.4g, QP %.4g\n",
+           trackingErrLu/cycles, trackingErrQp/cycles);
+
+    return 0;
+}
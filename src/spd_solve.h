@@ -0,0 +1,131 @@
+#ifndef SPD_SOLVE_H
+#define SPD_SOLVE_H
+
+/********************************************************************
+
+  spd_solve.h
+
+Fixed-size LDL' factorization for small symmetric positive definite
+systems, e.g. the 6x6 resolved rates matrix Jx'*W*Jx + W_damping + W_jointlim.
+No pivoting, no square roots and no heap allocation; all loop bounds are
+compile-time constants so the compiler fully unrolls and vectorizes them.
+
+Only the lower triangle of A is read.
+
+********************************************************************/
+
+#include <Eigen/Dense>
+#include <cmath>
+
+template<int N>
+class SpdSolver
+{
+public:
+    typedef Eigen::Matrix<double,N,N> MatrixN;
+    typedef Eigen::Matrix<double,N,1> VectorN;
+
+    SpdSolver() : valid(false) {}
+    explicit SpdSolver(const MatrixN &A) { compute(A); }
+
+    // Factorizes A = L*D*L'. Returns false if A is not (numerically) positive definite.
+    bool compute(const MatrixN &A)
+    {
+        valid = false;
+        for (int j = 0; j < N; j++)
+        {
+            // w(k) = L(j,k)*D(k) for the columns already factorized
+            double w[N];
+            double d = A(j,j);
+            for (int k = 0; k < j; k++)
+            {
+                w[k] = L(j,k)*D(k);
+                d -= L(j,k)*w[k];
+            }
+            if (!(d > 0.0))
+            {
+                return false;
+            }
+            D(j) = d;
+            L(j,j) = 1.0;
+
+            // column update, one axpy per factorized column
+            double col[N];
+            for (int i = j+1; i < N; i++)
+            {
+                col[i] = A(i,j);
+            }
+            for (int k = 0; k < j; k++)
+            {
+                for (int i = j+1; i < N; i++)
+                {
+                    col[i] -= L(i,k)*w[k];
+                }
+            }
+            double dinv = 1.0/d;
+            for (int i = j+1; i < N; i++)
+            {
+                L(i,j) = col[i]*dinv;
+                L(j,i) = 0.0;
+            }
+        }
+        valid = true;
+        return true;
+    }
+
+    bool ok() const { return valid; }
+
+    VectorN solve(const VectorN &b) const
+    {
+        VectorN x = b;
+
+        // forward substitution L*y = b
+        for (int j = 0; j < N; j++)
+        {
+            for (int i = j+1; i < N; i++)
+            {
+                x(i) -= L(i,j)*x(j);
+            }
+        }
+
+        // diagonal
+        for (int i = 0; i < N; i++)
+        {
+            x(i) /= D(i);
+        }
+
+        // back substitution L'*x = y
+        for (int i = N-1; i >= 0; i--)
+        {
+            double s = x(i);
+            for (int k = i+1; k < N; k++)
+            {
+                s -= L(k,i)*x(k);
+            }
+            x(i) = s;
+        }
+        return x;
+    }
+
+    MatrixN inverse() const
+    {
+        MatrixN Ainv;
+        for (int j = 0; j < N; j++)
+        {
+            Ainv.col(j) = solve(VectorN::Unit(j));
+        }
+        return Ainv;
+    }
+
+    // product of the pivots
+    double determinant() const
+    {
+        return D.prod();
+    }
+
+private:
+    MatrixN L;
+    VectorN D;
+    bool valid;
+};
+
+#endif // SPD_SOLVE_H
@@ -0,0 +1,301 @@
+#ifndef STAGE_EXECUTOR_H
+#define STAGE_EXECUTOR_H
+
+/********************************************************************
+
+  stage_executor.h
+
+Runs the stages of a pipeline (control, kinematics, tf, display) in one
+process on a fixed pool of worker threads, instead of one process with
+its own ros::Rate loop per stage.
+
+Every stage declares a rate, a priority and a trigger:
+  - PERIODIC stages are released every 1/rate seconds,
+  - ON_NOTIFY stages only when notify() was called since their last run
+    (new data arrived), and no more often than the rate. A stage without
+    new input does not wake up at all.
+A released stage's deadline is one period after its release. An idle
+worker runs the released stage of highest priority and, among those,
+the one with the earliest deadline. The last reservedWorkers idle
+workers are kept for stages of the top priority, so display work never
+holds up the control loop for longer than it takes to notice; running
+stages are not interrupted.
+
+A stage function returns false if it had nothing to do; such runs are
+counted as idle. Per stage the executor keeps runs, idle runs, deadline
+misses, and busy time, from which it reports the rate achieved and the
+share of one core the stage used.
+
+Stages are added before start(); notify() may be called from any thread.
+
+********************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+class StageExecutor
+{
+public:
+    typedef std::function<bool()> StageFunction;
+    typedef std::chrono::steady_clock Clock;
+
+    enum Trigger { PERIODIC, ON_NOTIFY };
+
+    struct StageStats
+    {
+        long runs;
+        long idleRuns;              // returned false
+        long deadlineMisses;        // finished after the deadline
+        double busy;                // [s]
+        double maxRunTime;          // [s]
+    };
+
+    StageExecutor() : running(false), idleWorkers(0), reserved(0), topPriority(0) {}
+
+    ~StageExecutor() { stop(); }
+
+    // returns the stage id, for notify()
+    int addStage(const std::string &name, double rate, int priority, Trigger trigger, StageFunction fn)
+    {
+        Stage s;
+        s.name = name;
+        s.period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0/rate));
+        s.priority = priority;
+        s.trigger = trigger;
+        s.fn = fn;
+        s.released = false;
+        s.active = false;
+        s.notified = false;
+        stages.push_back(s);
+        topPriority = std::max(topPriority, priority);
+        return int(stages.size()) - 1;
+    }
+
+    // new input for an ON_NOTIFY stage
+    void notify(int stage)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stages[stage].notified = true;
+        }
+        wake.notify_all();
+    }
+
+    // starts numWorkers threads, worker i pinned to cpus[i] if given (-1 for any);
+    // reservedWorkers idle workers are kept for stages of the top priority
+    void start(int numWorkers, int reservedWorkers = 1, const std::vector<int> &cpus = std::vector<int>())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running)
+        {
+            return;
+        }
+        running = true;
+        reserved = std::max(0, std::min(reservedWorkers, numWorkers - 1));
+        idleWorkers = numWorkers;
+        Clock::time_point now = Clock::now();
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            stages[i].nextRelease = now;
+            stages[i].stats = StageStats();
+        }
+        startTime = now;
+        for (int i = 0; i < numWorkers; i++)
+        {
+            workers.push_back(std::thread(&StageExecutor::work, this));
+            if (i < int(cpus.size()) && cpus[i] >= 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i], &set);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+            }
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+        workers.clear();
+    }
+
+    int numStages() const { return int(stages.size()); }
+    const std::string &stageName(int stage) const { return stages[stage].name; }
+
+    // statistics of every stage since the last call, and the time they cover
+    void takeStats(std::vector<StageStats> &stats, double &elapsed)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        elapsed = std::chrono::duration<double>(now - startTime).count();
+        startTime = now;
+        stats.resize(stages.size());
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            stats[i] = stages[i].stats;
+            stages[i].stats = StageStats();
+        }
+    }
+
+    // one line per stage and the pool total, since the last report
+    void printReport(FILE *out = stdout)
+    {
+        std::vector<StageStats> stats;
+        double elapsed;
+        takeStats(stats, elapsed);
+        double busy = 0.0;
+        for (size_t i = 0; i < stats.size(); i++)
+        {
+            const StageStats &s = stats[i];
+            fprintf(out, "%-12s %8.1f Hz  %5.1f %% of a core  run mean %7.1f us  max %7.1f us  %ld idle  %ld late\n",
+                    stages[i].name.c_str(), s.runs/elapsed, 100.0*s.busy/elapsed,
+                    s.runs ? 1e6*s.busy/s.runs : 0.0, 1e6*s.maxRunTime, s.idleRuns, s.deadlineMisses);
+            busy += s.busy;
+        }
+        fprintf(out, "%-12s %8s     %5.1f %% of %d cores\n", "total", "", 100.0*busy/(elapsed*workers.size()), int(workers.size()));
+        fflush(out);
+    }
+
+private:
+    struct Stage
+    {
+        std::string name;
+        Clock::duration period;
+        int priority;
+        Trigger trigger;
+        StageFunction fn;
+
+        Clock::time_point nextRelease;  // PERIODIC: next release; ON_NOTIFY: earliest one
+        Clock::time_point deadline;
+        bool released;
+        bool active;                    // running on a worker
+        bool notified;
+        StageStats stats;
+    };
+
+    // releases the stages that are due; returns the time of the next release
+    Clock::time_point release(Clock::time_point now)
+    {
+        Clock::time_point next = Clock::time_point::max();
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            Stage &s = stages[i];
+            if (s.released || s.active)
+            {
+                continue;
+            }
+            bool due = s.trigger == PERIODIC || s.notified;
+            if (due && now >= s.nextRelease)
+            {
+                s.released = true;
+                s.notified = false;
+                s.deadline = std::max(now, s.nextRelease) + s.period;
+                // a late stage restarts its schedule from now instead of catching up
+                s.nextRelease = s.trigger == PERIODIC && s.nextRelease + s.period > now ? s.nextRelease + s.period : now + s.period;
+            }
+            else if (due)
+            {
+                next = std::min(next, s.nextRelease);
+            }
+        }
+        return next;
+    }
+
+    // the released stage to run next, -1 if none may run now
+    int pick() const
+    {
+        int best = -1;
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            const Stage &s = stages[i];
+            if (!s.released || (s.priority < topPriority && idleWorkers <= reserved))
+            {
+                continue;
+            }
+            if (best < 0 || s.priority > stages[best].priority ||
+                (s.priority == stages[best].priority && s.deadline < stages[best].deadline))
+            {
+                best = int(i);
+            }
+        }
+        return best;
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running)
+        {
+            Clock::time_point next = release(Clock::now());
+            int i = pick();
+            if (i < 0)
+            {
+                if (next == Clock::time_point::max())
+                {
+                    wake.wait(lock);
+                }
+                else
+                {
+                    wake.wait_until(lock, next);
+                }
+                continue;
+            }
+
+            Stage &s = stages[i];
+            s.released = false;
+            s.active = true;
+            idleWorkers--;
+            lock.unlock();
+
+            Clock::time_point tic = Clock::now();
+            bool didWork = s.fn();
+            Clock::time_point toc = Clock::now();
+
+            lock.lock();
+            double dt = std::chrono::duration<double>(toc - tic).count();
+            s.stats.runs++;
+            s.stats.idleRuns += didWork ? 0 : 1;
+            s.stats.deadlineMisses += toc > s.deadline ? 1 : 0;
+            s.stats.busy += dt;
+            s.stats.maxRunTime = std::max(s.stats.maxRunTime, dt);
+            s.active = false;
+            idleWorkers++;
+            // a reserved worker may have become free for a lower priority stage
+            wake.notify_all();
+        }
+    }
+
+    std::vector<Stage> stages;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running;
+    int idleWorkers;
+    int reserved;
+    int topPriority;
+    Clock::time_point startTime;
+};
+
+#endif // STAGE_EXECUTOR_H
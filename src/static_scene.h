@@ -0,0 +1,103 @@
+#ifndef STATIC_SCENE_H
+#define STATIC_SCENE_H
+
+/********************************************************************
+
+  static_scene.h
+
+The parts of the RViz scene that do not move with the robot (the
+anatomy mesh), published as one MarkerArray on a latched topic.
+
+A marker is sent when it is added or changes (e.g. a new registration
+of the anatomy), never per display update. The topic is latched, so
+every subscriber that connects later, RViz included, gets the last
+scene from roscpp right away without the scene being republished to
+everyone; connections are counted for the report.
+
+********************************************************************/
+
+#include <ros/ros.h>
+#include <visualization_msgs/Marker.h>
+#include <visualization_msgs/MarkerArray.h>
+
+#include <string>
+
+class StaticScene
+{
+public:
+    StaticScene() : dirty(false), nPublished(0), nConnected(0) {}
+
+    void advertise(ros::NodeHandle &node, const std::string &topic)
+    {
+        pub = node.advertise<visualization_msgs::MarkerArray>(topic, 1,
+                  boost::bind(&StaticScene::onConnect, this, _1), ros::SubscriberStatusCallback(), ros::VoidConstPtr(), true);
+    }
+
+    // adds the marker, or replaces the one with the same ns and id if it differs
+    void setMarker(const visualization_msgs::Marker &m)
+    {
+        for (size_t i = 0; i < scene.markers.size(); i++)
+        {
+            visualization_msgs::Marker &old = scene.markers[i];
+            if (old.ns == m.ns && old.id == m.id)
+            {
+                if (!sameMarker(old, m))
+                {
+                    old = m;
+                    dirty = true;
+                }
+                return;
+            }
+        }
+        scene.markers.push_back(m);
+        dirty = true;
+    }
+
+    // publishes the scene if it changed since the last call
+    bool publishIfChanged()
+    {
+        if (!dirty)
+        {
+            return false;
+        }
+        ros::Time now = ros::Time::now();
+        for (size_t i = 0; i < scene.markers.size(); i++)
+        {
+            scene.markers[i].header.stamp = now;
+        }
+        pub.publish(scene);
+        dirty = false;
+        nPublished++;
+        return true;
+    }
+
+    long publishes() const { return nPublished; }
+    long connections() const { return nConnected; }
+
+private:
+    void onConnect(const ros::SingleSubscriberPublisher &)
+    {
+        nConnected++;
+    }
+
+    // the fields a static marker is set up with (not the stamp)
+    static bool sameMarker(const visualization_msgs::Marker &a, const visualization_msgs::Marker &b)
+    {
+        return a.header.frame_id == b.header.frame_id && a.type == b.type && a.action == b.action &&
+               a.mesh_resource == b.mesh_resource &&
+               a.pose.position.x == b.pose.position.x && a.pose.position.y == b.pose.position.y &&
+               a.pose.position.z == b.pose.position.z &&
+               a.pose.orientation.x == b.pose.orientation.x && a.pose.orientation.y == b.pose.orientation.y &&
+               a.pose.orientation.z == b.pose.orientation.z && a.pose.orientation.w == b.pose.orientation.w &&
+               a.scale.x == b.scale.x && a.scale.y == b.scale.y && a.scale.z == b.scale.z &&
+               a.color.r == b.color.r && a.color.g == b.color.g && a.color.b == b.color.b && a.color.a == b.color.a;
+    }
+
+    ros::Publisher pub;
+    visualization_msgs::MarkerArray scene;
+    bool dirty;
+    long nPublished;
+    long nConnected;
+};
+
+#endif // STATIC_SCENE_H
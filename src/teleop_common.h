@@ -0,0 +1,110 @@
+#ifndef TELEOP_COMMON_H
+#define TELEOP_COMMON_H
+
+/********************************************************************
+
+  teleop_common.h
+
+Types and basic math shared by the resolved rates and kinematics code.
+
+********************************************************************/
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+#include <cmath>
+
+// TYPEDEFS
+typedef Eigen::Matrix<double,4,4> Matrix4d;
+typedef Eigen::Matrix<double,6,6> Matrix6d;
+typedef Eigen::Matrix<double,7,1> Vector7d;
+typedef Eigen::Matrix<double,6,1> Vector6d;
+
+struct Configuration3
+{
+    Eigen::Vector3d PsiL;
+    Eigen::Vector3d Beta;
+    Eigen::Vector3d Ftip;
+    Eigen::Vector3d Ttip;
+};
+
+// BASIC MATH FUNCTION DEFINITIONS -----------------------------------
+
+inline double deg2rad (double degrees)
+{
+    return degrees * 4.0 * atan (1.0) / 180.0;
+}
+
+inline double vectornorm(Eigen::Vector3d v)
+{
+    return sqrt(v.transpose()*v);
+}
+
+inline Eigen::Matrix3d orthonormalize(Eigen::Matrix3d R)
+{
+    Eigen::Matrix3d R_ortho;
+    R_ortho.fill(0);
+    // Normalize the first column:
+    R_ortho.col(0) = R.col(0) / vectornorm(R.col(0));
+
+    // Orthogonalize & normalize second column:
+    R_ortho.col(1) = R.col(1);
+    double c = (R_ortho.col(1).transpose()*R_ortho.col(0));
+    c = c/(R_ortho.col(0).transpose()*R_ortho.col(0));
+    R_ortho.col(1) = R_ortho.col(1) - c*R_ortho.col(0);
+    R_ortho.col(1) = R_ortho.col(1)/vectornorm(R_ortho.col(1));
+
+    // Orthogonalize & normalize third column:
+    R_ortho.col(2) = R.col(2);
+    double d = (R_ortho.col(2).transpose()*R_ortho.col(0));
+    d = d/(R_ortho.col(0).transpose()*R_ortho.col(0));
+    R_ortho.col(2) = R_ortho.col(2) - d*R_ortho.col(0);
+    double e = (R_ortho.col(2).transpose()*R_ortho.col(1));
+    e = e/(R_ortho.col(1).transpose()*R_ortho.col(1));
+    R_ortho.col(2) = R_ortho.col(2) - e*R_ortho.col(1);
+    R_ortho.col(2) = R_ortho.col(2)/vectornorm(R_ortho.col(2));
+    return R_ortho;
+}
+
+inline Eigen::Matrix4d assembleTransformation(Eigen::Matrix3d Rot, Eigen::Vector3d Trans)
+{
+    Rot = orthonormalize(Rot);
+    Eigen::Matrix4d T;
+    T.fill(0);
+    T.topLeftCorner(3,3) = Rot;
+    T.topRightCorner(3,1) = Trans;
+    T(3,3) = 1;
+    return T;
+}
+
+inline Eigen::Matrix3d quat2rotm(Eigen::Vector4d Quat)
+{
+    // Agrees with Matlab
+    // Quaternion order is wxyz
+    Eigen::Matrix3d R;
+    R.fill(0);
+
+    R(0,0) = pow(Quat(0),2) + pow(Quat(1),2) - pow(Quat(2),2) - pow(Quat(3),2);
+    R(0,1) = 2*Quat(1)*Quat(2) - 2*Quat(0)*Quat(3);
+    R(0,2) = 2*Quat(1)*Quat(3) + 2*Quat(0)*Quat(2);
+
+    R(1,0) = 2*Quat(1)*Quat(2) + 2*Quat(0)*Quat(3);
+    R(1,1) = pow(Quat(0),2) - pow(Quat(1),2) + pow(Quat(2),2) - pow(Quat(3),2);
+    R(1,2) = 2*Quat(2)*Quat(3) - 2*Quat(0)*Quat(1);
+
+    R(2,0) = 2*Quat(1)*Quat(3) - 2*Quat(0)*Quat(2);
+    R(2,1) = 2*Quat(2)*Quat(3) + 2*Quat(0)*Quat(1);
+    R(2,2) = pow(Quat(0),2) - pow(Quat(1),2) - pow(Quat(2),2) + pow(Quat(3),2);
+    return R;
+}
+
+inline Eigen::Matrix4d inverseTransform(Eigen::Matrix4d T)
+{
+    Eigen::Matrix4d Tinv;
+    Tinv.fill(0);
+    Tinv.topLeftCorner(3,3) = T.topLeftCorner(3,3).transpose();
+    Tinv.topRightCorner(3,1) = -1*T.topLeftCorner(3,3).transpose()*T.topRightCorner(3,1);
+    Tinv(3,3) = 1.0;
+    return Tinv;
+}
+
+#endif // TELEOP_COMMON_H
@@ -0,0 +1,536 @@
+/********************************************************************
+
+  teleop_executor.cpp
+
+Single-arm teleoperation with all stages in one process, on the
+multi-rate executor of stage_executor.h instead of one process and one
+ros::Rate loop per stage (resolved_rates, kinematics, tf_broadcaster).
+
+Stages, highest priority first:
+    control      periodic, ~control_rate (the resolved rates rate):
+                 Omni input, resolved rates step, encoder commands, joint_q
+    kinematics   on new joint values, at most ~kinematics_rate:
+                 tip pose, Jacobian and backbone, kinematics_output
+    tf           on new Omni poses, at most ~tf_rate:
+                 the world -> tip_pose transform of tf_broadcaster
+    display      on new kinematics, at most ~display_rate:
+                 needle_position for workspace_display
+A stage without new input does not run: kinematics only solves when the
+joints moved, tf only when a pose came in. Control only steps on the
+kinematics of its previous command; while kinematics is behind, it
+holds the last command instead of stepping again on the old tip pose
+and Jacobian, and the report counts those periods. Omni poses are filtered at
+the input rate (omni_filter.h) on a spinner thread of their own.
+
+The stages run on ~threads workers (optionally pinned from ~first_cpu
+on). ~reserved_threads of them are kept for the control stages, so tf
+and display work never occupies the last free worker. With ~realtime the
+profile of realtime.h is applied first and the workers inherit it.
+
+Every ~report_period seconds the node prints the rate, busy share of a
+core, run time, idle runs and deadline misses of each stage, and the
+CPU time of the whole process.
+
+Topics:
+    in:  Omnipos_stamped (Omnipos while nothing publishes the stamped
+         topic), Buttonstates
+    out: joint_q, kinematics_output, needle_position, tf,
+         <board>/encoder_command for the boards of ~robot
+
+********************************************************************/
+
+#include "resolved_rates_core.h"
+#include "kinematics_core.h"
+#include "actuator_map.h"
+#include "force_feedback.h"
+#include "omni_filter.h"
+#include "stage_executor.h"
+#include "realtime.h"
+#include "alloc_guard.h"
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <ros/package.h>
+#include <tf/transform_broadcaster.h>
+#include <geometry_msgs/Pose.h>
+#include <std_msgs/Int8.h>
+#include <endonasal_teleop/config3.h>
+#include <endonasal_teleop/kinout.h>
+#include <endonasal_teleop/matrix8.h>
+#include <endonasal_teleop/stampedPose.h>
+
+#include "medlab_motor_control_board/McbEncoders.h"
+
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// the joint values the kinematics stage works on
+struct JointCommand
+{
+    Configuration3 q;
+    uint64_t seq;               // control step that produced it, from 1
+    uint64_t traceId;
+};
+
+// one arm's pipeline as executor stages
+class TeleopStages
+{
+public:
+    TeleopStages(const ResolvedRatesParams &params)
+        : executor(0), rr(params), kinComputed(false), kinStage(-1), displayStage(-1), tfStage(-1),
+          buttonState(0), lastButton(0), encSent(false), cmdSeq(0), heldCycles(0), stampedInput(false)
+    {
+        for (int i = 0; i < NUM_SAT_COUNTERS; i++)
+        {
+            logger.setCounterLabel(i, saturationLabels[i]);
+        }
+        rr.setLogger(&logger);
+        lastQ.PsiL.fill(0);
+        lastQ.Beta.fill(0);
+    }
+
+    bool setup(const std::string &hardwarePath, const std::string &robot, const OmniFilterParams &filterParams, std::string &error)
+    {
+        if (!actuators.load(hardwarePath, std::vector<std::string>(1, robot), error))
+        {
+            return false;
+        }
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            if (actuators.boardType(b) != "MedlabMotorControlBoard" || actuators.boardAxes(b) != 6)
+            {
+                error = robot + " uses " + actuators.boardName(b) + ", which is not a Medlab motor control board";
+                return false;
+            }
+        }
+        counts.assign(actuators.numCounts(), 0);
+        sentCounts.assign(actuators.numCounts(), 0);
+        omniFilter.setParams(filterParams);
+
+        ros::NodeHandle node;
+        jointPub = node.advertise<endonasal_teleop::config3>("joint_q", 10);
+        kinPub = node.advertise<endonasal_teleop::kinout>("kinematics_output", 10);
+        needlePub = node.advertise<endonasal_teleop::matrix8>("needle_position", 1);
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            encoderPub.push_back(node.advertise<medlab_motor_control_board::McbEncoders>(actuators.boardName(b) + "/encoder_command", 1));
+        }
+
+        // Omni input on its own queue and spinner thread
+        inputNode.setCallbackQueue(&inputQueue);
+        omniSub = inputNode.subscribe("Omnipos", 10, &TeleopStages::omniCallback, this);
+        omniStampedSub = inputNode.subscribe("Omnipos_stamped", 10, &TeleopStages::omniStampedCallback, this);
+        buttonSub = inputNode.subscribe("Buttonstates", 10, &TeleopStages::buttonCallback, this);
+
+        // both stages start from their home configurations
+        cannula.compute(CannulaKinematics::homeConfiguration(), kin);
+        kinState.ptip = kin.ptip;
+        kinState.qtip = kin.qtip;
+        kinState.alpha.fill(0);
+        kinState.J = kin.J;
+        kinLatest = kinState;
+        rr.reset(ResolvedRatesController::homeConfiguration(), cannula.tubeLengths());
+        return true;
+    }
+
+    void addTo(StageExecutor &executor, double controlRate, double kinematicsRate, double tfRate, double displayRate)
+    {
+        this->executor = &executor;
+        executor.addStage("control", controlRate, 2, StageExecutor::PERIODIC, [this]() { return control(); });
+        kinStage = executor.addStage("kinematics", kinematicsRate, 2, StageExecutor::ON_NOTIFY, [this]() { return kinematics(); });
+        tfStage = executor.addStage("tf", tfRate, 1, StageExecutor::ON_NOTIFY, [this]() { return broadcastTf(); });
+        displayStage = executor.addStage("display", displayRate, 0, StageExecutor::ON_NOTIFY, [this]() { return display(); });
+    }
+
+    void startInput()
+    {
+        logger.run();
+        spinner.reset(new ros::AsyncSpinner(1, &inputQueue));
+        spinner->start();
+    }
+
+    // control periods held for kinematics since the last call
+    long takeHeldCycles() { return heldCycles.exchange(0); }
+
+    void stopInput()
+    {
+        if (spinner)
+        {
+            spinner->stop();
+        }
+        logger.stop();
+    }
+
+private:
+    // STAGES ----------------------------------------------------------
+
+    bool control()
+    {
+        int b = buttonState.load();
+        if (b != lastButton)
+        {
+            rr.onButton(b);
+            lastButton = b;
+        }
+        if (omniInput.read(omniSample))
+        {
+            rr.onOmniPose(omniSample.position, omniSample.orientation);
+        }
+        kinOutput.read(kinState);
+        if (kinState.seq != cmdSeq)
+        {
+            // kinematics has not caught up with the last command yet
+            heldCycles++;
+            return false;
+        }
+
+        {
+            HotRegion hot;
+            rr.step(kinState, rrOut);
+            actuators.toCounts(rrOut.actuatorJoints.data(), counts.data());
+        }
+
+        // encoder commands (only when they change)
+        if (!encSent || counts != sentCounts)
+        {
+            for (int b = 0; b < actuators.numBoards(); b++)
+            {
+                const int *boardCounts = counts.data() + actuators.boardOffset(b);
+                for (int i = 0; i < 6; i++)
+                {
+                    encMsg.count[i] = boardCounts[i];
+                }
+                encoderPub[b].publish(encMsg);
+            }
+            sentCounts = counts;
+            encSent = true;
+        }
+
+        for (int h = 0; h < 6; h++)
+        {
+            jointMsg.joint_q[h] = rrOut.q_vec(h);
+            jointMsg.joint_q[h+6] = 0;
+        }
+        jointMsg.trace_id = omniSample.traceId;
+        jointPub.publish(jointMsg);
+
+        JointCommand cmd;
+        cmd.q.PsiL = rrOut.q_vec.head<3>();
+        cmd.q.Beta = rrOut.q_vec.tail<3>();
+        cmd.q.Ftip.fill(0);
+        cmd.q.Ttip.fill(0);
+        cmd.seq = ++cmdSeq;
+        cmd.traceId = omniSample.traceId;
+        jointInput.write(cmd);
+        executor->notify(kinStage);
+        return true;
+    }
+
+    bool kinematics()
+    {
+        JointCommand cmd;
+        if (!jointInput.read(cmd) || cmd.seq == kinLatest.seq)
+        {
+            return false;
+        }
+        if (kinComputed && cmd.q.PsiL == lastQ.PsiL && cmd.q.Beta == lastQ.Beta)
+        {
+            // same joints: the last solution holds for this command too
+            kinLatest.seq = cmd.seq;
+            kinOutput.write(kinLatest);
+            return false;
+        }
+        lastQ = cmd.q;
+        kinComputed = true;
+
+        {
+            HotRegion hot;
+            cannula.compute(cmd.q, kin);
+            kinLatest.seq = cmd.seq;
+            kinLatest.ptip = kin.ptip;
+            kinLatest.qtip = kin.qtip;
+            kinLatest.alpha = kin.alpha;
+            kinLatest.J = kin.J;
+        }
+        kinOutput.write(kinLatest);
+
+        for (int i = 0; i < 3; i++)
+        {
+            kinMsg.p[i] = kin.ptip(i);
+            kinMsg.alpha[i] = kin.alpha(i);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            kinMsg.q[i] = kin.qtip(i);
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            kinMsg.J1[i] = kin.J(0,i);
+            kinMsg.J2[i] = kin.J(1,i);
+            kinMsg.J3[i] = kin.J(2,i);
+            kinMsg.J4[i] = kin.J(3,i);
+            kinMsg.J5[i] = kin.J(4,i);
+            kinMsg.J6[i] = kin.J(5,i);
+        }
+        kinMsg.trace_id = cmd.traceId;
+        kinPub.publish(kinMsg);
+
+        // backbone for the display, as the kinematics node sends it
+        for (int j = 0; j < kin.nBackbone && j < int(markersMsg.A1.size()); j++)
+        {
+            markersMsg.A1[j] = kin.posedata(0,j);
+            markersMsg.A2[j] = kin.posedata(1,j);
+            markersMsg.A3[j] = kin.posedata(2,j);
+            markersMsg.A4[j] = kin.posedata(3,j);
+            markersMsg.A5[j] = kin.posedata(4,j);
+            markersMsg.A6[j] = kin.posedata(5,j);
+            markersMsg.A7[j] = kin.posedata(6,j);
+            markersMsg.A8[j] = kin.posedata(7,j);
+        }
+        markersMsg.stamp = ros::Time::now();
+        displayFrames.write(markersMsg);
+        executor->notify(displayStage);
+        return true;
+    }
+
+    bool broadcastTf()
+    {
+        OmniInputSample s;
+        if (!tfInput.read(s))
+        {
+            return false;
+        }
+        tf::Transform transform;
+        transform.setOrigin(tf::Vector3(s.rawPosition(0)/10, s.rawPosition(1)/10, s.rawPosition(2)/10));
+        tf::Quaternion q(s.rawOrientation(1), s.rawOrientation(2), s.rawOrientation(3), s.rawOrientation(0));
+        q.normalize();
+        transform.setRotation(q);
+        br.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", "tip_pose"));
+        return true;
+    }
+
+    bool display()
+    {
+        if (!displayFrames.read(displayMsg))
+        {
+            return false;
+        }
+        needlePub.publish(displayMsg);
+        return true;
+    }
+
+    // INPUT (spinner thread) ------------------------------------------
+
+    // omni_node publishes every sample on both topics; the plain one is only
+    // a fallback for sources without Omnipos_stamped and is dropped once a
+    // stamped sample arrives, so the filter sees every sample once
+    void omniCallback(const geometry_msgs::Pose &msg)
+    {
+        if (!stampedInput)
+        {
+            omniPose(msg);
+        }
+    }
+
+    void omniStampedCallback(const endonasal_teleop::stampedPose &msg)
+    {
+        if (!stampedInput)
+        {
+            stampedInput = true;
+            omniSub.shutdown();
+        }
+        omniFilter.setTraceId(msg.trace_id);
+        omniPose(msg.pose);
+    }
+
+    void omniPose(const geometry_msgs::Pose &msg)
+    {
+        Eigen::Vector3d p;
+        p << msg.position.x, msg.position.y, msg.position.z;
+        Eigen::Vector4d q;
+        q << msg.orientation.w, msg.orientation.x, msg.orientation.y, msg.orientation.z;
+        omniFilter.update(monotonicSeconds(), p, q);
+        omniInput.write(omniFilter.sample());
+        tfInput.write(omniFilter.sample());
+        executor->notify(tfStage);
+    }
+
+    void buttonCallback(const std_msgs::Int8 &msg)
+    {
+        buttonState = static_cast<int>(msg.data);
+    }
+
+    StageExecutor *executor;
+    AsyncLogger logger;
+
+    // control stage
+    ResolvedRatesController rr;
+    ResolvedRatesOutput rrOut;
+    KinematicsState kinState;
+    OmniInputSample omniSample;
+    ActuatorMap actuators;
+    std::vector<int> counts;
+    std::vector<int> sentCounts;
+
+    // kinematics stage
+    CannulaKinematics cannula;
+    KinematicsResult kin;
+    KinematicsState kinLatest;
+    Configuration3 lastQ;
+    bool kinComputed;
+
+    // between the stages and the input thread
+    int kinStage;
+    int displayStage;
+    int tfStage;
+    OmniInputFilter omniFilter;
+    TripleBuffer<OmniInputSample> omniInput;
+    TripleBuffer<OmniInputSample> tfInput;
+    TripleBuffer<JointCommand> jointInput;
+    TripleBuffer<KinematicsState> kinOutput;
+    TripleBuffer<endonasal_teleop::matrix8> displayFrames;
+    std::atomic<int> buttonState;
+    int lastButton;
+    bool encSent;
+    uint64_t cmdSeq;
+    std::atomic<long> heldCycles;   // control periods without new kinematics
+
+    // ROS
+    ros::NodeHandle inputNode;
+    ros::CallbackQueue inputQueue;
+    std::unique_ptr<ros::AsyncSpinner> spinner;
+    ros::Subscriber omniSub;
+    ros::Subscriber omniStampedSub;
+    bool stampedInput;          // Omnipos_stamped seen, Omnipos ignored
+    ros::Subscriber buttonSub;
+    ros::Publisher jointPub;
+    ros::Publisher kinPub;
+    ros::Publisher needlePub;
+    std::vector<ros::Publisher> encoderPub;
+    tf::TransformBroadcaster br;
+    endonasal_teleop::config3 jointMsg;
+    endonasal_teleop::kinout kinMsg;
+    endonasal_teleop::matrix8 markersMsg;
+    endonasal_teleop::matrix8 displayMsg;
+    medlab_motor_control_board::McbEncoders encMsg;
+};
+
+inline double processCpuSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+/*******************************************************************************
+                INITIALIZE ROS NODE
+********************************************************************************/
+    ros::init(argc, argv, "teleop_executor");
+    ros::NodeHandle node;
+
+/*******************************************************************************
+                PARAMETERS
+********************************************************************************/
+    ResolvedRatesParams rrParams;
+    ros::param::param<bool>("~use_constrained_solver", rrParams.use_constrained_solver, rrParams.use_constrained_solver);
+    ros::param::param<int>("~qp_max_iterations", rrParams.qp_max_iterations, rrParams.qp_max_iterations);
+    ros::param::param<double>("~max_rot_speed", rrParams.max_rot_speed, rrParams.max_rot_speed);
+    ros::param::param<double>("~max_trans_speed", rrParams.max_trans_speed, rrParams.max_trans_speed);
+
+    OmniFilterParams omniFilterParams;
+    ros::param::param<bool>("~omni_filter", omniFilterParams.enabled, omniFilterParams.enabled);
+    ros::param::param<double>("~omni_pos_min_cutoff", omniFilterParams.position.minCutoff, omniFilterParams.position.minCutoff);
+    ros::param::param<double>("~omni_pos_beta", omniFilterParams.position.beta, omniFilterParams.position.beta);
+    ros::param::param<double>("~omni_pos_d_cutoff", omniFilterParams.position.dCutoff, omniFilterParams.position.dCutoff);
+    ros::param::param<double>("~omni_rot_min_cutoff", omniFilterParams.orientation.minCutoff, omniFilterParams.orientation.minCutoff);
+    ros::param::param<double>("~omni_rot_beta", omniFilterParams.orientation.beta, omniFilterParams.orientation.beta);
+    ros::param::param<double>("~omni_rot_d_cutoff", omniFilterParams.orientation.dCutoff, omniFilterParams.orientation.dCutoff);
+
+    std::string hardware_file;
+    std::string robot_name;
+    double kinematics_rate = 200.0;
+    double tf_rate = 1000.0;
+    double display_rate = 30.0;
+    int threads = 2;
+    int reserved_threads = 1;
+    int first_cpu = -1;
+    double report_period = 5.0;
+    ros::param::param<std::string>("~hardware_file", hardware_file, ros::package::getPath("endonasal_teleop") + "/config/hardware.xml");
+    ros::param::param<std::string>("~robot", robot_name, "endonasal_cannula");
+    ros::param::param<double>("~control_rate", rrParams.rosLoopRate, rrParams.rosLoopRate);
+    ros::param::param<double>("~kinematics_rate", kinematics_rate, 200.0);
+    ros::param::param<double>("~tf_rate", tf_rate, 1000.0);
+    ros::param::param<double>("~display_rate", display_rate, 30.0);
+    ros::param::param<int>("~threads", threads, 2);
+    ros::param::param<int>("~reserved_threads", reserved_threads, 1);
+    ros::param::param<int>("~first_cpu", first_cpu, -1);
+    ros::param::param<double>("~report_period", report_period, 5.0);
+
+    RealtimeProfile rtProfile = readRealtimeProfile();
+
+/*******************************************************************************
+                SET UP THE STAGES
+********************************************************************************/
+    TeleopStages pipeline(rrParams);
+    std::string error;
+    if (!pipeline.setup(hardware_file, robot_name, omniFilterParams, error))
+    {
+        std::cout << "Could not set up the pipeline: " << error << std::endl;
+        return 1;
+    }
+
+    StageExecutor executor;
+    pipeline.addTo(executor, rrParams.rosLoopRate, kinematics_rate, tf_rate, display_rate);
+
+    std::vector<int> cpus;
+    for (int i = 0; first_cpu >= 0 && i < threads; i++)
+    {
+        cpus.push_back(first_cpu + i);
+    }
+
+/*******************************************************************************
+                RUN
+********************************************************************************/
+    // the workers are started afterwards, so they inherit the profile
+    if (rtProfile.enabled)
+    {
+        std::string rtReport;
+        bool rtOk = applyRealtimeProfile(rtProfile, rtReport);
+        std::cout << (rtOk ? "Real-time profile:" : "Real-time profile (incomplete):") << std::endl << rtReport << std::endl;
+    }
+
+    std::cout << robot_name << ": " << executor.numStages() << " stages on " << threads << " threads ("
+              << reserved_threads << " reserved for control)" << std::endl << std::endl;
+    executor.start(threads, reserved_threads, cpus);
+    pipeline.startInput();
+
+    ros::WallTime lastReport = ros::WallTime::now();
+    double lastCpu = processCpuSeconds();
+    while (ros::ok())
+    {
+        ros::WallDuration(0.1).sleep();
+        double elapsed = (ros::WallTime::now() - lastReport).toSec();
+        if (report_period <= 0.0 || elapsed < report_period)
+        {
+            continue;
+        }
+        double cpu = processCpuSeconds();
+        executor.printReport();
+        printf("%-12s %8ld     periods held for kinematics\n", "control", pipeline.takeHeldCycles());
+        printf("%-12s %8s     %5.1f %% CPU (whole process)\n\n", "process", "", 100.0*(cpu - lastCpu)/elapsed);
+        fflush(stdout);
+        lastCpu = cpu;
+        lastReport = ros::WallTime::now();
+    }
+
+    pipeline.stopInput();
+    executor.stop();
+    return 0;
+}
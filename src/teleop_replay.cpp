@@ -0,0 +1,457 @@
+/********************************************************************
+
+  teleop_replay.cpp
+
+Deterministic offline replay of the teleoperation pipeline.
+Feeds recorded Omni poses and button states through the resolved rates
+controller and the cannula kinematics in-process, one control cycle per
+1/rate seconds of input time, without ROS topics, the motor boards or
+wall-clock pacing. Every run over the same input produces the same joint
+values and encoder commands; the hash printed at the end identifies
+that output so regressions show up as a changed hash.
+
+Input is either a rosbag with Omnipos (geometry_msgs/Pose) and
+Buttonstates (std_msgs/Int8), or a resolved_rates flight recording
+(one cycle per record, see flight_recorder.h).
+
+Encoder commands are computed with the actuator map of --robot
+(default endonasal_cannula) in --hardware (default the package's
+config/hardware.xml).
+
+--check-allocations runs every cycle as a hot region of the allocation
+guard (alloc_guard.h) and fails if any cycle allocated on the heap;
+--abort-on-allocation aborts at the first such allocation instead, for
+a stack trace. Both need a build with -DALLOC_GUARD=ON.
+
+--omni-filter passes the Omni poses through the input filters of
+resolved_rates (omni_filter.h, default cutoffs) at their input times
+before the controller sees them; without it the poses go in raw, as
+recorded.
+
+Usage: teleop_replay <input.bag|recording> [--csv out.csv]
+                     [--rate Hz] [--legacy-solver] [--expect hash]
+                     [--hardware hardware.xml] [--robot name]
+                     [--check-allocations] [--abort-on-allocation]
+                     [--omni-filter]
+
+********************************************************************/
+
+#include "resolved_rates_core.h"
+#include "kinematics_core.h"
+#include "flight_recorder.h"
+#include "actuator_map.h"
+#include "alloc_guard.h"
+#include "omni_filter.h"
+
+#include <ros/package.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <geometry_msgs/Pose.h>
+#include <std_msgs/Int8.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// one recorded input, in input time
+struct ReplayEvent
+{
+    double t;
+    bool isPose;
+    Eigen::Vector3d p;
+    Eigen::Vector4d q;      // w x y z
+    int button;
+};
+
+bool eventBefore(const ReplayEvent &a, const ReplayEvent &b)
+{
+    return a.t < b.t;
+}
+
+bool endsWith(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool loadBag(const std::string &path, std::vector<ReplayEvent> &events)
+{
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(path, rosbag::bagmode::Read);
+    }
+    catch (rosbag::BagException &e)
+    {
+        std::cerr << "Could not open " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> topics;
+    topics.push_back("Omnipos");
+    topics.push_back("/Omnipos");
+    topics.push_back("Buttonstates");
+    topics.push_back("/Buttonstates");
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+    for (rosbag::View::iterator it = view.begin(); it != view.end(); ++it)
+    {
+        ReplayEvent ev;
+        ev.t = it->getTime().toSec();
+        geometry_msgs::Pose::ConstPtr pose = it->instantiate<geometry_msgs::Pose>();
+        std_msgs::Int8::ConstPtr button = it->instantiate<std_msgs::Int8>();
+        if (pose)
+        {
+            ev.isPose = true;
+            ev.p << pose->position.x, pose->position.y, pose->position.z;
+            ev.q << pose->orientation.w, pose->orientation.x, pose->orientation.y, pose->orientation.z;
+            ev.button = 0;
+        }
+        else if (button)
+        {
+            ev.isPose = false;
+            ev.button = button->data;
+        }
+        else
+        {
+            continue;
+        }
+        events.push_back(ev);
+    }
+    bag.close();
+
+    // a bag is ordered by receive time already; keep equal stamps in bag order
+    std::stable_sort(events.begin(), events.end(), eventBefore);
+    return true;
+}
+
+// each record holds what resolved_rates saw at the start of one cycle, so
+// records are placed on the cycle grid rather than at their stamps
+bool loadRecording(const std::string &path, double period, std::vector<ReplayEvent> &events)
+{
+    FlightRecording rec;
+    std::string error;
+    if (!loadFlightRecording(path, rec, error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    if (rec.header.recordType != RECORD_RESOLVED_RATES)
+    {
+        std::cerr << path << " is not a resolved_rates recording." << std::endl;
+        return false;
+    }
+
+    int cP = rec.column("omni_p_0");
+    int cQ = rec.column("omni_q_0");
+    int cButton = rec.column("button");
+    if (cP < 0 || cQ < 0 || cButton < 0)
+    {
+        std::cerr << path << " is missing the Omni input columns." << std::endl;
+        return false;
+    }
+
+    for (uint64_t r = 0; r < rec.count; r++)
+    {
+        ReplayEvent ev;
+        ev.t = r*period;
+        ev.isPose = true;
+        ev.p << rec.value(r, cP), rec.value(r, cP+1), rec.value(r, cP+2);
+        ev.q << rec.value(r, cQ), rec.value(r, cQ+1), rec.value(r, cQ+2), rec.value(r, cQ+3);
+        ev.button = 0;
+        events.push_back(ev);
+
+        ev.isPose = false;
+        ev.button = int(rec.value(r, cButton));
+        events.push_back(ev);
+    }
+    return true;
+}
+
+// 64-bit FNV-1a over the raw bytes of the output
+void fnv1a(uint64_t &h, const void *data, size_t n)
+{
+    const unsigned char *b = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: teleop_replay <input.bag|recording> [--csv out.csv] [--rate Hz] [--legacy-solver] [--expect hash]"
+                     " [--hardware hardware.xml] [--robot name] [--check-allocations] [--abort-on-allocation] [--omni-filter]" << std::endl;
+        return 1;
+    }
+
+    std::string inPath = argv[1];
+    std::string csvPath;
+    std::string expectHash;
+    std::string hardwarePath;
+    std::string robotName = "endonasal_cannula";
+    bool checkAllocations = false;
+    bool abortOnAllocation = false;
+    bool omniFilterOn = false;
+    ResolvedRatesParams params;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--csv" && i+1 < argc)
+        {
+            csvPath = argv[++i];
+        }
+        else if (arg == "--rate" && i+1 < argc)
+        {
+            params.rosLoopRate = atof(argv[++i]);
+        }
+        else if (arg == "--legacy-solver")
+        {
+            params.use_constrained_solver = false;
+        }
+        else if (arg == "--expect" && i+1 < argc)
+        {
+            expectHash = argv[++i];
+        }
+        else if (arg == "--hardware" && i+1 < argc)
+        {
+            hardwarePath = argv[++i];
+        }
+        else if (arg == "--robot" && i+1 < argc)
+        {
+            robotName = argv[++i];
+        }
+        else if (arg == "--check-allocations")
+        {
+            checkAllocations = true;
+        }
+        else if (arg == "--abort-on-allocation")
+        {
+            checkAllocations = true;
+            abortOnAllocation = true;
+        }
+        else if (arg == "--omni-filter")
+        {
+            omniFilterOn = true;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (checkAllocations && !allocationGuardEnabled())
+    {
+        std::cerr << "--check-allocations needs a build with the allocation guard (cmake -DALLOC_GUARD=ON)" << std::endl;
+        return 1;
+    }
+
+/*******************************************************************************
+                LOAD INPUT
+********************************************************************************/
+
+    std::vector<ReplayEvent> events;
+    bool loaded = endsWith(inPath, ".bag") ? loadBag(inPath, events) : loadRecording(inPath, 1.0/params.rosLoopRate, events);
+    if (!loaded)
+    {
+        return 1;
+    }
+    if (events.empty())
+    {
+        std::cerr << "No Omnipos or Buttonstates input in " << inPath << std::endl;
+        return 1;
+    }
+
+/*******************************************************************************
+                SET UP THE PIPELINE
+********************************************************************************/
+
+    if (hardwarePath.empty())
+    {
+        hardwarePath = ros::package::getPath("endonasal_teleop") + "/config/hardware.xml";
+    }
+    ActuatorMap actuators;
+    std::string error;
+    if (!actuators.load(hardwarePath, std::vector<std::string>(1, robotName), error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::vector<int> counts(actuators.numCounts(), 0);
+
+    CannulaKinematics cannula;
+    KinematicsResult kin;
+    KinematicsState kinState;
+    ResolvedRatesController rr(params);
+    ResolvedRatesOutput rrOut;
+
+    // kinematics starts at its home pose and hands that to resolved rates,
+    // which starts from its own starting configuration (get_starting_kin)
+    cannula.compute(CannulaKinematics::homeConfiguration(), kin);
+    kinState.ptip = kin.ptip;
+    kinState.qtip = kin.qtip;
+    kinState.alpha.fill(0);
+    kinState.J = kin.J;
+    rr.reset(ResolvedRatesController::homeConfiguration(), cannula.tubeLengths());
+
+    FILE *csv = 0;
+    if (!csvPath.empty())
+    {
+        csv = fopen(csvPath.c_str(), "w");
+        if (!csv)
+        {
+            std::cerr << "Could not open " << csvPath << std::endl;
+            return 1;
+        }
+        fprintf(csv, "cycle,t,button,clutched,solver_iterations");
+        for (int i = 0; i < 6; i++) fprintf(csv, ",q_%d", i);
+        for (int b = 0; b < actuators.numBoards(); b++)
+        {
+            for (int i = 0; i < actuators.boardAxes(b); i++) fprintf(csv, ",%s_%d", actuators.boardName(b).c_str(), i);
+        }
+        for (int i = 0; i < 3; i++) fprintf(csv, ",p_%d", i);
+        fprintf(csv, "\n");
+    }
+
+/*******************************************************************************
+                REPLAY
+********************************************************************************/
+
+    uint64_t hash = 14695981039346656037ULL;
+    double period = 1.0/params.rosLoopRate;
+    double t0 = events.front().t;
+    double tEnd = events.back().t;
+    size_t next = 0;
+    long cycles = 0;
+    double tRR = 0.0;
+    double tKin = 0.0;
+    long allocatingCycles = 0;
+    long firstAllocatingCycle = -1;
+    OmniInputFilter omniFilter;
+    resetHotAllocations();
+    setAllocationAbort(abortOnAllocation);
+    double wallStart = monotonicSeconds();
+
+    for (double t = t0; t <= tEnd + 0.5*period; t = t0 + (++cycles)*period)
+    {
+        // deliver everything received up to this cycle
+        while (next < events.size() && events[next].t <= t)
+        {
+            const ReplayEvent &ev = events[next++];
+            if (ev.isPose)
+            {
+                if (omniFilterOn)
+                {
+                    omniFilter.update(ev.t, ev.p, ev.q);
+                    rr.onOmniPose(omniFilter.sample().position, omniFilter.sample().orientation);
+                }
+                else
+                {
+                    rr.onOmniPose(ev.p, ev.q);
+                }
+            }
+            else
+            {
+                rr.onButton(ev.button);
+            }
+        }
+
+        long allocationsBefore = hotAllocations();
+        {
+            HotRegion hot;
+
+            double tic = monotonicSeconds();
+            rr.step(kinState, rrOut);
+            double toc = monotonicSeconds();
+            tRR += toc - tic;
+
+            // joint_q -> kinematics -> kinematics_output for the next cycle
+            Configuration3 q;
+            q.PsiL = rrOut.q_vec.head<3>();
+            q.Beta = rrOut.q_vec.tail<3>();
+            q.Ftip.fill(0);
+            q.Ttip.fill(0);
+            cannula.compute(q, kin);
+            kinState.ptip = kin.ptip;
+            kinState.qtip = kin.qtip;
+            kinState.alpha = kin.alpha;
+            kinState.J = kin.J;
+            tKin += monotonicSeconds() - toc;
+
+            actuators.toCounts(rrOut.actuatorJoints.data(), counts.data());
+        }
+        if (hotAllocations() != allocationsBefore)
+        {
+            if (firstAllocatingCycle < 0)
+            {
+                firstAllocatingCycle = cycles;
+            }
+            allocatingCycles++;
+        }
+
+        fnv1a(hash, rrOut.q_vec.data(), 6*sizeof(double));
+        fnv1a(hash, counts.data(), counts.size()*sizeof(int));
+
+        if (csv)
+        {
+            fprintf(csv, "%ld,%.9f,%d,%d,%d", cycles, t - t0, rr.button(), int(rrOut.clutched), rrOut.solverIterations);
+            for (int i = 0; i < 6; i++) fprintf(csv, ",%.17g", rrOut.q_vec(i));
+            for (size_t i = 0; i < counts.size(); i++) fprintf(csv, ",%d", counts[i]);
+            for (int i = 0; i < 3; i++) fprintf(csv, ",%.17g", kin.ptip(i));
+            fprintf(csv, "\n");
+        }
+    }
+    double wall = monotonicSeconds() - wallStart;
+
+    if (csv)
+    {
+        fclose(csv);
+    }
+
+    char hashText[17];
+    snprintf(hashText, sizeof(hashText), "%016llx", (unsigned long long)hash);
+
+    std::cout << "Replayed " << cycles << " cycles (" << events.size() << " input messages, "
+              << (tEnd - t0) << " s of input) in " << wall << " s: "
+              << cycles/wall << " cycles/s, " << (tEnd - t0)/wall << "x real time" << std::endl;
+    std::cout << "  resolved rates " << 1e6*tRR/cycles << " us/cycle, kinematics "
+              << 1e6*tKin/cycles << " us/cycle" << std::endl;
+    if (omniFilterOn)
+    {
+        const OmniInputSample &f = omniFilter.sample();
+        std::cout << "  Omni filter lag position " << (f.positionMoving ? 1e3*f.positionLagSum/f.positionMoving : 0.0)
+                  << " ms mean, " << 1e3*f.positionLagMax << " ms max; orientation "
+                  << (f.orientationMoving ? 1e3*f.orientationLagSum/f.orientationMoving : 0.0)
+                  << " ms mean, " << 1e3*f.orientationLagMax << " ms max" << std::endl;
+    }
+    std::cout << "Output hash " << hashText << std::endl;
+    if (checkAllocations)
+    {
+        std::cout << "Heap allocations in the control cycle: " << hotAllocations() << " (" << hotAllocationBytes()
+                  << " bytes) in " << allocatingCycles << " of " << cycles << " cycles";
+        if (firstAllocatingCycle >= 0)
+        {
+            std::cout << ", first in cycle " << firstAllocatingCycle;
+        }
+        std::cout << std::endl;
+    }
+
+    if (!expectHash.empty() && expectHash != hashText)
+    {
+        std::cerr << "Output hash does not match the expected " << expectHash << std::endl;
+        return 2;
+    }
+    if (checkAllocations && hotAllocations() > 0)
+    {
+        std::cerr << "The control cycle is not allocation-free" << std::endl;
+        return 3;
+    }
+    return 0;
+}
@@ -1,59 +1,162 @@
+/********************************************************************
+
+  tf_broadcaster.cpp
+
+Broadcasts the teleoperation frames for RViz, on new data instead of
+on a 1 kHz timer:
+    world -> tip_pose       the Omni stylus (Omnipos, position / 10)
+    world -> cannula_tip    the cannula tip (kinematics_output)
+    world -> cannula_base   the front plate (fixed, ~base_position and
+                            ~base_orientation, x y z w)
+The callbacks only take the newest values. Each pass of the loop sends
+the frames that changed, plus the base frame with the same stamp, as one
+tfMessage. If nothing was sent for 1/~keepalive_rate seconds, all
+frames are sent again, so new listeners and the base frame stay
+current (~keepalive_rate 0: never).
+
+Every ~report_period seconds (0: never) the node prints the messages
+and transforms it sent per second and its CPU use. The old loop sent
+1000 messages and transforms per second whatever came in (and an
+Omniforce message with each); this one follows the input, about one
+message per Omni sample while the Omni streams and only the keep-alive
+without input.
+
+********************************************************************/
+
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <tf/transform_broadcaster.h>
 #include <geometry_msgs/Pose.h>
-#include <std_msgs/Int32.h>
+#include <endonasal_teleop/kinout.h>
 
-// define tf stuff
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <vector>
 
-tf::Transform transform;
-//float z_value;
-float z_value =float();
+// newest frames from the callbacks, and whether they were sent yet
+tf::Transform omniTransform;
+tf::Transform tipTransform;
+bool newOmni = false;
+bool newTip = false;
+bool haveOmni = false;
+bool haveTip = false;
 
-//subscriber callback function
-void Callback(const geometry_msgs::Pose& msg)
+void omniCallback(const geometry_msgs::Pose &msg)
 {
-// Define the frame
-//double x= msg.position.x;
-transform.setOrigin( tf::Vector3(msg.position.x/10,msg.position.y/10,msg.position.z/10));
-tf::Quaternion q(msg.orientation.x,msg.orientation.y,msg.orientation.z,msg.orientation.w);
-q.normalize();
-transform.setRotation(q);
-z_value=msg.position.z;
+    omniTransform.setOrigin(tf::Vector3(msg.position.x/10,msg.position.y/10,msg.position.z/10));
+    tf::Quaternion q(msg.orientation.x,msg.orientation.y,msg.orientation.z,msg.orientation.w);
+    q.normalize();
+    omniTransform.setRotation(q);
+    newOmni = true;
+    haveOmni = true;
 }
 
+void kinCallback(const endonasal_teleop::kinout &msg)
+{
+    tipTransform.setOrigin(tf::Vector3(msg.p[0],msg.p[1],msg.p[2]));
+    tf::Quaternion q(msg.q[1],msg.q[2],msg.q[3],msg.q[0]); // kinout is wxyz
+    q.normalize();
+    tipTransform.setRotation(q);
+    newTip = true;
+    haveTip = true;
+}
 
-int main(int argc, char** argv){
-ros::init(argc,argv, "my_tf_broadcaster");
-ros::NodeHandle node;
+inline double processCpuSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+    ros::init(argc,argv, "my_tf_broadcaster");
+    ros::NodeHandle node;
 
-// use the tf library to broadcast tf frames to Rviz
-static tf::TransformBroadcaster br;
+    // use the tf library to broadcast tf frames to Rviz
+    tf::TransformBroadcaster br;
 
-// define frame positions
-float x_value =float(); 
-float y_value =float();
+    double keepalive_rate, report_period;
+    std::vector<double> base_position, base_orientation;
+    ros::param::param<double>("~keepalive_rate", keepalive_rate, 10.0);
+    ros::param::param<double>("~report_period", report_period, 10.0);
+    ros::param::param<std::vector<double> >("~base_position", base_position, {0.0, 0.0, 0.0});
+    ros::param::param<std::vector<double> >("~base_orientation", base_orientation, {0.0, 0.0, 0.0, 1.0});
+    tf::Transform baseTransform = tf::Transform::getIdentity();
+    if (base_position.size() == 3 && base_orientation.size() == 4)
+    {
+        baseTransform.setOrigin(tf::Vector3(base_position[0],base_position[1],base_position[2]));
+        tf::Quaternion q(base_orientation[0],base_orientation[1],base_orientation[2],base_orientation[3]);
+        q.normalize();
+        baseTransform.setRotation(q);
+    }
+    else
+    {
+        std::cout << "base_position needs 3 values and base_orientation 4 (x y z w), using the identity" << std::endl;
+    }
 
+    ros::Subscriber omniSub = node.subscribe("Omnipos", 10, omniCallback);
+    ros::Subscriber kinSub = node.subscribe("kinematics_output", 10, kinCallback);
+    ros::CallbackQueue *queue = ros::getGlobalCallbackQueue();
 
-// Force feedback stuff
-// Set the grid on xy plan. 
-float threshold = 0;
-std_msgs::Int32 force_flag;
+    ros::WallDuration keepalive(keepalive_rate > 0.0 ? 1.0/keepalive_rate : 0.0);
+    ros::WallDuration reportPeriod(std::max(report_period, 0.0));
+    ros::WallTime lastSent = ros::WallTime::now();
+    ros::WallTime lastReport = ros::WallTime::now();
+    double lastCpu = processCpuSeconds();
+    long nMessages = 0, nTransforms = 0;
+    std::vector<tf::StampedTransform> batch;
+    batch.reserve(3);
 
-//
-ros::Subscriber sub = node.subscribe("Omnipos", 1000, Callback);
-ros::Publisher pub = node.advertise<std_msgs::Int32>("Omniforce", 1000);
-ros::Rate r(1000);
+    while (ros::ok())
+    {
+        // sleep until a callback is due, or until the keep-alive or report is
+        ros::WallTime wakeUp = lastSent + (keepalive_rate > 0.0 ? keepalive : ros::WallDuration(1.0));
+        if (report_period > 0.0)
+        {
+            wakeUp = std::min(wakeUp, lastReport + reportPeriod);
+        }
+        queue->callAvailable(ros::WallDuration(std::max(0.0, (wakeUp - ros::WallTime::now()).toSec())));
 
-while(ros::ok()){
-// send transform
-br.sendTransform(tf::StampedTransform(transform,ros::Time::now(),"world","tip_pose"));
-// send force feedback back to windows & omni
-if (z_value < threshold) { force_flag.data = 1; }
-else { force_flag.data = 0; }
-pub.publish(force_flag);
-ros::spinOnce();
-r.sleep();
-}
+        // the changed frames, or everything if the keep-alive is due
+        ros::WallTime now = ros::WallTime::now();
+        bool keepaliveDue = keepalive_rate > 0.0 && now - lastSent >= keepalive;
+        ros::Time stamp = ros::Time::now();
+        batch.clear();
+        if (haveOmni && (newOmni || keepaliveDue))
+        {
+            batch.push_back(tf::StampedTransform(omniTransform,stamp,"world","tip_pose"));
+        }
+        if (haveTip && (newTip || keepaliveDue))
+        {
+            batch.push_back(tf::StampedTransform(tipTransform,stamp,"world","cannula_tip"));
+        }
+        if (!batch.empty() || keepaliveDue)
+        {
+            batch.push_back(tf::StampedTransform(baseTransform,stamp,"world","cannula_base"));
+            br.sendTransform(batch);
+            nMessages++;
+            nTransforms += batch.size();
+            lastSent = now;
+        }
+        newOmni = false;
+        newTip = false;
+
+        if (report_period > 0.0 && now - lastReport >= reportPeriod)
+        {
+            double elapsed = (now - lastReport).toSec();
+            double cpu = processCpuSeconds();
+            printf("tf: %.1f messages/s, %.1f transforms/s, %.2f %% CPU\n",
+                   nMessages/elapsed, nTransforms/elapsed, 100.0*(cpu - lastCpu)/elapsed);
+            fflush(stdout);
+            nMessages = 0;
+            nTransforms = 0;
+            lastCpu = cpu;
+            lastReport = now;
+        }
+    }
 
-return 0;
+    return 0;
 }
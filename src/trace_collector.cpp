@@ -0,0 +1,268 @@
+/********************************************************************
+
+  trace_collector.cpp
+
+Collects the latency trace events of the teleoperation pipeline (see
+trace_events.h) and reports, per hop, how long a traced Omni sample
+spent between leaving one stage and reaching the next, plus the
+end-to-end time from Omnipos to the encoder command.
+
+Histograms are printed every ~report_period seconds and at shutdown.
+If ~trace_file is set, every completed trace is written there at
+shutdown as Chrome trace JSON (chrome://tracing or ui.perfetto.dev),
+one lane per hop.
+
+omni_node stamps its samples with its rosserial-synchronized clock, so
+the first hop also contains the clock offset between the two machines.
+
+********************************************************************/
+
+#include <ros/ros.h>
+#include <endonasal_teleop/stampedPose.h>
+#include <endonasal_teleop/traceEvent.h>
+
+#include "trace_events.h"
+#include "latency_histogram.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// everything seen so far for one trace id
+struct TraceRecord
+{
+    double t[NUM_TRACE_HOPS];
+    bool seen[NUM_TRACE_HOPS];
+    double received;    // local time the first event arrived, for pruning
+};
+
+// intervals reported: each hop to the next, then end to end
+#define NUM_INTERVALS NUM_TRACE_HOPS
+
+std::unordered_map<uint64_t, TraceRecord> openTraces;
+LatencyHistogram intervalHist[NUM_INTERVALS];
+LatencyHistogram totalHist[NUM_INTERVALS];  // since startup
+
+// completed traces kept for the Chrome trace export
+std::vector<uint64_t> doneIds;
+std::vector<TraceRecord> doneTraces;
+int maxTraces = 100000;
+
+std::string intervalName(int k)
+{
+    if (k == NUM_INTERVALS-1)
+    {
+        return std::string(traceHopNames[0]) + " -> " + traceHopNames[NUM_TRACE_HOPS-1];
+    }
+    return std::string(traceHopNames[k]) + " -> " + traceHopNames[k+1];
+}
+
+void addInterval(int k, double dt)
+{
+    intervalHist[k].add(dt);
+    totalHist[k].add(dt);
+}
+
+void completeTrace(uint64_t id, const TraceRecord &tr)
+{
+    for (int k = 0; k < NUM_TRACE_HOPS-1; k++)
+    {
+        if (tr.seen[k] && tr.seen[k+1])
+        {
+            addInterval(k, tr.t[k+1] - tr.t[k]);
+        }
+    }
+    if (tr.seen[0])
+    {
+        addInterval(NUM_INTERVALS-1, tr.t[NUM_TRACE_HOPS-1] - tr.t[0]);
+    }
+
+    if (int(doneTraces.size()) < maxTraces)
+    {
+        doneIds.push_back(id);
+        doneTraces.push_back(tr);
+    }
+}
+
+void recordEvent(uint64_t id, int hop, double t)
+{
+    if (id == 0 || hop < 0 || hop >= NUM_TRACE_HOPS)
+    {
+        return;
+    }
+
+    std::unordered_map<uint64_t, TraceRecord>::iterator it = openTraces.find(id);
+    if (it == openTraces.end())
+    {
+        TraceRecord tr;
+        for (int k = 0; k < NUM_TRACE_HOPS; k++)
+        {
+            tr.seen[k] = false;
+        }
+        tr.received = ros::WallTime::now().toSec();
+        it = openTraces.insert(std::make_pair(id, tr)).first;
+    }
+
+    // a message can be passed on more than once (e.g. joint_q is
+    // republished every cycle); only its first appearance counts
+    TraceRecord &tr = it->second;
+    if (!tr.seen[hop])
+    {
+        tr.seen[hop] = true;
+        tr.t[hop] = t;
+    }
+
+    if (hop == NUM_TRACE_HOPS-1)
+    {
+        completeTrace(id, tr);
+        openTraces.erase(it);
+    }
+}
+
+// most Omni samples never make it into a control cycle
+void pruneTraces(double maxAge)
+{
+    double now = ros::WallTime::now().toSec();
+    for (std::unordered_map<uint64_t, TraceRecord>::iterator it = openTraces.begin(); it != openTraces.end(); )
+    {
+        if (now - it->second.received > maxAge)
+        {
+            it = openTraces.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void printHistograms(const LatencyHistogram *hist, const char *title)
+{
+    printf("%s\n", title);
+    printf("  %-44s %8s %8s %8s %8s %8s %8s\n", "hop [ms]", "n", "mean", "p50", "p90", "p99", "max");
+    for (int k = 0; k < NUM_INTERVALS; k++)
+    {
+        const LatencyHistogram &h = hist[k];
+        if (h.count() == 0)
+        {
+            continue;
+        }
+        printf("  %-44s %8ld %8.2f %8.2f %8.2f %8.2f %8.2f\n", intervalName(k).c_str(), h.count(),
+               1e3*h.mean(), 1e3*h.percentile(0.5), 1e3*h.percentile(0.9), 1e3*h.percentile(0.99), 1e3*h.maximum());
+    }
+    fflush(stdout);
+}
+
+bool writeChromeTrace(const std::string &path)
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+    {
+        return false;
+    }
+
+    double t0 = 0.0;
+    bool haveT0 = false;
+    for (size_t i = 0; i < doneTraces.size(); i++)
+    {
+        for (int k = 0; k < NUM_TRACE_HOPS; k++)
+        {
+            if (doneTraces[i].seen[k] && (!haveT0 || doneTraces[i].t[k] < t0))
+            {
+                t0 = doneTraces[i].t[k];
+                haveT0 = true;
+            }
+        }
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int k = 0; k < NUM_TRACE_HOPS-1; k++)
+    {
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                k, intervalName(k).c_str());
+    }
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"teleop pipeline\"}}");
+
+    for (size_t i = 0; i < doneTraces.size(); i++)
+    {
+        const TraceRecord &tr = doneTraces[i];
+        for (int k = 0; k < NUM_TRACE_HOPS-1; k++)
+        {
+            if (!tr.seen[k] || !tr.seen[k+1])
+            {
+                continue;
+            }
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace_id\":%llu}}",
+                    traceHopNames[k+1], k, 1e6*(tr.t[k] - t0), 1e6*(tr.t[k+1] - tr.t[k]),
+                    (unsigned long long)doneIds[i]);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return true;
+}
+
+void traceCallback(const endonasal_teleop::traceEvent &msg)
+{
+    recordEvent(msg.trace_id, msg.hop, msg.stamp.toSec());
+}
+
+void omniStampedCallback(const endonasal_teleop::stampedPose &msg)
+{
+    recordEvent(msg.trace_id, endonasal_teleop::traceEvent::OMNI_PUBLISH, msg.header.stamp.toSec());
+}
+
+int main(int argc, char *argv[])
+{
+    ros::init(argc, argv, "trace_collector");
+    ros::NodeHandle node;
+
+    double reportPeriod = 5.0;
+    std::string traceFile;
+    ros::param::param<double>("~report_period", reportPeriod, 5.0);
+    ros::param::param<std::string>("~trace_file", traceFile, "");
+    ros::param::param<int>("~max_traces", maxTraces, 100000);
+
+    ros::Subscriber traceSub = node.subscribe("trace_events", 10000, traceCallback);
+    ros::Subscriber omniSub = node.subscribe("Omnipos_stamped", 1000, omniStampedCallback);
+
+    ros::Rate r(100.0);
+    ros::WallTime lastReport = ros::WallTime::now();
+    while (ros::ok())
+    {
+        ros::spinOnce();
+
+        if ((ros::WallTime::now() - lastReport).toSec() >= reportPeriod)
+        {
+            char title[64];
+            snprintf(title, sizeof(title), "Latency over the last %.1f s:", reportPeriod);
+            printHistograms(intervalHist, title);
+            for (int k = 0; k < NUM_INTERVALS; k++)
+            {
+                intervalHist[k].clear();
+            }
+            pruneTraces(2.0);
+            lastReport = ros::WallTime::now();
+        }
+
+        r.sleep();
+    }
+
+    printHistograms(totalHist, "Latency since startup:");
+    if (!traceFile.empty())
+    {
+        if (writeChromeTrace(traceFile))
+        {
+            std::cout << "Wrote " << doneTraces.size() << " traces to " << traceFile << std::endl;
+        }
+        else
+        {
+            std::cout << "Could not write " << traceFile << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef TRACE_EVENTS_H
+#define TRACE_EVENTS_H
+
+/********************************************************************
+
+  trace_events.h
+
+End-to-end latency tracing for the teleoperation pipeline.
+omni_node gives every Omni sample a trace id (Omnipos_stamped). The id
+travels in config3 and kinout, and each node publishes a traceEvent on
+"trace_events" when a traced message arrives or leaves. trace_collector
+puts the events back together per trace id.
+
+Path of one sample:
+    omni_node       OMNI_PUBLISH        (stamp of Omnipos_stamped)
+    resolved_rates  RR_OMNI_RECEIVE
+                    RR_JOINT_PUBLISH    joint_q
+    kinematics      KIN_JOINT_RECEIVE
+                    KIN_OUTPUT_PUBLISH  kinematics_output
+    resolved_rates  RR_KIN_RECEIVE
+                    RR_ENCODER_PUBLISH  MCB1/MCB4 encoder_command
+The encoder command is the first one computed from the kinematics of
+that sample, i.e. the first command that fully reflects it.
+
+********************************************************************/
+
+#include <ros/ros.h>
+#include <endonasal_teleop/traceEvent.h>
+
+#define NUM_TRACE_HOPS 7
+
+static const char * const traceHopNames[NUM_TRACE_HOPS] =
+{
+    "omni_publish",
+    "rr_omni_receive",
+    "rr_joint_publish",
+    "kin_joint_receive",
+    "kin_output_publish",
+    "rr_kin_receive",
+    "rr_encoder_publish"
+};
+
+class TraceEventPublisher
+{
+public:
+    TraceEventPublisher() : enabled(false) {}
+
+    // tracing is on unless ~trace_events is false
+    void advertise(ros::NodeHandle &node)
+    {
+        ros::param::param<bool>("~trace_events", enabled, true);
+        if (enabled)
+        {
+            pub = node.advertise<endonasal_teleop::traceEvent>("trace_events", 1000);
+        }
+    }
+
+    // trace id 0 means the message was not traced (e.g. plain Omnipos);
+    // safe to call from several threads
+    void emit(uint64_t traceId, uint8_t hop, const ros::Time &stamp = ros::Time::now())
+    {
+        if (!enabled || traceId == 0)
+        {
+            return;
+        }
+        endonasal_teleop::traceEvent msg;
+        msg.trace_id = traceId;
+        msg.hop = hop;
+        msg.stamp = stamp;
+        pub.publish(msg);
+    }
+
+private:
+    bool enabled;
+    ros::Publisher pub;
+};
+
+#endif // TRACE_EVENTS_H
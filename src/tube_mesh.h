@@ -0,0 +1,141 @@
+#ifndef TUBE_MESH_H
+#define TUBE_MESH_H
+
+/********************************************************************
+
+  tube_mesh.h
+
+Triangle mesh of the cannula for display, independent of ROS: a circle
+of the tube's radius swept along the backbone frames (needle_position,
+z along the backbone).
+
+Each segment between two kept backbone points is a ring of quads (two
+triangles each, counterclockwise seen from outside) with the radius of
+the tube at its end, so the steps between tubes stay sharp. Points
+closer than minSpacing to the last kept one are skipped unless the tube
+changes there; the interpolated backbone is much denser than the
+display needs. The triangles go into one list per tube, three vertices
+each (an RViz TRIANGLE_LIST marker), so every tube is drawn in one
+color by one marker.
+
+The output vectors keep their capacity: once they have held the largest
+mesh, building allocates nothing.
+
+********************************************************************/
+
+#include "teleop_common.h"
+
+#include <Eigen/Dense>
+
+#include <cmath>
+#include <vector>
+
+class TubeMeshBuilder
+{
+public:
+    TubeMeshBuilder(int nSides = 12, double minPointSpacing = 1.0e-3)
+        : sides(nSides), minSpacing(minPointSpacing), nSegments(0)
+    {
+        // display diameters of tube 1 (inner) .. 3 (outer)
+        radii << 0.5*1.168e-3, 0.5*1.684e-3, 0.5*2.324e-3;
+        cosines.resize(sides+1);
+        sines.resize(sides+1);
+        for (int i = 0; i <= sides; i++)
+        {
+            cosines[i] = cos(2.0*M_PI*i/sides);
+            sines[i] = sin(2.0*M_PI*i/sides);
+        }
+    }
+
+    // outer radius of tube 1 (inner) .. 3 (outer) [m]
+    void setTubeRadii(const Eigen::Vector3d &r) { radii = r; }
+
+    int numSides() const { return sides; }
+    int numSegments() const { return nSegments; }
+
+    // Sweeps the first n points of posedata (8 x N: p, q wxyz, tube number
+    // 1..3) into one triangle list per tube, of points with x, y, z members
+    // (e.g. the points of a geometry_msgs TRIANGLE_LIST marker).
+    template<typename PointT>
+    void build(const Eigen::MatrixXd &posedata, int n,
+               std::vector<PointT> &inner, std::vector<PointT> &middle, std::vector<PointT> &outer)
+    {
+        std::vector<PointT> *triangles[3] = {&inner, &middle, &outer};
+        int nVertices[3] = {0, 0, 0};
+        nSegments = 0;
+        int last = -1;
+        for (int k = 0; k < n; k++)
+        {
+            int tube = tubeAt(posedata, k);
+            if (last >= 0 && k < n-1 && tube == tubeAt(posedata, last) &&
+                (posedata.block<3,1>(0,k) - posedata.block<3,1>(0,last)).norm() < minSpacing)
+            {
+                continue;
+            }
+            if (last >= 0)
+            {
+                addSegment(posedata, last, k, radii(tube-1), *triangles[tube-1], nVertices[tube-1]);
+            }
+            last = k;
+        }
+        for (int t = 0; t < 3; t++)
+        {
+            triangles[t]->resize(nVertices[t]);
+        }
+    }
+
+private:
+    static int tubeAt(const Eigen::MatrixXd &posedata, int k)
+    {
+        int tube = int(posedata(7,k) + 0.5);
+        return tube < 1 ? 1 : (tube > 3 ? 3 : tube);
+    }
+
+    // ring of 2*sides triangles from point a to point b
+    template<typename PointT>
+    void addSegment(const Eigen::MatrixXd &posedata, int a, int b, double r, std::vector<PointT> &out, int &nv)
+    {
+        Eigen::Matrix3d Ra = quat2rotm(posedata.block<4,1>(3,a));
+        Eigen::Matrix3d Rb = quat2rotm(posedata.block<4,1>(3,b));
+        Eigen::Vector3d pa = posedata.block<3,1>(0,a);
+        Eigen::Vector3d pb = posedata.block<3,1>(0,b);
+        if (int(out.size()) < nv + 6*sides)
+        {
+            out.resize(nv + 6*sides);
+        }
+        for (int i = 0; i < sides; i++)
+        {
+            Eigen::Vector3d a0 = pa + r*(cosines[i]*Ra.col(0) + sines[i]*Ra.col(1));
+            Eigen::Vector3d a1 = pa + r*(cosines[i+1]*Ra.col(0) + sines[i+1]*Ra.col(1));
+            Eigen::Vector3d b0 = pb + r*(cosines[i]*Rb.col(0) + sines[i]*Rb.col(1));
+            Eigen::Vector3d b1 = pb + r*(cosines[i+1]*Rb.col(0) + sines[i+1]*Rb.col(1));
+            set(out[nv++], a0);
+            set(out[nv++], a1);
+            set(out[nv++], b0);
+            set(out[nv++], a1);
+            set(out[nv++], b1);
+            set(out[nv++], b0);
+        }
+        nSegments++;
+    }
+
+    template<typename PointT>
+    static void set(PointT &p, const Eigen::Vector3d &v)
+    {
+        p.x = v(0);
+        p.y = v(1);
+        p.z = v(2);
+    }
+
+    int sides;
+    double minSpacing;
+    int nSegments;
+    Eigen::Vector3d radii;
+    std::vector<double> cosines;
+    std::vector<double> sines;
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif // TUBE_MESH_H
@@ -12,6 +12,9 @@
 #include <cstdlib>
 #include <vector>
 #include "spline.h"
+#include "async_logger.h"
+#include "tube_mesh.h"
+#include "static_scene.h"
 
 #include <ros/ros.h>
 #include <tf/transform_broadcaster.h>
@@ -19,6 +22,7 @@
 #include <std_msgs/Int32.h>
 
 #include <visualization_msgs/Marker.h>
+#include <visualization_msgs/MarkerArray.h>
 #include <geometry_msgs/Point.h>
 #include <math.h>
 #include "std_msgs/MultiArrayLayout.h"
@@ -26,6 +30,7 @@
 #include "std_msgs/Float64MultiArray.h"
 #include "std_msgs/Float64.h"
 #include <ros/console.h>
+#include <ros/callback_queue.h>
 
 // custom messages defined in /msg
 #include <endonasal_teleop/matrix8.h>
@@ -42,34 +47,42 @@ using namespace CTR::Functions;
 using Eigen::Vector2d;
 
 
+// console output from the display loop goes through the asynchronous logger
+AsyncLogger logger;
+enum DisplayCounter { MESHES_PUBLISHED, FRAMES_DROPPED, SCENES_PUBLISHED };
+
 //double tmp=0;
 bool new_message=0;
 //Arr stores all the transformations
 endonasal_teleop::matrix8 Arr;
 // Number of points/frames
 int length=0;
+// arrival of the newest backbone, for its age if it carries no stamp
+ros::Time arrival;
 
 
+// Only the newest backbone is kept: one that arrives before the previous
+// one was drawn replaces it and counts as a dropped frame.
 void Callback(const endonasal_teleop::matrix8& msg)
 {
-    length = 0;
+    if (new_message)
+    {
+        logger.count(FRAMES_DROPPED);
+    }
     // If a message arrives, the while loop that plots the curve will start
     new_message=1;
     Arr = msg;
-    // Count the number of frames arrving with the msg
-    // Assumimg length would not exceed the size of the array
-    while ((sqrt(Arr.A4[length]*Arr.A4[length]+Arr.A5[length]*Arr.A5[length]+Arr.A6[length]*Arr.A6[length]+Arr.A7[length]*Arr.A7[length])-0)>0.0001)
-    {
-        length=length+1;
-    }
+    arrival = ros::Time::now();
 
     return;
 }
 
 tf::Transform t;
 float z_value =float();
+bool new_omni_pose=0;
 void omniCallback(const geometry_msgs::Pose& msg)
 {
+    new_omni_pose=1;
     // Define the frame
     //double x= msg.position.x;
     t.setOrigin( tf::Vector3(msg.position.x/10,msg.position.y/10,msg.position.z/10));
@@ -85,6 +98,11 @@ int main(int argc, char** argv)
     ros::init(argc, argv, "workspace_display");
     ros::NodeHandle n;
 
+    logger.setCounterLabel(MESHES_PUBLISHED,"Cannula meshes published");
+    logger.setCounterLabel(FRAMES_DROPPED,"Backbone frames dropped (newer one arrived before drawing)");
+    logger.setCounterLabel(SCENES_PUBLISHED,"Static scene published");
+    logger.run();
+
     // use the tf library to broadcast tf frames to Rviz
     static tf::TransformBroadcaster br;
 
@@ -93,212 +111,180 @@ int main(int argc, char** argv)
     //    float y_value =float();
 
 
-    // Force feedback stuff
-    // Set the grid on xy plan.
-    float threshold = 0;
-    std_msgs::Int32 force_flag;
-
-
     // define publisher
-    ros::Publisher shape_pub = n.advertise<visualization_msgs::Marker>("visualization_marker", 1000);
-    ros::Publisher seg_pub = n.advertise<visualization_msgs::Marker>("segment_visual",1000);
-    uint32_t shape = visualization_msgs::Marker::CYLINDER;
+    ros::Publisher tube_pub = n.advertise<visualization_msgs::MarkerArray>("visualization_marker_array", 1);
 
-    ros::Publisher omni_pub = n.advertise<std_msgs::Int32>("Omniforce", 1000);
+    // static scene (latched; an RViz Marker display on segment_visual also
+    // subscribes to segment_visual_array)
+    StaticScene scene;
+    scene.advertise(n, "segment_visual_array");
 
     // define subscriber
-    ros::Subscriber sub = n.subscribe("needle_position", 1000, Callback);
+    // (callbacks run as messages arrive, so a short queue loses nothing;
+    // the callback keeps the newest backbone only)
+    ros::Subscriber sub = n.subscribe("needle_position", 10, Callback);
     ros::Subscriber omni_sub = n.subscribe("Omnipos",1000,omniCallback);
-    ros::Rate r(1500); //must be at least 1000Hz
 
-    // Initialize the marker
-    // Marker ID. Markers with the same IDs will be replaced
-    int ID=0;
-    // Gap is the distance between interpolated points along the curve
-    double gap=1;
+    // nothing is drawn without new data, so the loop sleeps until a
+    // callback is due (or for at most the registration check period)
+    ros::CallbackQueue *queue = ros::getGlobalCallbackQueue();
+
+    // A new backbone is drawn right away unless the last one was drawn less
+    // than a frame period ago; then the newest one at the end of the period.
+    // Display latency is the age of the backbone drawn, from the stamp
+    // kinematics gives it, reported every display_report_period.
+    double display_rate, display_report_period;
+    ros::param::param<double>("~display_rate", display_rate, 60.0);
+    ros::param::param<double>("~display_report_period", display_report_period, 5.0);
+    ros::WallDuration framePeriod(1.0/display_rate);
+    ros::WallTime nextFrame = ros::WallTime::now();
+    ros::WallTime nextReport = ros::WallTime::now() + ros::WallDuration(display_report_period);
+    long framesDrawn = 0;
+    double latencySum = 0.0, latencyMax = 0.0;
+    double registration_check_period;
+    ros::param::param<double>("~registration_check_period", registration_check_period, 1.0);
+    ros::WallTime nextRegistrationCheck = ros::WallTime::now();
+
+    // Cannula mesh: one TRIANGLE_LIST marker per tube (see tube_mesh.h),
+    // rebuilt in place for every new backbone, so the vertex buffers are reused
+    int tube_sides;
+    double tube_min_spacing;
+    ros::param::param<int>("~tube_sides", tube_sides, 12);
+    ros::param::param<double>("~tube_min_spacing", tube_min_spacing, 1.0e-3);
+    TubeMeshBuilder tubeMesh(tube_sides, tube_min_spacing);
+    Eigen::MatrixXd posedata(8, Arr.A1.size());
+    visualization_msgs::MarkerArray tubeMarkers;
+    tubeMarkers.markers.resize(3);
+    for (int t=0; t<3; t++)
+    {
+        visualization_msgs::Marker &marker = tubeMarkers.markers[t];
+        marker.header.frame_id = "world";
+        marker.ns = "cannula";
+        marker.id = t+1;
+        marker.type = visualization_msgs::Marker::TRIANGLE_LIST;
+        marker.pose.orientation.w = 1.0;
+        marker.scale.x = 1.0;
+        marker.scale.y = 1.0;
+        marker.scale.z = 1.0;
+        marker.color.r = (t == 1) ? 1.0f : 0.0f;   // inner tube = green, middle = red, outer = blue
+        marker.color.g = (t == 0) ? 1.0f : 0.0f;
+        marker.color.b = (t == 2) ? 1.0f : 0.0f;
+        marker.color.a = 1.0;
+    }
 
     // Initialize the marker
     // Marker ID. Markers with the same IDs will be replaced
     int seg_ID=10000;
-    int prevLength=length;
+
+    // the segmentation stl, at the registration kinematics checks the
+    // cannula against (same parameters and defaults)
+    visualization_msgs::Marker seg;
+    seg.header.frame_id = "world";
+    seg.ns = "seg_namespace";
+    seg.id = seg_ID;
+    seg.type = visualization_msgs::Marker::MESH_RESOURCE;
+    seg.action = visualization_msgs::Marker::ADD;
+    seg.color.a = 1.0;
+    seg.color.r = 1.0;
+    seg.color.g = 0.0;
+    seg.color.b = 0.0;
+    seg.mesh_resource = "package://endonasal_teleop/src/everythingSmoothedShrink.stl";
+    seg.lifetime = ros::Duration();
+    std::vector<double> anatomy_position, anatomy_orientation;
+    double anatomy_scale;
 
 
     //ROS_WARN("flag1");
     while (ros::ok())
     {
-        //publish the segmentation stl
-        visualization_msgs::Marker seg;
-        seg.header.frame_id = "world";
-        seg.header.stamp = ros::Time::now();
-
-        seg.ns = "seg_namespace";
-        seg.id = seg_ID;
-
-        seg.type = visualization_msgs::Marker::MESH_RESOURCE;
-        seg.action = visualization_msgs::Marker::ADD;
-
-        seg.pose.position.x = -0.001;
-        seg.pose.position.y = -0.4;
-        seg.pose.position.z = 0.2;
+        // registration of the anatomy; the scene goes out only if it changed
+        if (ros::WallTime::now() >= nextRegistrationCheck)
+        {
+            nextRegistrationCheck = ros::WallTime::now() + ros::WallDuration(registration_check_period);
+            ros::param::param<std::vector<double> >("~anatomy_position", anatomy_position, {-0.001, -0.4, 0.2});
+            ros::param::param<std::vector<double> >("~anatomy_orientation", anatomy_orientation, {0.3, -1.0, 0.3, -1.0}); // x y z w
+            ros::param::param<double>("~anatomy_scale", anatomy_scale, 1.0);
+            if (anatomy_position.size() == 3 && anatomy_orientation.size() == 4)
+            {
+                seg.pose.position.x = anatomy_position[0];
+                seg.pose.position.y = anatomy_position[1];
+                seg.pose.position.z = anatomy_position[2];
+
+                //change x and y to rotate around x-axis
+                seg.pose.orientation.x = anatomy_orientation[0];
+                seg.pose.orientation.y = anatomy_orientation[1];
+                seg.pose.orientation.z = anatomy_orientation[2];
+                seg.pose.orientation.w = anatomy_orientation[3];
+
+                seg.scale.x = anatomy_scale;
+                seg.scale.y = anatomy_scale;
+                seg.scale.z = anatomy_scale;
+                scene.setMarker(seg);
+            }
+            else
+            {
+                ROS_WARN_ONCE("anatomy_position needs 3 values and anatomy_orientation 4 (x y z w)");
+            }
+        }
+        if (scene.publishIfChanged())
+        {
+            logger.count(SCENES_PUBLISHED);
+        }
 
-        //change x and y to rotate around x-axis
-        seg.pose.orientation.x = 0.3;
-        seg.pose.orientation.y = -1.0;
-        seg.pose.orientation.z = 0.3;
-        seg.pose.orientation.w = -1.0;
+        if (new_message && ros::WallTime::now() >= nextFrame) // if you needle pose is updated, plot it
+        {
+            new_message = false;
+            nextFrame = ros::WallTime::now() + framePeriod;
 
-        seg.scale.x = 1.0;
-        seg.scale.y = 1.0;
-        seg.scale.z = 1.0;
+            // Count the number of frames arrving with the msg
+            length = 0;
+            while (length < int(Arr.A1.size()) && sqrt(Arr.A4[length]*Arr.A4[length]+Arr.A5[length]*Arr.A5[length]+Arr.A6[length]*Arr.A6[length]+Arr.A7[length]*Arr.A7[length])>0.0001)
+            {
+                length=length+1;
+            }
+            for (int j=0; j<length; j++)
+            {
+                posedata(0,j) = Arr.A1[j];
+                posedata(1,j) = Arr.A2[j];
+                posedata(2,j) = Arr.A3[j];
+                posedata(3,j) = Arr.A4[j]; // convention wxyz
+                posedata(4,j) = Arr.A5[j];
+                posedata(5,j) = Arr.A6[j];
+                posedata(6,j) = Arr.A7[j];
+                posedata(7,j) = Arr.A8[j]; // tube: 1 inner, 2 middle, 3 outer
+            }
+            tubeMesh.build(posedata, length, tubeMarkers.markers[0].points,
+                           tubeMarkers.markers[1].points, tubeMarkers.markers[2].points);
 
-        seg.color.a = 1.0;
-        seg.color.r = 1.0;
-        seg.color.g = 0.0;
-        seg.color.b = 0.0;
+            ros::Time stamp = ros::Time::now();
+            for (int t=0; t<3; t++)
+            {
+                visualization_msgs::Marker &marker = tubeMarkers.markers[t];
+                marker.header.stamp = stamp;
+                marker.action = marker.points.empty() ? visualization_msgs::Marker::DELETE : visualization_msgs::Marker::ADD;
+            }
+            tube_pub.publish(tubeMarkers);
+            logger.count(MESHES_PUBLISHED);
 
-        seg.mesh_resource = "package://endonasal_teleop/src/everythingSmoothedShrink.stl";
-        seg.lifetime = ros::Duration();
-        seg_pub.publish(seg);
+            double latency = (ros::Time::now() - (Arr.stamp.isZero() ? arrival : Arr.stamp)).toSec();
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, latency);
+            framesDrawn++;
+        }
 
-        if (new_message) // if you needle pose is updated, plot it
+        // frames drawn per second and their age
+        if (ros::WallTime::now() >= nextReport)
         {
-            std::cout<<"prev"<<prevLength<<std::endl;
-            std::cout<<"curr"<<length<<std::endl;
-            //ROS_WARN("length %d",length);
-            for (int i=0; i <prevLength; i++)
+            if (framesDrawn > 0)
             {
-                visualization_msgs::Marker marker;
-                marker.header.frame_id = "/world";
-                marker.header.stamp = ros::Time::now();
-
-                //maker sent with the same namespace and id will overwrite
-                marker.ns = "basic_shapes";
-                marker.id = ID;
-                // Marker shape; cylinder in this case
-                marker.type = shape;
-
-                if(length<i)
-                {
-                    std::cout<<"here in the if"<<std::endl;
-                    marker.action = visualization_msgs::Marker::DELETE;
-                }else
-                {
-                    // Set marker action. ADD/DELETE/DELETEALL
-                    marker.action = visualization_msgs::Marker::ADD;
-
-                    // Calulate the distance between this and the next marker
-                    //0.8 is arbitary; makes the cannula look better
-                    if (i<length-1)
-                    {
-                        gap=sqrt((Arr.A1[i]-Arr.A1[i+1])*(Arr.A1[i]-Arr.A1[i+1])+(Arr.A2[i]-Arr.A2[i+1])*(Arr.A2[i]-Arr.A2[i+1])+(Arr.A3[i]-Arr.A3[i+1])*(Arr.A3[i]-Arr.A3[i+1]));
-                    }
-
-                    if (gap<0.00001)
-                    {
-                        gap=0.00001;
-                    }
-
-                    // Set the pose of the marker
-                    // Since the cylinder marker "grows" in both direction, need to displace the first marker
-                    if (i==0){
-                        // basically (0,0,1) rotated by the quaternion then times half the gap is the displaced amount
-                        marker.pose.position.x = Arr.A1[i]+gap/2*(2*Arr.A4[i]*Arr.A6[i]-2*Arr.A7[i]*Arr.A5[i]);
-                        marker.pose.position.y = Arr.A2[i]+gap/2*(2*Arr.A4[i]*Arr.A5[i]+2*Arr.A6[i]*Arr.A7[i]);
-                        marker.pose.position.z = Arr.A3[i]+gap/2*(1+2*Arr.A5[i]*Arr.A5[i]-2*Arr.A6[i]*Arr.A6[i]);
-                    }
-                    else
-                    {
-                        marker.pose.position.x = Arr.A1[i];
-                        marker.pose.position.y = Arr.A2[i];
-                        marker.pose.position.z = Arr.A3[i];
-                    }
-
-                    marker.pose.orientation.w = Arr.A4[i]; // convention wxyz
-                    marker.pose.orientation.x = Arr.A5[i];
-                    marker.pose.orientation.y = Arr.A6[i];
-                    marker.pose.orientation.z = Arr.A7[i];
-
-
-
-
-
-                    // Set the scale of the marker
-                    //                    marker.scale.x = 0.001;
-                    //                    marker.scale.y = 0.001;
-                    //                  // generaly make the length of the cylinders twice the gaps
-                    // for the first cylinder, the length should equal to the gap
-                    // make the length of the last marker arbitrarily small
-                    if (i==length)
-                    {
-                        marker.scale.z = 0.00000005;
-                    }
-                    else if (i==1)
-                    {
-                        marker.scale.z = gap;
-                    }
-                    else
-                    {
-                        marker.scale.z = gap*2;
-                    }
-                    // Set the color of the marker
-                    if (Arr.A8[i]-1 < 0.0001)
-                    {
-                        marker.color.r = 0.0f;  // inner tube = green
-                        marker.color.g = 1.0f;
-                        marker.color.b = 0.0f;
-                        marker.color.a = 1.0;
-
-                        marker.scale.x = 1.168e-3; // width of inner tube
-                        marker.scale.y = 1.168e-3;
-                    }
-                    else if (Arr.A8[i]-2 < 0.0001)
-                    {
-                        marker.color.r = 1.0f; // middle tube = red
-                        marker.color.g = 0.0f;
-                        marker.color.b = 0.0f;
-                        marker.color.a = 1.0;
-
-                        marker.scale.x = 1.684e-3; // width of middle tube
-                        marker.scale.y = 1.684e-3;
-                    }
-                    else
-                    {
-                        marker.color.r = 0.0f; // outer tube = blue;
-                        marker.color.g = 0.0f;
-                        marker.color.b = 1.0f;
-                        marker.color.a = 1.0;
-
-                        marker.scale.x = 2.324e-3; // width of outer tube
-                        marker.scale.y = 2.324e-3;
-                    }
-
-                    //marker.lifetime = ros::Duration();
-
-                    // Publish the marker
-                    while (shape_pub.getNumSubscribers() < 1)
-                    {
-                        if (!ros::ok())
-                        {
-                            return 0;
-                        }
-                        ROS_WARN_ONCE("Please create a subscriber to the marker");
-                        sleep(1);
-                    }
-
-                }
-
-                std::cout<<"published"<<std::endl;
-                shape_pub.publish(marker);
-                ID=ID+1;
-                if (ID==length)
-                {
-                    ID=0;
-                    length=0;
-                    new_message=false;
-                }
+                Eigen::Vector3d report;
+                report << framesDrawn/display_report_period, 1e3*latencySum/framesDrawn, 1e3*latencyMax;
+                logger.log("Display frames/s, latency mean, max [ms]",report.transpose());
             }
-
-            prevLength = length;
+            nextReport = ros::WallTime::now() + ros::WallDuration(display_report_period);
+            framesDrawn = 0;
+            latencySum = 0.0;
+            latencyMax = 0.0;
         }
 
 
@@ -307,16 +293,19 @@ int main(int argc, char** argv)
         //sub.shutdown();
 
 
-        // send transform
-        br.sendTransform(tf::StampedTransform(t,ros::Time::now(),"world","tip_pose"));
-        // send force feedback back to windows & omni
-        if (z_value < threshold) { force_flag.data = 0; }
-        else { force_flag.data = 0; }
-        omni_pub.publish(force_flag);
-
+        // send transform (only for a new Omni pose)
+        if (new_omni_pose)
+        {
+            new_omni_pose = false;
+            br.sendTransform(tf::StampedTransform(t,ros::Time::now(),"world","tip_pose"));
+        }
 
-        ros::spinOnce();
-        r.sleep();
+        ros::WallTime wakeUp = std::min(nextRegistrationCheck, nextReport);
+        if (new_message)
+        {
+            wakeUp = std::min(wakeUp, nextFrame);
+        }
+        queue->callAvailable(ros::WallDuration(std::max(0.0, (wakeUp - ros::WallTime::now()).toSec())));
     }
 
     return 0;
@@ -0,0 +1,103 @@
+/********************************************************************
+
+  test_hot_path_allocations.cpp
+
+Checks that the control cycle does not touch the heap: resolved rates
+step (ResolvedRatesController::step) and the cannula kinematics
+(CannulaKinematics::compute) on synthetic Omni input, every cycle inside
+a hot region of the allocation guard (alloc_guard.h), as in
+resolved_rates, kinematics and teleop_replay --check-allocations.
+
+The input moves the stylus on a circle while turning it, with the
+button pressed and released a few times so the clutch paths run too.
+
+This target is always built with ENDONASAL_ALLOC_GUARD, whether or not
+the package is configured with -DALLOC_GUARD=ON.
+
+********************************************************************/
+
+#include "src/resolved_rates_core.h"
+#include "src/kinematics_core.h"
+#include "src/alloc_guard.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+// Omni input at time t [s]: 20 mm circle at 0.5 Hz, turning about z,
+// button pressed for 2 of every 3 seconds
+void syntheticOmni(double t, Eigen::Vector3d &p, Eigen::Vector4d &q, int &button)
+{
+    double phase = 2.0*M_PI*0.5*t;
+    p << 20.0*cos(phase), 20.0*sin(phase), 5.0*sin(0.5*phase);
+    double angle = 0.2*sin(phase);
+    q << cos(0.5*angle), 0.0, 0.0, sin(0.5*angle);
+    button = fmod(t, 3.0) < 2.0 ? 1 : 0;
+}
+
+TEST(HotPath, ControlCycleDoesNotAllocate)
+{
+    CannulaKinematics cannula;
+    KinematicsResult kin;
+    KinematicsState kinState;
+    ResolvedRatesController rr;
+    ResolvedRatesOutput rrOut;
+
+    cannula.compute(CannulaKinematics::homeConfiguration(), kin);
+    kinState.ptip = kin.ptip;
+    kinState.qtip = kin.qtip;
+    kinState.alpha.fill(0);
+    kinState.J = kin.J;
+    rr.reset(ResolvedRatesController::homeConfiguration(), cannula.tubeLengths());
+
+    double period = 1.0/rr.parameters().rosLoopRate;
+    long cycles = long(10.0/period);
+    long allocatingCycles = 0;
+    long firstAllocatingCycle = -1;
+    Configuration3 q;
+    q.Ftip.fill(0);
+    q.Ttip.fill(0);
+    resetHotAllocations();
+
+    for (long cycle = 0; cycle < cycles; cycle++)
+    {
+        // the Omni callbacks run outside the hot region in the nodes as well
+        Eigen::Vector3d pOmni;
+        Eigen::Vector4d qOmni;
+        int button;
+        syntheticOmni(cycle*period, pOmni, qOmni, button);
+        rr.onOmniPose(pOmni, qOmni);
+        rr.onButton(button);
+
+        long allocationsBefore = hotAllocations();
+        {
+            HotRegion hot;
+            rr.step(kinState, rrOut);
+
+            q.PsiL = rrOut.q_vec.head<3>();
+            q.Beta = rrOut.q_vec.tail<3>();
+            cannula.compute(q, kin);
+            kinState.ptip = kin.ptip;
+            kinState.qtip = kin.qtip;
+            kinState.alpha = kin.alpha;
+            kinState.J = kin.J;
+        }
+        if (hotAllocations() != allocationsBefore)
+        {
+            if (firstAllocatingCycle < 0)
+            {
+                firstAllocatingCycle = cycle;
+            }
+            allocatingCycles++;
+        }
+    }
+
+    EXPECT_EQ(0, hotAllocations()) << allocatingCycles << " of " << cycles << " cycles allocated ("
+                                   << hotAllocationBytes() << " bytes), first in cycle " << firstAllocatingCycle;
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}